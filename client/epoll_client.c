@@ -2,20 +2,59 @@
 #include "client.h"
 #include "epoll_client.h"
 #include "colors.h"
+#include "compress.h"
+#include "checksum.h"
+#include "tar.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/epoll.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <termios.h>
 #include <stdint.h>
+#include <endian.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <glob.h>
+#include <fnmatch.h>
 
 #define MAX_EVENTS 10
-#define CHUNK_SIZE 512
+#define RECV_BUFFER_SIZE (256 * 1024)      // Bytes taken from a socket per recv()
+#define UPLOAD_CHUNKS_PER_WAKEUP 16        // Chunks an upload may send per EPOLLOUT
+#define PROGRESS_INTERVAL_US 100000        // Progress bars redraw at most this often
+#define CHUNK_SIZE 512                     // Chunk size for servers that don't answer hello
+#define REQUESTED_CHUNK_SIZE (1024 * 1024) // Chunk size asked for in the hello handshake
 #define FILENAME_MAX_LEN 64
+#define MAX_STREAMS 16 // Connections a parallel download may open
+#define BATCH_DEFAULT_JOBS 4 // Files an mget/mput keeps in flight, one per connection
+#define BATCH_MAX_JOBS 16
+#define BATCH_LIST_PAGE 256 // Entries per ls page when mget lists the server's directory
+
+// FileChunkHeader.type values
+#define CHUNK_TYPE_DATA 0   // [Header][Payload] chunk
+#define CHUNK_TYPE_STREAM 1 // Header + 64-bit byte length, then the raw file contents
+#define STREAM_TRAILER_LEN 4 // A stream ends with the big-endian CRC32C of its contents
+#define CHUNK_TYPE_LZ4 2    // [Header][Payload] chunk, payload is one LZ4 block of the chunk
+
+// Every message on the wire is a frame: [FrameHeader][length bytes of payload]
+#define FRAME_VERSION 2
+#define FRAME_COMMAND 1  // Client -> server: command text, no newline
+#define FRAME_RESPONSE 2 // Server -> client: the complete reply to one command
+#define FRAME_DATA 3     // Either direction: FileChunkHeader + chunk payload
+#define FRAME_STREAM 4   // Server -> client: raw file bytes of a stream download
+
+typedef struct
+{
+    uint8_t version; // FRAME_VERSION
+    uint8_t type;    // FRAME_COMMAND, FRAME_RESPONSE, FRAME_DATA or FRAME_STREAM
+    uint16_t flags;  // Reserved, 0
+    uint32_t length; // Payload length in network byte order
+} FrameHeader;
 
 // File transfer structures
 typedef struct
@@ -24,9 +63,17 @@ typedef struct
     uint32_t chunk_size;
     uint32_t total_chunks;
     uint32_t type;
+    uint32_t checksum; // CRC32C of the transfer's file bytes up to and including this chunk
     char filename[FILENAME_MAX_LEN];
 } FileChunkHeader;
 
+// Last progress drawn for a transfer; redraws are limited to PROGRESS_INTERVAL_US
+typedef struct
+{
+    int percent;               // -1 before the first draw
+    unsigned long long drawn_us;
+} progress_t;
+
 // Client state for file transfers
 typedef enum
 {
@@ -35,6 +82,15 @@ typedef enum
     STATE_RECEIVING // Receiving file from server
 } client_state_t;
 
+// Progress of a --resume transfer that is waiting for the server
+typedef enum
+{
+    RESUME_NONE,
+    RESUME_UPLOAD,   // Reply is the size of the partial upload in saved/
+    RESUME_DOWNLOAD, // Reply is the size of the file on the server
+    RESUME_RANGE     // The ranged get is out, its first data frame or an error follows
+} resume_t;
+
 typedef struct
 {
     client_state_t state;
@@ -44,20 +100,135 @@ typedef struct
     int current_chunk;
     int bytes_written;
     long file_size;
-    char file_buffer[CHUNK_SIZE];
-    int buffer_pos;
-    int header_received;
+    int chunk_size;      // Negotiated with the server, kept across transfers
+    char *file_buffer;   // One [Frame][Header][Payload] chunk, kept across transfers
+    char *codec_buffer;  // Chunk-sized LZ4 scratch, kept across transfers
+    int server_lz4;      // The server takes and sends LZ4 chunks (hello reply)
+    int compress;        // This transfer uses LZ4 chunks (--compress)
+    int archive;         // This download is a directory tree sent as a tar (get --recursive)
+    tar_reader_t *unpack; // Unpacks an archive download as its chunks arrive
+    int incompressible_chunks; // Consecutive upload chunks that did not shrink
+    uint32_t crc;        // CRC32C of this transfer's file bytes so far
+    long long resume_offset; // File offset a resumed upload starts at, its crc covers the bytes from there
+    int upload_check;    // The reply to an upload is due, it carries the server's digest (kept across transfers)
+    uint32_t upload_crc; // CRC32C of the upload that reply confirms
+    long long upload_from; // Offset upload_crc starts at, past 0 for a resumed upload
+    int replies_due;     // Commands sent whose response (or first data frame) is still due (kept across transfers)
+    int outcome;         // 1 once the last transfer completed and verified, -1 while it hasn't (kept across transfers)
+    int quiet;           // Part of an mget/mput: no progress bars, prompts or per-file messages (kept across transfers)
+    int file_buffer_len; // Bytes of the current outgoing chunk
+    int buffer_pos;      // Bytes of the current outgoing chunk already sent
+    // Chunk parser of a download, reset with the transfer
+    char header_buffer[sizeof(FileChunkHeader)]; // Header bytes of the chunk being received
+    int parse_pos;              // Header bytes collected, or payload bytes once the header is in
+    int expecting_header;
+    int payload_remaining;
     FileChunkHeader current_header;
+    int stream_mode;            // Download arrives as a raw stream after one header
+    long long stream_remaining; // Raw stream bytes still expected, the CRC32C trailer included
+    progress_t progress;
+    resume_t resume;            // Set while a --resume transfer waits for the server
 } transfer_state_t;
 
+// Parser state for frames coming from the server
+typedef struct
+{
+    FrameHeader header; // Length converted to host order once complete
+    int header_len;     // Header bytes received so far
+    uint32_t remaining; // Payload bytes of the current frame still to come
+    char line[4096];    // Partial line of the response being printed
+    int line_len;
+    int hold;           // Keep the response for the caller instead of printing it
+} frame_reader_t;
+
+// One connection of a parallel download, fetching its own chunk range
+typedef struct
+{
+    int sock;
+    FrameHeader frame;        // Frame being received, length in host order
+    int frame_header_len;
+    uint32_t frame_remaining; // Frame bytes still to come
+    FileChunkHeader chunk;    // Header of the data frame being received
+    int chunk_header_len;
+    off_t write_offset; // File offset of the next payload byte
+    int next_chunk;     // Next chunk id expected on this connection
+    uint32_t crc;       // CRC32C of the range's bytes received so far
+    int end_chunk;      // One past the last chunk of the range
+} range_stream_t;
+
+// A download split across several connections (get <file> --streams N)
+typedef struct
+{
+    int active;
+    int fd; // Local file, preallocated and written with pwrite()
+    char filename[FILENAME_MAX_LEN];
+    long long file_size;
+    int chunk_size;
+    int total_chunks;
+    int chunks_done;
+    int stream_count;
+    int streams_open;
+    progress_t progress;
+    range_stream_t streams[MAX_STREAMS];
+} parallel_download_t;
+
+// One connection of an mget/mput, moving one file at a time through its own transfer
+typedef struct
+{
+    int sock; // -1 once closed
+    frame_reader_t reader;
+    transfer_state_t transfer; // Quiet, with buffers of its own
+    int file;                  // Index of the file in flight, -1 while idle
+} batch_worker_t;
+
+// A queue of files moved over a pool of connections (mget/mput <glob>)
+typedef struct
+{
+    int active;
+    int upload; // mput
+    int compress;
+    int chunk_size;
+    int server_lz4;
+    char **files;
+    int file_count;
+    int next_file; // Next file handed to an idle connection
+    int done;
+    int failed;
+    int worker_count;
+    char cwd[PATH_MAX]; // Directory of the main connection, every batch connection moves there
+    unsigned long long started_us;
+    progress_t progress; // Files finished out of file_count
+    batch_worker_t workers[BATCH_MAX_JOBS];
+} batch_t;
+
 // Function declarations
 void init_transfer_state(transfer_state_t *state);
 int send_file_chunk_epoll(int sock, transfer_state_t *state);
 int receive_file_chunk_epoll(int sock, transfer_state_t *state, char *buffer, int bytes_available);
 int start_file_upload(int sock, const char *filename, transfer_state_t *state);
 int start_file_download(int sock, const char *filename, transfer_state_t *state);
-void process_user_command(int sock, const char *command, transfer_state_t *transfer_state, int epoll_fd);
+int begin_upload(int sock, transfer_state_t *state, int epoll_fd);
+int request_resume(int sock, const char *filename, resume_t resume, transfer_state_t *state);
+void resume_transfer(int sock, transfer_state_t *state, char *reply, int epoll_fd);
+void process_user_command(int sock, const char *command, transfer_state_t *transfer_state,
+                          parallel_download_t *parallel, batch_t *batch, int epoll_fd);
+int send_request(int sock, transfer_state_t *state, const char *command);
 void progress_bar(int percent);
+void progress_update(progress_t *progress, long long done, long long total);
+int negotiate_chunk_size(int sock, int *server_lz4);
+int send_command(int sock, const char *command);
+int handle_server_data(int sock, frame_reader_t *reader, transfer_state_t *state, char *data, int len, int epoll_fd);
+int start_parallel_download(int sock, const char *filename, int stream_count, int chunk_size,
+                            parallel_download_t *download, int epoll_fd);
+int receive_range_data(parallel_download_t *download, range_stream_t *range, int epoll_fd);
+void close_parallel_download(parallel_download_t *download, int epoll_fd);
+int start_batch(int sock, const char *pattern, int upload, int jobs, const transfer_state_t *state, batch_t *batch,
+                int epoll_fd);
+void handle_batch_event(int sock, batch_t *batch, batch_worker_t *worker, uint32_t events, int epoll_fd);
+batch_worker_t *find_batch_worker(batch_t *batch, int fd);
+void finish_batch(batch_t *batch, int epoll_fd);
+void close_batch(batch_t *batch, int epoll_fd);
+static unsigned long long now_us(void);
 
 // Function to set socket to non-blocking mode
 int set_nonblocking(int socket_fd)
@@ -78,6 +249,14 @@ int set_nonblocking(int socket_fd)
     return 0;
 }
 
+// Every frame leaves in one send(), so Nagle would only hold back the first data frame of
+// an upload until the server acks the upload command
+void set_nodelay(int socket_fd)
+{
+    int nodelay = 1;
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+}
+
 // Function to set stdin to non-blocking mode
 int set_stdin_nonblocking()
 {
@@ -94,8 +273,41 @@ void restore_stdin_blocking()
     }
 }
 
-// Non-blocking client with epoll
-int start_epoll_client(const char *server_ip, int server_port)
+// Run one line of user input; returns 0 once the client should exit
+static int run_command(int sock, const char *command, transfer_state_t *transfer_state,
+                       parallel_download_t *parallel, batch_t *batch, int epoll_fd)
+{
+    if (strcmp(command, "exit") == 0)
+    {
+        return 0;
+    }
+    else if (strcmp(command, "help") == 0)
+    {
+        show_help();
+    }
+    else if (strcmp(command, "clear") == 0)
+    {
+        printf("\033[H\033[J");
+    }
+    else
+    {
+        // Send command to server
+        process_user_command(sock, command, transfer_state, parallel, batch, epoll_fd);
+    }
+    return 1;
+}
+
+// Nothing is in flight: no transfer, no reply due, no parallel download or batch
+static int client_idle(const transfer_state_t *state, const parallel_download_t *parallel, const batch_t *batch)
+{
+    return state->state == STATE_COMMAND && state->resume == RESUME_NONE && state->replies_due == 0 &&
+           !parallel->active && !batch->active;
+}
+
+// Non-blocking client with epoll; with a script, its commands run one after another in
+// place of stdin and the client exits at its end
+// Returns 0, 1 if a scripted transfer failed, or -1 if the client could not start
+int start_epoll_client(const char *server_ip, int server_port, FILE *script)
 {
     // Create socket
     int sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -125,6 +337,30 @@ int start_epoll_client(const char *server_ip, int server_port)
     }
 
     printf(GREEN "Connected to server %s:%d\n" RESET, server_ip, server_port);
+    set_nodelay(sock);
+
+    // Agree on a chunk size while the socket is still blocking
+    int server_lz4 = 0;
+    int chunk_size = negotiate_chunk_size(sock, &server_lz4);
+    if (chunk_size == 0)
+    {
+        printf(YELLOW "Server did not negotiate a chunk size, using %d bytes\n" RESET, CHUNK_SIZE);
+        chunk_size = CHUNK_SIZE;
+    }
+    else
+    {
+        printf(GREEN "Using %d byte chunks\n" RESET, chunk_size);
+    }
+    char *file_buffer = malloc(sizeof(FrameHeader) + sizeof(FileChunkHeader) + chunk_size);
+    char *codec_buffer = malloc(chunk_size);
+    if (!file_buffer || !codec_buffer)
+    {
+        perror("malloc");
+        free(file_buffer);
+        free(codec_buffer);
+        close(sock);
+        return -1;
+    }
 
     // Set socket and stdin to non-blocking
     if (set_nonblocking(sock) == -1)
@@ -133,7 +369,7 @@ int start_epoll_client(const char *server_ip, int server_port)
         return -1;
     }
 
-    if (set_stdin_nonblocking() == -1)
+    if (!script && set_stdin_nonblocking() == -1)
     {
         close(sock);
         return -1;
@@ -163,11 +399,11 @@ int start_epoll_client(const char *server_ip, int server_port)
         return -1;
     }
 
-    // Add stdin to epoll
+    // Add stdin to epoll, unless a script stands in for it
     event.events = EPOLLIN;
     event.data.fd = STDIN_FILENO;
 
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) == -1)
+    if (!script && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) == -1)
     {
         perror("epoll_ctl: stdin");
         close(epoll_fd);
@@ -180,13 +416,26 @@ int start_epoll_client(const char *server_ip, int server_port)
     fflush(stdout);
 
     char input_buffer[1024] = {0};
-    char server_buffer[4096] = {0};
     int input_len = 0;
-    int server_data_len = 0;
     int running = 1;
+    frame_reader_t reader = {0};
     // Initialize transfer state
     transfer_state_t transfer_state;
     init_transfer_state(&transfer_state);
+    transfer_state.chunk_size = chunk_size;
+    transfer_state.file_buffer = file_buffer;
+    transfer_state.codec_buffer = codec_buffer;
+    transfer_state.server_lz4 = server_lz4;
+    transfer_state.upload_check = 0;
+    transfer_state.upload_crc = 0;
+    transfer_state.upload_from = 0;
+    transfer_state.replies_due = 0;
+    transfer_state.outcome = 0;
+    transfer_state.quiet = 0;
+    parallel_download_t parallel = {.active = 0, .fd = -1};
+    batch_t batch = {.active = 0};
+    int script_failed = 0; // A scripted command failed, or the script didn't run to its end
+    int script_done = 0;
 
     // Event loop
     struct epoll_event events[MAX_EVENTS];
@@ -195,8 +444,43 @@ int start_epoll_client(const char *server_ip, int server_port)
 
     while (running)
     {
+        // A script runs its next command once everything the previous one started is done
+        while (script && !script_done && running && client_idle(&transfer_state, &parallel, &batch))
+        {
+            if (transfer_state.outcome == -1)
+            {
+                script_failed = 1;
+            }
+            transfer_state.outcome = 0;
+
+            char line[1024];
+            if (!fgets(line, sizeof(line), script))
+            {
+                script_done = 1;
+                running = 0;
+                break;
+            }
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] == '\0' || line[0] == '#')
+            {
+                continue;
+            }
+            printf("%s\n", line);
+            running = run_command(sock, line, &transfer_state, &parallel, &batch, epoll_fd);
+            if (running && client_idle(&transfer_state, &parallel, &batch))
+            {
+                // Nothing will answer, so nothing else prints the next prompt
+                printf("ftp> ");
+                fflush(stdout);
+            }
+        }
+        if (!running)
+        {
+            break;
+        }
+
         // Use a timeout for epoll_wait when receiving files
-        int timeout = (transfer_state.state == STATE_RECEIVING) ? 10000 : -1; // 10 second timeout during download
+        int timeout = (transfer_state.state == STATE_RECEIVING || parallel.active || batch.active) ? 10000 : -1; // 10 second timeout during download
         int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
 
         if (num_events == -1)
@@ -209,6 +493,34 @@ int start_epoll_client(const char *server_ip, int server_port)
         else if (num_events == 0)
         {
             // Timeout occurred
+            if (batch.active && transfer_state.state != STATE_RECEIVING && !parallel.active)
+            {
+                if (++no_data_iterations >= 5)
+                {
+                    printf(RED "\nTimeout: No data moved on any batch connection for 50 seconds\n" RESET);
+                    batch.failed = batch.file_count - batch.done;
+                    finish_batch(&batch, epoll_fd);
+                    transfer_state.outcome = -1;
+                    printf("ftp> ");
+                    fflush(stdout);
+                }
+                continue;
+            }
+            if (parallel.active)
+            {
+                if (++no_data_iterations >= 5)
+                {
+                    printf(RED "\nTimeout: No data received on any stream for 50 seconds\n" RESET);
+                    printf(RED "Download may have stalled. Current progress: %d/%d chunks\n" RESET,
+                           parallel.chunks_done, parallel.total_chunks);
+                    close_parallel_download(&parallel, epoll_fd);
+                    unlink(parallel.filename);
+                    transfer_state.outcome = -1;
+                    printf("ftp> ");
+                    fflush(stdout);
+                }
+                continue;
+            }
             if (transfer_state.state == STATE_RECEIVING)
             {
                 no_data_iterations++;
@@ -224,6 +536,7 @@ int start_epoll_client(const char *server_ip, int server_port)
                     {
                         fclose(transfer_state.file_ptr);
                     }
+                    tar_reader_close(transfer_state.unpack);
                     init_transfer_state(&transfer_state);
                     printf("ftp> ");
                     fflush(stdout);
@@ -286,26 +599,11 @@ int start_epoll_client(const char *server_ip, int server_port)
                         }
 
                         // Process command
-                        if (strlen(input_buffer) > 0)
+                        if (strlen(input_buffer) > 0 &&
+                            !run_command(sock, input_buffer, &transfer_state, &parallel, &batch, epoll_fd))
                         {
-                            if (strcmp(input_buffer, "exit") == 0)
-                            {
-                                running = 0;
-                                break;
-                            }
-                            else if (strcmp(input_buffer, "help") == 0)
-                            {
-                                show_help();
-                            }
-                            else if (strcmp(input_buffer, "clear") == 0)
-                            {
-                                printf("\033[H\033[J");
-                            }
-                            else
-                            {
-                                // Send command to server
-                                process_user_command(sock, input_buffer, &transfer_state, epoll_fd);
-                            }
+                            running = 0;
+                            break;
                         }
 
                         // Shift remaining data in buffer
@@ -341,13 +639,21 @@ int start_epoll_client(const char *server_ip, int server_port)
                 }
                 else if (events[i].events & EPOLLOUT && transfer_state.state == STATE_SENDING)
                 {
-                    // Socket ready for writing during file upload
-                    int result = send_file_chunk_epoll(sock, &transfer_state);
+                    // Socket ready for writing: send chunks until it fills up, but give
+                    // stdin and the server's replies a turn every few chunks
+                    int result;
+                    int budget = UPLOAD_CHUNKS_PER_WAKEUP;
+                    do
+                    {
+                        result = send_file_chunk_epoll(sock, &transfer_state);
+                    } while (result == 0 && --budget > 0);
                     if (result == 1)
                     {
-                        // Upload complete
+                        // Upload complete, the server's reply confirms the digest
                         printf(GREEN "\nFile upload completed successfully!\n" RESET);
                         fclose(transfer_state.file_ptr);
+                        transfer_state.upload_crc = transfer_state.crc;
+                        transfer_state.upload_from = transfer_state.resume_offset;
                         init_transfer_state(&transfer_state);
 
                         // Remove EPOLLOUT from socket events
@@ -367,6 +673,7 @@ int start_epoll_client(const char *server_ip, int server_port)
                             fclose(transfer_state.file_ptr);
                         }
                         init_transfer_state(&transfer_state);
+                        transfer_state.upload_check = 0;
 
                         // Remove EPOLLOUT from socket events
                         event.events = EPOLLIN;
@@ -380,8 +687,8 @@ int start_epoll_client(const char *server_ip, int server_port)
                 }
                 else if (events[i].events & EPOLLIN)
                 {
-                    char temp_buffer[1024];
-                    ssize_t bytes_read = recv(sock, temp_buffer, sizeof(temp_buffer) - 1, 0);
+                    static char temp_buffer[RECV_BUFFER_SIZE];
+                    ssize_t bytes_read = recv(sock, temp_buffer, sizeof(temp_buffer), 0);
 
                     if (bytes_read <= 0)
                     {
@@ -397,235 +704,280 @@ int start_epoll_client(const char *server_ip, int server_port)
                         break;
                     }
 
-                    if (transfer_state.state == STATE_RECEIVING)
+                    // Dispatch on frame type: responses are printed, data frames feed the download
+                    if (handle_server_data(sock, &reader, &transfer_state, temp_buffer, bytes_read, epoll_fd) == -1)
                     {
-                        // Handle incoming file data
-                        int result = receive_file_chunk_epoll(sock, &transfer_state, temp_buffer, bytes_read);
-                        if (result == 1)
-                        {
-                            // Download complete
-                            if (transfer_state.file_ptr)
-                            {
-                                fclose(transfer_state.file_ptr);
-                            }
-                            init_transfer_state(&transfer_state);
-                            printf("ftp> ");
-                            fflush(stdout);
-                        }
-                        else if (result == -1)
-                        {
-                            // Download error
-                            printf(RED "\nFile download failed!\n" RESET);
-                            if (transfer_state.file_ptr)
-                            {
-                                fclose(transfer_state.file_ptr);
-                            }
-                            init_transfer_state(&transfer_state);
-                            printf("ftp> ");
-                            fflush(stdout);
-                        }
+                        printf(RED "\nProtocol error, closing connection\n" RESET);
+                        running = 0;
+                        break;
                     }
-                    else
+                }
+            }
+            else if (batch.active && find_batch_worker(&batch, fd))
+            {
+                // One of the connections of an mget/mput
+                handle_batch_event(sock, &batch, find_batch_worker(&batch, fd), events[i].events, epoll_fd);
+                if (batch.done + batch.failed == batch.file_count)
+                {
+                    transfer_state.outcome = batch.failed ? -1 : 1;
+                    finish_batch(&batch, epoll_fd);
+                    printf("ftp> ");
+                    fflush(stdout);
+                }
+            }
+            else if (parallel.active)
+            {
+                // One of the connections of a parallel download
+                for (int s = 0; s < parallel.stream_count; s++)
+                {
+                    if (parallel.streams[s].sock != fd)
+                        continue;
+
+                    int result = receive_range_data(&parallel, &parallel.streams[s], epoll_fd);
+                    if (result != 0)
                     {
-                        // Check if this might be the start of a file transfer (binary data)
-                        if (bytes_read >= sizeof(FileChunkHeader) && transfer_state.state == STATE_COMMAND)
+                        if (result == 1)
                         {
-                            // Try to interpret as file header
-                            FileChunkHeader potential_header;
-                            memcpy(&potential_header, temp_buffer, sizeof(FileChunkHeader));
-
-                            // Check if this looks like a valid file header
-                            uint32_t chunk_id = ntohl(potential_header.chunk_id);
-                            uint32_t total_chunks = ntohl(potential_header.total_chunks);
-                            uint32_t chunk_size = ntohl(potential_header.chunk_size);
-
-                            // If this looks like a valid file header (first chunk, reasonable values)
-                            if (chunk_id == 0 && total_chunks > 0 && total_chunks < 2000000 &&
-                                chunk_size > 0 && chunk_size <= CHUNK_SIZE &&
-                                potential_header.filename[0] != '\0')
-                            {
-                                // This is likely the start of a file transfer
-                                transfer_state.state = STATE_RECEIVING;
-                                transfer_state.current_chunk = 0;
-                                transfer_state.total_chunks = 0;
-                                memset(transfer_state.filename, 0, FILENAME_MAX_LEN);
-
-                                printf(GREEN "Starting download of file: %s\n" RESET, potential_header.filename);
-
-                                // Process this data as file transfer
-                                int result = receive_file_chunk_epoll(sock, &transfer_state, temp_buffer, bytes_read);
-                                if (result == 1)
-                                {
-                                    // Download complete
-                                    if (transfer_state.file_ptr)
-                                    {
-                                        fclose(transfer_state.file_ptr);
-                                    }
-                                    init_transfer_state(&transfer_state);
-                                    printf("ftp> ");
-                                    fflush(stdout);
-                                }
-                                else if (result == -1)
-                                {
-                                    // Download error
-                                    printf(RED "\nFile download failed!\n" RESET);
-                                    if (transfer_state.file_ptr)
-                                    {
-                                        fclose(transfer_state.file_ptr);
-                                    }
-                                    init_transfer_state(&transfer_state);
-                                    printf("ftp> ");
-                                    fflush(stdout);
-                                }
-                                continue; // Skip text processing
-                            }
+                            printf(GREEN "\nFile received successfully: %s (crc32c verified per chunk)\n" RESET, parallel.filename);
                         }
-
-                        // Handle regular server responses (text)
-                        temp_buffer[bytes_read] = '\0';
-
-                        // Append to server buffer
-                        if (server_data_len + bytes_read < sizeof(server_buffer) - 1)
+                        else
                         {
-                            memcpy(server_buffer + server_data_len, temp_buffer, bytes_read);
-                            server_data_len += bytes_read;
-                            server_buffer[server_data_len] = '\0';
+                            printf(RED "\nFile download failed!\n" RESET);
+                            transfer_state.outcome = -1;
                         }
-
-                        // Process complete lines from server
-                        char *newline_pos;
-                        while ((newline_pos = strchr(server_buffer, '\n')) != NULL)
+                        close_parallel_download(&parallel, epoll_fd);
+                        if (result == -1)
                         {
-                            *newline_pos = '\0';
-
-                            // Print server response
-                            if (strlen(server_buffer) > 0)
-                            {
-                                // Check for error messages and highlight them
-                                if (strncmp(server_buffer, "ERROR:", 6) == 0)
-                                {
-                                    printf(RED "%s\n" RESET, server_buffer);
-                                }
-                                else if (strncmp(server_buffer, "SUCCESS:", 8) == 0)
-                                {
-                                    printf(GREEN "%s\n" RESET, server_buffer);
-                                }
-                                else if (strncmp(server_buffer, "OK:", 3) == 0)
-                                {
-                                    printf(GREEN "%s\n" RESET, server_buffer);
-                                }
-                                else
-                                {
-                                    printf("%s\n", server_buffer);
-                                }
-                                printf("ftp> ");
-                                fflush(stdout);
-                            }
-
-                            // Shift remaining data in buffer
-                            int remaining = server_data_len - (newline_pos - server_buffer + 1);
-                            if (remaining > 0)
-                            {
-                                memmove(server_buffer, newline_pos + 1, remaining);
-                                server_data_len = remaining;
-                                server_buffer[server_data_len] = '\0';
-                            }
-                            else
-                            {
-                                server_data_len = 0;
-                                server_buffer[0] = '\0';
-                            }
+                            // The preallocated file would pass for a complete one
+                            unlink(parallel.filename);
                         }
+                        printf("ftp> ");
+                        fflush(stdout);
                     }
+                    break;
                 }
             }
         }
     }
 
     // Cleanup
+    if (script && !script_done)
+    {
+        // The connection went away before the script was done
+        script_failed = 1;
+    }
+    if (transfer_state.outcome == -1)
+    {
+        script_failed = 1;
+    }
+    if (batch.active)
+    {
+        close_batch(&batch, epoll_fd);
+    }
+    if (parallel.active)
+    {
+        close_parallel_download(&parallel, epoll_fd);
+        unlink(parallel.filename);
+    }
     if (transfer_state.file_ptr)
     {
         fclose(transfer_state.file_ptr);
     }
+    tar_reader_close(transfer_state.unpack);
+    free(transfer_state.file_buffer);
+    free(transfer_state.codec_buffer);
     close(epoll_fd);
     restore_stdin_blocking();
     close(sock);
-    return 0;
+    return (script && script_failed) ? 1 : 0;
 }
 
 void show_help()
 {
     printf(YELLOW "Available commands:\n" RESET);
     printf(CYAN "  get <filename> - Download a file from the server\n" RESET);
+    printf(CYAN "  get <filename> --streams N - Download over N parallel connections\n" RESET);
+    printf(CYAN "  get <directory> --recursive - Download a directory tree (streamed as tar)\n" RESET);
     printf(CYAN "  send <filename> - Upload a file to the server\n" RESET);
-    printf(CYAN "  list - List files on the server\n" RESET);
+    printf(CYAN "  mget/mput <glob> [--jobs K] - Download/upload every matching file, K at a time\n" RESET);
+    printf(CYAN "  get/send <filename> --resume - Continue an interrupted transfer\n" RESET);
+    printf(CYAN "  get/send <filename> --compress - Send chunks LZ4 compressed (skipped for compressed formats)\n" RESET);
+    printf(CYAN "  list [--offset N] [--limit N] [--compact] - List files on the server\n" RESET);
     printf(CYAN "  pwd - Print current working directory on the server\n" RESET);
     printf(CYAN "  cd <directory> - Change directory on the server\n" RESET);
     printf(CYAN "  delete <filename> - Delete a file on the server\n" RESET);
     printf(CYAN "  health - Show server health information\n" RESET);
+    printf(CYAN "  stats - Show server session and buffer pool usage\n" RESET);
+    printf(CYAN "  metrics [json] - Show server counters and latency histograms\n" RESET);
     printf(CYAN "  help - Show this help message\n" RESET);
     printf(CYAN "  clear - Clear the console\n" RESET);
     printf(CYAN "  exit - Exit the client\n" RESET);
 }
 
-void process_user_command(int sock, const char *command, transfer_state_t *transfer_state, int epoll_fd)
+void process_user_command(int sock, const char *command, transfer_state_t *transfer_state,
+                          parallel_download_t *parallel, batch_t *batch, int epoll_fd)
 {
+    if (transfer_state->resume != RESUME_NONE)
+    {
+        printf(RED "Error: Waiting for the server to confirm where to resume.\n" RESET);
+        return;
+    }
+
     if (strncmp(command, "get ", 4) == 0)
     {
-        const char *filename = command + 4;
-        if (strlen(filename) == 0)
+        char filename[256];
+        int stream_count = 1;
+        const char *options = strstr(command + 4, " --");
+        const char *streams_option = options ? strstr(options, " --streams ") : NULL;
+        int resume = options && strstr(options, " --resume") != NULL;
+        int compress = options && strstr(options, " --compress") != NULL;
+        int recursive = options && strstr(options, " --recursive") != NULL;
+        size_t name_len = options ? (size_t)(options - (command + 4)) : strlen(command + 4);
+        if (streams_option && (sscanf(streams_option + 11, "%d", &stream_count) != 1 || stream_count < 1 || stream_count > MAX_STREAMS))
+        {
+            printf(RED "Error: --streams takes a number from 1 to %d.\n" RESET, MAX_STREAMS);
+            return;
+        }
+        if (name_len == 0 || name_len >= sizeof(filename))
         {
             printf(RED "Error: 'get' command requires a filename.\n" RESET);
             return;
         }
+        memcpy(filename, command + 4, name_len);
+        filename[name_len] = '\0';
 
-        if (transfer_state->state != STATE_COMMAND)
+        if (transfer_state->state != STATE_COMMAND || parallel->active || batch->active)
         {
             printf(RED "Error: File transfer already in progress.\n" RESET);
             return;
         }
 
-        if (start_file_download(sock, filename, transfer_state) == 0)
+        if (compress && !transfer_state->server_lz4)
+        {
+            printf(YELLOW "The server does not offer compression, downloading uncompressed\n" RESET);
+            compress = 0;
+        }
+        transfer_state->compress = compress;
+        transfer_state->archive = recursive;
+
+        if (recursive && (resume || stream_count > 1))
+        {
+            printf(RED "Error: --recursive can't be combined with --resume or --streams.\n" RESET);
+        }
+        else if (resume && stream_count > 1)
+        {
+            printf(RED "Error: --resume and --streams can't be combined.\n" RESET);
+        }
+        else if (compress && stream_count > 1)
+        {
+            printf(RED "Error: --compress and --streams can't be combined.\n" RESET);
+        }
+        else if (resume)
+        {
+            request_resume(sock, filename, RESUME_DOWNLOAD, transfer_state);
+        }
+        else if (stream_count > 1)
+        {
+            transfer_state->outcome =
+                start_parallel_download(sock, filename, stream_count, transfer_state->chunk_size, parallel, epoll_fd);
+        }
+        else if (start_file_download(sock, filename, transfer_state) == 0)
         {
-            printf(GREEN "Starting download of file: %s\n" RESET, filename);
+            printf(GREEN "Starting download of %s: %s\n" RESET, recursive ? "directory" : "file", filename);
         }
     }
     else if (strncmp(command, "send ", 5) == 0)
     {
-        const char *filename = command + 5;
-        if (strlen(filename) == 0)
+        char filename[256];
+        const char *options = strstr(command + 5, " --");
+        int resume = options && strstr(options, " --resume") != NULL;
+        int compress = options && strstr(options, " --compress") != NULL;
+        size_t name_len = options ? (size_t)(options - (command + 5)) : strlen(command + 5);
+        if (name_len == 0 || name_len >= sizeof(filename))
         {
             printf(RED "Error: 'send' command requires a filename.\n" RESET);
             return;
         }
+        memcpy(filename, command + 5, name_len);
+        filename[name_len] = '\0';
 
-        if (transfer_state->state != STATE_COMMAND)
+        if (transfer_state->state != STATE_COMMAND || parallel->active || batch->active)
         {
             printf(RED "Error: File transfer already in progress.\n" RESET);
             return;
         }
 
-        if (start_file_upload(sock, filename, transfer_state) == 0)
+        if (compress && !transfer_state->server_lz4)
+        {
+            printf(YELLOW "The server does not offer compression, uploading uncompressed\n" RESET);
+            compress = 0;
+        }
+        transfer_state->compress = compress;
+
+        if (resume)
+        {
+            // The upload starts once the server says how much of it is already there
+            request_resume(sock, filename, RESUME_UPLOAD, transfer_state);
+        }
+        else if (start_file_upload(sock, filename, transfer_state) == 0)
         {
             // Send upload command to server first
-            send(sock, "upload\n", 7, MSG_NOSIGNAL);
+            begin_upload(sock, transfer_state, epoll_fd);
+        }
+    }
+    else if (strncmp(command, "mget ", 5) == 0 || strncmp(command, "mput ", 5) == 0)
+    {
+        char pattern[256];
+        int jobs = BATCH_DEFAULT_JOBS;
+        const char *options = strstr(command + 5, " --");
+        const char *jobs_option = options ? strstr(options, " --jobs ") : NULL;
+        size_t pattern_len = options ? (size_t)(options - (command + 5)) : strlen(command + 5);
+        if (jobs_option && (sscanf(jobs_option + 8, "%d", &jobs) != 1 || jobs < 1 || jobs > BATCH_MAX_JOBS))
+        {
+            printf(RED "Error: --jobs takes a number from 1 to %d.\n" RESET, BATCH_MAX_JOBS);
+            return;
+        }
+        if (pattern_len == 0 || pattern_len >= sizeof(pattern))
+        {
+            printf(RED "Error: '%.4s' command requires a file pattern.\n" RESET, command);
+            return;
+        }
+        memcpy(pattern, command + 5, pattern_len);
+        pattern[pattern_len] = '\0';
+
+        if (transfer_state->state != STATE_COMMAND || parallel->active || batch->active)
+        {
+            printf(RED "Error: File transfer already in progress.\n" RESET);
+            return;
+        }
+        if (transfer_state->replies_due > 0)
+        {
+            // The batch asks this connection for its directory first
+            printf(RED "Error: Waiting for the server's reply.\n" RESET);
+            return;
+        }
 
-            // Enable EPOLLOUT for socket to start sending file chunks
-            struct epoll_event event;
-            event.events = EPOLLIN | EPOLLOUT;
-            event.data.fd = sock;
-            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sock, &event);
+        int compress = options && strstr(options, " --compress") != NULL;
+        if (compress && !transfer_state->server_lz4)
+        {
+            printf(YELLOW "The server does not offer compression, transferring uncompressed\n" RESET);
+            compress = 0;
         }
+        transfer_state->compress = compress;
+        transfer_state->outcome = start_batch(sock, pattern, command[1] == 'p', jobs, transfer_state, batch, epoll_fd);
     }
-    else if (strcmp(command, "list") == 0)
+    else if (strcmp(command, "list") == 0 || strncmp(command, "list ", 5) == 0)
     {
+        // Paging and format options are passed through to ls
+        char ls_command[256];
+        snprintf(ls_command, sizeof(ls_command), "ls%s", command + 4);
         printf(BLUE "Listing files on the server...\n" RESET);
-        send(sock, "ls\n", 3, MSG_NOSIGNAL);
+        send_request(sock, transfer_state, ls_command);
     }
     else if (strcmp(command, "pwd") == 0)
     {
         printf(BLUE "Getting current working directory...\n" RESET);
-        send(sock, "pwd\n", 4, MSG_NOSIGNAL);
+        send_request(sock, transfer_state, "pwd");
     }
     else if (strncmp(command, "cd ", 3) == 0)
     {
@@ -636,9 +988,7 @@ void process_user_command(int sock, const char *command, transfer_state_t *trans
             return;
         }
         printf(GREEN "Changing directory to: %s\n" RESET, path);
-        char cmd_with_newline[256];
-        snprintf(cmd_with_newline, sizeof(cmd_with_newline), "%s\n", command);
-        send(sock, cmd_with_newline, strlen(cmd_with_newline), MSG_NOSIGNAL);
+        send_request(sock, transfer_state, command);
     }
     else if (strncmp(command, "delete ", 7) == 0)
     {
@@ -649,14 +999,22 @@ void process_user_command(int sock, const char *command, transfer_state_t *trans
             return;
         }
         printf(GREEN "Deleting file: %s\n" RESET, filename);
-        char cmd_with_newline[256];
-        snprintf(cmd_with_newline, sizeof(cmd_with_newline), "%s\n", command);
-        send(sock, cmd_with_newline, strlen(cmd_with_newline), MSG_NOSIGNAL);
+        send_request(sock, transfer_state, command);
     }
     else if (strcmp(command, "health") == 0)
     {
         printf(BLUE "Getting server health information...\n" RESET);
-        send(sock, "health\n", 7, MSG_NOSIGNAL);
+        send_request(sock, transfer_state, "health");
+    }
+    else if (strcmp(command, "stats") == 0)
+    {
+        printf(BLUE "Getting server memory statistics...\n" RESET);
+        send_request(sock, transfer_state, "stats");
+    }
+    else if (strcmp(command, "metrics") == 0 || strcmp(command, "metrics json") == 0)
+    {
+        printf(BLUE "Getting server metrics...\n" RESET);
+        send_request(sock, transfer_state, command);
     }
     else
     {
@@ -666,7 +1024,7 @@ void process_user_command(int sock, const char *command, transfer_state_t *trans
 
 // Progress bar function
 
-// Initialize transfer state
+// Initialize transfer state (the negotiated chunk size and its buffer are kept)
 void init_transfer_state(transfer_state_t *state)
 {
     // printf("DEBUG: Initializing transfer state\n");
@@ -677,9 +1035,23 @@ void init_transfer_state(transfer_state_t *state)
     state->current_chunk = 0;
     state->bytes_written = 0;
     state->file_size = 0;
+    state->file_buffer_len = 0;
     state->buffer_pos = 0;
-    state->header_received = 0;
+    state->parse_pos = 0;
+    state->expecting_header = 1;
+    state->payload_remaining = 0;
     memset(&state->current_header, 0, sizeof(FileChunkHeader));
+    state->stream_mode = 0;
+    state->stream_remaining = 0;
+    state->progress.percent = -1;
+    state->progress.drawn_us = 0;
+    state->resume = RESUME_NONE;
+    state->compress = 0;
+    state->archive = 0;
+    state->unpack = NULL;
+    state->incompressible_chunks = 0;
+    state->crc = 0;
+    state->resume_offset = 0;
 }
 
 // Send file chunk in non-blocking manner
@@ -691,42 +1063,74 @@ int send_file_chunk_epoll(int sock, transfer_state_t *state)
         return -1; // File not open
     }
 
-    // Read chunk from file
-    int bytes_read = fread(state->file_buffer, 1, CHUNK_SIZE, state->file_ptr);
-    if (bytes_read <= 0)
+    // Only read the next chunk once the previous one is fully sent
+    if (state->buffer_pos == state->file_buffer_len)
     {
-        return 0; // End of file or error
-    }
+        int bytes_read = fread(state->file_buffer + sizeof(FrameHeader) + sizeof(FileChunkHeader), 1, state->chunk_size, state->file_ptr);
+        if (bytes_read <= 0)
+        {
+            // Chunks are still due, so the file shrank or can't be read
+            printf(RED "\nError: Cannot read chunk %d of '%s'\n" RESET, state->current_chunk, state->filename);
+            return -1;
+        }
 
-    //  header
-    FileChunkHeader header;
-    header.chunk_id = htonl(state->current_chunk);
-    header.chunk_size = htonl(bytes_read);
-    header.total_chunks = htonl(state->total_chunks);
-    header.type = 0;
+        // The checksum covers the file bytes, sent as they are or compressed
+        state->crc = crc32c(state->crc, state->file_buffer + sizeof(FrameHeader) + sizeof(FileChunkHeader), bytes_read);
 
-    if (state->current_chunk == 0)
-    {
-        strncpy(header.filename, state->filename, FILENAME_MAX_LEN - 1);
-        header.filename[FILENAME_MAX_LEN - 1] = '\0';
-    }
-    else
-    {
-        memset(header.filename, 0, FILENAME_MAX_LEN);
-    }
+        uint32_t type = CHUNK_TYPE_DATA;
+        if (state->compress)
+        {
+            // Keep the LZ4 block only if it saves enough; data that keeps not shrinking goes raw
+            char *payload = state->file_buffer + sizeof(FrameHeader) + sizeof(FileChunkHeader);
+            int packed_len = lz4_compress_block(payload, bytes_read, state->codec_buffer,
+                                                bytes_read - bytes_read / COMPRESS_MIN_SAVING);
+            if (packed_len > 0)
+            {
+                memcpy(payload, state->codec_buffer, packed_len);
+                bytes_read = packed_len;
+                type = CHUNK_TYPE_LZ4;
+                state->incompressible_chunks = 0;
+            }
+            else if (++state->incompressible_chunks >= COMPRESS_GIVE_UP)
+            {
+                state->compress = 0;
+            }
+        }
 
-    // Send header
-    if (send(sock, &header, sizeof(header), MSG_NOSIGNAL) != sizeof(header))
-    {
-        if (errno == EWOULDBLOCK || errno == EAGAIN)
+        //  header
+        FileChunkHeader header;
+        header.chunk_id = htonl(state->current_chunk);
+        header.chunk_size = htonl(bytes_read);
+        header.total_chunks = htonl(state->total_chunks);
+        header.type = htonl(type);
+        header.checksum = htonl(state->crc);
+
+        // The first chunk sent names the file: chunk 0, or the resume point
+        if (state->file_buffer_len == 0)
         {
-            return -2; // Would block, try again later
+            strncpy(header.filename, state->filename, FILENAME_MAX_LEN - 1);
+            header.filename[FILENAME_MAX_LEN - 1] = '\0';
         }
-        return -1; // Error
+        else
+        {
+            memset(header.filename, 0, FILENAME_MAX_LEN);
+        }
+
+        FrameHeader frame = {
+            .version = FRAME_VERSION,
+            .type = FRAME_DATA,
+            .flags = 0,
+            .length = htonl(sizeof(header) + bytes_read)};
+        memcpy(state->file_buffer, &frame, sizeof(frame));
+        memcpy(state->file_buffer + sizeof(frame), &header, sizeof(header));
+        state->file_buffer_len = sizeof(frame) + sizeof(header) + bytes_read;
+        state->buffer_pos = 0;
     }
 
-    // Send payload
-    if (send(sock, state->file_buffer, bytes_read, MSG_NOSIGNAL) != bytes_read)
+    // Send frame + header + payload, remembering how far a short send got
+    ssize_t sent = send(sock, state->file_buffer + state->buffer_pos,
+                        state->file_buffer_len - state->buffer_pos, MSG_NOSIGNAL);
+    if (sent < 0)
     {
         if (errno == EWOULDBLOCK || errno == EAGAIN)
         {
@@ -735,9 +1139,15 @@ int send_file_chunk_epoll(int sock, transfer_state_t *state)
         return -1; // Error
     }
 
+    state->buffer_pos += sent;
+    if (state->buffer_pos < state->file_buffer_len)
+    {
+        return -2; // Rest of the chunk goes out on the next EPOLLOUT
+    }
+
     state->current_chunk++;
-    int percent = (state->total_chunks > 0) ? (state->current_chunk * 100) / state->total_chunks : 0;
-    progress_bar(percent);
+    if (!state->quiet)
+        progress_update(&state->progress, state->current_chunk, state->total_chunks);
 
     if (state->current_chunk >= state->total_chunks)
     {
@@ -747,208 +1157,607 @@ int send_file_chunk_epoll(int sock, transfer_state_t *state)
     return 0; // Continue
 }
 
-// Handle incoming file data in non-blocking manner
-int receive_file_chunk_epoll(int sock, transfer_state_t *state, char *buffer, int bytes_available)
+// Validate a complete chunk header and open the local file on the first one
+// Returns 0 to go on with the payload, -1 on error
+static int begin_chunk(transfer_state_t *state)
 {
-    static char recv_buffer[sizeof(FileChunkHeader) + CHUNK_SIZE];
-    static int recv_pos = 0;
-    static int expecting_header = 1;
-    static int payload_remaining = 0;
-    static int last_chunk_id = -1;
-    static int transfer_active = 0;
-
-    // printf("DEBUG: receive_file_chunk_epoll called - bytes_available=%d, expecting_header=%d, recv_pos=%d, transfer_active=%d\n",
-    //        bytes_available, expecting_header, recv_pos, transfer_active);
+    FileChunkHeader *header = &state->current_header;
+    memcpy(header, state->header_buffer, sizeof(FileChunkHeader));
+    header->chunk_id = ntohl(header->chunk_id);
+    header->chunk_size = ntohl(header->chunk_size);
+    header->total_chunks = ntohl(header->total_chunks);
+    header->type = ntohl(header->type);
+    header->checksum = ntohl(header->checksum);
+
+    if (header->chunk_size > (uint32_t)state->chunk_size || header->chunk_size == 0)
+    {
+        printf(RED "\nInvalid chunk size: %u\n" RESET, header->chunk_size);
+        return -1;
+    }
+    if (header->total_chunks > 2000000)
+    {
+        printf(RED "\nFile too large: %u chunks (max: 2,000,000)\n" RESET, header->total_chunks);
+        return -1;
+    }
+    if (header->type != CHUNK_TYPE_DATA && header->type != CHUNK_TYPE_STREAM && header->type != CHUNK_TYPE_LZ4)
+    {
+        printf(RED "\nUnknown chunk type %u\n" RESET, header->type);
+        return -1;
+    }
 
-    // Reset static variables only when starting a completely new download
-    // This should only happen when the client state is being reset
-    if (state->current_chunk == 0 && state->total_chunks == 0 && !transfer_active)
+    // A stream header only carries the 64-bit byte length
+    if (header->type == CHUNK_TYPE_STREAM && (header->chunk_id != 0 || header->chunk_size != sizeof(uint64_t)))
+    {
+        printf(RED "\nInvalid stream header\n" RESET);
+        return -1;
+    }
+    state->stream_mode = (header->type == CHUNK_TYPE_STREAM);
+    if (state->stream_mode && state->archive)
     {
-        // printf("DEBUG: Resetting static variables for new download\n");
-        recv_pos = 0;
-        expecting_header = 1;
-        payload_remaining = 0;
-        last_chunk_id = -1;
-        transfer_active = 1;
+        printf(RED "\nUnexpected stream for a directory download\n" RESET);
+        return -1;
     }
 
-    int processed = 0;
-    int max_iterations = bytes_available * 2; // Safety limit to prevent infinite loops
-    int iteration_count = 0;
+    // Chunks arrive in order from where the transfer starts: 0, or the resume point
+    if (header->chunk_id != (uint32_t)state->current_chunk)
+    {
+        printf(RED "\nChunk sequence error: expected %d, got %u\n" RESET, state->current_chunk, header->chunk_id);
+        return -1;
+    }
 
-    while (processed < bytes_available && iteration_count < max_iterations)
+    if (header->chunk_id == 0 && !state->file_ptr && !state->unpack)
     {
-        iteration_count++;
-        if (expecting_header)
+        // First chunk names the file
+        header->filename[FILENAME_MAX_LEN - 1] = '\0';
+        strncpy(state->filename, header->filename, FILENAME_MAX_LEN - 1);
+        state->total_chunks = header->total_chunks;
+        if (state->archive)
         {
-            // Need to receive header
-            int header_needed = sizeof(FileChunkHeader) - recv_pos;
-            int to_copy = (bytes_available - processed < header_needed) ? (bytes_available - processed) : header_needed;
-
-            memcpy(recv_buffer + recv_pos, buffer + processed, to_copy);
-            recv_pos += to_copy;
-            processed += to_copy;
-
-            if (recv_pos >= sizeof(FileChunkHeader))
+            // Entries are created below the current directory as the archive arrives
+            state->unpack = tar_reader_open(AT_FDCWD);
+            if (!state->unpack)
             {
-                // Header complete
-                memcpy(&state->current_header, recv_buffer, sizeof(FileChunkHeader));
-
-                // Convert from network byte order
-                state->current_header.chunk_id = ntohl(state->current_header.chunk_id);
-                state->current_header.chunk_size = ntohl(state->current_header.chunk_size);
-                state->current_header.total_chunks = ntohl(state->current_header.total_chunks);
-
-                // printf("DEBUG: Header received - chunk_id=%d, chunk_size=%d, total_chunks=%d, filename='%s'\n",
-                //        state->current_header.chunk_id, state->current_header.chunk_size,
-                //        state->current_header.total_chunks, state->current_header.filename);
-
-                // Validate chunk size
-                if (state->current_header.chunk_size > CHUNK_SIZE || state->current_header.chunk_size <= 0)
-                {
-                    printf(RED "\nInvalid chunk size: %d\n" RESET, state->current_header.chunk_size);
-                    transfer_active = 0; // Reset on error
-                    return -1;
-                }
-
-                // Validate total chunks for very large files
-                if (state->current_header.total_chunks > 2000000)
-                {
-                    printf(RED "\nFile too large: %d chunks (max: 2,000,000)\n" RESET, state->current_header.total_chunks);
-                    transfer_active = 0; // Reset on error
-                    return -1;
-                }
-
-                // Update last chunk id tracking and validate sequence
-                if (state->current_chunk > 0 && state->current_header.chunk_id != last_chunk_id + 1)
-                {
-                    printf(RED "\nChunk sequence error: expected %d, got %d\n" RESET,
-                           last_chunk_id + 1, state->current_header.chunk_id);
-                    transfer_active = 0; // Reset on error
-                    return -1;
-                }
-                last_chunk_id = state->current_header.chunk_id;
-
-                // First chunk contains filename
-                if (state->current_header.chunk_id == 0)
-                {
-                    state->current_header.filename[FILENAME_MAX_LEN - 1] = '\0';
-                    strncpy(state->filename, state->current_header.filename, FILENAME_MAX_LEN - 1);
-                    state->total_chunks = state->current_header.total_chunks;
-
-                    // printf("DEBUG: Opening file for writing: %s\n", state->filename);
-                    state->file_ptr = fopen(state->filename, "wb");
-                    if (!state->file_ptr)
-                    {
-                        printf(RED "\nFailed to open file for writing: %s\n" RESET, state->filename);
-                        transfer_active = 0; // Reset on error
-                        return -1;
-                    }
-                    printf(GREEN "\nReceiving file: %s (%d chunks)\n" RESET,
-                           state->filename, state->total_chunks);
-                }
-
-                expecting_header = 0;
-                payload_remaining = state->current_header.chunk_size;
-                recv_pos = 0;
-                // printf("DEBUG: Expecting payload of %d bytes\n", payload_remaining);
+                printf(RED "\nOut of memory\n" RESET);
+                return -1;
             }
+            if (!state->quiet)
+                printf(GREEN "\nReceiving directory: %s (%d chunks)\n" RESET, state->filename, state->total_chunks);
+            return 0;
         }
-        else
+        state->file_ptr = fopen(state->filename, "wb");
+        if (!state->file_ptr)
+        {
+            printf(RED "\nFailed to open file for writing: %s\n" RESET, state->filename);
+            return -1;
+        }
+        if (!state->quiet)
+            printf(GREEN "\nReceiving file: %s (%d chunks)\n" RESET, state->filename, state->total_chunks);
+    }
+    else if (state->total_chunks == 0)
+    {
+        // First chunk of a resumed download, the file is already open at its offset
+        if (!state->file_ptr)
         {
-            // Receive payload
-            int to_copy = (bytes_available - processed < payload_remaining) ? (bytes_available - processed) : payload_remaining;
+            printf(RED "\nUnexpected chunk %u at the start of a download\n" RESET, header->chunk_id);
+            return -1;
+        }
+        state->total_chunks = header->total_chunks;
+        printf(GREEN "\nResuming file: %s at chunk %d of %d\n" RESET, state->filename, state->current_chunk,
+               state->total_chunks);
+    }
+    return 0;
+}
 
-            memcpy(recv_buffer + recv_pos, buffer + processed, to_copy);
-            recv_pos += to_copy;
-            processed += to_copy;
-            payload_remaining -= to_copy;
+// Decode, verify and write a chunk whose payload is complete in file_buffer
+// Returns 1 once the last chunk is written, 0 to go on, -1 on error
+static int finish_chunk(transfer_state_t *state, int len)
+{
+    const char *plain = state->file_buffer;
+    if (state->current_header.type == CHUNK_TYPE_LZ4)
+    {
+        len = lz4_decompress_block(state->file_buffer, len, state->codec_buffer, state->chunk_size);
+        if (len <= 0)
+        {
+            printf(RED "\nCorrupt compressed chunk %u\n" RESET, state->current_header.chunk_id);
+            return -1;
+        }
+        plain = state->codec_buffer;
+    }
 
-            if (payload_remaining == 0)
+    // A chunk that fails verification is not written, resume continues before it
+    state->crc = crc32c(state->crc, plain, len);
+    if (state->crc != state->current_header.checksum)
+    {
+        printf(RED "\nChecksum mismatch in chunk %u\n" RESET, state->current_header.chunk_id);
+        return -1;
+    }
+    if (state->unpack)
+    {
+        if (tar_reader_feed(state->unpack, plain, len) == -1)
+        {
+            printf(RED "\nFailed to unpack directory: %s\n" RESET, tar_reader_error(state->unpack));
+            return -1;
+        }
+    }
+    else if (fwrite(plain, 1, len, state->file_ptr) != (size_t)len)
+    {
+        printf(RED "\nFailed to write to file\n" RESET);
+        return -1;
+    }
+
+    state->current_chunk++;
+    if (state->unpack && state->current_chunk >= state->total_chunks && tar_reader_finish(state->unpack) == -1)
+    {
+        printf(RED "\nFailed to unpack directory: %s\n" RESET, tar_reader_error(state->unpack));
+        return -1;
+    }
+    if (state->quiet)
+        return state->current_chunk >= state->total_chunks;
+    progress_update(&state->progress, state->current_chunk, state->total_chunks);
+    if (state->current_chunk >= state->total_chunks)
+    {
+        if (state->unpack)
+            printf(GREEN "\nDirectory received successfully: %s (%ld files, crc32c %08x verified)\n" RESET,
+                   state->filename, tar_reader_files(state->unpack), state->crc);
+        else
+            printf(GREEN "\nFile received successfully: %s (crc32c %08x verified)\n" RESET, state->filename, state->crc);
+        return 1;
+    }
+    return 0;
+}
+
+// Handle incoming file data in non-blocking manner; the parser lives in the transfer
+// state, so it starts over with every transfer
+// Returns 1 when the download is complete, 0 to keep going, -1 on error
+int receive_file_chunk_epoll(int sock, transfer_state_t *state, char *buffer, int bytes_available)
+{
+    (void)sock;
+    int processed = 0;
+
+    while (processed < bytes_available)
+    {
+        int available = bytes_available - processed;
+
+        long long contents_left = state->stream_remaining - STREAM_TRAILER_LEN;
+        if (contents_left > 0)
+        {
+            // Raw stream, write straight from the socket buffer
+            int to_write = (available < contents_left) ? available : (int)contents_left;
+            if (fwrite(buffer + processed, 1, to_write, state->file_ptr) != (size_t)to_write)
+            {
+                printf(RED "\nFailed to write to file\n" RESET);
+                return -1;
+            }
+            state->crc = crc32c(state->crc, buffer + processed, to_write);
+            processed += to_write;
+            state->stream_remaining -= to_write;
+            if (!state->quiet)
+                progress_update(&state->progress, state->file_size - contents_left + to_write, state->file_size);
+            continue;
+        }
+        if (state->stream_remaining > 0)
+        {
+            // Trailer, collected in the header buffer and compared with the sum of the contents
+            int to_copy = (available < state->stream_remaining) ? available : (int)state->stream_remaining;
+            memcpy(state->header_buffer + state->parse_pos, buffer + processed, to_copy);
+            state->parse_pos += to_copy;
+            processed += to_copy;
+            state->stream_remaining -= to_copy;
+            if (state->stream_remaining > 0)
+            {
+                continue;
+            }
+
+            uint32_t server_crc;
+            memcpy(&server_crc, state->header_buffer, sizeof(server_crc));
+            if (ntohl(server_crc) != state->crc)
+            {
+                printf(RED "\nChecksum mismatch: received crc32c %08x, the server sent %08x\n" RESET, state->crc,
+                       ntohl(server_crc));
+                return -1;
+            }
+            if (!state->quiet)
+                printf(GREEN "\nFile received successfully: %s (crc32c %08x verified)\n" RESET, state->filename,
+                       state->crc);
+            return 1;
+        }
+
+        if (state->expecting_header)
+        {
+            int header_needed = sizeof(FileChunkHeader) - state->parse_pos;
+            int to_copy = (available < header_needed) ? available : header_needed;
+            memcpy(state->header_buffer + state->parse_pos, buffer + processed, to_copy);
+            state->parse_pos += to_copy;
+            processed += to_copy;
+
+            if (state->parse_pos == (int)sizeof(FileChunkHeader))
             {
-                // Payload complete, write to file
-                // printf("DEBUG: Chunk payload complete, writing %d bytes to file\n", recv_pos);
-                if (state->file_ptr && fwrite(recv_buffer, 1, recv_pos, state->file_ptr) != recv_pos)
+                if (begin_chunk(state) == -1)
                 {
-                    printf(RED "\nFailed to write to file\n" RESET);
-                    transfer_active = 0; // Reset on error
                     return -1;
                 }
+                state->expecting_header = 0;
+                state->payload_remaining = state->current_header.chunk_size;
+                state->parse_pos = 0;
+            }
+            continue;
+        }
+
+        // Payload, collected whole so it can be decoded and verified before it is written
+        int to_copy = (available < state->payload_remaining) ? available : state->payload_remaining;
+        memcpy(state->file_buffer + state->parse_pos, buffer + processed, to_copy);
+        state->parse_pos += to_copy;
+        processed += to_copy;
+        state->payload_remaining -= to_copy;
+        if (state->payload_remaining > 0)
+        {
+            continue;
+        }
+
+        int len = state->parse_pos;
+        state->expecting_header = 1;
+        state->parse_pos = 0;
+
+        if (state->stream_mode)
+        {
+            // Stream header payload is the file length; the raw bytes follow
+            uint64_t length;
+            memcpy(&length, state->file_buffer, sizeof(length));
+            state->file_size = (long)be64toh(length);
+            state->stream_remaining = state->file_size + STREAM_TRAILER_LEN;
+            continue;
+        }
+
+        int result = finish_chunk(state, len);
+        if (result != 0)
+        {
+            return result;
+        }
+    }
+    return 0;
+}
+
+// Blocking read of one response frame into reply as a C string
+// Returns the reply length, or -1 if the server sent something else
+static int read_reply(int sock, char *reply, size_t size)
+{
+    FrameHeader frame;
+    if (recv(sock, &frame, sizeof(frame), MSG_WAITALL) != (ssize_t)sizeof(frame) ||
+        frame.version != FRAME_VERSION || frame.type != FRAME_RESPONSE)
+    {
+        return -1;
+    }
+    uint32_t length = ntohl(frame.length);
+    if (length >= size || recv(sock, reply, length, MSG_WAITALL) != (ssize_t)length)
+    {
+        return -1;
+    }
+    reply[length] = '\0';
+    return (int)length;
+}
+
+// Ask the server for a larger chunk size while the socket is still blocking; *server_lz4
+// is set if the reply advertises LZ4 chunks
+// Returns the granted size, or 0 if the server doesn't understand hello
+int negotiate_chunk_size(int sock, int *server_lz4)
+{
+    char command[64];
+    snprintf(command, sizeof(command), "hello %d", REQUESTED_CHUNK_SIZE);
+    if (send_command(sock, command) == -1)
+    {
+        return 0;
+    }
+
+    char reply[128];
+    int chunk_size = 0;
+    if (read_reply(sock, reply, sizeof(reply)) == -1 ||
+        sscanf(reply, "OK: chunk_size=%d", &chunk_size) != 1 || chunk_size < CHUNK_SIZE)
+    {
+        return 0;
+    }
+    *server_lz4 = strstr(reply, " compress=lz4") != NULL;
+    return chunk_size;
+}
+
+// Send one command to the server as a command frame
+int send_command(int sock, const char *command)
+{
+    char frame[sizeof(FrameHeader) + 1024];
+    size_t len = strlen(command);
+    if (len > sizeof(frame) - sizeof(FrameHeader))
+    {
+        printf(RED "Error: Command too long\n" RESET);
+        return -1;
+    }
+
+    FrameHeader header = {
+        .version = FRAME_VERSION,
+        .type = FRAME_COMMAND,
+        .flags = 0,
+        .length = htonl(len)};
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), command, len);
+
+    if (send(sock, frame, sizeof(header) + len, MSG_NOSIGNAL) != (ssize_t)(sizeof(header) + len))
+    {
+        printf(RED "Error: Failed to send command\n" RESET);
+        return -1;
+    }
+    return 0;
+}
+
+// Send a command that the server answers with a response frame, or the first data frame
+// of a download, and count the answer as due until it arrives
+int send_request(int sock, transfer_state_t *state, const char *command)
+{
+    if (send_command(sock, command) == -1)
+    {
+        return -1;
+    }
+    state->replies_due++;
+    return 0;
+}
+
+// Print one line of a server response, highlighting status lines
+static void print_response_line(const char *line)
+{
+    if (strncmp(line, "ERROR:", 6) == 0)
+    {
+        printf(RED "%s\n" RESET, line);
+    }
+    else if (strncmp(line, "SUCCESS:", 8) == 0)
+    {
+        printf(GREEN "%s\n" RESET, line);
+    }
+    else if (strncmp(line, "OK:", 3) == 0)
+    {
+        printf(GREEN "%s\n" RESET, line);
+    }
+    else
+    {
+        printf("%s\n", line);
+    }
+}
+
+// Print response text as it arrives, one line at a time
+static void handle_response_text(frame_reader_t *reader, const char *data, int len)
+{
+    if (reader->hold)
+    {
+        // Collect the whole reply, the caller parses it once the frame is complete
+        int room = (int)sizeof(reader->line) - 1 - reader->line_len;
+        int to_copy = (len < room) ? len : room;
+        memcpy(reader->line + reader->line_len, data, to_copy);
+        reader->line_len += to_copy;
+        return;
+    }
+
+    for (int i = 0; i < len; i++)
+    {
+        if (data[i] == '\n' || reader->line_len == (int)sizeof(reader->line) - 1)
+        {
+            reader->line[reader->line_len] = '\0';
+            print_response_line(reader->line);
+            reader->line_len = 0;
+            if (data[i] == '\n')
+                continue;
+        }
+        reader->line[reader->line_len++] = data[i];
+    }
+}
+
+// Print the reply to an upload and compare the digest in it with the one of the bytes sent;
+// after a resume both cover the bytes from the offset the reply names with from=
+static void check_upload_reply(transfer_state_t *state, char *reply)
+{
+    state->upload_check = 0;
+
+    unsigned int server_crc;
+    long long server_from = 0;
+    const char *digest = strstr(reply, " crc32c=");
+    const char *from = strstr(reply, " from=");
+    int verified = strncmp(reply, "SUCCESS:", 8) == 0 && digest && sscanf(digest, " crc32c=%x", &server_crc) == 1 &&
+                   (!from || sscanf(from, " from=%lld", &server_from) == 1);
+
+    // Batch transfers only show replies that aren't a plain success
+    for (char *line = reply; *line && !(state->quiet && verified);)
+    {
+        char *end = line + strcspn(line, "\n");
+        int last = (*end == '\0');
+        *end = '\0';
+        print_response_line(line);
+        line = last ? end : end + 1;
+    }
+
+    if (verified && server_from != state->upload_from)
+    {
+        printf(RED "Checksum mismatch: the server's digest starts at byte %lld, the upload at %lld\n" RESET,
+               server_from, state->upload_from);
+    }
+    else if (verified && server_crc == state->upload_crc)
+    {
+        state->outcome = 1;
+        if (!state->quiet && server_from > 0)
+            printf(GREEN "Checksum verified (crc32c %08x of the bytes from %lld on)\n" RESET, server_crc, server_from);
+        else if (!state->quiet)
+            printf(GREEN "Checksum verified (crc32c %08x)\n" RESET, server_crc);
+    }
+    else if (verified)
+    {
+        printf(RED "Checksum mismatch: sent crc32c %08x, the server stored %08x\n" RESET, state->upload_crc, server_crc);
+    }
+}
+
+// Close out a download after receive_file_chunk_epoll() finished or failed
+static void finish_download(transfer_state_t *state, int result)
+{
+    if (result == -1 && !state->quiet)
+    {
+        printf(RED "\nFile download failed!\n" RESET);
+    }
+    if (state->file_ptr)
+    {
+        fclose(state->file_ptr);
+    }
+    tar_reader_close(state->unpack);
+    init_transfer_state(state);
+    state->outcome = result;
+    if (!state->quiet)
+    {
+        printf("ftp> ");
+        fflush(stdout);
+    }
+}
+
+// Run data received from the server through the frame parser
+// Returns -1 on a protocol violation, after which the stream can't be trusted
+int handle_server_data(int sock, frame_reader_t *reader, transfer_state_t *state, char *data, int len, int epoll_fd)
+{
+    int processed = 0;
+    while (processed < len)
+    {
+        if (reader->header_len < (int)sizeof(FrameHeader))
+        {
+            int header_needed = sizeof(FrameHeader) - reader->header_len;
+            int to_copy = (len - processed < header_needed) ? (len - processed) : header_needed;
+            memcpy((char *)&reader->header + reader->header_len, data + processed, to_copy);
+            reader->header_len += to_copy;
+            processed += to_copy;
+            if (reader->header_len < (int)sizeof(FrameHeader))
+            {
+                break;
+            }
+
+            reader->header.length = ntohl(reader->header.length);
+            reader->remaining = reader->header.length;
+            if (reader->header.version != FRAME_VERSION)
+            {
+                printf(RED "\nUnsupported protocol version %u\n" RESET, reader->header.version);
+                return -1;
+            }
 
-                // Flush file periodically for large files to ensure data is written
-                if (state->total_chunks > 10000 && state->current_chunk % 1000 == 0)
+            switch (reader->header.type)
+            {
+            case FRAME_RESPONSE:
+                reader->line_len = 0;
+                reader->hold = (state->resume == RESUME_UPLOAD || state->resume == RESUME_DOWNLOAD || state->upload_check);
+                break;
+            case FRAME_DATA:
+                if (state->stream_remaining > 0)
                 {
-                    fflush(state->file_ptr);
+                    printf(RED "\nUnexpected data frame inside a stream\n" RESET);
+                    return -1;
                 }
+                if (state->state == STATE_COMMAND && state->resume == RESUME_RANGE)
+                {
+                    // The resumed download continues into the file resume_transfer() opened
+                    state->state = STATE_RECEIVING;
+                    state->resume = RESUME_NONE;
+                    if (state->replies_due > 0)
+                        state->replies_due--;
+                }
+                else if (state->state == STATE_COMMAND)
+                {
+                    // The server accepted our get, the download starts with this frame
+                    if (state->replies_due > 0)
+                        state->replies_due--;
+                    state->state = STATE_RECEIVING;
+                    state->current_chunk = 0;
+                    state->total_chunks = 0;
+                    memset(state->filename, 0, FILENAME_MAX_LEN);
+                }
+                break;
+            case FRAME_STREAM:
+                if (state->state != STATE_RECEIVING || state->stream_remaining < reader->header.length)
+                {
+                    printf(RED "\nUnexpected stream frame\n" RESET);
+                    return -1;
+                }
+                break;
+            default:
+                printf(RED "\nUnknown frame type %u\n" RESET, reader->header.type);
+                return -1;
+            }
+        }
+        else
+        {
+            int to_copy = (len - processed < (int)reader->remaining) ? (len - processed) : (int)reader->remaining;
+            if (reader->header.type == FRAME_RESPONSE)
+            {
+                handle_response_text(reader, data + processed, to_copy);
+            }
+            else if (state->state == STATE_RECEIVING)
+            {
+                int result = receive_file_chunk_epoll(sock, state, data + processed, to_copy);
+                if (result != 0)
+                {
+                    finish_download(state, result);
+                }
+                if (result == -1 && state->quiet)
+                {
+                    return -1; // A batch connection is replaced rather than resynchronized
+                }
+            }
+            processed += to_copy;
+            reader->remaining -= to_copy;
+        }
 
-                state->current_chunk++;
-                int percent = (state->total_chunks > 0) ? (state->current_chunk * 100) / state->total_chunks : 0;
-                progress_bar(percent);
-
-                // For large files, show periodic status updates
-                if (state->total_chunks > 10000)
+        if (reader->remaining == 0)
+        {
+            // Frame complete
+            reader->header_len = 0;
+            if (reader->header.type == FRAME_RESPONSE && state->replies_due > 0)
+            {
+                state->replies_due--;
+            }
+            if (reader->header.type == FRAME_RESPONSE && reader->hold)
+            {
+                reader->line[reader->line_len] = '\0';
+                reader->line_len = 0;
+                reader->hold = 0;
+                if (state->resume == RESUME_UPLOAD || state->resume == RESUME_DOWNLOAD)
                 {
-                    if (state->current_chunk % 5000 == 0 || state->current_chunk == state->total_chunks)
-                    {
-                        printf("\nProgress: %d/%d chunks (%d%%) - %.2f MB received",
-                               state->current_chunk, state->total_chunks, percent,
-                               (float)(state->current_chunk * CHUNK_SIZE) / (1024 * 1024));
-                        fflush(stdout);
-                    }
+                    resume_transfer(sock, state, reader->line, epoll_fd);
                 }
-                else if (state->total_chunks > 1000 && state->current_chunk % 1000 == 0)
+                else
+                {
+                    check_upload_reply(state, reader->line);
+                }
+                if (state->state == STATE_COMMAND && state->resume == RESUME_NONE && !state->quiet)
                 {
-                    printf("\nProgress: %d/%d chunks (%d%%)",
-                           state->current_chunk, state->total_chunks, percent);
+                    printf("ftp> ");
                     fflush(stdout);
                 }
-
-                // For very large files, add extra file flushing to prevent buffer issues
-                if (state->total_chunks > 500000 && state->current_chunk % 500 == 0)
+            }
+            else if (reader->header.type == FRAME_RESPONSE)
+            {
+                if (reader->line_len > 0)
                 {
-                    fflush(state->file_ptr);
-                    fsync(fileno(state->file_ptr)); // Force data to disk
+                    reader->line[reader->line_len] = '\0';
+                    print_response_line(reader->line);
+                    reader->line_len = 0;
                 }
-
-                // printf("DEBUG: Completed chunk %d/%d\n", state->current_chunk, state->total_chunks);
-
-                // Check if transfer complete
-                if (state->current_chunk >= state->total_chunks)
+                if (state->resume == RESUME_RANGE)
                 {
-                    printf(GREEN "\nFile received successfully: %s\n" RESET, state->filename);
-
-                    // Reset static variables for next download
-                    // printf("DEBUG: Transfer complete, resetting static variables\n");
-                    recv_pos = 0;
-                    expecting_header = 1;
-                    payload_remaining = 0;
-                    last_chunk_id = -1;
-                    transfer_active = 0; // Mark transfer as complete
-
-                    return 1; // Transfer complete
+                    // The server refused the ranged get, the partial file stays as it was
+                    fclose(state->file_ptr);
+                    init_transfer_state(state);
+                }
+                if (!state->quiet)
+                {
+                    printf("ftp> ");
+                    fflush(stdout);
                 }
-
-                expecting_header = 1;
-                recv_pos = 0;
-                // printf("DEBUG: Ready for next chunk header\n");
             }
         }
     }
-
-    // Check if we hit the iteration limit (potential infinite loop)
-    if (iteration_count >= max_iterations)
-    {
-        printf(RED "\nError: Hit iteration limit during file receive (potential corruption)\n" RESET);
-        transfer_active = 0; // Reset on error
-        return -1;
-    }
-
-    return 0; // Continue receiving
+    return 0;
 }
 
 // Start file upload
 int start_file_upload(int sock, const char *filename, transfer_state_t *state)
 {
+    state->outcome = -1; // Until the server confirms the digest
     FILE *fp = fopen(filename, "rb");
     if (!fp)
     {
@@ -974,11 +1783,22 @@ int start_file_upload(int sock, const char *filename, transfer_state_t *state)
     strncpy(state->filename, filename, FILENAME_MAX_LEN - 1);
     state->filename[FILENAME_MAX_LEN - 1] = '\0';
     state->file_size = filesize;
-    state->total_chunks = (filesize > 0) ? (filesize + CHUNK_SIZE - 1) / CHUNK_SIZE : 1;
+    state->total_chunks = (filesize > 0) ? (filesize + state->chunk_size - 1) / state->chunk_size : 1;
     state->current_chunk = 0;
 
-    printf(GREEN "Starting upload of '%s' (%ld bytes, %d chunks)\n" RESET,
-           filename, filesize, state->total_chunks);
+    // Formats that are compressed already go out raw
+    unsigned char head[16];
+    ssize_t head_len = pread(fileno(fp), head, sizeof(head), 0);
+    if (state->compress && head_len > 0 && compress_skip_data(head, head_len))
+    {
+        if (!state->quiet)
+            printf(YELLOW "'%s' is compressed already, sending it uncompressed\n" RESET, filename);
+        state->compress = 0;
+    }
+
+    if (!state->quiet)
+        printf(GREEN "Starting upload of '%s' (%ld bytes, %d chunks%s)\n" RESET,
+           filename, filesize, state->total_chunks, state->compress ? ", lz4" : "");
 
     return 0;
 }
@@ -986,30 +1806,929 @@ int start_file_upload(int sock, const char *filename, transfer_state_t *state)
 // Start file download
 int start_file_download(int sock, const char *filename, transfer_state_t *state)
 {
+    state->outcome = -1; // Until the download completes
     // Send get command to server
     char command[256];
-    snprintf(command, sizeof(command), "get %s\n", filename);
+    // Ask for the raw sendfile() stream, or LZ4 chunks with --compress; the header type
+    // tells us what we got. A directory comes as chunks of a tar archive.
+    if (state->archive)
+        snprintf(command, sizeof(command), "get %s-t %s", state->compress ? "-z " : "", filename);
+    else
+        snprintf(command, sizeof(command), "get %s %s", state->compress ? "-z" : "-s", filename);
 
-    if (send(sock, command, strlen(command), MSG_NOSIGNAL) <= 0)
+    if (send_request(sock, state, command) == -1)
     {
         printf(RED "Error: Failed to send get command\n" RESET);
         return -1;
     }
 
     // Don't switch to receiving state immediately - wait for server response
-    // The state will be changed in the response handler if the file exists
+    // The first data frame switches to receiving, a response frame means it failed
 
-    printf(GREEN "Requesting file: %s\n" RESET, filename);
+    if (!state->quiet)
+        printf(GREEN "Requesting %s: %s\n" RESET, state->archive ? "directory" : "file", filename);
     return 0;
 }
 
-int main()
+// Tell the server an upload starts and let EPOLLOUT drive the chunks
+int begin_upload(int sock, transfer_state_t *state, int epoll_fd)
 {
-    printf(GREEN "Starting epoll-based FTP client...\n" RESET);
-    return start_epoll_client("127.0.0.1", 8080);
+    if (send_request(sock, state, "upload") == -1)
+    {
+        fclose(state->file_ptr);
+        init_transfer_state(state);
+        return -1;
+    }
+    state->upload_check = 1;
+
+    // Enable EPOLLOUT for socket to start sending file chunks
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT;
+    event.data.fd = sock;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sock, &event);
+    return 0;
+}
+
+// Ask how much of a file the server already has (send/get --resume); the reply is
+// handed to resume_transfer() instead of being printed
+int request_resume(int sock, const char *filename, resume_t resume, transfer_state_t *state)
+{
+    char command[512];
+    strncpy(state->filename, filename, FILENAME_MAX_LEN - 1);
+    state->filename[FILENAME_MAX_LEN - 1] = '\0';
+    if (resume == RESUME_UPLOAD)
+    {
+        // Uploads land in saved/ below the session's directory; size -u counts an unfinished
+        // upload's .part, or the finished file if there is none
+        snprintf(command, sizeof(command), "size -u %s", state->filename);
+    }
+    else
+    {
+        snprintf(command, sizeof(command), "size %s", state->filename);
+    }
+
+    if (send_request(sock, state, command) == -1)
+    {
+        return -1;
+    }
+    state->resume = resume;
+    return 0;
+}
+
+// Continue a --resume transfer from the size the server reported; only whole chunks
+// count, so a torn last chunk is sent again
+void resume_transfer(int sock, transfer_state_t *state, char *reply, int epoll_fd)
+{
+    char filename[FILENAME_MAX_LEN];
+    resume_t resume = state->resume;
+    long long remote_size = -1;
+    strcpy(filename, state->filename);
+    state->resume = RESUME_NONE;
+    if (sscanf(reply, "OK: size=%lld", &remote_size) != 1)
+    {
+        remote_size = -1; // Nothing on the server yet
+    }
+
+    if (resume == RESUME_UPLOAD)
+    {
+        if (start_file_upload(sock, filename, state) == -1)
+        {
+            return;
+        }
+        if (remote_size >= state->file_size)
+        {
+            if (remote_size == state->file_size)
+            {
+                printf(GREEN "'%s' is already complete on the server\n" RESET, filename);
+                state->outcome = 1;
+            }
+            else
+                printf(RED "Error: The server's copy of '%s' is larger than the local file\n" RESET, filename);
+            fclose(state->file_ptr);
+            init_transfer_state(state);
+            return;
+        }
+
+        long long resume_chunk = (remote_size > 0) ? remote_size / state->chunk_size : 0;
+        if (fseeko(state->file_ptr, (off_t)resume_chunk * state->chunk_size, SEEK_SET) == -1)
+        {
+            perror("fseeko");
+            fclose(state->file_ptr);
+            init_transfer_state(state);
+            return;
+        }
+        state->current_chunk = (int)resume_chunk;
+        state->resume_offset = resume_chunk * state->chunk_size;
+        if (resume_chunk > 0)
+        {
+            printf(GREEN "Resuming upload of '%s' at chunk %lld of %d\n" RESET, filename, resume_chunk, state->total_chunks);
+        }
+        begin_upload(sock, state, epoll_fd);
+        return;
+    }
+
+    if (remote_size < 0)
+    {
+        reply[strcspn(reply, "\n")] = '\0';
+        print_response_line(reply);
+        return;
+    }
+    if (remote_size == 0)
+    {
+        // No chunks to resume from, a plain download creates the empty file
+        start_file_download(sock, filename, state);
+        return;
+    }
+
+    struct stat st;
+    long long local_size = (stat(filename, &st) == 0) ? st.st_size : 0;
+    if (local_size >= remote_size)
+    {
+        if (local_size == remote_size)
+            printf(GREEN "'%s' is already complete\n" RESET, filename);
+        else
+            printf(RED "Error: The local copy of '%s' is larger than the server's\n" RESET, filename);
+        return;
+    }
+
+    // Keep the whole chunks of the local copy and ask for everything after them
+    long long first_chunk = local_size / state->chunk_size;
+    off_t offset = (off_t)first_chunk * state->chunk_size;
+    FILE *fp = fopen(filename, local_size > 0 ? "r+b" : "wb");
+    if (!fp || ftruncate(fileno(fp), offset) == -1 || fseeko(fp, offset, SEEK_SET) == -1)
+    {
+        printf(RED "Failed to open file for writing: %s\n" RESET, filename);
+        if (fp)
+            fclose(fp);
+        return;
+    }
+
+    char command[512];
+    snprintf(command, sizeof(command), "get %s-r %lld %d %s", state->compress ? "-z " : "", first_chunk, INT_MAX,
+             filename);
+    if (send_request(sock, state, command) == -1)
+    {
+        fclose(fp);
+        return;
+    }
+    state->file_ptr = fp;
+    state->current_chunk = (int)first_chunk;
+    state->total_chunks = 0;
+    state->resume = RESUME_RANGE;
+}
+
+// Open one more connection to the server sock is connected to, using the same chunk size
+// Returns the blocking socket, or -1 on error
+static int open_range_connection(int sock, int chunk_size)
+{
+    struct sockaddr_in server_addr;
+    socklen_t addr_len = sizeof(server_addr);
+    if (getpeername(sock, (struct sockaddr *)&server_addr, &addr_len) == -1)
+    {
+        perror("getpeername");
+        return -1;
+    }
+
+    int range_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (range_sock < 0)
+    {
+        perror("Socket creation failed");
+        return -1;
+    }
+    if (connect(range_sock, (struct sockaddr *)&server_addr, addr_len) < 0)
+    {
+        perror("Connection failed");
+        close(range_sock);
+        return -1;
+    }
+    set_nodelay(range_sock);
+
+    // Chunk ids only map to the same file offsets if every connection uses one chunk size
+    int server_lz4;
+    if (negotiate_chunk_size(range_sock, &server_lz4) != chunk_size)
+    {
+        printf(RED "Error: Stream connection did not get %d byte chunks\n" RESET, chunk_size);
+        close(range_sock);
+        return -1;
+    }
+    return range_sock;
+}
+
+// Ask the main connection, idle and blocking for the moment, which directory it is in
+static int remote_cwd(int sock, char *cwd, size_t size)
+{
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1 || fcntl(sock, F_SETFL, flags & ~O_NONBLOCK) == -1)
+    {
+        return -1;
+    }
+    int len = (send_command(sock, "pwd") == -1) ? -1 : read_reply(sock, cwd, size);
+    fcntl(sock, F_SETFL, flags);
+    if (len <= 0 || cwd[0] != '/')
+    {
+        printf(RED "Error: Server did not report its directory\n" RESET);
+        return -1;
+    }
+    cwd[strcspn(cwd, "\n")] = '\0';
+    return 0;
+}
+
+// Open one more connection with open_range_connection and move it to cwd, the directory
+// the main connection is in. Returns the blocking socket, or -1 on error
+static int open_connection_in(int sock, const char *cwd, int chunk_size)
+{
+    int extra_sock = open_range_connection(sock, chunk_size);
+    if (extra_sock == -1)
+    {
+        return -1;
+    }
+
+    char command[PATH_MAX + 4];
+    char reply[128];
+    snprintf(command, sizeof(command), "cd %s", cwd);
+    if (send_command(extra_sock, command) == -1 || read_reply(extra_sock, reply, sizeof(reply)) == -1 ||
+        strncmp(reply, "OK:", 3) != 0)
+    {
+        printf(RED "Error: Extra connection cannot change to '%s'\n" RESET, cwd);
+        close(extra_sock);
+        return -1;
+    }
+    return extra_sock;
+}
+
+// Close every connection and the local file of a parallel download
+void close_parallel_download(parallel_download_t *download, int epoll_fd)
+{
+    for (int i = 0; i < download->stream_count; i++)
+    {
+        if (download->streams[i].sock != -1)
+        {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, download->streams[i].sock, NULL);
+            close(download->streams[i].sock);
+            download->streams[i].sock = -1;
+        }
+    }
+    if (download->fd != -1)
+    {
+        close(download->fd);
+        download->fd = -1;
+    }
+    download->streams_open = 0;
+    download->active = 0;
+}
+
+// Split a download into disjoint chunk ranges, one per connection (get <file> --streams N)
+int start_parallel_download(int sock, const char *filename, int stream_count, int chunk_size,
+                            parallel_download_t *download, int epoll_fd)
+{
+    char command[512];
+    char reply[256];
+    char cwd[PATH_MAX];
+    long long file_size = -1;
+
+    // Every range connection starts in the home directory: move it where the main one is
+    if (remote_cwd(sock, cwd, sizeof(cwd)) == -1)
+    {
+        return -1;
+    }
+
+    // The first connection learns the size, the ranges are cut from it
+    int first_sock = open_connection_in(sock, cwd, chunk_size);
+    if (first_sock == -1)
+    {
+        return -1;
+    }
+    snprintf(command, sizeof(command), "size %s", filename);
+    if (send_command(first_sock, command) == -1 || read_reply(first_sock, reply, sizeof(reply)) == -1)
+    {
+        printf(RED "Error: Server did not answer the size request\n" RESET);
+        close(first_sock);
+        return -1;
+    }
+    if (sscanf(reply, "OK: size=%lld", &file_size) != 1 || file_size < 0)
+    {
+        reply[strcspn(reply, "\n")] = '\0';
+        print_response_line(reply);
+        close(first_sock);
+        return -1;
+    }
+
+    memset(download, 0, sizeof(*download));
+    strncpy(download->filename, filename, FILENAME_MAX_LEN - 1);
+    download->file_size = file_size;
+    download->chunk_size = chunk_size;
+    download->total_chunks = (file_size + chunk_size - 1) / chunk_size;
+    download->progress.percent = -1;
+    download->fd = open(download->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (download->fd == -1)
+    {
+        printf(RED "Failed to open file for writing: %s\n" RESET, download->filename);
+        close(first_sock);
+        return -1;
+    }
+
+    // Reserve the whole file up front so ranges landing out of order don't fragment it
+    if (file_size > 0 && posix_fallocate(download->fd, 0, file_size) != 0 && ftruncate(download->fd, file_size) == -1)
+    {
+        perror("ftruncate");
+        close(first_sock);
+        close_parallel_download(download, epoll_fd);
+        unlink(download->filename);
+        return -1;
+    }
+
+    if (download->total_chunks == 0)
+    {
+        close(first_sock);
+        close_parallel_download(download, epoll_fd);
+        printf(GREEN "File received successfully: %s\n" RESET, download->filename);
+        return 0;
+    }
+    if (stream_count > download->total_chunks)
+    {
+        stream_count = download->total_chunks;
+    }
+
+    int first_chunk = 0;
+    for (int i = 0; i < stream_count; i++)
+    {
+        range_stream_t *range = &download->streams[i];
+        int chunk_count = download->total_chunks / stream_count + (i < download->total_chunks % stream_count);
+
+        range->sock = (i == 0) ? first_sock : open_connection_in(sock, cwd, chunk_size);
+        if (range->sock == -1)
+        {
+            break;
+        }
+        download->stream_count = i + 1;
+        range->next_chunk = first_chunk;
+        range->end_chunk = first_chunk + chunk_count;
+        first_chunk += chunk_count;
+
+        snprintf(command, sizeof(command), "get -r %d %d %s", range->next_chunk, chunk_count, filename);
+        struct epoll_event event = {.events = EPOLLIN, .data.fd = range->sock};
+        if (send_command(range->sock, command) == -1 || set_nonblocking(range->sock) == -1 ||
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, range->sock, &event) == -1)
+        {
+            break;
+        }
+        download->streams_open++;
+    }
+
+    if (download->streams_open < stream_count)
+    {
+        printf(RED "Error: Could not open %d stream connections\n" RESET, stream_count);
+        close_parallel_download(download, epoll_fd);
+        unlink(download->filename);
+        return -1;
+    }
+
+    download->active = 1;
+    printf(GREEN "Requesting file: %s (%lld bytes, %d chunks over %d streams)\n" RESET,
+           download->filename, file_size, download->total_chunks, stream_count);
+    return 0;
+}
+
+// Receive on one connection of a parallel download, writing payloads to their file offset
+// straight from the receive buffer
+// Returns 1 once every range is complete, 0 to keep going, -1 on error
+int receive_range_data(parallel_download_t *download, range_stream_t *range, int epoll_fd)
+{
+    static char buffer[RECV_BUFFER_SIZE];
+    ssize_t len = recv(range->sock, buffer, sizeof(buffer), 0);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return 0;
+    }
+    if (len <= 0)
+    {
+        printf(RED "\nStream connection closed before its range was complete\n" RESET);
+        return -1;
+    }
+
+    int processed = 0;
+    while (processed < len)
+    {
+        if (range->frame_header_len < (int)sizeof(FrameHeader))
+        {
+            int header_needed = sizeof(FrameHeader) - range->frame_header_len;
+            int to_copy = (len - processed < header_needed) ? (len - processed) : header_needed;
+            memcpy((char *)&range->frame + range->frame_header_len, buffer + processed, to_copy);
+            range->frame_header_len += to_copy;
+            processed += to_copy;
+            if (range->frame_header_len < (int)sizeof(FrameHeader))
+            {
+                break;
+            }
+
+            range->frame.length = ntohl(range->frame.length);
+            range->frame_remaining = range->frame.length;
+            range->chunk_header_len = 0;
+            if (range->frame.version == FRAME_VERSION && range->frame.type == FRAME_RESPONSE)
+            {
+                // The server refused the range, show why
+                int shown = (len - processed < (int)range->frame.length) ? (len - processed) : (int)range->frame.length;
+                printf(RED "\n%.*s" RESET, shown, buffer + processed);
+                return -1;
+            }
+            if (range->frame.version != FRAME_VERSION || range->frame.type != FRAME_DATA ||
+                range->frame.length <= sizeof(FileChunkHeader) ||
+                range->frame.length - sizeof(FileChunkHeader) > (uint32_t)download->chunk_size)
+            {
+                printf(RED "\nUnexpected frame on stream connection\n" RESET);
+                return -1;
+            }
+            continue;
+        }
+
+        if (range->chunk_header_len < (int)sizeof(FileChunkHeader))
+        {
+            int header_needed = sizeof(FileChunkHeader) - range->chunk_header_len;
+            int to_copy = (len - processed < header_needed) ? (len - processed) : header_needed;
+            memcpy((char *)&range->chunk + range->chunk_header_len, buffer + processed, to_copy);
+            range->chunk_header_len += to_copy;
+            range->frame_remaining -= to_copy;
+            processed += to_copy;
+            if (range->chunk_header_len < (int)sizeof(FileChunkHeader))
+            {
+                break;
+            }
+
+            uint32_t chunk_id = ntohl(range->chunk.chunk_id);
+            range->write_offset = (off_t)chunk_id * download->chunk_size;
+            if (chunk_id != (uint32_t)range->next_chunk || ntohl(range->chunk.chunk_size) != range->frame_remaining ||
+                range->write_offset + range->frame_remaining > download->file_size)
+            {
+                printf(RED "\nChunk sequence error: expected %d, got %u\n" RESET, range->next_chunk, chunk_id);
+                return -1;
+            }
+            continue;
+        }
+
+        int to_write = (len - processed < (int)range->frame_remaining) ? (len - processed) : (int)range->frame_remaining;
+        ssize_t written = pwrite(download->fd, buffer + processed, to_write, range->write_offset);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            printf(RED "\nFailed to write to file\n" RESET);
+            return -1;
+        }
+        range->crc = crc32c(range->crc, buffer + processed, written);
+        processed += written;
+        range->write_offset += written;
+        range->frame_remaining -= written;
+        if (range->frame_remaining > 0)
+        {
+            continue;
+        }
+
+        // Chunk complete; a mismatch fails the whole download, its bytes are in the file already
+        if (range->crc != ntohl(range->chunk.checksum))
+        {
+            printf(RED "\nChecksum mismatch in chunk %d\n" RESET, range->next_chunk);
+            return -1;
+        }
+        range->frame_header_len = 0;
+        range->next_chunk++;
+        download->chunks_done++;
+        progress_update(&download->progress, download->chunks_done, download->total_chunks);
+
+        if (range->next_chunk == range->end_chunk)
+        {
+            // This connection's range is in, it has nothing more to send
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, range->sock, NULL);
+            close(range->sock);
+            range->sock = -1;
+            download->streams_open--;
+            return (download->streams_open == 0) ? 1 : 0;
+        }
+    }
+    return 0;
+}
+
+// Add a file to a batch's queue
+static int batch_add_file(batch_t *batch, const char *name)
+{
+    char **files = realloc(batch->files, (batch->file_count + 1) * sizeof(char *));
+    if (!files)
+    {
+        perror("realloc");
+        return -1;
+    }
+    batch->files = files;
+    if (!(batch->files[batch->file_count] = strdup(name)))
+    {
+        perror("strdup");
+        return -1;
+    }
+    batch->file_count++;
+    return 0;
+}
+
+// Queue the regular files of the server directory that match pattern, paging through
+// ls --compact on list_sock while it is still blocking
+static int list_remote_files(int list_sock, const char *pattern, batch_t *batch)
+{
+    static char reply[BATCH_LIST_PAGE * 260 + 64]; // A page of "<type>\t<name>\n" lines
+    char command[128];
+    long offset = 0;
+    for (;;)
+    {
+        snprintf(command, sizeof(command), "ls --compact --offset %ld --limit %d", offset, BATCH_LIST_PAGE);
+        if (send_command(list_sock, command) == -1 || read_reply(list_sock, reply, sizeof(reply)) == -1)
+        {
+            printf(RED "Error: Server did not answer the listing\n" RESET);
+            return -1;
+        }
+        if (strncmp(reply, "ERROR:", 6) == 0)
+        {
+            reply[strcspn(reply, "\n")] = '\0';
+            print_response_line(reply);
+            return -1;
+        }
+
+        int more = 0;
+        for (char *line = strtok(reply, "\n"); line; line = strtok(NULL, "\n"))
+        {
+            if (sscanf(line, "MORE: offset=%ld", &offset) == 1)
+            {
+                more = 1;
+            }
+            else if (line[0] == 'f' && line[1] == '\t' && fnmatch(pattern, line + 2, 0) == 0 &&
+                     batch_add_file(batch, line + 2) == -1)
+            {
+                return -1;
+            }
+        }
+        if (!more)
+        {
+            return 0;
+        }
+    }
+}
+
+// Queue the local regular files that match pattern
+static int glob_local_files(const char *pattern, batch_t *batch)
+{
+    glob_t matches;
+    int result = glob(pattern, 0, NULL, &matches);
+    if (result == GLOB_NOMATCH)
+    {
+        return 0;
+    }
+    if (result != 0)
+    {
+        printf(RED "Error: Cannot expand '%s'\n" RESET, pattern);
+        return -1;
+    }
+
+    for (size_t i = 0; i < matches.gl_pathc; i++)
+    {
+        struct stat st;
+        if (stat(matches.gl_pathv[i], &st) == 0 && S_ISREG(st.st_mode) &&
+            batch_add_file(batch, matches.gl_pathv[i]) == -1)
+        {
+            globfree(&matches);
+            return -1;
+        }
+    }
+    globfree(&matches);
+    return 0;
+}
+
+// Give a worker the connection sock, with transfer buffers of its own
+static int open_batch_worker(batch_t *batch, batch_worker_t *worker, int sock, int epoll_fd)
+{
+    memset(&worker->reader, 0, sizeof(worker->reader));
+    init_transfer_state(&worker->transfer);
+    worker->transfer.chunk_size = batch->chunk_size;
+    worker->transfer.server_lz4 = batch->server_lz4;
+    worker->transfer.upload_check = 0;
+    worker->transfer.upload_crc = 0;
+    worker->transfer.upload_from = 0;
+    worker->transfer.replies_due = 0;
+    worker->transfer.outcome = 0;
+    worker->transfer.quiet = 1;
+    worker->transfer.file_buffer = malloc(sizeof(FrameHeader) + sizeof(FileChunkHeader) + batch->chunk_size);
+    worker->transfer.codec_buffer = malloc(batch->chunk_size);
+    worker->file = -1;
+    worker->sock = sock;
+
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = sock};
+    if (!worker->transfer.file_buffer || !worker->transfer.codec_buffer || set_nonblocking(sock) == -1 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event) == -1)
+    {
+        free(worker->transfer.file_buffer);
+        free(worker->transfer.codec_buffer);
+        close(sock);
+        worker->sock = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void close_batch_worker(batch_worker_t *worker, int epoll_fd)
+{
+    if (worker->sock == -1)
+    {
+        return;
+    }
+    if (worker->transfer.file_ptr)
+    {
+        fclose(worker->transfer.file_ptr);
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, worker->sock, NULL);
+    close(worker->sock);
+    free(worker->transfer.file_buffer);
+    free(worker->transfer.codec_buffer);
+    worker->sock = -1;
+    worker->file = -1;
+}
+
+// Count the worker's file as done or failed and draw the batch's progress
+static void batch_file_done(batch_t *batch, batch_worker_t *worker, int ok)
+{
+    if (ok)
+    {
+        batch->done++;
+    }
+    else
+    {
+        batch->failed++;
+        printf(RED "\n%s failed: %s\n" RESET, batch->upload ? "Upload" : "Download", batch->files[worker->file]);
+    }
+    worker->file = -1;
+    progress_update(&batch->progress, batch->done + batch->failed, batch->file_count);
+}
+
+// Hand the next queued files to idle connections; once none are left open, the rest fail
+static void batch_dispatch(batch_t *batch, int epoll_fd)
+{
+    int open_workers = 0;
+    for (int w = 0; w < batch->worker_count; w++)
+    {
+        batch_worker_t *worker = &batch->workers[w];
+        while (worker->sock != -1 && worker->file == -1 && batch->next_file < batch->file_count)
+        {
+            transfer_state_t *transfer = &worker->transfer;
+            worker->file = batch->next_file++;
+            transfer->compress = batch->compress;
+            const char *path = batch->files[worker->file];
+            int started;
+            if (batch->upload)
+            {
+                started = start_file_upload(worker->sock, path, transfer) == 0;
+                if (started && strrchr(path, '/'))
+                {
+                    // The server stores an upload under its name, without the local directory
+                    strncpy(transfer->filename, strrchr(path, '/') + 1, FILENAME_MAX_LEN - 1);
+                }
+                started = started && begin_upload(worker->sock, transfer, epoll_fd) == 0;
+            }
+            else
+            {
+                started = start_file_download(worker->sock, path, transfer) == 0;
+            }
+            if (!started)
+            {
+                batch_file_done(batch, worker, 0);
+            }
+        }
+        open_workers += (worker->sock != -1);
+    }
+
+    if (open_workers == 0 && batch->next_file < batch->file_count)
+    {
+        printf(RED "\nNo batch connection left, %d files not transferred\n" RESET,
+               batch->file_count - batch->next_file);
+        batch->failed += batch->file_count - batch->next_file;
+        batch->next_file = batch->file_count;
+    }
+}
+
+// Open one more connection for a batch, in the directory of the main connection
+// Returns the blocking socket, or -1 on error
+static int open_batch_connection(int sock, const batch_t *batch)
+{
+    return open_connection_in(sock, batch->cwd, batch->chunk_size);
+}
+
+// Queue the files that match pattern (local ones for mput, the server's for mget) and
+// move them over min(jobs, files) extra connections, one file per connection at a time
+int start_batch(int sock, const char *pattern, int upload, int jobs, const transfer_state_t *state, batch_t *batch,
+                int epoll_fd)
+{
+    memset(batch, 0, sizeof(*batch));
+    batch->upload = upload;
+    batch->compress = state->compress;
+    batch->chunk_size = state->chunk_size;
+    batch->server_lz4 = state->server_lz4;
+    batch->progress.percent = -1;
+    if (remote_cwd(sock, batch->cwd, sizeof(batch->cwd)) == -1)
+    {
+        return -1;
+    }
+
+    // mget lists the directory on the first connection, which then joins the pool
+    int first_sock = -1;
+    if (!upload && (first_sock = open_batch_connection(sock, batch)) == -1)
+    {
+        return -1;
+    }
+    if ((upload ? glob_local_files(pattern, batch) : list_remote_files(first_sock, pattern, batch)) == -1 ||
+        batch->file_count == 0)
+    {
+        if (batch->file_count == 0)
+            printf(YELLOW "No files match '%s'\n" RESET, pattern);
+        if (first_sock != -1)
+            close(first_sock);
+        close_batch(batch, epoll_fd);
+        return -1;
+    }
+
+    int worker_count = (jobs < batch->file_count) ? jobs : batch->file_count;
+    for (int w = 0; w < worker_count; w++)
+    {
+        int worker_sock = (w == 0 && first_sock != -1) ? first_sock : open_batch_connection(sock, batch);
+        if (worker_sock == -1 || open_batch_worker(batch, &batch->workers[w], worker_sock, epoll_fd) == -1)
+        {
+            break;
+        }
+        batch->worker_count = w + 1;
+    }
+    if (batch->worker_count == 0)
+    {
+        printf(RED "Error: Could not open a connection for the batch\n" RESET);
+        close_batch(batch, epoll_fd);
+        return -1;
+    }
+
+    printf(GREEN "%s %d files over %d connections\n" RESET, upload ? "Uploading" : "Downloading", batch->file_count,
+           batch->worker_count);
+    batch->active = 1;
+    batch->started_us = now_us();
+    batch_dispatch(batch, epoll_fd);
+    return 0;
+}
+
+batch_worker_t *find_batch_worker(batch_t *batch, int fd)
+{
+    for (int w = 0; w < batch->worker_count; w++)
+    {
+        if (batch->workers[w].sock == fd)
+            return &batch->workers[w];
+    }
+    return NULL;
+}
+
+// Drive one connection of a batch; a file that fails takes its connection with it, and a
+// fresh one is opened while files are left
+void handle_batch_event(int sock, batch_t *batch, batch_worker_t *worker, uint32_t events, int epoll_fd)
+{
+    transfer_state_t *transfer = &worker->transfer;
+    int failed = 0;
+
+    if (events & (EPOLLERR | EPOLLHUP))
+    {
+        failed = 1;
+    }
+    else if ((events & EPOLLOUT) && transfer->state == STATE_SENDING)
+    {
+        int result;
+        int budget = UPLOAD_CHUNKS_PER_WAKEUP;
+        do
+        {
+            result = send_file_chunk_epoll(worker->sock, transfer);
+        } while (result == 0 && --budget > 0);
+        if (result == 1)
+        {
+            // Sent, the server's reply confirms the digest
+            fclose(transfer->file_ptr);
+            transfer->upload_crc = transfer->crc;
+            transfer->upload_from = transfer->resume_offset;
+            init_transfer_state(transfer);
+            struct epoll_event event = {.events = EPOLLIN, .data.fd = worker->sock};
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, worker->sock, &event);
+        }
+        failed = (result == -1);
+    }
+    else if (events & EPOLLIN)
+    {
+        static char buffer[RECV_BUFFER_SIZE];
+        ssize_t len = recv(worker->sock, buffer, sizeof(buffer), 0);
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            return;
+        }
+        failed = (len <= 0 || handle_server_data(worker->sock, &worker->reader, transfer, buffer, len, epoll_fd) == -1);
+    }
+
+    if (!failed && worker->file != -1 && transfer->state == STATE_COMMAND && transfer->replies_due == 0)
+    {
+        // The file's last answer is in: its download completed, or the upload was confirmed
+        failed = (transfer->outcome != 1);
+        if (!failed)
+            batch_file_done(batch, worker, 1);
+    }
+    if (failed)
+    {
+        if (worker->file != -1)
+            batch_file_done(batch, worker, 0);
+        close_batch_worker(worker, epoll_fd);
+        int worker_sock = (batch->next_file < batch->file_count) ? open_batch_connection(sock, batch) : -1;
+        if (worker_sock != -1)
+            open_batch_worker(batch, worker, worker_sock, epoll_fd);
+    }
+    batch_dispatch(batch, epoll_fd);
+}
+
+// Print how the batch went and release it
+void finish_batch(batch_t *batch, int epoll_fd)
+{
+    unsigned long long elapsed_us = now_us() - batch->started_us;
+    printf("%s\n%s: %d of %d files in %.2f s (%.1f files/s)", batch->failed ? RED : GREEN,
+           batch->upload ? "mput" : "mget", batch->done, batch->file_count, elapsed_us / 1e6,
+           (elapsed_us > 0) ? batch->done * 1e6 / elapsed_us : 0.0);
+    if (batch->failed)
+        printf(", %d failed", batch->failed);
+    printf("\n" RESET);
+    close_batch(batch, epoll_fd);
+}
+
+// Close every connection of a batch and free its queue
+void close_batch(batch_t *batch, int epoll_fd)
+{
+    for (int w = 0; w < batch->worker_count; w++)
+    {
+        close_batch_worker(&batch->workers[w], epoll_fd);
+    }
+    for (int i = 0; i < batch->file_count; i++)
+    {
+        free(batch->files[i]);
+    }
+    free(batch->files);
+    batch->files = NULL;
+    batch->file_count = 0;
+    batch->worker_count = 0;
+    batch->active = 0;
+}
+
+int main(int argc, char *argv[])
+{
+    // -b <script> runs the script's commands instead of reading them from the terminal
+    FILE *script = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:")) != -1)
+    {
+        if (opt != 'b')
+        {
+            fprintf(stderr, "Usage: %s [-b script]\n", argv[0]);
+            return 2;
+        }
+        if (script)
+            fclose(script);
+        if (!(script = fopen(optarg, "r")))
+        {
+            fprintf(stderr, RED "Error: Cannot open script '%s'\n" RESET, optarg);
+            return 2;
+        }
+    }
+
+    printf(GREEN "Starting epoll-based FTP client...\n" RESET);
+    int result = start_epoll_client("127.0.0.1", 8080, script);
+    if (script)
+        fclose(script);
+    return result;
+}
+
+// Progress bar function
+static unsigned long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Redraw a progress bar when its percentage moved, at most every PROGRESS_INTERVAL_US;
+// 100% is always drawn
+void progress_update(progress_t *progress, long long done, long long total)
+{
+    int percent = (total > 0) ? (int)((done * 100) / total) : 100;
+    if (percent == progress->percent)
+    {
+        return;
+    }
+    unsigned long long now = now_us();
+    if (percent < 100 && progress->percent >= 0 && now - progress->drawn_us < PROGRESS_INTERVAL_US)
+    {
+        return;
+    }
+    progress->percent = percent;
+    progress->drawn_us = now;
+    progress_bar(percent);
 }
 
-// Progress bar function
 void progress_bar(int percent)
 {
     const int length = 30;
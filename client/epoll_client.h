@@ -1,6 +1,8 @@
 #ifndef EPOLL_CLIENT_H
 #define EPOLL_CLIENT_H
 
+#include <stdio.h>
+
 /**
  * @file epoll_client.h
  * @brief Epoll-based Non-Blocking FTP-like Client
@@ -48,55 +50,156 @@
  * ------------------------------------------------
  * The client implements the same protocols as the server.
  *
+ *   0. FRAMING
+ *   ----------
+ *   Every message is `[FrameHeader][Payload]` with a version byte, a type byte and a
+ *   32-bit payload length (see epoll_server.h). `handle_server_data()` parses frames out
+ *   of whatever `recv()` returned and dispatches on the type: response frames are printed,
+ *   data and stream frames go to the download handler.
+ *
  *   A. COMMAND PROTOCOL (Text-based)
  *   --------------------------------
- *   -   The client sends newline-terminated ASCII commands (e.g., `list\n`).
- *   -   It reads newline-terminated ASCII responses from the server and prints them to the
- *       console. Responses starting with `ERROR:`, `SUCCESS:`, or `OK:` are color-coded.
+ *   -   The client sends every command as a command frame (e.g., `ls`) via `send_command()`.
+ *   -   Each response frame is printed line by line, followed by a new prompt. Lines
+ *       starting with `ERROR:`, `SUCCESS:`, or `OK:` are color-coded.
  *
  *   B. FILE TRANSFER PROTOCOL (Binary)
  *   ---------------------------------
  *   The client uses the same `[Header][Payload]` chunk structure as the server. All integer
  *   fields in the header are converted to network byte order (`htonl`) before sending.
  *
+ *   -   **Chunk Size Handshake**: Right after connecting, while the socket is still blocking,
+ *       the client sends `hello 1048576` and reads the `OK: chunk_size=<bytes>\n` reply.
+ *       The granted size is used for uploads and to validate download headers. Servers that
+ *       don't understand `hello` leave the client on 512-byte chunks. A trailing
+ *       `compress=lz4` sets `server_lz4`, which `--compress` needs.
+ *
+ *   -   **Compression (`get/send <filename> --compress`)**:
+ *       Chunks flagged `type = 2` carry one LZ4 block (`compress.c`) that decodes to the
+ *       chunk's original bytes. A compressed upload encodes each chunk into `codec_buffer`
+ *       and keeps the block only if it saves 1/16 of the chunk; after COMPRESS_GIVE_UP
+ *       chunks in a row that didn't, and from the start for files that begin like JPEG,
+ *       PNG, GIF, ZIP, gzip and other compressed formats, it sends raw chunks. A
+ *       compressed download sends `get -z <filename>` (chunks instead of the stream) and
+ *       `receive_file_chunk_epoll()` decodes every LZ4 chunk before it is written; plain
+ *       chunks in the same download are written as they are.
+ *
+ *   -   **Checksums**:
+ *       A chunk's `checksum` is the CRC32C (`checksum.c`) of the transfer's file bytes up
+ *       to and including it. `send_file_chunk_epoll()` keeps the running sum in `crc`
+ *       and, when the upload is sent, moves it to `upload_crc`; `upload_check` holds
+ *       back the next response until `check_upload_reply()` has compared it with the
+ *       `crc32c=` of the server's `SUCCESS: File uploaded` reply (and its `from=` with
+ *       `upload_from`, the resume offset both sums start at). Downloads verify
+ *       each chunk after decoding and before writing it, and each connection of a
+ *       parallel download keeps a sum for its range (`range_stream_t.crc`). A failed
+ *       check ends the download like any other error. A stream download sums its contents
+ *       as they are written and compares the sum with the stream's 4-byte trailer.
+ *
  *   -   **Upload Flow (`send <filename>`)**:
  *       1.  The user issues the `send <filename>` command.
- *       2.  The client first sends the text command `upload\n` to the server to signal the
+ *       2.  The client first sends the command `upload` to the server to signal the
  *           start of a transfer.
  *       3.  It transitions to the `STATE_SENDING` state.
  *       4.  It modifies its `epoll` registration for the socket to include the `EPOLLOUT` flag.
  *       5.  The `epoll` loop will now trigger an `EPOLLOUT` event when the socket's send buffer
  *           has space.
  *       6.  The event handler calls `send_file_chunk_epoll()`, which reads a chunk from the
- *           local file, prepares the header, and sends the `[Header][Payload]` pair.
- *       7.  This process repeats until all chunks are sent. The client displays a progress bar.
+ *           local file, prepares the header, and sends the `[Header][Payload]` pair as one
+ *           data frame. Each `EPOLLOUT` sends up to UPLOAD_CHUNKS_PER_WAKEUP chunks, stopping
+ *           early when the socket is full; a short send is resumed from the same offset on
+ *           the next `EPOLLOUT`.
+ *       7.  This process repeats until all chunks are sent. The client displays a progress
+ *           bar, redrawn at most every PROGRESS_INTERVAL_US.
  *       8.  Upon completion, the client removes the `EPOLLOUT` flag and transitions back to
  *           `STATE_COMMAND`.
  *
  *   -   **Download Flow (`get <filename>`)**:
  *       1.  The user issues the `get <filename>` command.
- *       2.  The client sends the text command `get <filename>\n` to the server. It remains
- *           in `STATE_COMMAND`.
- *       3.  The client waits for data from the server.
- *       4.  The `EPOLLIN` event handler inspects the first few bytes of incoming data.
- *           - If it's a text response (e.g., `ERROR: File not found\n`), it's printed normally.
- *           - **If the data heuristically matches the structure of a `FileChunkHeader`**, the
- *             client assumes a file transfer is beginning.
- *       5.  The client transitions to `STATE_RECEIVING`.
- *       6.  The `receive_file_chunk_epoll()` function is called for all subsequent `EPOLLIN` events.
- *           This function is stateful and designed to reassemble headers and payloads from
- *           potentially fragmented TCP packets.
- *       7.  It opens a local file for writing and writes each received payload to it. A
- *           progress bar is displayed.
- *       8.  When the number of received chunks matches `total_chunks` from the first header,
+ *       2.  The client sends the command `get -s <filename>` to the server, asking for
+ *           the raw `sendfile()` stream. It remains in `STATE_COMMAND`.
+ *       3.  The client waits for a frame from the server.
+ *           - A response frame (e.g., `ERROR: File not found\n`) is printed normally.
+ *           - A data frame means the server accepted the request.
+ *       4.  On the first data frame the client transitions to `STATE_RECEIVING`.
+ *       5.  The payloads of data and stream frames are passed to `receive_file_chunk_epoll()`.
+ *           Its parser state (`header_buffer`, `parse_pos`, `payload_remaining`) lives in
+ *           `transfer_state_t`, so headers and payloads are reassembled across fragmented
+ *           TCP reads and reset with every new transfer. Sockets are read RECV_BUFFER_SIZE
+ *           (256 KiB) at a time.
+ *       6.  It opens a local file for writing and writes each received payload to it, leaving
+ *           flushing to the kernel. A progress bar is displayed. If the first header has `type = 1` (stream), its
+ *           payload is the 64-bit file length and the rest of the download arrives in stream
+ *           frames of raw file bytes, written straight from the receive buffer, followed by the
+ *           big-endian CRC32C of those bytes.
+ *       7.  When the number of received chunks matches `total_chunks` from the first header,
  *           the download is complete. The client closes the file and transitions back to
  *           `STATE_COMMAND`.
  *
+ *   -   **Resuming (`get/send <filename> --resume`)**:
+ *       1.  `request_resume()` sends `size <filename>` (or `size saved/<filename>` for an
+ *           upload) and sets `resume`, so the reply frame is handed to `resume_transfer()`
+ *           instead of being printed. Other commands are refused until it is answered.
+ *       2.  Only whole chunks count: `resume_chunk = size / chunk_size`.
+ *       3.  An upload seeks the local file there and starts sending at that `chunk_id`;
+ *           the first chunk sent carries the filename. A download truncates the local file
+ *           to the same boundary and sends `get -r <resume_chunk> <INT_MAX> <filename>`;
+ *           the first data frame continues the existing file and the chunk sequence is
+ *           validated from `resume_chunk` on.
+ *
+ *   -   **Directory Download (`get <directory> --recursive`)**:
+ *       The client sends `get -t <directory>` (`get -z -t` with `--compress`) and takes the
+ *       chunks like any download, but chunk 0 opens a `tar_reader_t` (`tar.c`) instead of
+ *       a file: `finish_chunk()` feeds every verified, decoded payload to
+ *       `tar_reader_feed()`, which creates the directories and files below the current
+ *       directory as the archive arrives. Absolute names and `..` components fail the
+ *       download; the last chunk must end the archive.
+ *
+ *   -   **Batch Transfers (`mget/mput <glob> [--jobs K]`)**:
+ *       1.  `start_batch()` asks the main connection for its directory (`pwd`), then queues
+ *           the matching files: local regular files from `glob()` for `mput`, or the `f`
+ *           entries of `ls --compact` pages accepted by `fnmatch()` for `mget`.
+ *       2.  It opens min(K, files) more connections (`open_batch_connection()`), each
+ *           changing to that directory. Every `batch_worker_t` has its own `frame_reader_t`
+ *           and `transfer_state_t` with `quiet` set, so the usual upload and download code
+ *           runs on it without progress bars or prompts.
+ *       3.  `batch_dispatch()` hands the next file to every idle connection. A connection
+ *           is idle again once `replies_due` is 0 in `STATE_COMMAND`; `outcome` says if the
+ *           file completed with a verified checksum. A failed file closes its connection and
+ *           a fresh one takes its place.
+ *       4.  The batch is done when every file is counted as done or failed.
+ *
+ *   -   **Scripts (`-b <script>`)**:
+ *       The script's lines run as commands in place of stdin. The next line is read once
+ *       `client_idle()`: no transfer, no batch or parallel download, and no reply due.
+ *       `start_epoll_client()` returns 1 if a scripted transfer failed.
+ *
+ *   -   **Parallel Download (`get <filename> --streams N`)**:
+ *       1.  The client opens N more connections to the server (`open_connection_in()`),
+ *           each negotiating the same chunk size and moving with `cd` to the directory the
+ *           main connection reports with `pwd`, and asks the first one for `size <filename>`.
+ *       2.  It preallocates the local file and splits the chunks into N disjoint ranges,
+ *           sending `get -r <first_chunk> <chunk_count> <filename>` on each connection.
+ *       3.  The connections are added to the same `epoll` instance. `receive_range_data()`
+ *           parses each connection's frames and `pwrite()`s every payload at
+ *           `chunk_id * chunk_size`, straight from the receive buffer.
+ *       4.  A connection is closed once its range is complete; the download is done when
+ *           all of them are. On any error the partial file is removed. The main connection
+ *           stays usable for other commands meanwhile.
+ *
  *
  * III. CLIENT COMMAND REFERENCE
  * -----------------------------
  * - `get <filename>`: Downloads a file from the server.
+ * - `get <filename> --streams N`: Downloads a file over N parallel connections (N <= 16).
+ * - `get <directory> --recursive`: Downloads a directory tree, streamed as a tar archive
+ *   (combines with `--compress`).
  * - `send <filename>`: Uploads a local file to the server.
+ * - `mget <glob> [--jobs K]`, `mput <glob> [--jobs K]`: Download or upload every matching file,
+ *   K at a time over their own connections (K <= 16, default 4; combines with `--compress`).
+ * - `get <filename> --resume`, `send <filename> --resume`: Continue an interrupted transfer.
+ * - `get <filename> --compress`, `send <filename> --compress`: Transfer LZ4-compressed chunks
+ *   (combines with `--resume`, not with `--streams`).
  * - `list`: Lists files on the server (sends `ls`).
  * - `pwd`: Shows the current directory on the server.
  * - `cd <directory>`: Changes directory on the server.
@@ -117,12 +220,14 @@
  * - **File Errors**: If a local file for an upload cannot be opened, an error is printed, and
  *   the transfer is aborted.
  * - **Protocol Errors**: The download handler includes validation to check for invalid chunk
- *   sizes or out-of-sequence chunks, which will abort a corrupt transfer.
+ *   sizes or out-of-sequence chunks, which will abort a corrupt transfer. A frame with an
+ *   unknown version or type closes the connection, since the stream can't be resynchronized.
  */
 
 // Function declarations for epoll client
-int start_epoll_client(const char *server_ip, int server_port);
+int start_epoll_client(const char *server_ip, int server_port, FILE *script);
 int set_nonblocking(int socket_fd);
+void set_nodelay(int socket_fd);
 int set_stdin_nonblocking();
 void restore_stdin_blocking();
 void show_help();
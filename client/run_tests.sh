@@ -1,15 +1,8 @@
-#!/bin/zsh
-
-cd /home/hajorda/Developer/original/client || exit
-
-chmod +x test_client.sh
-
-# Run the test script 5 times in parallel
-for i in {1..5}; do
-    ./test_client.sh &
-done
-
-# Wait for all background processes to finish
-wait
-
-echo "All tests completed."
\ No newline at end of file
+#!/bin/sh
+# Load test against a server that is already running: ./run_tests.sh [bench_load options]
+# e.g. ./run_tests.sh --port 8080 --connections 32 --idle 2000 --duration 30
+# (make -f Makefile_epoll bench-load in ../server starts its own server and runs fixed scenarios)
+
+cd "$(dirname "$0")/../server" || exit 1
+make -s -f Makefile_epoll bench_load || exit 1
+exec ./bench_load "$@"
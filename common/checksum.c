@@ -0,0 +1,197 @@
+#include "checksum.h"
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78 // Castagnoli polynomial, reflected
+#define CRC32C_LONG 8192        // Bytes per lane of the three-lane hardware loop
+#define CRC32C_SHORT 256        // Lane length for what is left after the long lanes
+
+static uint32_t table[8][256]; // Slicing-by-8: table[k][b] is b's CRC pushed through k more zero bytes
+static uint32_t (*implementation)(uint32_t, const void *, size_t) = crc32c_portable;
+
+uint32_t crc32c_portable(uint32_t crc, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    crc = ~crc;
+
+    while (len >= 8)
+    {
+        uint32_t low;
+        uint32_t high;
+        memcpy(&low, p, 4);
+        memcpy(&high, p + 4, 4);
+        low ^= crc;
+        crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^ table[5][(low >> 16) & 0xff] ^
+              table[4][low >> 24] ^ table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^
+              table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+    {
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+// Tables that push a CRC register through CRC32C_LONG or CRC32C_SHORT zero bytes
+static uint32_t long_shift[4][256];
+static uint32_t short_shift[4][256];
+
+// Multiply a vector by a 32x32 matrix over GF(2), one column per bit
+static uint32_t gf2_times(const uint32_t *matrix, uint32_t vector)
+{
+    uint32_t sum = 0;
+    for (; vector; vector >>= 1, matrix++)
+    {
+        if (vector & 1)
+            sum ^= *matrix;
+    }
+    return sum;
+}
+
+static void gf2_square(uint32_t *square, const uint32_t *matrix)
+{
+    for (int n = 0; n < 32; n++)
+    {
+        square[n] = gf2_times(matrix, matrix[n]);
+    }
+}
+
+// Operator that feeds len zero bytes through the CRC register, by repeated squaring
+static void build_shift_table(uint32_t shift[4][256], size_t len)
+{
+    uint32_t even[32];
+    uint32_t odd[32];
+
+    odd[0] = CRC32C_POLY; // One zero bit
+    for (int n = 1; n < 32; n++)
+    {
+        odd[n] = 1u << (n - 1);
+    }
+    gf2_square(even, odd); // Two zero bits
+    gf2_square(odd, even); // Four zero bits
+
+    uint32_t *op = odd;
+    while (len)
+    {
+        gf2_square(even, odd); // First pass: one zero byte
+        op = even;
+        len >>= 1;
+        if (!len)
+            break;
+        gf2_square(odd, even);
+        op = odd;
+        len >>= 1;
+    }
+
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        shift[0][n] = gf2_times(op, n);
+        shift[1][n] = gf2_times(op, n << 8);
+        shift[2][n] = gf2_times(op, n << 16);
+        shift[3][n] = gf2_times(op, n << 24);
+    }
+}
+
+static uint32_t shift_crc(uint32_t shift[4][256], uint32_t crc)
+{
+    return shift[0][crc & 0xff] ^ shift[1][(crc >> 8) & 0xff] ^ shift[2][(crc >> 16) & 0xff] ^ shift[3][crc >> 24];
+}
+
+// crc32 has a latency of three cycles but issues every cycle, so three independent
+// lanes run at once and are folded together with the shift tables afterwards
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(uint32_t crc, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t crc0 = ~crc;
+
+    static const size_t lanes[2] = {CRC32C_LONG, CRC32C_SHORT};
+    for (int i = 0; i < 2; i++)
+    {
+        size_t lane = lanes[i];
+        while (len >= 3 * lane)
+        {
+            uint64_t crc1 = 0;
+            uint64_t crc2 = 0;
+            const unsigned char *end = p + lane;
+            do
+            {
+                uint64_t word0, word1, word2;
+                memcpy(&word0, p, 8);
+                memcpy(&word1, p + lane, 8);
+                memcpy(&word2, p + 2 * lane, 8);
+                crc0 = _mm_crc32_u64(crc0, word0);
+                crc1 = _mm_crc32_u64(crc1, word1);
+                crc2 = _mm_crc32_u64(crc2, word2);
+                p += 8;
+            } while (p < end);
+            uint32_t (*shift)[256] = (lane == CRC32C_LONG) ? long_shift : short_shift;
+            crc0 = shift_crc(shift, (uint32_t)crc0) ^ crc1;
+            crc0 = shift_crc(shift, (uint32_t)crc0) ^ crc2;
+            p += 2 * lane;
+            len -= 3 * lane;
+        }
+    }
+
+    while (len >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc0 = _mm_crc32_u64(crc0, word);
+        p += 8;
+        len -= 8;
+    }
+    uint32_t crc32 = (uint32_t)crc0;
+    while (len--)
+    {
+        crc32 = _mm_crc32_u8(crc32, *p++);
+    }
+    return ~crc32;
+}
+#endif
+
+// Build the tables and pick the fastest implementation before main() runs, so no
+// thread ever sees them half done
+__attribute__((constructor)) static void crc32c_init(void)
+{
+    for (uint32_t b = 0; b < 256; b++)
+    {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+        }
+        table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++)
+    {
+        for (int k = 1; k < 8; k++)
+        {
+            table[k][b] = table[0][table[k - 1][b] & 0xff] ^ (table[k - 1][b] >> 8);
+        }
+    }
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        build_shift_table(long_shift, CRC32C_LONG);
+        build_shift_table(short_shift, CRC32C_SHORT);
+        implementation = crc32c_sse42;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    return implementation(crc, data, len);
+}
+
+const char *crc32c_implementation(void)
+{
+    return implementation == crc32c_portable ? "slicing-by-8" : "sse4.2";
+}
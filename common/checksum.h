@@ -0,0 +1,22 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file checksum.h
+ * @brief CRC32C (Castagnoli) of chunk payloads (shared by client and server)
+ *
+ * crc32c() continues a checksum over more data, starting from 0, so the value of a
+ * whole transfer is built up chunk by chunk: crc32c(crc32c(0, a), b) is the CRC32C of
+ * a followed by b. On x86-64 processors with SSE4.2 the `crc32` instruction does the
+ * work (picked once at startup); elsewhere a slicing-by-8 table version is used.
+ * `make -f Makefile_epoll bench` prints the throughput of both.
+ */
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+uint32_t crc32c_portable(uint32_t crc, const void *data, size_t len);
+const char *crc32c_implementation(void);
+
+#endif
@@ -0,0 +1,228 @@
+#include "compress.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_HASH_LOG 12
+#define LZ4_LAST_LITERALS 5 // The block always ends with at least this many literals
+#define LZ4_MATCH_LIMIT 12  // No match may start closer than this to the end
+#define LZ4_MAX_DISTANCE 65535
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hash4(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+// Append the 255-continued part of a length that did not fit its token nibble
+static unsigned char *put_length(unsigned char *op, size_t length)
+{
+    while (length >= 255)
+    {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (unsigned char)length;
+    return op;
+}
+
+// Emit one sequence: literals from anchor, then a match (match_length 0 = none, last sequence)
+// Returns the new output position, or NULL if it would not fit before op_end
+static unsigned char *put_sequence(unsigned char *op, unsigned char *op_end, const unsigned char *anchor,
+                                   size_t literals, size_t offset, size_t match_length)
+{
+    // Token, literal length bytes, literals, offset, match length bytes
+    size_t worst = 1 + literals / 255 + 1 + literals + 2 + match_length / 255 + 1;
+    if ((size_t)(op_end - op) < worst)
+        return NULL;
+
+    unsigned char *token = op++;
+    *token = (unsigned char)((literals >= 15 ? 15 : literals) << 4);
+    if (literals >= 15)
+        op = put_length(op, literals - 15);
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    if (match_length == 0)
+        return op;
+
+    *op++ = (unsigned char)(offset & 0xff);
+    *op++ = (unsigned char)(offset >> 8);
+    size_t stored = match_length - LZ4_MIN_MATCH;
+    *token |= (unsigned char)(stored >= 15 ? 15 : stored);
+    if (stored >= 15)
+        op = put_length(op, stored - 15);
+    return op;
+}
+
+// Compress source into dest; returns the block length, or 0 if it does not fit in
+// dest_capacity (callers pass what the block must beat, and send the chunk raw then)
+int lz4_compress_block(const char *source, int source_len, char *dest, int dest_capacity)
+{
+    const unsigned char *src = (const unsigned char *)source;
+    const unsigned char *end = src + source_len;
+    const unsigned char *ip = src;
+    const unsigned char *anchor = src;
+    unsigned char *op = (unsigned char *)dest;
+    unsigned char *op_end = op + dest_capacity;
+    uint32_t table[1 << LZ4_HASH_LOG]; // Last position of each hashed 4-byte sequence
+
+    if (source_len > LZ4_MATCH_LIMIT)
+    {
+        const unsigned char *match_limit = end - LZ4_MATCH_LIMIT;
+        const unsigned char *extend_limit = end - LZ4_LAST_LITERALS;
+        memset(table, 0, sizeof(table));
+
+        while (ip < match_limit)
+        {
+            uint32_t sequence = read32(ip);
+            uint32_t hash = hash4(sequence);
+            const unsigned char *ref = src + table[hash];
+            table[hash] = (uint32_t)(ip - src);
+
+            if (ref >= ip || ip - ref > LZ4_MAX_DISTANCE || read32(ref) != sequence)
+            {
+                // Step further the longer nothing matched, incompressible data goes fast
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1])
+            {
+                ip--;
+                ref--;
+            }
+            const unsigned char *match_end = ip + LZ4_MIN_MATCH;
+            const unsigned char *ref_end = ref + LZ4_MIN_MATCH;
+            while (match_end < extend_limit && *match_end == *ref_end)
+            {
+                match_end++;
+                ref_end++;
+            }
+
+            op = put_sequence(op, op_end, anchor, ip - anchor, ip - ref, match_end - ip);
+            if (!op)
+                return 0;
+            ip = anchor = match_end;
+            if (ip < match_limit)
+                table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+        }
+    }
+
+    op = put_sequence(op, op_end, anchor, end - anchor, 0, 0);
+    return op ? (int)(op - (unsigned char *)dest) : 0;
+}
+
+// Decode one block into dest; returns the decoded length, or -1 if the block is
+// malformed or would not fit in dest_capacity
+int lz4_decompress_block(const char *source, int source_len, char *dest, int dest_capacity)
+{
+    const unsigned char *ip = (const unsigned char *)source;
+    const unsigned char *ip_end = ip + source_len;
+    unsigned char *out = (unsigned char *)dest;
+    unsigned char *op = out;
+    unsigned char *op_end = out + dest_capacity;
+
+    while (ip < ip_end)
+    {
+        unsigned int token = *ip++;
+
+        size_t literals = token >> 4;
+        if (literals == 15)
+        {
+            unsigned int byte;
+            do
+            {
+                if (ip >= ip_end)
+                    return -1;
+                byte = *ip++;
+                literals += byte;
+            } while (byte == 255);
+        }
+        if ((size_t)(ip_end - ip) < literals || (size_t)(op_end - op) < literals)
+            return -1;
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+
+        if (ip == ip_end)
+            break; // The last sequence has no match
+
+        if (ip_end - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - out))
+            return -1;
+
+        size_t match_length = token & 15;
+        if (match_length == 15)
+        {
+            unsigned int byte;
+            do
+            {
+                if (ip >= ip_end)
+                    return -1;
+                byte = *ip++;
+                match_length += byte;
+            } while (byte == 255);
+        }
+        match_length += LZ4_MIN_MATCH;
+        if ((size_t)(op_end - op) < match_length)
+            return -1;
+
+        // Overlapping matches repeat the last offset bytes; copying whole periods and
+        // doubling the distance keeps every memcpy() free of overlap
+        size_t distance = offset;
+        while (match_length > 0)
+        {
+            size_t n = match_length < distance ? match_length : distance;
+            memcpy(op, op - distance, n);
+            op += n;
+            match_length -= n;
+            distance += n;
+        }
+    }
+    return (int)(op - out);
+}
+
+// True if the data starts like a compressed format, where LZ4 would only cost time
+int compress_skip_data(const unsigned char *head, size_t len)
+{
+    static const struct
+    {
+        size_t offset;
+        size_t len;
+        const char *magic;
+    } formats[] = {
+        {0, 3, "\xff\xd8\xff"},             // JPEG
+        {0, 4, "\x89PNG"},                  // PNG
+        {0, 4, "GIF8"},                     // GIF
+        {0, 4, "PK\x03\x04"},               // ZIP and everything built on it
+        {0, 2, "\x1f\x8b"},                 // gzip
+        {0, 3, "BZh"},                      // bzip2
+        {0, 6, "\xfd" "7zXZ\x00"},          // xz
+        {0, 4, "\x28\xb5\x2f\xfd"},         // zstd
+        {0, 4, "\x04\x22\x4d\x18"},         // LZ4 frame
+        {0, 6, "7z\xbc\xaf\x27\x1c"},       // 7-Zip
+        {0, 4, "Rar!"},                     // RAR
+        {0, 4, "OggS"},                     // Ogg
+        {0, 3, "ID3"},                      // MP3
+        {4, 4, "ftyp"},                     // MP4, MOV, HEIC
+        {8, 4, "WEBP"},                     // WebP
+    };
+
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+    {
+        if (len >= formats[i].offset + formats[i].len &&
+            memcmp(head + formats[i].offset, formats[i].magic, formats[i].len) == 0)
+            return 1;
+    }
+    return 0;
+}
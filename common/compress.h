@@ -0,0 +1,27 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+/**
+ * @file compress.h
+ * @brief LZ4 block compression for chunk payloads (shared by client and server)
+ *
+ * A self-contained implementation of the LZ4 block format: single-pass compression
+ * with a 4096-entry hash table (no state between calls, so every chunk decodes on
+ * its own) and a bounds-checked decoder that never writes past its output buffer.
+ * Chunks flagged CHUNK_TYPE_LZ4 carry one such block; the block's decoded size is
+ * the chunk's original size.
+ *
+ * compress_skip_data() recognizes formats that are compressed already (JPEG, PNG,
+ * GIF, ZIP, gzip, ...) from their first bytes, so transfers of them go out raw.
+ */
+
+#define COMPRESS_MIN_SAVING 16 // A compressed chunk must save 1/16 of its size
+#define COMPRESS_GIVE_UP 4     // Consecutive chunks that didn't shrink before a transfer goes raw
+
+int lz4_compress_block(const char *source, int source_len, char *dest, int dest_capacity);
+int lz4_decompress_block(const char *source, int source_len, char *dest, int dest_capacity);
+int compress_skip_data(const unsigned char *head, size_t len);
+
+#endif
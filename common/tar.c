@@ -0,0 +1,735 @@
+#define _GNU_SOURCE
+#include "tar.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TAR_OCTAL_SIZE_MAX 077777777777LL   // Largest size the 12-byte octal field holds
+#define TAR_LONG_NAME "././@LongLink"
+#define TAR_PREFETCH_BYTES (1024 * 1024)   // Readahead asked for at the start of the next file
+#define TAR_END_BLOCKS 2                   // Zero blocks that end an archive
+
+// GNU tar header; prefix is only meaningful in POSIX ustar archives
+typedef struct
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} tar_header_t;
+
+typedef struct
+{
+    char *path;  // Relative to the walked directory, "" for the directory itself
+    int directory;
+    mode_t mode;
+    long long size;
+    time_t mtime;
+} tar_entry_t;
+
+struct tar_writer
+{
+    int root_fd;
+    char root[NAME_MAX + 1]; // Name every entry is stored below
+    tar_entry_t *entries;
+    size_t count;
+    size_t capacity;
+    size_t next;                // Entry whose header goes out next
+    char stage[3 * TAR_BLOCK_SIZE + PATH_MAX]; // Headers (and a long name) of one entry
+    size_t stage_len;
+    size_t stage_pos;
+    int fd;                     // File whose contents are going out
+    long long file_remaining;   // Its bytes still to send
+    long long zeros_remaining;  // Padding, missing contents or the end blocks
+    int ended;
+    int prefetch_fd;            // Next file, opened early for readahead
+    size_t prefetch_entry;
+    long files;
+    int damaged;
+};
+
+struct tar_reader
+{
+    int dir_fd;
+    char header[TAR_BLOCK_SIZE];
+    size_t header_len;
+    long long data_remaining;  // Contents of the current entry still to come
+    long long pad_remaining;
+    int fd;                    // File being written, -1 while contents are skipped
+    mode_t mode;
+    time_t mtime;
+    int collecting_name;       // Contents are the next entry's long name
+    char long_name[PATH_MAX];
+    size_t long_name_len;
+    int have_long_name;
+    int zero_blocks;
+    int ended;
+    long files;
+    char error[160];
+};
+
+static long long round_block(long long size)
+{
+    return (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+}
+
+// Stored name of an entry: root/path, with a slash after directories
+static int entry_name(const tar_writer_t *writer, const tar_entry_t *entry, char *out, size_t out_size)
+{
+    int written = snprintf(out, out_size, "%s%s%s%s", writer->root, entry->path[0] ? "/" : "", entry->path,
+                           entry->directory ? "/" : "");
+    return (written < 0 || (size_t)written >= out_size) ? -1 : written;
+}
+
+// Archive bytes of one entry: long name entry, header and padded contents
+static long long entry_archive_size(const tar_writer_t *writer, const tar_entry_t *entry)
+{
+    char name[PATH_MAX];
+    int name_len = entry_name(writer, entry, name, sizeof(name));
+    long long size = TAR_BLOCK_SIZE + round_block(entry->size);
+    if (name_len >= (int)sizeof(((tar_header_t *)0)->name))
+        size += TAR_BLOCK_SIZE + round_block(name_len + 1);
+    return size;
+}
+
+static int add_entry(tar_writer_t *writer, const char *path, const struct stat *st)
+{
+    if (writer->count == writer->capacity)
+    {
+        size_t capacity = writer->capacity ? writer->capacity * 2 : 64;
+        tar_entry_t *entries = realloc(writer->entries, capacity * sizeof(tar_entry_t));
+        if (!entries)
+            return -1;
+        writer->entries = entries;
+        writer->capacity = capacity;
+    }
+    tar_entry_t *entry = &writer->entries[writer->count];
+    entry->path = strdup(path);
+    if (!entry->path)
+        return -1;
+    entry->directory = S_ISDIR(st->st_mode);
+    entry->mode = st->st_mode & 07777;
+    entry->size = entry->directory ? 0 : st->st_size;
+    entry->mtime = st->st_mtime;
+
+    char name[PATH_MAX];
+    if (entry_name(writer, entry, name, sizeof(name)) == -1)
+    {
+        // Too long to store, leave it out
+        free(entry->path);
+        writer->damaged++;
+        return 0;
+    }
+    writer->count++;
+    if (!entry->directory)
+        writer->files++;
+    return 0;
+}
+
+// Append the regular files and directories inside entry index's directory
+static int walk_directory(tar_writer_t *writer, size_t index)
+{
+    const char *path = writer->entries[index].path;
+    int fd = openat(writer->root_fd, path[0] ? path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (!dir)
+    {
+        if (fd != -1)
+            close(fd);
+        writer->damaged++;
+        return 0; // Archived as an empty directory
+    }
+
+    struct dirent *de;
+    int result = 0;
+    while (result == 0 && (de = readdir(dir)) != NULL)
+    {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        struct stat st;
+        if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+            !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+        {
+            continue;
+        }
+        char child[PATH_MAX];
+        int written = snprintf(child, sizeof(child), "%s%s%s", path, path[0] ? "/" : "", de->d_name);
+        if (written < 0 || (size_t)written >= sizeof(child))
+        {
+            writer->damaged++;
+            continue;
+        }
+        // add_entry may move the entries, path is not used after it
+        result = add_entry(writer, child, &st);
+        path = writer->entries[index].path;
+    }
+    closedir(dir);
+    return result;
+}
+
+// Name the archive's top directory after the walked one, resolving "." and ".."
+static void root_name(int root_fd, const char *path, char *out, size_t out_size)
+{
+    char copy[PATH_MAX];
+    snprintf(copy, sizeof(copy), "%s", path);
+    size_t len = strlen(copy);
+    while (len > 1 && copy[len - 1] == '/')
+        copy[--len] = '\0';
+    const char *base = strrchr(copy, '/') ? strrchr(copy, '/') + 1 : copy;
+
+    char resolved[PATH_MAX];
+    if (base[0] == '\0' || strcmp(base, ".") == 0 || strcmp(base, "..") == 0)
+    {
+        char link[64];
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", root_fd);
+        ssize_t n = readlink(link, resolved, sizeof(resolved) - 1);
+        resolved[n > 0 ? n : 0] = '\0';
+        base = strrchr(resolved, '/') ? strrchr(resolved, '/') + 1 : resolved;
+    }
+    snprintf(out, out_size, "%s", base[0] ? base : "root");
+}
+
+// Walk the tree below path (resolved against dir_fd) and size its archive
+// Returns NULL with errno set if path is not a readable directory
+tar_writer_t *tar_writer_open(int dir_fd, const char *path, long long *archive_size)
+{
+    tar_writer_t *writer = calloc(1, sizeof(tar_writer_t));
+    if (!writer)
+        return NULL;
+    writer->fd = -1;
+    writer->prefetch_fd = -1;
+    writer->root_fd = openat(dir_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+    if (writer->root_fd == -1 || fstat(writer->root_fd, &st) == -1)
+    {
+        tar_writer_close(writer);
+        return NULL;
+    }
+    root_name(writer->root_fd, path, writer->root, sizeof(writer->root));
+
+    // Breadth first, so only one directory is open at a time
+    if (add_entry(writer, "", &st) == -1)
+    {
+        tar_writer_close(writer);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (size_t i = 0; i < writer->count; i++)
+    {
+        if (writer->entries[i].directory && walk_directory(writer, i) == -1)
+        {
+            tar_writer_close(writer);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    long long size = TAR_END_BLOCKS * TAR_BLOCK_SIZE;
+    for (size_t i = 0; i < writer->count; i++)
+    {
+        size += entry_archive_size(writer, &writer->entries[i]);
+    }
+    *archive_size = size;
+    return writer;
+}
+
+static void put_octal(char *field, size_t width, long long value)
+{
+    // width includes the terminating NUL
+    snprintf(field, width, "%0*llo", (int)width - 1, (unsigned long long)value);
+}
+
+static void put_size(char *field, long long size)
+{
+    if (size <= TAR_OCTAL_SIZE_MAX)
+    {
+        put_octal(field, 12, size);
+        return;
+    }
+    // GNU base-256: high bit set, big-endian binary in the rest of the field
+    field[0] = (char)0x80;
+    for (int i = 11; i > 0; i--, size >>= 8)
+    {
+        field[i] = (char)(size & 0xff);
+    }
+}
+
+static void put_header(char *out, const char *name, char type, mode_t mode, long long size, time_t mtime)
+{
+    tar_header_t *header = (tar_header_t *)out;
+    memset(header, 0, sizeof(tar_header_t));
+    strncpy(header->name, name, sizeof(header->name));
+    put_octal(header->mode, sizeof(header->mode), mode);
+    put_octal(header->uid, sizeof(header->uid), 0);
+    put_octal(header->gid, sizeof(header->gid), 0);
+    put_size(header->size, size);
+    put_octal(header->mtime, sizeof(header->mtime), mtime < 0 ? 0 : mtime);
+    header->typeflag = type;
+    memcpy(header->magic, "ustar ", 6);
+    memcpy(header->version, " ", 2);
+
+    memset(header->checksum, ' ', sizeof(header->checksum));
+    unsigned int sum = 0;
+    for (size_t i = 0; i < sizeof(tar_header_t); i++)
+    {
+        sum += (unsigned char)out[i];
+    }
+    snprintf(header->checksum, sizeof(header->checksum), "%06o", sum);
+    header->checksum[7] = ' ';
+}
+
+// Open entry index's file for reading; the prefetched one if it is that file
+static int open_entry_file(tar_writer_t *writer, size_t index)
+{
+    int fd;
+    if (writer->prefetch_fd != -1 && writer->prefetch_entry == index)
+    {
+        fd = writer->prefetch_fd;
+        writer->prefetch_fd = -1;
+    }
+    else
+    {
+        fd = openat(writer->root_fd, writer->entries[index].path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    }
+    if (fd != -1)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Get the disk going on the next non-empty file while this one is sent
+    if (writer->prefetch_fd != -1)
+    {
+        close(writer->prefetch_fd);
+        writer->prefetch_fd = -1;
+    }
+    for (size_t next = index + 1; next < writer->count; next++)
+    {
+        if (writer->entries[next].directory || writer->entries[next].size == 0)
+            continue;
+        writer->prefetch_fd = openat(writer->root_fd, writer->entries[next].path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+        writer->prefetch_entry = next;
+        if (writer->prefetch_fd != -1)
+            posix_fadvise(writer->prefetch_fd, 0, TAR_PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+        break;
+    }
+    return fd;
+}
+
+// Stage the headers of the next entry and open its contents
+static void start_entry(tar_writer_t *writer)
+{
+    tar_entry_t *entry = &writer->entries[writer->next];
+    char name[PATH_MAX];
+    int name_len = entry_name(writer, entry, name, sizeof(name));
+
+    writer->stage_len = 0;
+    writer->stage_pos = 0;
+    if (name_len >= (int)sizeof(((tar_header_t *)0)->name))
+    {
+        put_header(writer->stage, TAR_LONG_NAME, 'L', 0, name_len + 1, 0);
+        size_t data_len = round_block(name_len + 1);
+        memset(writer->stage + TAR_BLOCK_SIZE, 0, data_len);
+        memcpy(writer->stage + TAR_BLOCK_SIZE, name, name_len);
+        writer->stage_len = TAR_BLOCK_SIZE + data_len;
+    }
+    put_header(writer->stage + writer->stage_len, name, entry->directory ? '5' : '0', entry->mode, entry->size,
+               entry->mtime);
+    writer->stage_len += TAR_BLOCK_SIZE;
+
+    writer->file_remaining = 0;
+    writer->zeros_remaining = round_block(entry->size) - entry->size;
+    if (entry->size > 0)
+    {
+        writer->fd = open_entry_file(writer, writer->next);
+        writer->file_remaining = entry->size;
+        if (writer->fd == -1)
+        {
+            // Gone since the walk, its place is filled with zeros
+            writer->damaged++;
+            writer->zeros_remaining += writer->file_remaining;
+            writer->file_remaining = 0;
+        }
+    }
+    writer->next++;
+}
+
+// Produce the next len bytes of the archive (fewer only at its end)
+// Returns the number of bytes written to buf, 0 once the archive is complete
+long tar_writer_read(tar_writer_t *writer, char *buf, size_t len)
+{
+    size_t produced = 0;
+    while (produced < len)
+    {
+        size_t want = len - produced;
+        if (writer->stage_pos < writer->stage_len)
+        {
+            size_t n = writer->stage_len - writer->stage_pos;
+            if (n > want)
+                n = want;
+            memcpy(buf + produced, writer->stage + writer->stage_pos, n);
+            writer->stage_pos += n;
+            produced += n;
+        }
+        else if (writer->file_remaining > 0)
+        {
+            size_t n = writer->file_remaining < (long long)want ? (size_t)writer->file_remaining : want;
+            ssize_t got = read(writer->fd, buf + produced, n);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+            {
+                // Shrank or failed since the walk: pad it out to the announced size
+                writer->damaged++;
+                writer->zeros_remaining += writer->file_remaining;
+                writer->file_remaining = 0;
+            }
+            else
+            {
+                writer->file_remaining -= got;
+                produced += got;
+            }
+            if (writer->file_remaining == 0)
+            {
+                // Anything the file grew by since the walk stays out
+                close(writer->fd);
+                writer->fd = -1;
+            }
+        }
+        else if (writer->zeros_remaining > 0)
+        {
+            size_t n = writer->zeros_remaining < (long long)want ? (size_t)writer->zeros_remaining : want;
+            memset(buf + produced, 0, n);
+            writer->zeros_remaining -= n;
+            produced += n;
+        }
+        else if (writer->next < writer->count)
+        {
+            start_entry(writer);
+        }
+        else if (!writer->ended)
+        {
+            writer->ended = 1;
+            writer->zeros_remaining = TAR_END_BLOCKS * TAR_BLOCK_SIZE;
+        }
+        else
+        {
+            break;
+        }
+    }
+    return (long)produced;
+}
+
+// Regular files in the archive
+long tar_writer_files(const tar_writer_t *writer)
+{
+    return writer->files;
+}
+
+// Entries left out or padded because they could not be read as walked
+int tar_writer_damaged(const tar_writer_t *writer)
+{
+    return writer->damaged;
+}
+
+void tar_writer_close(tar_writer_t *writer)
+{
+    if (!writer)
+        return;
+    if (writer->fd != -1)
+        close(writer->fd);
+    if (writer->prefetch_fd != -1)
+        close(writer->prefetch_fd);
+    if (writer->root_fd != -1)
+        close(writer->root_fd);
+    for (size_t i = 0; i < writer->count; i++)
+    {
+        free(writer->entries[i].path);
+    }
+    free(writer->entries);
+    free(writer);
+}
+
+// Unpack below dir_fd
+tar_reader_t *tar_reader_open(int dir_fd)
+{
+    tar_reader_t *reader = calloc(1, sizeof(tar_reader_t));
+    if (!reader)
+        return NULL;
+    reader->dir_fd = dir_fd;
+    reader->fd = -1;
+    return reader;
+}
+
+static int reader_fail(tar_reader_t *reader, const char *what, const char *name)
+{
+    snprintf(reader->error, sizeof(reader->error), "%s%s%.100s", what, name ? ": " : "", name ? name : "");
+    return -1;
+}
+
+// Octal or GNU base-256 number field; -1 if malformed
+static long long parse_number(const char *field, size_t width)
+{
+    long long value = 0;
+    if ((unsigned char)field[0] & 0x80)
+    {
+        for (size_t i = 1; i < width; i++)
+        {
+            if (value >> 55)
+                return -1;
+            value = (value << 8) | (unsigned char)field[i];
+        }
+        return value;
+    }
+    size_t i = 0;
+    while (i < width && field[i] == ' ')
+        i++;
+    for (; i < width && field[i] >= '0' && field[i] <= '7'; i++)
+    {
+        value = value * 8 + (field[i] - '0');
+    }
+    if (i < width && field[i] != '\0' && field[i] != ' ')
+        return -1;
+    return value;
+}
+
+// Absolute names and ".." components could write outside the target directory
+static int name_is_safe(const char *name)
+{
+    if (name[0] == '\0' || name[0] == '/')
+        return 0;
+    for (const char *p = name; *p;)
+    {
+        const char *end = strchr(p, '/');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len == 2 && p[0] == '.' && p[1] == '.')
+            return 0;
+        p += len;
+        while (*p == '/')
+            p++;
+    }
+    return 1;
+}
+
+// mkdir -p below the reader's directory; with parent_only the last component is left out
+static int make_directories(tar_reader_t *reader, const char *name, int parent_only)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", name);
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/')
+        path[--len] = '\0';
+
+    for (char *p = strchr(path, '/'); ; p = strchr(p + 1, '/'))
+    {
+        if (p)
+            *p = '\0';
+        if ((p || !parent_only) && path[0] && mkdirat(reader->dir_fd, path, 0755) == -1 && errno != EEXIST)
+            return reader_fail(reader, "Cannot create directory", path);
+        if (!p)
+            break;
+        *p = '/';
+    }
+    return 0;
+}
+
+// Contents of the current entry are complete
+static int finish_entry(tar_reader_t *reader)
+{
+    if (reader->collecting_name)
+    {
+        reader->long_name[reader->long_name_len < sizeof(reader->long_name) ? reader->long_name_len
+                                                                            : sizeof(reader->long_name) - 1] = '\0';
+        reader->collecting_name = 0;
+        reader->have_long_name = 1;
+    }
+    if (reader->fd != -1)
+    {
+        struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, {.tv_sec = reader->mtime}};
+        fchmod(reader->fd, reader->mode & 0777);
+        futimens(reader->fd, times);
+        int result = close(reader->fd);
+        reader->fd = -1;
+        if (result == -1)
+            return reader_fail(reader, "Cannot write file", strerror(errno));
+    }
+    return 0;
+}
+
+static int parse_header(tar_reader_t *reader)
+{
+    const tar_header_t *header = (const tar_header_t *)reader->header;
+
+    int all_zero = 1;
+    for (size_t i = 0; i < TAR_BLOCK_SIZE && all_zero; i++)
+    {
+        all_zero = reader->header[i] == 0;
+    }
+    if (all_zero)
+    {
+        if (++reader->zero_blocks == TAR_END_BLOCKS)
+            reader->ended = 1;
+        return 0;
+    }
+    reader->zero_blocks = 0;
+
+    unsigned int sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; i++)
+    {
+        int in_checksum = i >= offsetof(tar_header_t, checksum) &&
+                          i < offsetof(tar_header_t, checksum) + sizeof(header->checksum);
+        sum += in_checksum ? ' ' : (unsigned char)reader->header[i];
+    }
+    long long size = parse_number(header->size, sizeof(header->size));
+    if ((long long)sum != parse_number(header->checksum, sizeof(header->checksum) - 1))
+        return reader_fail(reader, "Corrupt header", NULL);
+    if (size < 0)
+        return reader_fail(reader, "Invalid entry size", NULL);
+
+    reader->data_remaining = size;
+    reader->pad_remaining = round_block(size) - size;
+    if (header->typeflag == 'L')
+    {
+        if (size >= (long long)sizeof(reader->long_name))
+            return reader_fail(reader, "Name too long", NULL);
+        reader->collecting_name = 1;
+        reader->long_name_len = 0;
+        return size == 0 ? finish_entry(reader) : 0;
+    }
+
+    char name[PATH_MAX];
+    if (reader->have_long_name)
+        snprintf(name, sizeof(name), "%s", reader->long_name);
+    else if (memcmp(header->magic, "ustar", 6) == 0 && header->prefix[0])
+        snprintf(name, sizeof(name), "%.155s/%.100s", header->prefix, header->name);
+    else
+        snprintf(name, sizeof(name), "%.100s", header->name);
+    reader->have_long_name = 0;
+
+    if (header->typeflag == '5')
+    {
+        if (!name_is_safe(name))
+            return reader_fail(reader, "Unsafe name", name);
+        return make_directories(reader, name, 0);
+    }
+    if (header->typeflag != '0' && header->typeflag != '\0' && header->typeflag != '7')
+    {
+        return 0; // Links and special files are skipped
+    }
+
+    if (!name_is_safe(name))
+        return reader_fail(reader, "Unsafe name", name);
+    if (make_directories(reader, name, 1) == -1)
+        return -1;
+    reader->fd = openat(reader->dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (reader->fd == -1)
+        return reader_fail(reader, "Cannot create file", name);
+    long long mode = parse_number(header->mode, sizeof(header->mode));
+    long long mtime = parse_number(header->mtime, sizeof(header->mtime));
+    reader->mode = mode < 0 ? 0644 : (mode_t)mode;
+    reader->mtime = mtime < 0 ? 0 : (time_t)mtime;
+    reader->files++;
+    return size == 0 ? finish_entry(reader) : 0;
+}
+
+// Unpack the next piece of the archive; returns 0, or -1 with tar_reader_error() set
+int tar_reader_feed(tar_reader_t *reader, const char *data, size_t len)
+{
+    while (len > 0 && !reader->ended)
+    {
+        if (reader->data_remaining > 0)
+        {
+            size_t n = reader->data_remaining < (long long)len ? (size_t)reader->data_remaining : len;
+            if (reader->fd != -1)
+            {
+                for (size_t done = 0; done < n;)
+                {
+                    ssize_t written = write(reader->fd, data + done, n - done);
+                    if (written < 0 && errno == EINTR)
+                        continue;
+                    if (written <= 0)
+                        return reader_fail(reader, "Cannot write file", strerror(errno));
+                    done += written;
+                }
+            }
+            else if (reader->collecting_name)
+            {
+                memcpy(reader->long_name + reader->long_name_len, data, n);
+                reader->long_name_len += n;
+            }
+            data += n;
+            len -= n;
+            reader->data_remaining -= n;
+            if (reader->data_remaining == 0 && finish_entry(reader) == -1)
+                return -1;
+        }
+        else if (reader->pad_remaining > 0)
+        {
+            size_t n = reader->pad_remaining < (long long)len ? (size_t)reader->pad_remaining : len;
+            data += n;
+            len -= n;
+            reader->pad_remaining -= n;
+        }
+        else
+        {
+            size_t n = TAR_BLOCK_SIZE - reader->header_len;
+            if (n > len)
+                n = len;
+            memcpy(reader->header + reader->header_len, data, n);
+            reader->header_len += n;
+            data += n;
+            len -= n;
+            if (reader->header_len == TAR_BLOCK_SIZE)
+            {
+                reader->header_len = 0;
+                if (parse_header(reader) == -1)
+                    return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// The whole archive was fed: 0 if it ended properly, -1 if it was cut short
+int tar_reader_finish(tar_reader_t *reader)
+{
+    if (!reader->ended)
+        return reader_fail(reader, "Archive ended early", NULL);
+    return 0;
+}
+
+// Regular files created so far
+long tar_reader_files(const tar_reader_t *reader)
+{
+    return reader->files;
+}
+
+const char *tar_reader_error(const tar_reader_t *reader)
+{
+    return reader->error;
+}
+
+void tar_reader_close(tar_reader_t *reader)
+{
+    if (!reader)
+        return;
+    if (reader->fd != -1)
+        close(reader->fd);
+    free(reader);
+}
@@ -0,0 +1,46 @@
+#ifndef TAR_H
+#define TAR_H
+
+#include <stddef.h>
+
+/**
+ * @file tar.h
+ * @brief Streaming tar archives of directory trees (shared by client and server)
+ *
+ * tar_writer_open() walks a directory tree once (regular files and directories; symlinks,
+ * devices and sockets are left out) and knows the exact archive size before the first
+ * byte goes out, so the archive can be cut into a fixed number of chunks. tar_writer_read()
+ * then produces the archive sequentially, reading each file as it gets there and asking
+ * the kernel to read ahead the next one. A file that shrank in between is padded with
+ * zeros and one that grew is cut at its walked size, so the size never changes; both
+ * are counted by tar_writer_damaged().
+ *
+ * The format is GNU tar: 512-byte headers, names of 100 bytes and more in a
+ * "././@LongLink" entry before the header, sizes of 8 GiB and more in base-256.
+ * Every entry is named below the walked directory's own name.
+ *
+ * tar_reader_feed() unpacks an archive below a directory as it arrives, in pieces of
+ * any size. It reads GNU and ustar headers; pax extended headers are skipped. Only
+ * regular files and directories are created; names that are absolute or contain a ".."
+ * component fail the archive.
+ */
+
+#define TAR_BLOCK_SIZE 512
+
+typedef struct tar_writer tar_writer_t;
+typedef struct tar_reader tar_reader_t;
+
+tar_writer_t *tar_writer_open(int dir_fd, const char *path, long long *archive_size);
+long tar_writer_read(tar_writer_t *writer, char *buf, size_t len);
+long tar_writer_files(const tar_writer_t *writer);
+int tar_writer_damaged(const tar_writer_t *writer);
+void tar_writer_close(tar_writer_t *writer);
+
+tar_reader_t *tar_reader_open(int dir_fd);
+int tar_reader_feed(tar_reader_t *reader, const char *data, size_t len);
+int tar_reader_finish(tar_reader_t *reader);
+long tar_reader_files(const tar_reader_t *reader);
+const char *tar_reader_error(const tar_reader_t *reader);
+void tar_reader_close(tar_reader_t *reader);
+
+#endif
@@ -0,0 +1,92 @@
+#define _POSIX_C_SOURCE 199309L
+#include "checksum.h"
+#include "colors.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// CRC32C throughput against link rates (make -f Makefile_epoll bench)
+
+#define BENCH_BUFFER_SIZE (64 * 1024 * 1024)
+#define BENCH_CHUNK_SIZE (1024 * 1024) // The chunk size clients ask for
+#define BENCH_ROUNDS 8
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Checksum the buffer chunk by chunk like a transfer does; returns bytes per second
+static double measure(uint32_t (*function)(uint32_t, const void *, size_t), const char *buffer, uint32_t *result)
+{
+    double best = 0;
+    for (int round = 0; round < BENCH_ROUNDS; round++)
+    {
+        uint32_t crc = 0;
+        double start = now_seconds();
+        for (size_t offset = 0; offset < BENCH_BUFFER_SIZE; offset += BENCH_CHUNK_SIZE)
+        {
+            crc = function(crc, buffer + offset, BENCH_CHUNK_SIZE);
+        }
+        double rate = BENCH_BUFFER_SIZE / (now_seconds() - start);
+        if (rate > best)
+            best = rate;
+        *result = crc;
+    }
+    return best;
+}
+
+static void report(const char *name, double rate)
+{
+    static const double links_gbit[] = {1, 10, 25, 100};
+    printf("%-14s %6.2f GB/s  (%6.1f Gbit/s):", name, rate / 1e9, rate * 8 / 1e9);
+    for (size_t i = 0; i < sizeof(links_gbit) / sizeof(links_gbit[0]); i++)
+    {
+        double times = rate * 8 / (links_gbit[i] * 1e9);
+        printf(" %s%.1fx %.0fG" RESET, times >= 1 ? GREEN : RED, times, links_gbit[i]);
+    }
+    printf("\n");
+}
+
+int main(void)
+{
+    // Known answer, and chaining has to give the same result as one call
+    static const char check[] = "123456789";
+    uint32_t expected = 0xe3069283;
+    if (crc32c(0, check, 9) != expected || crc32c_portable(0, check, 9) != expected ||
+        crc32c(crc32c(0, check, 4), check + 4, 5) != expected)
+    {
+        fprintf(stderr, RED "CRC32C self-test failed\n" RESET);
+        return 1;
+    }
+
+    char *buffer = malloc(BENCH_BUFFER_SIZE);
+    if (!buffer)
+    {
+        perror("malloc");
+        return 1;
+    }
+    srand(1);
+    for (size_t i = 0; i < BENCH_BUFFER_SIZE; i++)
+    {
+        buffer[i] = (char)rand();
+    }
+
+    uint32_t fast_crc;
+    uint32_t portable_crc;
+    printf("CRC32C over %d MiB in %d KiB chunks, best of %d (selected: %s)\n", BENCH_BUFFER_SIZE >> 20,
+           BENCH_CHUNK_SIZE >> 10, BENCH_ROUNDS, crc32c_implementation());
+    report(crc32c_implementation(), measure(crc32c, buffer, &fast_crc));
+    report("slicing-by-8", measure(crc32c_portable, buffer, &portable_crc));
+    free(buffer);
+
+    if (fast_crc != portable_crc)
+    {
+        fprintf(stderr, RED "Implementations disagree: %08x vs %08x\n" RESET, fast_crc, portable_crc);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,742 @@
+#define _GNU_SOURCE
+// Load generator for the epoll server: many connections speaking the frame and chunk
+// protocol, reporting throughput, latency percentiles and server CPU (make -f Makefile_epoll bench-load)
+#include "checksum.h"
+#include "colors.h"
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FRAME_VERSION 2
+#define FRAME_COMMAND 1
+#define FRAME_RESPONSE 2
+#define FRAME_DATA 3
+#define FRAME_STREAM 4
+
+#define CHUNK_TYPE_DATA 0
+#define CHUNK_TYPE_STREAM 1
+
+#define FRAME_HEADER_SIZE 8  // version, type, flags, length
+#define CHUNK_HEADER_SIZE 84 // chunk_id, chunk_size, total_chunks, type, checksum, filename[64]
+#define FILENAME_LEN 64
+#define RESPONSE_MAX 65536  // Kept of a reply, the rest is read and dropped
+#define SEED_NAME "bench_seed.dat" // Uploaded once, then downloaded by every connection
+
+enum
+{
+    OP_COMMAND,
+    OP_UPLOAD,
+    OP_DOWNLOAD,
+    OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = {"commands", "uploads", "downloads"};
+
+typedef struct
+{
+    const char *host;
+    const char *port;
+    int connections;   // Active connections, one thread each
+    int idle;          // Connections opened and left silent
+    double duration;   // Seconds of load, unless ops is set
+    long ops;          // Operations per connection, 0 = run for duration
+    int weight[OP_COUNT];
+    long long upload_size;
+    long long download_size;
+    int chunk_size;
+    int stream;        // Downloads as get -s
+    const char *command;
+    int server_pid;    // Read its CPU time from /proc, 0 = don't
+} bench_options_t;
+
+static bench_options_t options = {
+    .host = "127.0.0.1",
+    .port = "8080",
+    .connections = 16,
+    .idle = 0,
+    .duration = 10,
+    .ops = 0,
+    .weight = {80, 10, 10},
+    .upload_size = 1 << 20,
+    .download_size = 1 << 20,
+    .chunk_size = 1 << 20,
+    .stream = 0,
+    .command = "pwd",
+    .server_pid = 0};
+
+// Latencies of one kind of operation, in microseconds
+typedef struct
+{
+    double *samples;
+    size_t count;
+    size_t capacity;
+} latency_log_t;
+
+typedef struct
+{
+    int id;
+    pthread_t thread;
+    int fd;
+    unsigned int seed; // rand_r() state, so every run draws the same sequence of operations
+    char *buffer;      // Chunk payloads in and out
+    char upload_name[FILENAME_LEN];
+    latency_log_t latency[OP_COUNT];
+    long long bytes[OP_COUNT];
+    long errors;
+} bench_worker_t;
+
+static pthread_barrier_t start_barrier;
+static volatile int stop_requested = 0;
+static char *upload_payload; // One chunk of pseudo-random bytes every upload repeats
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_server(void)
+{
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *result;
+    int error = getaddrinfo(options.host, options.port, &hints, &result);
+    if (error != 0)
+    {
+        fprintf(stderr, RED "%s:%s: %s\n" RESET, options.host, options.port, gai_strerror(error));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = result; ai && fd == -1; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd != -1 && connect(fd, ai->ai_addr, ai->ai_addrlen) == -1)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(result);
+    if (fd != -1)
+    {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+static int send_iov(int fd, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t sent = writev(fd, iov, count);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (count > 0 && (size_t)sent >= iov->iov_len)
+        {
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+// Read exactly len bytes; NULL buf drops them
+static int recv_exact(int fd, char *buf, size_t len)
+{
+    char scratch[65536];
+    while (len > 0)
+    {
+        size_t want = buf ? len : (len < sizeof(scratch) ? len : sizeof(scratch));
+        ssize_t got = recv(fd, buf ? buf : scratch, want, 0);
+        if (got <= 0)
+        {
+            if (got == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (buf)
+            buf += got;
+        len -= got;
+    }
+    return 0;
+}
+
+static void put_frame_header(char *out, uint8_t type, uint32_t length)
+{
+    out[0] = FRAME_VERSION;
+    out[1] = type;
+    out[2] = 0;
+    out[3] = 0;
+    uint32_t be = htonl(length);
+    memcpy(out + 4, &be, 4);
+}
+
+static int recv_frame_header(int fd, int *type, uint32_t *length)
+{
+    unsigned char header[FRAME_HEADER_SIZE];
+    if (recv_exact(fd, (char *)header, sizeof(header)) == -1 || header[0] != FRAME_VERSION)
+        return -1;
+    *type = header[1];
+    uint32_t be;
+    memcpy(&be, header + 4, 4);
+    *length = ntohl(be);
+    return 0;
+}
+
+static int send_command(int fd, const char *command)
+{
+    char header[FRAME_HEADER_SIZE];
+    put_frame_header(header, FRAME_COMMAND, strlen(command));
+    struct iovec iov[2] = {{header, sizeof(header)}, {(char *)command, strlen(command)}};
+    return send_iov(fd, iov, 2);
+}
+
+// Read the payload of a response frame whose header was already read
+static int recv_response_body(int fd, uint32_t length, char *reply, size_t capacity)
+{
+    size_t keep = length < capacity - 1 ? length : capacity - 1;
+    if (recv_exact(fd, reply, keep) == -1 || recv_exact(fd, NULL, length - keep) == -1)
+        return -1;
+    reply[keep] = '\0';
+    return 0;
+}
+
+static int recv_response(int fd, char *reply, size_t capacity)
+{
+    int type;
+    uint32_t length;
+    if (recv_frame_header(fd, &type, &length) == -1 || type != FRAME_RESPONSE)
+        return -1;
+    return recv_response_body(fd, length, reply, capacity);
+}
+
+static int say_hello(int fd)
+{
+    char command[32];
+    char reply[256];
+    snprintf(command, sizeof(command), "hello %d", options.chunk_size);
+    if (send_command(fd, command) == -1 || recv_response(fd, reply, sizeof(reply)) == -1)
+        return -1;
+    return strncmp(reply, "OK:", 3) == 0 ? 0 : -1;
+}
+
+static void put_u32(char *out, uint32_t value)
+{
+    uint32_t be = htonl(value);
+    memcpy(out, &be, 4);
+}
+
+static uint32_t get_u32(const char *in)
+{
+    uint32_t be;
+    memcpy(&be, in, 4);
+    return ntohl(be);
+}
+
+// upload, then size bytes as chunks of upload_payload, then wait for SUCCESS
+static int upload_file(int fd, const char *name, long long size)
+{
+    if (send_command(fd, "upload") == -1)
+        return -1;
+
+    uint32_t total = (uint32_t)((size + options.chunk_size - 1) / options.chunk_size);
+    uint32_t crc = 0;
+    char headers[FRAME_HEADER_SIZE + CHUNK_HEADER_SIZE];
+    memset(headers, 0, sizeof(headers));
+    snprintf(headers + FRAME_HEADER_SIZE + 20, FILENAME_LEN, "%s", name);
+    for (uint32_t id = 0; id < total; id++)
+    {
+        long long left = size - (long long)id * options.chunk_size;
+        uint32_t len = left < options.chunk_size ? (uint32_t)left : (uint32_t)options.chunk_size;
+        crc = crc32c(crc, upload_payload, len);
+
+        put_frame_header(headers, FRAME_DATA, CHUNK_HEADER_SIZE + len);
+        char *chunk = headers + FRAME_HEADER_SIZE;
+        put_u32(chunk, id);
+        put_u32(chunk + 4, len);
+        put_u32(chunk + 8, total);
+        put_u32(chunk + 12, CHUNK_TYPE_DATA);
+        put_u32(chunk + 16, crc);
+        struct iovec iov[2] = {{headers, sizeof(headers)}, {upload_payload, len}};
+        if (send_iov(fd, iov, 2) == -1)
+            return -1;
+    }
+
+    char reply[256];
+    if (recv_response(fd, reply, sizeof(reply)) == -1 || strncmp(reply, "SUCCESS", 7) != 0)
+        return -1;
+    return 0;
+}
+
+// get the seed file and read every chunk (or the stream); returns the bytes received
+static long long download_file(int fd, char *buffer)
+{
+    char command[128];
+    snprintf(command, sizeof(command), "get %ssaved/%s", options.stream ? "-s " : "", SEED_NAME);
+    if (send_command(fd, command) == -1)
+        return -1;
+
+    long long received = 0;
+    for (;;)
+    {
+        int type;
+        uint32_t length;
+        if (recv_frame_header(fd, &type, &length) == -1)
+            return -1;
+        if (type == FRAME_RESPONSE)
+        {
+            char reply[256];
+            recv_response_body(fd, length, reply, sizeof(reply));
+            return -1; // ERROR: File not found and the like
+        }
+        if (type != FRAME_DATA || length < CHUNK_HEADER_SIZE)
+            return -1;
+
+        char chunk[CHUNK_HEADER_SIZE];
+        if (recv_exact(fd, chunk, sizeof(chunk)) == -1)
+            return -1;
+        uint32_t payload = length - CHUNK_HEADER_SIZE;
+        if (get_u32(chunk + 12) == CHUNK_TYPE_STREAM)
+        {
+            uint64_t be;
+            if (payload != sizeof(be) || recv_exact(fd, (char *)&be, sizeof(be)) == -1)
+                return -1;
+            long long total = (long long)be64toh(be);
+            while (received < total)
+            {
+                if (recv_frame_header(fd, &type, &length) == -1 || type != FRAME_STREAM ||
+                    recv_exact(fd, NULL, length) == -1)
+                    return -1;
+                received += length;
+            }
+            // The stream ends with a frame holding the CRC32C of its contents
+            if (recv_frame_header(fd, &type, &length) == -1 || type != FRAME_STREAM || length != sizeof(uint32_t) ||
+                recv_exact(fd, NULL, length) == -1)
+                return -1;
+            return received;
+        }
+
+        // Plain (or LZ4) chunks, the payload goes into the scratch buffer unread
+        if (payload > (uint32_t)options.chunk_size || recv_exact(fd, buffer, payload) == -1)
+            return -1;
+        received += payload;
+        if (get_u32(chunk) + 1 >= get_u32(chunk + 8))
+            return received;
+    }
+}
+
+static void record_latency(latency_log_t *log, double usec)
+{
+    if (log->count == log->capacity)
+    {
+        size_t capacity = log->capacity ? log->capacity * 2 : 4096;
+        double *samples = realloc(log->samples, capacity * sizeof(double));
+        if (!samples)
+            return;
+        log->samples = samples;
+        log->capacity = capacity;
+    }
+    log->samples[log->count++] = usec;
+}
+
+static int pick_operation(bench_worker_t *worker)
+{
+    int total = options.weight[OP_COMMAND] + options.weight[OP_UPLOAD] + options.weight[OP_DOWNLOAD];
+    int draw = rand_r(&worker->seed) % total;
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        if (draw < options.weight[op])
+            return op;
+        draw -= options.weight[op];
+    }
+    return OP_COMMAND;
+}
+
+static void *worker_thread(void *arg)
+{
+    bench_worker_t *worker = arg;
+    pthread_barrier_wait(&start_barrier);
+
+    char reply[RESPONSE_MAX];
+    for (long done = 0; worker->fd != -1; done++)
+    {
+        if (options.ops ? done >= options.ops : __atomic_load_n(&stop_requested, __ATOMIC_RELAXED))
+            break;
+
+        int op = pick_operation(worker);
+        double start = now_seconds();
+        long long bytes = 0;
+        int result;
+        if (op == OP_COMMAND)
+        {
+            result = send_command(worker->fd, options.command) == -1 ? -1 : recv_response(worker->fd, reply, sizeof(reply));
+        }
+        else if (op == OP_UPLOAD)
+        {
+            result = upload_file(worker->fd, worker->upload_name, options.upload_size);
+            bytes = options.upload_size;
+        }
+        else
+        {
+            bytes = download_file(worker->fd, worker->buffer);
+            result = bytes == options.download_size ? 0 : -1;
+        }
+
+        if (result == -1)
+        {
+            // The stream can't be trusted after a failed operation: start over on a new connection
+            worker->errors++;
+            close(worker->fd);
+            worker->fd = connect_server();
+            if (worker->fd != -1 && say_hello(worker->fd) == -1)
+            {
+                close(worker->fd);
+                worker->fd = -1;
+            }
+            continue;
+        }
+        record_latency(&worker->latency[op], (now_seconds() - start) * 1e6);
+        worker->bytes[op] += bytes;
+    }
+    return NULL;
+}
+
+// utime + stime of a process in seconds, -1 if it can't be read
+static double process_cpu_seconds(int pid, double *user, double *sys)
+{
+    char path[64];
+    char line[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+    size_t len = fread(line, 1, sizeof(line) - 1, fp);
+    fclose(fp);
+    line[len] = '\0';
+
+    // Fields after the command name, which may itself hold spaces and parentheses
+    char *rest = strrchr(line, ')');
+    unsigned long utime;
+    unsigned long stime;
+    if (!rest || sscanf(rest + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return -1;
+    double ticks = sysconf(_SC_CLK_TCK);
+    *user = utime / ticks;
+    *sys = stime / ticks;
+    return *user + *sys;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const latency_log_t *log, double p)
+{
+    size_t index = (size_t)(p * log->count + 0.999999);
+    return log->samples[index ? index - 1 : 0];
+}
+
+// 512k, 4m, 1g, or plain bytes
+static long long parse_size(const char *text)
+{
+    char *end;
+    long long value = strtoll(text, &end, 10);
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        return value << 10;
+    case 'm':
+    case 'M':
+        return value << 20;
+    case 'g':
+    case 'G':
+        return value << 30;
+    default:
+        return value;
+    }
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --host HOST           Server address (127.0.0.1)\n"
+            "  --port PORT           Server port (8080)\n"
+            "  --connections N       Active connections, one thread each (16)\n"
+            "  --idle N              Extra connections opened and left idle (0)\n"
+            "  --duration SECONDS    Length of the run (10)\n"
+            "  --ops N               Operations per connection instead of a duration\n"
+            "  --mix C:U:D           Weights of commands, uploads and downloads (80:10:10)\n"
+            "  --command TEXT        Small command to send (pwd)\n"
+            "  --upload-size BYTES   Size of each upload, k/m/g suffixes (1m)\n"
+            "  --download-size BYTES Size of the file downloaded (1m)\n"
+            "  --chunk-size BYTES    Chunk size asked for with hello (1m)\n"
+            "  --stream              Download with get -s\n"
+            "  --server-pid PID      Report the server's CPU time from /proc\n",
+            program);
+}
+
+static int parse_options(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--stream") == 0)
+            options.stream = 1;
+        else if (!value)
+            return -1;
+        else if (strcmp(argv[i], "--host") == 0)
+            options.host = value;
+        else if (strcmp(argv[i], "--port") == 0)
+            options.port = value;
+        else if (strcmp(argv[i], "--connections") == 0)
+            options.connections = atoi(value);
+        else if (strcmp(argv[i], "--idle") == 0)
+            options.idle = atoi(value);
+        else if (strcmp(argv[i], "--duration") == 0)
+            options.duration = atof(value);
+        else if (strcmp(argv[i], "--ops") == 0)
+            options.ops = atol(value);
+        else if (strcmp(argv[i], "--mix") == 0)
+        {
+            if (sscanf(value, "%d:%d:%d", &options.weight[OP_COMMAND], &options.weight[OP_UPLOAD],
+                       &options.weight[OP_DOWNLOAD]) != 3)
+                return -1;
+        }
+        else if (strcmp(argv[i], "--command") == 0)
+            options.command = value;
+        else if (strcmp(argv[i], "--upload-size") == 0)
+            options.upload_size = parse_size(value);
+        else if (strcmp(argv[i], "--download-size") == 0)
+            options.download_size = parse_size(value);
+        else if (strcmp(argv[i], "--chunk-size") == 0)
+            options.chunk_size = (int)parse_size(value);
+        else if (strcmp(argv[i], "--server-pid") == 0)
+            options.server_pid = atoi(value);
+        else
+            return -1;
+        if (strcmp(argv[i], "--stream") != 0)
+            i++;
+    }
+
+    int weights = options.weight[OP_COMMAND] + options.weight[OP_UPLOAD] + options.weight[OP_DOWNLOAD];
+    if (options.connections <= 0 || options.idle < 0 || (options.ops <= 0 && options.duration <= 0) ||
+        options.weight[OP_COMMAND] < 0 || options.weight[OP_UPLOAD] < 0 || options.weight[OP_DOWNLOAD] < 0 ||
+        weights <= 0 || options.upload_size <= 0 || options.download_size <= 0 ||
+        options.chunk_size < 512 || options.chunk_size > 4 << 20)
+    {
+        fprintf(stderr, RED "Invalid options (sizes must be positive, chunks 512 B to 4 MiB)\n" RESET);
+        return -1;
+    }
+    return 0;
+}
+
+// Make room for every connection in the descriptor table
+static void raise_fd_limit(int needed)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)needed)
+    {
+        limit.rlim_cur = (rlim_t)needed < limit.rlim_max ? (rlim_t)needed : limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        if (limit.rlim_cur < (rlim_t)needed)
+            fprintf(stderr, YELLOW "Descriptor limit is %lu, not all %d connections may open\n" RESET,
+                    (unsigned long)limit.rlim_cur, needed);
+    }
+}
+
+// Connections the server has not closed: a peek that would block means still open
+static int count_open(const int *fds, int count)
+{
+    int open = 0;
+    for (int i = 0; i < count; i++)
+    {
+        char byte;
+        if (fds[i] != -1 && recv(fds[i], &byte, 1, MSG_PEEK | MSG_DONTWAIT) == -1 && errno == EAGAIN)
+            open++;
+    }
+    return open;
+}
+
+static void report_latency(int op, latency_log_t *log, long long bytes, double elapsed)
+{
+    if (log->count == 0)
+        return;
+    qsort(log->samples, log->count, sizeof(double), compare_samples);
+    printf("  %-10s %9zu ops %10.1f/s  p50 %9.3f ms  p99 %9.3f ms  p999 %9.3f ms", op_names[op], log->count,
+           log->count / elapsed, percentile(log, 0.50) / 1000, percentile(log, 0.99) / 1000,
+           percentile(log, 0.999) / 1000);
+    if (bytes > 0)
+        printf("  %9.1f MB/s", bytes / elapsed / 1e6);
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (parse_options(argc, argv) == -1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    raise_fd_limit(options.connections + options.idle + 64);
+    signal(SIGPIPE, SIG_IGN); // A connection the server closed fails its operation instead
+
+    upload_payload = malloc(options.chunk_size);
+    bench_worker_t *workers = calloc(options.connections, sizeof(bench_worker_t));
+    int *idle_fds = malloc((options.idle ? options.idle : 1) * sizeof(int));
+    if (!upload_payload || !workers || !idle_fds)
+    {
+        perror("malloc");
+        return 1;
+    }
+    unsigned int fill = 1;
+    for (int i = 0; i < options.chunk_size; i++)
+        upload_payload[i] = (char)rand_r(&fill);
+
+    // The file every download fetches
+    int fd = connect_server();
+    if (fd == -1 || say_hello(fd) == -1 ||
+        (options.weight[OP_DOWNLOAD] > 0 && upload_file(fd, SEED_NAME, options.download_size) == -1))
+    {
+        fprintf(stderr, RED "Cannot prepare %s:%s (is the server running?)\n" RESET, options.host, options.port);
+        return 1;
+    }
+
+    int idle_open = 0;
+    for (int i = 0; i < options.idle; i++)
+    {
+        idle_fds[i] = connect_server();
+        idle_open += idle_fds[i] != -1;
+    }
+    if (idle_open < options.idle)
+        fprintf(stderr, YELLOW "Opened %d of %d idle connections\n" RESET, idle_open, options.idle);
+
+    pthread_barrier_init(&start_barrier, NULL, options.connections + 1);
+    for (int i = 0; i < options.connections; i++)
+    {
+        bench_worker_t *worker = &workers[i];
+        worker->id = i;
+        worker->seed = i + 1;
+        worker->buffer = malloc(options.chunk_size);
+        snprintf(worker->upload_name, sizeof(worker->upload_name), "bench_%d.dat", i);
+        worker->fd = connect_server();
+        if (!worker->buffer || worker->fd == -1 || say_hello(worker->fd) == -1)
+        {
+            fprintf(stderr, RED "Connection %d failed\n" RESET, i);
+            return 1;
+        }
+        if (pthread_create(&worker->thread, NULL, worker_thread, worker) != 0)
+        {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    double cpu_user = 0, cpu_sys = 0, end_user = 0, end_sys = 0;
+    double cpu_start = options.server_pid ? process_cpu_seconds(options.server_pid, &cpu_user, &cpu_sys) : -1;
+    pthread_barrier_wait(&start_barrier);
+    double start = now_seconds();
+    if (!options.ops)
+    {
+        struct timespec pause = {(time_t)options.duration, (long)((options.duration - (time_t)options.duration) * 1e9)};
+        while (nanosleep(&pause, &pause) == -1 && errno == EINTR)
+            ;
+        __atomic_store_n(&stop_requested, 1, __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < options.connections; i++)
+        pthread_join(workers[i].thread, NULL);
+    double elapsed = now_seconds() - start;
+    double cpu_end = cpu_start >= 0 ? process_cpu_seconds(options.server_pid, &end_user, &end_sys) : -1;
+
+    // Merge the workers' results into the first one
+    latency_log_t *logs = workers[0].latency;
+    long long bytes[OP_COUNT] = {0};
+    long errors = 0;
+    for (int i = 0; i < options.connections; i++)
+    {
+        for (int op = 0; op < OP_COUNT; op++)
+        {
+            bytes[op] += workers[i].bytes[op];
+            if (i == 0)
+                continue;
+            for (size_t s = 0; s < workers[i].latency[op].count; s++)
+                record_latency(&logs[op], workers[i].latency[op].samples[s]);
+            free(workers[i].latency[op].samples);
+        }
+        errors += workers[i].errors;
+    }
+
+    printf(CYAN "%d connections (+%d idle) for %.1f s against %s:%s, chunk %d B, mix %d:%d:%d" RESET "\n",
+           options.connections, options.idle, elapsed, options.host, options.port, options.chunk_size,
+           options.weight[OP_COMMAND], options.weight[OP_UPLOAD], options.weight[OP_DOWNLOAD]);
+    for (int op = 0; op < OP_COUNT; op++)
+        report_latency(op, &logs[op], bytes[op], elapsed);
+    long long moved = bytes[OP_UPLOAD] + bytes[OP_DOWNLOAD];
+    if (moved > 0)
+        printf("  throughput %.1f MB/s (uploads %.1f, downloads %.1f)\n", moved / elapsed / 1e6,
+               bytes[OP_UPLOAD] / elapsed / 1e6, bytes[OP_DOWNLOAD] / elapsed / 1e6);
+    printf("  %s%ld errors" RESET, errors ? RED : GREEN, errors);
+    if (options.idle)
+        printf(", idle connections still open %d/%d", count_open(idle_fds, options.idle), options.idle);
+    printf("\n");
+    if (cpu_end >= 0)
+    {
+        double cpu = cpu_end - cpu_start;
+        printf("  server CPU %.2f s (user %.2f, sys %.2f), %.1f%% of a core", cpu, end_user - cpu_user,
+               end_sys - cpu_sys, cpu / elapsed * 100);
+        if (moved > 0)
+            printf(", %.2f CPU-s per GB", cpu / (moved / 1e9));
+        printf("\n");
+    }
+    else if (options.server_pid)
+    {
+        fprintf(stderr, YELLOW "Cannot read the CPU time of process %d\n" RESET, options.server_pid);
+    }
+
+    // Leave the server's directory as it was
+    if (fd != -1)
+    {
+        char reply[256];
+        char command[128];
+        for (int i = 0; i < options.connections && options.weight[OP_UPLOAD] > 0; i++)
+        {
+            snprintf(command, sizeof(command), "delete saved/%s", workers[i].upload_name);
+            if (send_command(fd, command) == -1 || recv_response(fd, reply, sizeof(reply)) == -1)
+                break;
+        }
+        snprintf(command, sizeof(command), "delete saved/%s", SEED_NAME);
+        if (options.weight[OP_DOWNLOAD] > 0 && send_command(fd, command) != -1)
+            recv_response(fd, reply, sizeof(reply));
+        close(fd);
+    }
+    return errors ? 2 : 0;
+}
@@ -1,7 +1,8 @@
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 #include "commands.h"
 #include "colors.h"
 #include "server.h" // Ensure the log_message function is accessible
+#include "logger.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,9 +17,14 @@
 #include <sys/sysinfo.h>
 #include <errno.h>
 #include <netinet/tcp.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/syscall.h>
 
 #define CHUNK_SIZE 512
 #define FILENAME_MAX_LEN 64
+#define LIST_GETDENTS_BUFFER 65536 // Directory entries read per getdents64() call
+#define LIST_OUTPUT_BATCH 65536    // ls output handed to reply_write() at a time
 
 typedef struct
 {
@@ -29,6 +35,63 @@ typedef struct
     char filename[FILENAME_MAX_LEN];
 } FileChunkHeader;
 
+// Write part of a command's reply, straight to the socket or into the reply buffer
+int reply_write(reply_t *reply, const char *data, size_t len)
+{
+    if (!reply->buffered)
+    {
+        return send(reply->sock, data, len, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+    }
+
+    if (reply->len + len > reply->capacity)
+    {
+        size_t capacity = reply->capacity ? reply->capacity : 1024;
+        while (capacity < reply->len + len)
+            capacity *= 2;
+        char *data_buffer = realloc(reply->data, capacity);
+        if (!data_buffer)
+        {
+            perror("realloc");
+            return -1;
+        }
+        reply->data = data_buffer;
+        reply->capacity = capacity;
+    }
+    memcpy(reply->data + reply->len, data, len);
+    reply->len += len;
+    return 0;
+}
+
+// Open a directory as a session's working directory handle; *at() calls resolve
+// names against it, so no lookup starts from the process cwd again
+int open_dir_fd(int dir_fd, const char *path)
+{
+    return openat(dir_fd, path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+// Absolute path of the directory behind a handle, for pwd and the logs
+static int dir_fd_path(int dir_fd, char *out, size_t out_size)
+{
+    char link[64];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", dir_fd);
+    ssize_t len = readlink(link, out, out_size - 1);
+    if (len < 0 || (size_t)len >= out_size - 1)
+        return -1;
+    out[len] = '\0';
+    return 0;
+}
+
+// Resolve a client-supplied name against a session's working directory
+int resolve_path(const char *cwd, const char *name, char *out, size_t out_size)
+{
+    int written;
+    if (name[0] == '/')
+        written = snprintf(out, out_size, "%s", name);
+    else
+        written = snprintf(out, out_size, "%s/%s", cwd, name);
+    return (written < 0 || (size_t)written >= out_size) ? -1 : 0;
+}
+
 ssize_t read_line(int sock, char *buf, size_t max_len)
 {
     size_t i = 0;
@@ -52,14 +115,16 @@ ssize_t read_line(int sock, char *buf, size_t max_len)
     return i;
 }
 
-void receive_file(int sock)
+void receive_file(int sock, const char *cwd)
 {
     FILE *fp = NULL;
     int total_chunks = 0;
     int received_chunks = 0;
     char filename[FILENAME_MAX_LEN] = {0};
+    char saved_dir[PATH_MAX + sizeof("/saved")];
 
-    mkdir("saved", 0777);
+    snprintf(saved_dir, sizeof(saved_dir), "%s/saved", cwd);
+    mkdir(saved_dir, 0777);
 
     while (1)
     {
@@ -77,8 +142,8 @@ void receive_file(int sock)
             strncpy(filename, header.filename, FILENAME_MAX_LEN - 1);
             filename[FILENAME_MAX_LEN - 1] = '\0'; // Ensure null-termination
             // save on 'saved' directory
-            char full_path[256];
-            snprintf(full_path, sizeof(full_path), "saved/%s", filename);
+            char full_path[sizeof(saved_dir) + FILENAME_MAX_LEN];
+            snprintf(full_path, sizeof(full_path), "%s/%s", saved_dir, filename);
             fp = fopen(full_path, "wb");
             if (!fp)
             {
@@ -214,16 +279,6 @@ void send_file(int sock, const char *filename)
             return;
         }
 
-        // Progressive delays for very large files
-        if (total_chunks > 500000 && i % 100 == 0)
-        {
-            usleep(900); // 0.5ms delay every 100 chunks for very large files
-        }
-        else if (total_chunks > 100000 && i % 500 == 0)
-        {
-            usleep(600); // 0.2ms delay every 500 chunks for large files
-        }
-
         // Progress reporting
         if (total_chunks > 50000 && i % 1000 == 0)
         {
@@ -241,130 +296,283 @@ void send_file(int sock, const char *filename)
     printf(GREEN "File sent successfully: %s (%d chunks)\n" RESET, filename, total_chunks);
 }
 
-void send_list(int sock)
+// Entry layout returned by getdents64()
+struct linux_dirent64
 {
-    DIR *d = opendir(".");
-    if (!d)
-    {
-        printf(RED "Error: Cannot open current directory\n" RESET);
-        send(sock, "ERROR: Cannot list directory\n", 29, 0);
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Listing output collected before it is handed to reply_write() in large pieces
+typedef struct
+{
+    reply_t *reply;
+    size_t len;
+    char data[LIST_OUTPUT_BATCH];
+} list_output_t;
 
-        return;
-    }
+static void list_flush(list_output_t *out)
+{
+    if (out->len > 0)
+        reply_write(out->reply, out->data, out->len);
+    out->len = 0;
+}
 
-    printf(BLUE "Listing directory contents\n" RESET);
-    struct dirent *dir;
-    char buffer[512] = {0};
-    while ((dir = readdir(d)) != NULL)
+static void list_printf(list_output_t *out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void list_printf(list_output_t *out, const char *format, ...)
+{
+    va_list args;
+    for (int attempt = 0; attempt < 2; attempt++)
     {
-        // Skip the current and parent directory entries
-        if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0)
-            continue;
+        va_start(args, format);
+        int len = vsnprintf(out->data + out->len, sizeof(out->data) - out->len, format, args);
+        va_end(args);
+        if (len < 0)
+            return;
+        if ((size_t)len < sizeof(out->data) - out->len)
+        {
+            out->len += len;
+            return;
+        }
+        // Did not fit, retry in an empty batch
+        list_flush(out);
+    }
+}
 
-        struct stat st;
-        // Get file type and name
-        if (strlen(dir->d_name) >= FILENAME_MAX_LEN)
+// Parse "[--offset N] [--limit N] [--compact]"; returns -1 on anything else
+static int parse_list_args(const char *args, long *offset, long *limit, int *compact)
+{
+    *offset = 0;
+    *limit = -1;
+    *compact = 0;
+    while (*args)
+    {
+        int used = 0;
+        if (*args == ' ')
         {
-            printf(RED "Error: Filename '%s' is too long\n" RESET, dir->d_name);
-            snprintf(buffer, sizeof(buffer), "%s (Error: Filename too long)\n", dir->d_name);
-            send(sock, buffer, strlen(buffer), 0);
+            args++;
             continue;
         }
+        if (sscanf(args, "--offset %ld%n", offset, &used) == 1 && *offset >= 0)
+            args += used;
+        else if (sscanf(args, "--limit %ld%n", limit, &used) == 1 && *limit >= 0)
+            args += used;
+        else if (strncmp(args, "--compact", 9) == 0 && (args[9] == ' ' || args[9] == '\0'))
+        {
+            *compact = 1;
+            args += 9;
+        }
+        else
+            return -1;
+    }
+    return 0;
+}
+
+// List the directory behind dir_fd. Entries are read in getdents64() batches and
+// typed from d_type; only links and filesystems without d_type cost an fstatat().
+// args takes the ls options: --offset/--limit page through the entries (a page that
+// stops early ends with "MORE: offset=<n>"), --compact prints "<d|f|o|?>\t<name>".
+void send_list(reply_t *reply, int dir_fd, const char *args)
+{
+    long offset, limit;
+    int compact;
+    if (parse_list_args(args, &offset, &limit, &compact) == -1)
+    {
+        reply_write(reply, "ERROR: Invalid ls option\n", 25);
+        return;
+    }
 
-        // TODO LOOK ??
-        if (stat(dir->d_name, &st) == 0)
+    // The session handle is O_PATH; reading entries needs a descriptor of its own
+    int list_fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char *entries = list_fd == -1 ? NULL : malloc(LIST_GETDENTS_BUFFER);
+    if (!entries)
+    {
+        if (list_fd != -1)
+            close(list_fd);
+        LOG_ERROR(RED "Error: Cannot open current directory\n" RESET);
+        reply_write(reply, "ERROR: Cannot list directory\n", 29);
+
+        return;
+    }
+
+    LOG_INFO(BLUE "Listing directory contents\n" RESET);
+    list_output_t *out = malloc(sizeof(list_output_t));
+    if (!out)
+    {
+        perror("malloc");
+        free(entries);
+        close(list_fd);
+        reply_write(reply, "ERROR: Cannot list directory\n", 29);
+        return;
+    }
+    out->reply = reply;
+    out->len = 0;
+
+    long index = 0; // Entries seen, without . and ..
+    int more = 0;
+    long bytes;
+    while (!more && (bytes = syscall(SYS_getdents64, list_fd, entries, LIST_GETDENTS_BUFFER)) > 0)
+    {
+        for (long pos = 0; pos < bytes;)
         {
-            if (S_ISDIR(st.st_mode))
+            struct linux_dirent64 *dir = (struct linux_dirent64 *)(entries + pos);
+            pos += dir->d_reclen;
+
+            // Skip the current and parent directory entries
+            if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0)
+                continue;
+            if (index++ < offset)
+                continue;
+            if (limit >= 0 && index > offset + limit)
             {
-                snprintf(buffer, sizeof(buffer), "- 📁 %s (Directory)\n", dir->d_name);
+                more = 1;
+                break;
             }
-            else if (S_ISREG(st.st_mode))
+
+            if (strlen(dir->d_name) >= FILENAME_MAX_LEN)
             {
-                snprintf(buffer, sizeof(buffer), "- 📄 %s (File)\n", dir->d_name);
+                LOG_ERROR(RED "Error: Filename '%s' is too long\n" RESET, dir->d_name);
+                list_printf(out, compact ? "?\t%s\n" : "%s (Error: Filename too long)\n", dir->d_name);
+                continue;
             }
-            else
+
+            // Links are followed, as a stat() would
+            unsigned char type = dir->d_type;
+            if (type == DT_UNKNOWN || type == DT_LNK)
             {
-                snprintf(buffer, sizeof(buffer), "%s (Other)\n", dir->d_name);
+                struct stat st;
+                if (fstatat(dir_fd, dir->d_name, &st, 0) == 0)
+                    type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_FIFO;
+                else
+                    type = DT_UNKNOWN;
             }
-        }
-        else
-        {
-            snprintf(buffer, sizeof(buffer), "%s (Error getting type)\n", dir->d_name);
-        }
 
-        send(sock, buffer, strlen(buffer), 0);
-        printf(CYAN "Sent: %s" RESET, buffer);
+            if (type == DT_DIR)
+                list_printf(out, compact ? "d\t%s\n" : "- 📁 %s (Directory)\n", dir->d_name);
+            else if (type == DT_REG)
+                list_printf(out, compact ? "f\t%s\n" : "- 📄 %s (File)\n", dir->d_name);
+            else if (type != DT_UNKNOWN)
+                list_printf(out, compact ? "o\t%s\n" : "%s (Other)\n", dir->d_name);
+            else
+                list_printf(out, compact ? "?\t%s\n" : "%s (Error getting type)\n", dir->d_name);
+            LOG_DEBUG(CYAN "Listed: %s\n" RESET, dir->d_name);
+        }
+    }
+    close(list_fd);
+    free(entries);
+
+    if (more)
+        list_printf(out, "MORE: offset=%ld\n", offset + limit);
+    list_printf(out, "END_OF_LIST\n");
+    list_flush(out);
+    free(out);
+}
 
-        // Clear buffer for next entry
-        memset(buffer, 0, sizeof(buffer));
+void send_pwd(reply_t *reply, const char *cwd)
+{
+    char response[PATH_MAX + 1];
+    if (cwd[0] != '\0' && snprintf(response, sizeof(response), "%s\n", cwd) < (int)sizeof(response))
+    {
+        LOG_INFO(BLUE "Current directory: %s\n" RESET, cwd);
+        reply_write(reply, response, strlen(response));
+    }
+    else
+    {
+        LOG_ERROR(RED "Error: Cannot get current directory\n" RESET);
+        reply_write(reply, "ERROR: Cannot get current directory\n", 36);
     }
-    closedir(d);
-    send(sock, "END_OF_LIST\n", 12, 0);
 }
 
-void send_pwd(int sock)
+// Change a session's working directory handle (and its path, kept for pwd); the
+// process cwd is never touched
+void change_dir(reply_t *reply, int *dir_fd, char *cwd, size_t cwd_size, const char *path)
 {
-    char cwd[256];
-    if (getcwd(cwd, sizeof(cwd)))
+    char resolved[PATH_MAX];
+    int new_fd = -1;
+
+    if (faccessat(*dir_fd, path, X_OK, 0) == 0 && (new_fd = open_dir_fd(*dir_fd, path)) != -1 &&
+        dir_fd_path(new_fd, resolved, sizeof(resolved)) == 0 && strlen(resolved) < cwd_size)
     {
-        printf(BLUE "Current directory: %s\n" RESET, cwd);
-        strcat(cwd, "\n");
-        send(sock, cwd, strlen(cwd), 0);
+        close(*dir_fd);
+        *dir_fd = new_fd;
+        strcpy(cwd, resolved);
+        LOG_INFO(GREEN "Changed directory to: %s\n" RESET, cwd);
+        reply_write(reply, "OK: Directory changed\n", 22);
     }
     else
     {
-        printf(RED "Error: Cannot get current directory\n" RESET);
-        send(sock, "ERROR: Cannot get current directory\n", 36, 0);
+        if (new_fd != -1)
+            close(new_fd);
+        LOG_ERROR(RED "Error: Cannot change to directory '%s'\n" RESET, path);
+        reply_write(reply, "ERROR: Cannot change directory\n", 31);
     }
 }
 
-void change_dir(int sock, const char *path)
+void delete_file(reply_t *reply, int dir_fd, const char *filename)
 {
-    if (chdir(path) == 0)
+    if (unlinkat(dir_fd, filename, 0) == 0)
     {
-        printf(GREEN "Changed directory to: %s\n" RESET, path);
-        send(sock, "OK: Directory changed\n", 22, 0);
+        LOG_INFO(GREEN "Deleted file: %s\n" RESET, filename);
+        reply_write(reply, "SUCCESS: File deleted\n", 22);
     }
     else
     {
-        printf(RED "Error: Cannot change to directory '%s'\n" RESET, path);
-        send(sock, "ERROR: Cannot change directory\n", 31, 0);
+        LOG_ERROR(RED "Error: Cannot delete file '%s'\n" RESET, filename);
+        reply_write(reply, "ERROR: Cannot delete file\n", 26);
     }
 }
 
-void delete_file(int sock, const char *filename)
+void rename_file(reply_t *reply, int dir_fd, const char *old_name, const char *new_name)
 {
-    if (unlink(filename) == 0)
+    if (renameat(dir_fd, old_name, dir_fd, new_name) == 0)
     {
-        printf(GREEN "Deleted file: %s\n" RESET, filename);
-        send(sock, "SUCCESS: File deleted\n", 23, 0);
+        LOG_INFO(GREEN "Renamed file: %s -> %s\n" RESET, old_name, new_name);
+        reply_write(reply, "SUCCESS: File renamed\n", 22);
     }
     else
     {
-        printf(RED "Error: Cannot delete file '%s'\n" RESET, filename);
-        send(sock, "ERROR: Cannot delete file\n", 26, 0);
+        LOG_ERROR(RED "Error: Cannot rename file '%s' to '%s'\n" RESET, old_name, new_name);
+        reply_write(reply, "ERROR: Cannot rename file\n", 26);
     }
 }
 
-void rename_file(int sock, const char *old_name, const char *new_name)
+// Report a file's size so a client can split its download into chunk ranges
+void send_file_size(reply_t *reply, int dir_fd, const char *filename)
 {
-    if (rename(old_name, new_name) == 0)
+    struct stat st;
+    if (fstatat(dir_fd, filename, &st, 0) == 0 && S_ISREG(st.st_mode))
     {
-        printf(GREEN "Renamed file: %s -> %s\n" RESET, old_name, new_name);
-        send(sock, "SUCCESS: File renamed\n", 23, 0);
+        char response[64];
+        snprintf(response, sizeof(response), "OK: size=%lld\n", (long long)st.st_size);
+        reply_write(reply, response, strlen(response));
     }
     else
     {
-        printf(RED "Error: Cannot rename file '%s' to '%s'\n" RESET, old_name, new_name);
-        send(sock, "ERROR: Cannot rename file\n", 26, 0);
+        reply_write(reply, "ERROR: File not found\n", 22);
     }
 }
 
 void handle_client(int sock)
 {
     char command[128];
+    char cwd[PATH_MAX];
+    char path[PATH_MAX];
+    reply_t reply = {.sock = sock}; // Unbuffered, replies go straight out
     log_message("INFO", "Client handler started");
 
+    if (!getcwd(cwd, sizeof(cwd)))
+        cwd[0] = '\0';
+    int dir_fd = open_dir_fd(AT_FDCWD, ".");
+    if (dir_fd == -1)
+    {
+        perror("open");
+        send(sock, "ERROR: Cannot open working directory\n", 37, 0);
+        return;
+    }
+
     while (1)
     {
         memset(command, 0, sizeof(command));
@@ -382,32 +590,40 @@ void handle_client(int sock)
         if (strncmp(command, "upload", 6) == 0)
         {
             log_message("INFO", "Handling upload command");
-            receive_file(sock);
+            receive_file(sock, cwd);
         }
         else if (strncmp(command, "get ", 4) == 0)
         {
             log_message("INFO", "Handling get command");
-            send_file(sock, command + 4);
+            if (resolve_path(cwd, command + 4, path, sizeof(path)) == 0)
+                send_file(sock, path);
+            else
+                send(sock, "ERROR: File not found\n", 22, 0);
         }
         else if (strcmp(command, "ls") == 0)
         {
             log_message("INFO", "Handling ls command");
-            send_list(sock);
+            send_list(&reply, dir_fd, "");
         }
         else if (strcmp(command, "pwd") == 0)
         {
             log_message("INFO", "Handling pwd command");
-            send_pwd(sock);
+            send_pwd(&reply, cwd);
         }
         else if (strncmp(command, "cd ", 3) == 0)
         {
             log_message("INFO", "Handling cd command");
-            change_dir(sock, command + 3);
+            change_dir(&reply, &dir_fd, cwd, sizeof(cwd), command + 3);
         }
         else if (strncmp(command, "delete ", 7) == 0)
         {
             log_message("INFO", "Handling delete command");
-            delete_file(sock, command + 7);
+            delete_file(&reply, dir_fd, command + 7);
+        }
+        else if (strncmp(command, "size ", 5) == 0)
+        {
+            log_message("INFO", "Handling size command");
+            send_file_size(&reply, dir_fd, command + 5);
         }
         else if (strncmp(command, "rename ", 7) == 0)
         {
@@ -416,7 +632,7 @@ void handle_client(int sock)
             char *new_name = strtok(NULL, " ");
             if (old_name && new_name)
             {
-                rename_file(sock, old_name, new_name);
+                rename_file(&reply, dir_fd, old_name, new_name);
             }
             else
             {
@@ -427,7 +643,7 @@ void handle_client(int sock)
         else if (strcmp(command, "health") == 0)
         {
             log_message("INFO", "Handling health command");
-            send_health_info(sock);
+            send_health_info(&reply);
         }
         else
         {
@@ -437,52 +653,65 @@ void handle_client(int sock)
         }
     }
 
+    close(dir_fd);
     log_message("INFO", "Client handler finished");
     printf(YELLOW "Client handler finished\n" RESET);
 }
 
 // Health monitoring functions
-double get_cpu_usage()
+
+// Read the aggregate idle and total jiffies from /proc/stat
+int read_cpu_times(unsigned long long *idle, unsigned long long *total)
 {
-    FILE *f;
-    unsigned long long prevIdle = 0, prevTotal = 0;
-    unsigned long long idle, total;
     char buf[256];
-
-    f = fopen("/proc/stat", "r");
+    FILE *f = fopen("/proc/stat", "r");
     if (!f)
         return -1;
-    fgets(buf, sizeof(buf), f);
+    if (!fgets(buf, sizeof(buf), f))
+    {
+        fclose(f);
+        return -1;
+    }
     fclose(f);
 
     char cpu[5];
-    unsigned long long user, nice, system, irq, softirq, steal, guest, guest_nice;
-    sscanf(buf, "%s %llu %llu %llu %llu %llu %llu %llu %llu",
-           cpu, &user, &nice, &system, &idle, &irq, &softirq, &steal, &guest);
-
-    total = user + nice + system + idle + irq + softirq + steal;
-    prevIdle = idle;
-    prevTotal = total;
-
-    usleep(100000); // 100ms delay instead of 1 second to avoid blocking
-
-    f = fopen("/proc/stat", "r");
-    if (!f)
+    unsigned long long user, nice, system, irq, softirq, steal, guest;
+    if (sscanf(buf, "%4s %llu %llu %llu %llu %llu %llu %llu %llu",
+               cpu, &user, &nice, &system, idle, &irq, &softirq, &steal, &guest) != 9)
         return -1;
-    fgets(buf, sizeof(buf), f);
-    fclose(f);
-    sscanf(buf, "%s %llu %llu %llu %llu %llu %llu %llu %llu",
-           cpu, &user, &nice, &system, &idle, &irq, &softirq, &steal, &guest);
-    total = user + nice + system + idle + irq + softirq + steal;
 
-    unsigned long long deltaTotal = total - prevTotal;
-    unsigned long long deltaIdle = idle - prevIdle;
+    *total = user + nice + system + *idle + irq + softirq + steal;
+    return 0;
+}
+
+// CPU busy percentage between two /proc/stat readings
+double cpu_usage_between(unsigned long long prev_idle, unsigned long long prev_total,
+                         unsigned long long idle, unsigned long long total)
+{
+    unsigned long long deltaTotal = total - prev_total;
+    unsigned long long deltaIdle = idle - prev_idle;
 
     if (deltaTotal == 0)
         return 0;
     return (double)(deltaTotal - deltaIdle) / deltaTotal * 100.0;
 }
 
+// Blocking measurement over 100 ms, for callers without a background sampler
+double get_cpu_usage()
+{
+    unsigned long long prevIdle, prevTotal;
+    unsigned long long idle, total;
+
+    if (read_cpu_times(&prevIdle, &prevTotal) == -1)
+        return -1;
+
+    usleep(100000); // 100ms delay instead of 1 second to avoid blocking
+
+    if (read_cpu_times(&idle, &total) == -1)
+        return -1;
+    return cpu_usage_between(prevIdle, prevTotal, idle, total);
+}
+
 int get_cpu_temp()
 {
     FILE *f;
@@ -490,7 +719,8 @@ int get_cpu_temp()
     f = fopen("/sys/class/thermal/thermal_zone0/temp", "r");
     if (!f)
         return -1;
-    fscanf(f, "%d", &temp_milli);
+    if (fscanf(f, "%d", &temp_milli) != 1)
+        temp_milli = -1000;
     fclose(f);
     return temp_milli / 1000;
 }
@@ -505,7 +735,24 @@ double get_disk_usage(const char *path)
     return (double)used / total * 100.0;
 }
 
-void send_health_info(int sock)
+// Take every reading except CPU usage, which needs two samples over time
+void read_health(health_snapshot_t *snapshot)
+{
+    snapshot->cpu_temp = get_cpu_temp();
+    snapshot->disk_usage = get_disk_usage("/");
+
+    struct sysinfo mem;
+    snapshot->ram_ok = sysinfo(&mem) == 0;
+    if (snapshot->ram_ok)
+    {
+        snapshot->total_ram = (unsigned long long)mem.totalram * mem.mem_unit;
+        snapshot->free_ram = (unsigned long long)mem.freeram * mem.mem_unit;
+        snapshot->uptime = mem.uptime;
+    }
+}
+
+// Format a health report; negative readings are reported as unavailable
+void send_health_snapshot(reply_t *reply, const health_snapshot_t *snapshot)
 {
     char response[1024];
     char temp_buf[256];
@@ -513,22 +760,25 @@ void send_health_info(int sock)
     strcpy(response, "=== SERVER HEALTH INFORMATION ===\n");
 
     // CPU Usage
-    double cpu_usage = get_cpu_usage();
-    if (cpu_usage >= 0)
+    if (snapshot->cpu_usage >= 0)
     {
-        snprintf(temp_buf, sizeof(temp_buf), "CPU Usage: %.2f%%\n", cpu_usage);
+        snprintf(temp_buf, sizeof(temp_buf), "CPU Usage: %.2f%%\n", snapshot->cpu_usage);
         strcat(response, temp_buf);
     }
     else
     {
         strcat(response, "CPU Usage: Unable to read\n");
     }
+    if (snapshot->cpu_usage_avg >= 0)
+    {
+        snprintf(temp_buf, sizeof(temp_buf), "CPU Usage (1 min avg): %.2f%%\n", snapshot->cpu_usage_avg);
+        strcat(response, temp_buf);
+    }
 
     // CPU Temperature
-    int cpu_temp = get_cpu_temp();
-    if (cpu_temp >= 0)
+    if (snapshot->cpu_temp >= 0)
     {
-        snprintf(temp_buf, sizeof(temp_buf), "CPU Temperature: %d °C\n", cpu_temp);
+        snprintf(temp_buf, sizeof(temp_buf), "CPU Temperature: %d °C\n", snapshot->cpu_temp);
         strcat(response, temp_buf);
     }
     else
@@ -537,10 +787,9 @@ void send_health_info(int sock)
     }
 
     // Disk Usage
-    double disk = get_disk_usage("/");
-    if (disk >= 0)
+    if (snapshot->disk_usage >= 0)
     {
-        snprintf(temp_buf, sizeof(temp_buf), "Disk Usage ('/'): %.2f%%\n", disk);
+        snprintf(temp_buf, sizeof(temp_buf), "Disk Usage ('/'): %.2f%%\n", snapshot->disk_usage);
         strcat(response, temp_buf);
     }
     else
@@ -549,11 +798,10 @@ void send_health_info(int sock)
     }
 
     // RAM Usage
-    struct sysinfo mem;
-    if (sysinfo(&mem) == 0)
+    if (snapshot->ram_ok)
     {
-        unsigned long long total = mem.totalram;
-        unsigned long long free = mem.freeram;
+        unsigned long long total = snapshot->total_ram;
+        unsigned long long free = snapshot->free_ram;
         double ram_usage = (double)(total - free) / total * 100.0;
         snprintf(temp_buf, sizeof(temp_buf), "RAM Usage: %.2f%%\n", ram_usage);
         strcat(response, temp_buf);
@@ -565,23 +813,31 @@ void send_health_info(int sock)
         // Free RAM in MB
         snprintf(temp_buf, sizeof(temp_buf), "Free RAM: %.2f MB\n", (double)free / (1024 * 1024));
         strcat(response, temp_buf);
+
+        // System uptime
+        long uptime_hours = snapshot->uptime / 3600;
+        long uptime_minutes = (snapshot->uptime % 3600) / 60;
+        snprintf(temp_buf, sizeof(temp_buf), "System Uptime: %ld hours, %ld minutes\n", uptime_hours, uptime_minutes);
+        strcat(response, temp_buf);
     }
     else
     {
         strcat(response, "RAM Usage: Unable to read\n");
     }
 
-    // System uptime
-    if (sysinfo(&mem) == 0)
-    {
-        long uptime_hours = mem.uptime / 3600;
-        long uptime_minutes = (mem.uptime % 3600) / 60;
-        snprintf(temp_buf, sizeof(temp_buf), "System Uptime: %ld hours, %ld minutes\n", uptime_hours, uptime_minutes);
-        strcat(response, temp_buf);
-    }
-
     strcat(response, "================================\n");
 
-    send(sock, response, strlen(response), MSG_NOSIGNAL);
+    reply_write(reply, response, strlen(response));
+}
+
+// Measure and report health on the spot (blocks for the 100 ms CPU sample)
+void send_health_info(reply_t *reply)
+{
+    health_snapshot_t snapshot;
+    snapshot.cpu_usage = get_cpu_usage();
+    snapshot.cpu_usage_avg = -1;
+    read_health(&snapshot);
+
+    send_health_snapshot(reply, &snapshot);
     log_message("INFO", "Sent health information to client");
 }
@@ -1,14 +1,49 @@
 #ifndef COMMANDS_H
 #define COMMANDS_H
 
+#include <stddef.h>
+
+// Where a command's reply goes. Unbuffered replies are sent to sock as they are written;
+// buffered ones are collected in data so the caller can send the whole reply at once.
+typedef struct
+{
+    int sock;
+    int buffered;
+    char *data;
+    size_t len;
+    size_t capacity;
+} reply_t;
+
+// One set of health readings; negative values mean the reading is unavailable
+typedef struct
+{
+    double cpu_usage;     // Busy percentage over the last sample interval
+    double cpu_usage_avg; // Busy percentage over the last minute
+    int cpu_temp;         // Degrees Celsius
+    double disk_usage;    // Percentage of '/' in use
+    int ram_ok;           // Whether the RAM and uptime fields are filled in
+    unsigned long long total_ram;
+    unsigned long long free_ram;
+    long uptime; // Seconds
+} health_snapshot_t;
+
+int reply_write(reply_t *reply, const char *data, size_t len);
 void handle_client(int sock);
-void receive_file(int sock);
+void receive_file(int sock, const char *cwd);
 void send_file(int sock, const char *filename);
-void send_list(int sock);
-void send_pwd(int sock);
-void change_dir(int sock, const char *path);
-void delete_file(int sock, const char *filename);
-void rename_file(int sock, const char *old_name, const char *new_name);
-void send_health_info(int sock);
+void send_list(reply_t *reply, int dir_fd, const char *args);
+void send_pwd(reply_t *reply, const char *cwd);
+void change_dir(reply_t *reply, int *dir_fd, char *cwd, size_t cwd_size, const char *path);
+void delete_file(reply_t *reply, int dir_fd, const char *filename);
+void rename_file(reply_t *reply, int dir_fd, const char *old_name, const char *new_name);
+void send_file_size(reply_t *reply, int dir_fd, const char *filename);
+void send_health_info(reply_t *reply);
+void send_health_snapshot(reply_t *reply, const health_snapshot_t *snapshot);
+void read_health(health_snapshot_t *snapshot);
+int read_cpu_times(unsigned long long *idle, unsigned long long *total);
+double cpu_usage_between(unsigned long long prev_idle, unsigned long long prev_total,
+                         unsigned long long idle, unsigned long long total);
+int open_dir_fd(int dir_fd, const char *path);
+int resolve_path(const char *cwd, const char *name, char *out, size_t out_size);
 
 #endif
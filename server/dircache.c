@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+#include "dircache.h"
+#include "colors.h"
+#include "logger.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+// Changes that alter the names or types a listing shows. Links are listed by their
+// target's type; a target changing type behind a link is not seen.
+#define DIRCACHE_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR)
+
+// One rendered listing, a complete `ls` reply up to and including END_OF_LIST
+typedef struct dir_listing
+{
+    dev_t dev;
+    ino_t ino;
+    int compact;
+    int wd; // inotify watch of the directory, shared by both formats
+    char *data;
+    size_t len;
+    struct dir_listing *prev; // LRU list, most recently used first
+    struct dir_listing *next;
+} dir_listing_t;
+
+static __thread int inotify_fd = -1;
+static __thread size_t cache_budget = 0;
+static __thread size_t cache_bytes = 0;
+static __thread int listing_count = 0;
+static __thread dir_listing_t *lru_head = NULL;
+static __thread dir_listing_t *lru_tail = NULL;
+
+// Create this worker's cache; returns the inotify fd to poll, or -1 when caching is off
+int dircache_attach(size_t max_bytes)
+{
+    if (max_bytes == 0)
+        return -1;
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1)
+    {
+        LOG_WARNING(YELLOW "inotify unavailable (%s), directory listings are not cached\n" RESET, strerror(errno));
+        return -1;
+    }
+    cache_budget = max_bytes;
+    return inotify_fd;
+}
+
+static void unlink_listing(dir_listing_t *listing)
+{
+    if (listing->prev)
+        listing->prev->next = listing->next;
+    else
+        lru_head = listing->next;
+    if (listing->next)
+        listing->next->prev = listing->prev;
+    else
+        lru_tail = listing->prev;
+    listing->prev = listing->next = NULL;
+}
+
+static void push_front(dir_listing_t *listing)
+{
+    listing->prev = NULL;
+    listing->next = lru_head;
+    if (lru_head)
+        lru_head->prev = listing;
+    lru_head = listing;
+    if (!lru_tail)
+        lru_tail = listing;
+}
+
+static int watch_in_use(int wd)
+{
+    for (dir_listing_t *listing = lru_head; listing; listing = listing->next)
+    {
+        if (listing->wd == wd)
+            return 1;
+    }
+    return 0;
+}
+
+// Forget a listing; the watch goes once no listing of that directory is left.
+// remove_watch is 0 when the kernel has already dropped it.
+static void drop_listing(dir_listing_t *listing, int remove_watch)
+{
+    unlink_listing(listing);
+    cache_bytes -= listing->len;
+    listing_count--;
+    METRIC_ADD(dircache_bytes, -(long)listing->len);
+    if (remove_watch && !watch_in_use(listing->wd))
+        inotify_rm_watch(inotify_fd, listing->wd);
+    free(listing->data);
+    free(listing);
+}
+
+// Drop every listing of the directory behind wd, or everything for wd == -1
+static void invalidate(int wd, int remove_watch)
+{
+    dir_listing_t *listing = lru_head;
+    while (listing)
+    {
+        dir_listing_t *next = listing->next;
+        if (wd == -1 || listing->wd == wd)
+        {
+            METRIC_INC(dircache_invalidations);
+            drop_listing(listing, remove_watch);
+        }
+        listing = next;
+    }
+}
+
+// Apply queued inotify events; called when the fd polls readable and before lookups
+void dircache_handle_events(void)
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t bytes;
+    while ((bytes = read(inotify_fd, events, sizeof(events))) > 0)
+    {
+        for (char *pos = events; pos < events + bytes;)
+        {
+            struct inotify_event *event = (struct inotify_event *)pos;
+            pos += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                LOG_WARNING(YELLOW "inotify queue overflowed, dropping all cached listings\n" RESET);
+                invalidate(-1, 1);
+            }
+            else if (event->mask & IN_IGNORED)
+            {
+                invalidate(event->wd, 0); // Directory removed, or our own rm_watch
+            }
+            else
+            {
+                invalidate(event->wd, 1);
+            }
+        }
+    }
+}
+
+// Only `ls` and `ls --compact` are cached; paged requests are rendered every time
+static int full_listing(const char *args, int *compact)
+{
+    while (*args == ' ')
+        args++;
+    *compact = strncmp(args, "--compact", 9) == 0;
+    if (*compact)
+        args += 9;
+    while (*args == ' ')
+        args++;
+    return *args == '\0' ? 0 : -1;
+}
+
+// Answer ls from the cache when the listing is there, render and keep it otherwise
+void dircache_send_list(reply_t *reply, int dir_fd, const char *args)
+{
+    int compact;
+    struct stat st;
+    if (inotify_fd == -1 || full_listing(args, &compact) == -1 || fstat(dir_fd, &st) == -1)
+    {
+        send_list(reply, dir_fd, args);
+        return;
+    }
+
+    // Anything that changed before this command has been queued by now
+    dircache_handle_events();
+
+    for (dir_listing_t *listing = lru_head; listing; listing = listing->next)
+    {
+        if (listing->dev == st.st_dev && listing->ino == st.st_ino && listing->compact == compact)
+        {
+            METRIC_INC(dircache_hits);
+            LOG_DEBUG(CYAN "Listing served from cache (%zu bytes)\n" RESET, listing->len);
+            unlink_listing(listing);
+            push_front(listing);
+            reply_write(reply, listing->data, listing->len);
+            return;
+        }
+    }
+    METRIC_INC(dircache_misses);
+
+    // Watch before reading, so a change made while rendering still invalidates the result
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", dir_fd);
+    int wd = inotify_add_watch(inotify_fd, path, DIRCACHE_WATCH_MASK);
+
+    reply_t rendered = {.sock = -1, .buffered = 1, .data = NULL, .len = 0, .capacity = 0};
+    send_list(&rendered, dir_fd, args);
+    if (rendered.len > 0)
+        reply_write(reply, rendered.data, rendered.len);
+
+    dir_listing_t *listing = NULL;
+    int cacheable = wd != -1 && rendered.len > 0 && strncmp(rendered.data, "ERROR:", 6) != 0 &&
+                    rendered.len <= cache_budget / 4;
+    if (cacheable)
+        listing = malloc(sizeof(dir_listing_t));
+    if (!listing)
+    {
+        if (wd != -1 && !watch_in_use(wd))
+            inotify_rm_watch(inotify_fd, wd);
+        free(rendered.data);
+        return;
+    }
+
+    // Evict least recently used listings until the new one fits
+    while (lru_tail && (listing_count >= DIRCACHE_MAX_ENTRIES || cache_bytes + rendered.len > cache_budget))
+    {
+        drop_listing(lru_tail, lru_tail->wd != wd);
+    }
+
+    listing->dev = st.st_dev;
+    listing->ino = st.st_ino;
+    listing->compact = compact;
+    listing->wd = wd;
+    listing->data = rendered.data;
+    listing->len = rendered.len;
+    push_front(listing);
+    cache_bytes += rendered.len;
+    listing_count++;
+    METRIC_ADD(dircache_bytes, (long)rendered.len);
+}
@@ -0,0 +1,28 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include "commands.h"
+
+/**
+ * @file dircache.h
+ * @brief Per-worker cache of rendered `ls` replies, invalidated through inotify
+ *
+ * A full listing (`ls` or `ls --compact`) is rendered once into its wire format and
+ * kept under the directory's device and inode, so every session listing the same
+ * directory, whatever path it took to get there, shares one entry. Paged listings go
+ * straight to send_list().
+ *
+ * Each worker owns its cache and an inotify instance (dircache_attach()) whose fd it
+ * polls; a change to the entries of a cached directory drops its listings. The queue
+ * is also drained before every lookup, so a hit never predates a change that finished
+ * before the `ls` arrived. The cache holds at most the configured number of bytes and
+ * evicts the least recently used listing first.
+ */
+
+#define DIRCACHE_MAX_ENTRIES 256 // Listings per worker, whatever their size
+
+int dircache_attach(size_t max_bytes);
+void dircache_send_list(reply_t *reply, int dir_fd, const char *args);
+void dircache_handle_events(void);
+
+#endif
@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+#include "disk_writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#define DISK_WRITER_MAX_THREADS 64
+
+// Completed jobs of one event-loop thread, announced through its eventfd
+typedef struct disk_queue
+{
+    pthread_mutex_t lock;
+    disk_write_t *head;
+    disk_write_t *tail;
+    int event_fd;
+} disk_queue_t;
+
+// Jobs waiting for a writer thread, shared by all workers
+static pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t submit_ready = PTHREAD_COND_INITIALIZER;
+static disk_write_t *submit_head = NULL;
+static disk_write_t *submit_tail = NULL;
+static int writer_threads = 0;
+
+// Completion queue of the calling event-loop thread, NULL until it attaches
+static __thread disk_queue_t *completions = NULL;
+
+// Write the whole job, retrying short writes
+static void write_all(disk_write_t *job)
+{
+    size_t written = 0;
+    job->error = 0;
+    while (written < job->len)
+    {
+        ssize_t result = pwrite(job->fd, job->data + written, job->len - written, job->offset + written);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            job->error = errno;
+            return;
+        }
+        if (result == 0)
+        {
+            job->error = EIO;
+            return;
+        }
+        written += result;
+    }
+}
+
+// Write the job and record how long the disk took
+static void write_job(disk_write_t *job)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    write_all(job);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    job->duration_us = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+static void *writer_main(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        pthread_mutex_lock(&submit_lock);
+        while (!submit_head)
+        {
+            pthread_cond_wait(&submit_ready, &submit_lock);
+        }
+        disk_write_t *job = submit_head;
+        submit_head = job->next;
+        if (!submit_head)
+            submit_tail = NULL;
+        pthread_mutex_unlock(&submit_lock);
+
+        write_job(job);
+
+        // Hand the job back to the thread that submitted it
+        disk_queue_t *queue = job->queue;
+        job->next = NULL;
+        pthread_mutex_lock(&queue->lock);
+        if (queue->tail)
+            queue->tail->next = job;
+        else
+            queue->head = job;
+        queue->tail = job;
+        pthread_mutex_unlock(&queue->lock);
+
+        uint64_t one = 1;
+        if (write(queue->event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        {
+            perror("disk writer: eventfd");
+        }
+    }
+    return NULL;
+}
+
+// Start the writer threads; returns how many run, 0 means writes are synchronous
+int disk_writer_start(int threads)
+{
+    if (threads > DISK_WRITER_MAX_THREADS)
+        threads = DISK_WRITER_MAX_THREADS;
+
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, writer_main, NULL) != 0)
+        {
+            perror("disk writer: pthread_create");
+            break;
+        }
+        pthread_detach(thread);
+        writer_threads++;
+    }
+    return writer_threads;
+}
+
+int disk_writer_threads(void)
+{
+    return writer_threads;
+}
+
+// Give the calling thread a completion queue; returns the eventfd to poll, or -1 if
+// writes are synchronous and there is nothing to poll
+int disk_writer_attach(void)
+{
+    if (writer_threads == 0)
+        return -1;
+    if (completions)
+        return completions->event_fd;
+
+    disk_queue_t *queue = calloc(1, sizeof(disk_queue_t));
+    if (!queue)
+    {
+        perror("calloc");
+        return -1;
+    }
+    queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->event_fd == -1)
+    {
+        perror("eventfd");
+        free(queue);
+        return -1;
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    completions = queue;
+    return queue->event_fd;
+}
+
+// Queue a write; returns 0 if a writer thread took it, 1 if it was written inline
+int disk_writer_submit(disk_write_t *job)
+{
+    job->next = NULL;
+    if (!completions)
+    {
+        write_job(job);
+        return 1;
+    }
+
+    job->queue = completions;
+    pthread_mutex_lock(&submit_lock);
+    if (submit_tail)
+        submit_tail->next = job;
+    else
+        submit_head = job;
+    submit_tail = job;
+    pthread_cond_signal(&submit_ready);
+    pthread_mutex_unlock(&submit_lock);
+    return 0;
+}
+
+// Take the calling thread's completed jobs, linked through next
+disk_write_t *disk_writer_reap(void)
+{
+    if (!completions)
+        return NULL;
+
+    // Clear the eventfd before taking the list, so a job added in between re-arms it
+    uint64_t count;
+    if (read(completions->event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    {
+        perror("disk writer: eventfd");
+    }
+
+    pthread_mutex_lock(&completions->lock);
+    disk_write_t *done = completions->head;
+    completions->head = NULL;
+    completions->tail = NULL;
+    pthread_mutex_unlock(&completions->lock);
+    return done;
+}
@@ -0,0 +1,42 @@
+#ifndef DISK_WRITER_H
+#define DISK_WRITER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * @file disk_writer.h
+ * @brief Asynchronous pwrite() jobs for the epoll workers
+ *
+ * A small pool of writer threads runs pwrite() so an event loop never blocks on a
+ * slow disk. Each event-loop thread calls disk_writer_attach() once and polls the
+ * returned eventfd; when it becomes readable, disk_writer_reap() hands back the
+ * jobs that thread submitted and that have completed since the last call.
+ *
+ * With no writer threads (disk_writer_start(0), or if none could be created) the
+ * backend is synchronous: disk_writer_submit() writes inline and returns 1, so the
+ * caller completes the job right away. The caller owns the job and its data in both
+ * cases and must not touch the file range or free the buffer until it is completed.
+ */
+
+typedef struct disk_write
+{
+    int fd;          // File to write to, must stay open until the job completes
+    off_t offset;    // File offset of data[0]
+    char *data;      // Bytes to write
+    size_t len;      // Bytes in data
+    size_t capacity; // Allocated size of data, for the caller
+    void *context;   // Caller's, untouched by the writer
+    int error;       // errno of a failed write once completed, 0 on success
+    long duration_us; // Time the write took once completed
+    struct disk_queue *queue; // Completion queue of the submitting thread
+    struct disk_write *next;  // List link, also used by disk_writer_reap()
+} disk_write_t;
+
+int disk_writer_start(int threads);
+int disk_writer_threads(void);
+int disk_writer_attach(void);
+int disk_writer_submit(disk_write_t *job);
+disk_write_t *disk_writer_reap(void);
+
+#endif
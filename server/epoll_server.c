@@ -1,11 +1,27 @@
+#define _GNU_SOURCE
 #include "server.h"
+#include "epoll_server.h"
 #include "commands.h"
 #include "colors.h"
+#include "pool.h"
+#include "disk_writer.h"
+#include "logger.h"
+#include "health.h"
+#include "metrics.h"
+#include "dircache.h"
+#include "compress.h"
+#include "checksum.h"
+#include "tar.h"
+#include "file_map.h"
+#include "filecache.h"
+#include "ratelimit.h"
+#include "timer_wheel.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <time.h>
 #include <sys/stat.h>
@@ -13,11 +29,51 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <stdint.h>
-
-#define MAX_EVENTS 64
-#define MAX_CLIENTS 10
-#define CHUNK_SIZE 512
+#include <limits.h>
+#include <pthread.h>
+#include <endian.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <poll.h>
+
+#define DEFAULT_MAX_EVENTS 64 // Events taken per epoll_wait() unless --max-events says otherwise
+#define MAX_WORKERS 256
+#define DEFAULT_MAX_CLIENTS 1024
+#define CHUNK_SIZE 512                 // Default chunk size until the client says hello
+#define CHUNK_SIZE_MAX (4 * 1024 * 1024) // Largest chunk size a client may negotiate
 #define FILENAME_MAX_LEN 64
+#define DOWNLOAD_CHUNKS_PER_WAKEUP 64 // Fairness budget so one download can't starve other clients
+#define SENDFILE_BYTES_PER_WAKEUP (1024 * 1024)
+#define RECV_BYTES_PER_WAKEUP (1024 * 1024) // Input a session may drain before others get the loop
+#define STREAM_FRAME_MAX_LEN (1024 * 1024) // Stream downloads are cut into frames of this size
+#define STREAM_TRAILER_LEN 4                // A stream ends with one frame holding the CRC32C of its contents
+#define RX_BUFFER_SIZE (256 * 1024)        // Per-worker receive buffer
+#define DIRECT_RECV_MIN_CHUNK (64 * 1024)  // Upload chunks at least this large are received in place
+#define OUTPUT_KEEP_CAPACITY 1024          // Output queue memory kept by a session once drained
+#define MAX_WRITES_IN_FLIGHT 4             // Upload chunks a session may have queued for the disk
+#define COMPRESS_BYTES_PER_WAKEUP (1024 * 1024) // File bytes a compressed download may encode per wakeup
+#define DIRECT_IO_ALIGN 4096               // Offsets, lengths and buffers of O_DIRECT upload writes
+#define PART_SUFFIX ".part"                // Uploads are received as saved/<name>.part, renamed when complete
+
+// FileChunkHeader.type values
+#define CHUNK_TYPE_DATA 0   // [Header][Payload] chunk
+#define CHUNK_TYPE_STREAM 1 // Header + 64-bit byte length, then the raw file contents
+#define CHUNK_TYPE_LZ4 2    // [Header][Payload] chunk, payload is one LZ4 block of the chunk
+
+// Every message on the wire is a frame: [FrameHeader][length bytes of payload]
+#define FRAME_VERSION 2
+#define FRAME_COMMAND 1  // Client -> server: command text, no newline
+#define FRAME_RESPONSE 2 // Server -> client: the complete reply to one command
+#define FRAME_DATA 3     // Either direction: FileChunkHeader + chunk payload
+#define FRAME_STREAM 4   // Server -> client: raw file bytes of a stream download
+
+typedef struct
+{
+    uint8_t version; // FRAME_VERSION
+    uint8_t type;    // FRAME_COMMAND, FRAME_RESPONSE, FRAME_DATA or FRAME_STREAM
+    uint16_t flags;  // Reserved, 0
+    uint32_t length; // Payload length in network byte order
+} FrameHeader;
 
 // File transfer structures (matching client-side)
 typedef struct
@@ -26,43 +82,160 @@ typedef struct
     uint32_t chunk_size;
     uint32_t total_chunks;
     uint32_t type;
+    uint32_t checksum; // CRC32C of the transfer's file bytes up to and including this chunk
     char filename[FILENAME_MAX_LEN];
 } FileChunkHeader;
 
-// Client state structure
+// File transfer state, taken from the pool only while an upload or download is
+// active and returned when the session goes back to command mode (or, if upload
+// writes are still on their way to the disk, once the last of them completes)
 typedef struct
 {
-    int socket_fd;
-    char buffer[1024];
-    int buffer_len;
-    int state; // 0 = reading command, 1 = file transfer, etc.
-    char client_ip[INET_ADDRSTRLEN];
-    // File transfer specific fields
-    FILE *upload_file;
+    struct client_info *owner; // Session, NULL once it let go with writes in flight
+    unsigned long long started_us; // When the get or upload command arrived
+    uint32_t crc;                  // CRC32C of the file bytes transferred so far
+    // Upload specific fields
+    int upload_fd;               // saved/<name>.part, -1 until the first chunk arrives
+    int saved_fd;                // The saved/ directory it is in, where it is renamed
+    int upload_direct;           // upload_fd writes with O_DIRECT
+    int upload_padded;           // The O_DIRECT tail write went past upload_offset
     char upload_filename[256];
     int expected_chunks;
     int received_chunks;
-    // File transfer receive buffer state
-    char recv_buffer[sizeof(FileChunkHeader) + CHUNK_SIZE];
+    off_t upload_offset;         // File offset of the next chunk
+    off_t resume_offset;         // Where a resumed upload picked up, its crc covers the bytes from there
+    disk_write_t *upload_write;  // Payload of the chunk being received, written when complete
+    int writes_in_flight;        // Chunks handed to the disk writer and not yet reaped
+    int write_error;             // errno of the first failed write
+    // Upload receive buffer state
+    char recv_buffer[sizeof(FileChunkHeader)];
     int bytes_in_buffer;
     int header_complete;
     FileChunkHeader current_header;
     int payload_remaining;
+    // Download state, resumed on EPOLLOUT
+    FILE *download_file;
+    file_map_t download_map;   // Windows of download_file that chunks are cut from
+    int download_mapped;       // download_map is in use, 0 = chunks are read with fread()
+    tar_writer_t *download_archive; // Directory tree sent as a tar stream (get -t), in place of download_file
+    char download_filename[256];
+    int download_total_chunks; // Chunks in the whole file, sent in every header
+    int download_next_chunk;
+    int download_end_chunk;    // One past the last chunk of the requested range
+    int download_stream; // 1 = raw sendfile() stream, 0 = chunked
+    int download_compress;     // Chunks are offered to LZ4 (get -z)
+    int incompressible_chunks; // Consecutive chunks that did not shrink
+    off_t download_offset;
+    off_t download_size;
+    off_t stream_frame_remaining; // Stream frame bytes still to go out via sendfile()
+    int stream_trailer_sent;      // The CRC32C frame that ends the stream is in the send buffer
+    // One [Frame][Header][Payload] chunk of the negotiated size
+    char *transfer_buffer;
+    int transfer_buffer_size;
+    char *codec_buffer; // Chunk-sized scratch for LZ4, taken on first use
+    int send_len;
+    int send_offset;
+    const char *send_mapped; // The last send_mapped_len bytes of send_len come from here, not the buffer
+    int send_mapped_len;
+    // File cache: a hit is sent from its entry, a miss records what it sends
+    filecache_entry_t *cached;
+    size_t cached_offset;     // Bytes of the entry already queued
+    filecache_key_t cache_key;
+    char *recording;          // Copy of every byte sent, kept once the download completes
+    size_t recording_len;
+    size_t recording_capacity;
+} transfer_t;
+
+// Client state structure, kept small so idle connections stay cheap
+typedef struct client_info
+{
+    int socket_fd;
+    FrameHeader frame;        // Header of the frame being received (length in host order)
+    int frame_header_len;     // Header bytes received so far
+    uint32_t frame_remaining; // Payload bytes of the frame still to come
+    char buffer[1024];        // Payload of the command frame being received
+    int buffer_len;
+    char *pending_input;      // Input received behind a get, parsed when the download ends
+    int pending_len;
+    reply_t output;           // Framed replies not yet written to the socket
+    size_t output_sent;       // Bytes of output already written
+    uint32_t events;          // Epoll events the socket is registered for
+    int state; // 0 = reading command, 1 = file upload, 2 = file download
+    char client_ip[INET_ADDRSTRLEN];
+    char cwd[PATH_MAX]; // Per-session working directory, changed by cd (for pwd)
+    int dir_fd;         // Handle of cwd, all names are resolved against it
+    int chunk_size;     // Negotiated with hello
+    transfer_t *transfer; // Only set while state != 0
+    token_bucket_t bucket;     // Session download rate limit
+    ratelimit_ip_t *ip_limit;  // Bucket shared with the other sessions from client_ip, NULL = none
+    long long bytes_sent;      // Download bytes written, charged to the buckets
+    int throttled;             // Waiting on the rate limit timer with no epoll events
+    struct client_info *next_throttled;
+    int write_blocked;         // The last send found the socket buffer full
+    int ready;                 // Edge-triggered: stopped on a budget, resumed without an event
+    struct client_info *next_ready;
+    wheel_timer_t timer;               // Idle, command or transfer deadline
+    unsigned long long active_tick;    // Last tick the socket moved data
+    unsigned long long frame_tick;     // Tick the frame being received started arriving
+    int closing;                   // Closed, waiting for the end of the epoll batch to be pooled
+    struct client_info *next_free; // Link on the closed list, then on the free list
 } client_info_t;
 
-// Global client storage
-static client_info_t clients[MAX_CLIENTS];
+// Per-worker session pool: every event-loop thread owns its own sessions and epoll
+// instance, so the hot path never takes a lock. Sessions are found through
+// epoll_event.data.ptr, so a session's address must stay valid for as long as any
+// event carrying it can still be dispatched. Lifetime rule: remove_client() only
+// marks the session closing and puts it on closed_clients; every handler skips
+// closing sessions, and release_closed_clients() pools them once the batch of
+// events (and the ready list) has been processed. A slot is never reused, or
+// released twice, while the batch that may still name it is being handled.
+static __thread client_info_t *free_clients = NULL;
+static __thread client_info_t *closed_clients = NULL; // Closed during the current batch
+static char disk_events_marker; // data.ptr of the worker's disk completion eventfd
+static char health_timer_marker; // data.ptr of the health sampler's timerfd
+static char metrics_listener_marker; // data.ptr of the metrics HTTP listener
+static char dircache_events_marker; // data.ptr of the worker's listing cache inotify fd
+static char ratelimit_timer_marker; // data.ptr of the worker's rate limit timerfd
+static char wheel_timer_marker; // data.ptr of the worker's session timeout timerfd
+static int metrics_port = 0;          // HTTP port for metrics, 0 = none (--metrics-port)
+static size_t dir_cache_bytes = 0;    // Listing cache budget per worker, 0 = off (--dir-cache-mb)
+static size_t file_cache_bytes = 0;   // Download cache budget per worker, 0 = off (--file-cache-mb)
+static long long direct_upload_bytes = 0; // Uploads this large bypass the page cache, 0 = never (--direct-upload-mb)
+static __thread int server_epoll_fd = -1;
+static __thread int ratelimit_fd = -1;                  // Wakes throttled downloads, -1 = shaping off
+static __thread client_info_t *throttled_clients = NULL; // Downloads out of tokens
+static __thread client_info_t *ready_clients = NULL;     // Edge-triggered sessions with work left
+static int edge_triggered = 0;        // Client sockets use EPOLLET (--edge-triggered)
+static int max_events = DEFAULT_MAX_EVENTS; // epoll_wait() batch size (--max-events)
+// Session deadlines in timer wheel ticks, 0 = none
+static unsigned long long idle_timeout = 0;     // Command mode, nothing in flight (--idle-timeout)
+static unsigned long long command_timeout = 0;  // A command frame that started arriving (--command-timeout)
+static unsigned long long transfer_timeout = 0; // An upload or download without progress (--transfer-timeout)
+static __thread timer_wheel_t session_wheel;
+static __thread int wheel_fd = -1; // Drives session_wheel, -1 = no deadlines
+static __thread char rx_buffer[RX_BUFFER_SIZE]; // Input is parsed straight out of here
+
+// Connection cap shared by all workers
+static int max_clients = DEFAULT_MAX_CLIENTS;
 static int client_count = 0;
 
+// Process working directory at startup, the initial cwd of every session
+static char initial_cwd[PATH_MAX];
+static int initial_dir_fd = -1;
+
 // Function declarations
 int set_nonblocking(int socket_fd);
 client_info_t *add_client(int socket_fd, const char *client_ip);
-void remove_client(int socket_fd);
-client_info_t *find_client(int socket_fd);
+void remove_client(client_info_t *client);
 int handle_new_connection(int server_fd, int epoll_fd);
-int handle_client_data(int client_fd);
-int handle_file_transfer(int client_fd);
-void process_client_command(int sock, const char *command);
+int handle_client_data(client_info_t *client);
+int start_file_download(client_info_t *client, const char *filename, int stream, int compress, int first_chunk,
+                        int chunk_count);
+int start_archive_download(client_info_t *client, const char *dirname, int compress);
+int handle_file_download(client_info_t *client);
+int handle_client_output(client_info_t *client);
+void process_client_command(client_info_t *client, const char *command);
+int negotiate_chunk_size(client_info_t *client, const char *requested);
 
 // Function to set socket to non-blocking mode
 int set_nonblocking(int socket_fd)
@@ -83,103 +256,345 @@ int set_nonblocking(int socket_fd)
     return 0;
 }
 
-// Add client to our client array
+// Take a session from the worker's pool (or the heap) and initialize it
 client_info_t *add_client(int socket_fd, const char *client_ip)
 {
-    if (client_count >= MAX_CLIENTS)
+    if (__atomic_add_fetch(&client_count, 1, __ATOMIC_RELAXED) > max_clients)
+    {
+        __atomic_sub_fetch(&client_count, 1, __ATOMIC_RELAXED);
+        LOG_ERROR(RED "Maximum client limit reached\n" RESET);
+        return NULL;
+    }
+
+    // Every session gets its own handle, so a cd only ever moves that session
+    int dir_fd = dup(initial_dir_fd);
+    if (dir_fd == -1)
     {
-        printf(RED "Maximum client limit reached\n" RESET);
+        perror("dup");
+        __atomic_sub_fetch(&client_count, 1, __ATOMIC_RELAXED);
         return NULL;
     }
 
-    client_info_t *client = &clients[client_count++];
+    client_info_t *client = free_clients;
+    if (client)
+    {
+        free_clients = client->next_free;
+    }
+    else
+    {
+        client = malloc(sizeof(client_info_t));
+        if (!client)
+        {
+            perror("malloc");
+            close(dir_fd);
+            __atomic_sub_fetch(&client_count, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    }
+
+    client->next_free = NULL;
+    client->closing = 0;
     client->socket_fd = socket_fd;
     client->buffer_len = 0;
+    client->frame_header_len = 0;
+    client->frame_remaining = 0;
+    client->pending_input = NULL;
+    client->pending_len = 0;
+    client->output = (reply_t){.sock = socket_fd, .buffered = 1};
+    client->output_sent = 0;
+    client->events = EPOLLIN;
     client->state = 0;
+    METRIC_INC(sessions[0]);
     strncpy(client->client_ip, client_ip, INET_ADDRSTRLEN - 1);
     client->client_ip[INET_ADDRSTRLEN - 1] = '\0';
-    // Initialize file transfer fields
-    client->upload_file = NULL;
-    client->upload_filename[0] = '\0';
-    client->expected_chunks = 0;
-    client->received_chunks = 0;
-    // Initialize per-client transfer state
-    client->bytes_in_buffer = 0;
-    client->header_complete = 0;
-    client->payload_remaining = 0;
-    // Initialize file transfer receive state
-    client->bytes_in_buffer = 0;
-    client->header_complete = 0;
-    client->payload_remaining = 0;
-    memset(&client->current_header, 0, sizeof(FileChunkHeader));
+    strcpy(client->cwd, initial_cwd);
+    client->dir_fd = dir_fd;
+    client->chunk_size = CHUNK_SIZE;
+    client->transfer = NULL; // Allocated when a transfer starts
+    ratelimit_session_init(&client->bucket);
+    client->ip_limit = ratelimit_ip_acquire(client->client_ip);
+    client->bytes_sent = 0;
+    client->throttled = 0;
+    client->next_throttled = NULL;
+    client->write_blocked = 0;
+    client->ready = 0;
+    client->next_ready = NULL;
+    client->timer = (wheel_timer_t){.data = client};
+    client->active_tick = session_wheel.now;
 
     return client;
 }
 
-// Remove client from our client array
-void remove_client(int socket_fd)
+// Tick by which the session must have done something, 0 = no deadline in its state:
+// a transfer must make progress, a command that started arriving must complete and
+// an idle session must send a command
+static unsigned long long session_deadline(const client_info_t *client)
 {
-    for (int i = 0; i < client_count; i++)
+    if (client->state != 0)
+        return transfer_timeout ? client->active_tick + transfer_timeout : 0;
+    if (client->frame_header_len > 0 && command_timeout)
+        return client->frame_tick + command_timeout;
+    return idle_timeout ? client->active_tick + idle_timeout : 0;
+}
+
+// Put the session's deadline on the worker's wheel. Activity itself only stamps
+// active_tick; a deadline that comes due for a session that moved data meanwhile is
+// pushed out then, so the I/O paths never touch the wheel.
+static void arm_session_timer(client_info_t *client)
+{
+    unsigned long long deadline = session_deadline(client);
+    if (wheel_fd == -1 || deadline == 0)
     {
-        if (clients[i].socket_fd == socket_fd)
-        {
-            // Clean up any open file handles
-            if (clients[i].upload_file)
-            {
-                fclose(clients[i].upload_file);
-                clients[i].upload_file = NULL;
-            }
+        timer_wheel_remove(&client->timer);
+        return;
+    }
+    timer_wheel_add(&session_wheel, &client->timer, deadline);
+}
 
-            // Move last client to this position
-            if (i < client_count - 1)
-            {
-                clients[i] = clients[client_count - 1];
-            }
-            client_count--;
-            break;
-        }
+// Data moved on the session's socket
+static void session_active(client_info_t *client)
+{
+    client->active_tick = session_wheel.now;
+}
+
+// Switch a session between command (0), upload (1) and download (2) mode
+static void set_state(client_info_t *client, int state)
+{
+    METRIC_ADD(sessions[client->state], -1);
+    METRIC_INC(sessions[state]);
+    client->state = state;
+    session_active(client); // The new state's timeout counts from here
+    arm_session_timer(client);
+}
+
+// Take transfer state and a chunk buffer of the negotiated size from the pool
+static transfer_t *begin_transfer(client_info_t *client)
+{
+    if (client->transfer)
+    {
+        return client->transfer;
+    }
+
+    // The headers (92 bytes) fit the POOL_HEADROOM of a power-of-two chunk's pool class
+    int buffer_size = sizeof(FrameHeader) + sizeof(FileChunkHeader) + client->chunk_size;
+    transfer_t *transfer = pool_alloc(sizeof(transfer_t));
+    char *buffer = pool_alloc(buffer_size);
+    if (!transfer || !buffer)
+    {
+        perror("pool_alloc");
+        pool_free(transfer, sizeof(transfer_t));
+        pool_free(buffer, buffer_size);
+        return NULL;
     }
+
+    memset(transfer, 0, sizeof(transfer_t));
+    transfer->upload_fd = -1;
+    transfer->saved_fd = -1;
+    transfer->owner = client;
+    transfer->started_us = metrics_now_us();
+    transfer->transfer_buffer = buffer;
+    transfer->transfer_buffer_size = buffer_size;
+    client->transfer = transfer;
+    return transfer;
+}
+
+// Chunk size the transfer's buffers were sized for
+static int transfer_chunk_size(const transfer_t *transfer)
+{
+    return transfer->transfer_buffer_size - sizeof(FrameHeader) - sizeof(FileChunkHeader);
 }
 
-// Find client by socket fd
-client_info_t *find_client(int socket_fd)
+// Scratch space to compress a chunk into or decompress one out of
+static char *codec_buffer(transfer_t *transfer)
 {
-    for (int i = 0; i < client_count; i++)
+    if (!transfer->codec_buffer)
     {
-        if (clients[i].socket_fd == socket_fd)
-        {
-            return &clients[i];
-        }
+        transfer->codec_buffer = pool_alloc(transfer_chunk_size(transfer));
+        if (!transfer->codec_buffer)
+            perror("pool_alloc");
     }
-    return NULL;
+    return transfer->codec_buffer;
 }
 
-// Handle new client connection
-int handle_new_connection(int server_fd, int epoll_fd)
+// Give back a chunk queued for the disk writer (or never submitted) and its buffer
+static void free_upload_write(disk_write_t *job)
 {
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
+    pool_free(job->data, job->capacity);
+    pool_free(job, sizeof(disk_write_t));
+}
 
-    int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-    if (client_fd == -1)
+// Close any open transfer files and return the transfer state to the pool
+static void release_transfer(transfer_t *transfer)
+{
+    if (transfer->upload_write)
+    {
+        free_upload_write(transfer->upload_write);
+    }
+    if (transfer->upload_fd != -1)
     {
-        if (errno != EWOULDBLOCK && errno != EAGAIN)
+        // An unfinished upload stays behind as its .part for a resume, minus any direct write padding
+        struct stat st;
+        if (transfer->upload_padded && fstat(transfer->upload_fd, &st) == 0 && st.st_size > transfer->upload_offset &&
+            ftruncate(transfer->upload_fd, transfer->upload_offset) == -1)
         {
-            perror("accept");
+            perror("ftruncate");
         }
-        return -1;
+        close(transfer->upload_fd);
+    }
+    if (transfer->saved_fd != -1)
+    {
+        close(transfer->saved_fd);
+    }
+    if (transfer->download_mapped)
+    {
+        file_map_close(&transfer->download_map);
+    }
+    if (transfer->download_file)
+    {
+        fclose(transfer->download_file);
     }
+    tar_writer_close(transfer->download_archive);
+    filecache_release(transfer->cached);
+    free(transfer->recording);
+    pool_free(transfer->transfer_buffer, transfer->transfer_buffer_size);
+    pool_free(transfer->codec_buffer, transfer_chunk_size(transfer));
+    pool_free(transfer, sizeof(transfer_t));
+}
 
-    // Set client socket to non-blocking
-    if (set_nonblocking(client_fd) == -1)
+// Detach the transfer from its session; writes still in flight keep it (and the
+// upload file) alive until they are reaped
+static void end_transfer(client_info_t *client)
+{
+    transfer_t *transfer = client->transfer;
+    if (!transfer)
     {
-        close(client_fd);
-        return -1;
+        return;
+    }
+
+    client->transfer = NULL;
+    transfer->owner = NULL;
+    if (transfer->writes_in_flight == 0)
+    {
+        release_transfer(transfer);
+    }
+}
+
+// Take a session off the worker's list of throttled downloads
+static void unthrottle(client_info_t *client)
+{
+    client_info_t **link = &throttled_clients;
+    while (*link && *link != client)
+    {
+        link = &(*link)->next_throttled;
+    }
+    if (*link)
+    {
+        *link = client->next_throttled;
+    }
+    client->next_throttled = NULL;
+    client->throttled = 0;
+    METRIC_ADD(throttled_sessions, -1);
+}
+
+// Queue an edge-triggered session that stopped on a fairness budget: no new edge will
+// come for the data or buffer space it left, so the loop calls it again itself
+static void mark_ready(client_info_t *client)
+{
+    if (!client->ready)
+    {
+        client->ready = 1;
+        client->next_ready = ready_clients;
+        ready_clients = client;
+    }
+}
+
+static void unmark_ready(client_info_t *client)
+{
+    client_info_t **link = &ready_clients;
+    while (*link && *link != client)
+    {
+        link = &(*link)->next_ready;
+    }
+    if (*link)
+    {
+        *link = client->next_ready;
+    }
+    client->next_ready = NULL;
+    client->ready = 0;
+}
+
+// Release a session's resources; the slot itself goes back to the worker's pool only
+// after the current epoll batch (release_closed_clients()), a second call is a no-op
+void remove_client(client_info_t *client)
+{
+    if (client->closing)
+    {
+        return;
+    }
+    client->closing = 1;
+    if (client->throttled)
+    {
+        unthrottle(client);
+    }
+    if (client->ready)
+    {
+        unmark_ready(client);
+    }
+    timer_wheel_remove(&client->timer);
+    ratelimit_ip_release(client->ip_limit);
+    client->ip_limit = NULL;
+    end_transfer(client);
+    if (client->pending_input)
+    {
+        pool_free(client->pending_input, client->pending_len);
+        client->pending_input = NULL;
+    }
+    free(client->output.data);
+    client->output.data = NULL;
+    close(client->dir_fd);
+    METRIC_ADD(sessions[client->state], -1);
+
+    client->next_free = closed_clients;
+    closed_clients = client;
+    __atomic_sub_fetch(&client_count, 1, __ATOMIC_RELAXED);
+}
+
+// Pool the sessions closed during the batch that was just handled; nothing refers
+// to them any more
+static void release_closed_clients(void)
+{
+    while (closed_clients)
+    {
+        client_info_t *client = closed_clients;
+        closed_clients = client->next_free;
+        client->next_free = free_clients;
+        free_clients = client;
+    }
+}
+
+// Unregister, close and release a client connection, once
+static void disconnect_client(int epoll_fd, client_info_t *client)
+{
+    if (client->closing)
+    {
+        return;
     }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->socket_fd, NULL);
+    close(client->socket_fd);
+    remove_client(client);
+}
+
+// Set up one accepted, already non-blocking connection
+static int add_connection(int client_fd, const struct sockaddr_in *client_addr, int epoll_fd)
+{
+    // Replies and frames are queued whole before they are written, so Nagle only delays
+    // them: the tail of a small download would wait for the client's delayed ACK
+    int nodelay = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 
     // Get client IP
     char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+    inet_ntop(AF_INET, &client_addr->sin_addr, client_ip, INET_ADDRSTRLEN);
 
     // Add client to our tracking
     client_info_t *client = add_client(client_fd, client_ip);
@@ -189,470 +604,2009 @@ int handle_new_connection(int server_fd, int epoll_fd)
         return -1;
     }
 
-    // Add client socket to epoll
+    // Add client socket to epoll, level-triggered unless --edge-triggered
     struct epoll_event event;
-    event.events = EPOLLIN; // Level-triggered mode for reliable data handling
-    event.data.fd = client_fd;
+    event.events = EPOLLIN | (edge_triggered ? EPOLLET : 0);
+    event.data.ptr = client;
 
     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1)
     {
         perror("epoll_ctl: client");
-        remove_client(client_fd);
+        remove_client(client);
         close(client_fd);
         return -1;
     }
 
-    printf(GREEN "New client connected from %s (fd: %d)\n" RESET, client_ip, client_fd);
-    log_message("INFO", "New client connected");
+    arm_session_timer(client);
+    LOG_INFO(GREEN "New client connected from %s (fd: %d)\n" RESET, client_ip, client_fd);
 
     return 0;
 }
 
-// Handle client data - non-blocking version of handle_client
-int handle_client_data(int client_fd)
+// Listener readable: accept every pending connection, non-blocking from the start
+// Returns the number of connections added
+int handle_new_connection(int server_fd, int epoll_fd)
 {
-    client_info_t *client = find_client(client_fd);
-    if (!client)
+    int added = 0;
+    while (1)
     {
-        printf(RED "Client not found for fd %d\n" RESET, client_fd);
-        return -1;
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_fd = accept4(server_fd, (struct sockaddr *)&client_addr, &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EWOULDBLOCK && errno != EAGAIN)
+            {
+                perror("accept4");
+            }
+            return added;
+        }
+        if (add_connection(client_fd, &client_addr, epoll_fd) == 0)
+        {
+            added++;
+        }
     }
+}
 
-    // If client is in file transfer mode, handle binary data
-    if (client->state == 1)
+// Change the epoll events a client socket is registered for
+static int set_client_events(client_info_t *client, uint32_t events)
+{
+    if (client->events == events)
     {
-        return handle_file_transfer(client_fd);
+        return 0;
     }
 
-    // Normal command handling
-    char temp_buffer[1024];
-    ssize_t bytes_read = recv(client_fd, temp_buffer, sizeof(temp_buffer) - 1, 0);
+    // With EPOLLET the MOD also re-arms: data or space that is already there is reported
+    struct epoll_event event;
+    event.events = events | (edge_triggered ? EPOLLET : 0);
+    event.data.ptr = client;
 
-    if (bytes_read <= 0)
+    if (epoll_ctl(server_epoll_fd, EPOLL_CTL_MOD, client->socket_fd, &event) == -1)
     {
-        if (bytes_read == 0)
-        {
-            printf(YELLOW "Client %s disconnected (fd: %d)\n" RESET, client->client_ip, client_fd);
-            log_message("INFO", "Client disconnected");
-        }
-        else if (errno != EWOULDBLOCK && errno != EAGAIN)
-        {
-            perror("recv");
-            printf(RED "Error reading from client %s (fd: %d)\n" RESET, client->client_ip, client_fd);
-            log_message("ERROR", "Error reading from client");
-        }
+        perror("epoll_ctl: modify client");
         return -1;
     }
+    client->events = events;
+    return 0;
+}
 
-    temp_buffer[bytes_read] = '\0';
+// Open saved/<name>.part under the session's directory for the upload described by
+// current_header; complete_upload() renames it to saved/<name>, so nobody sees a partial file
+// under the real name. A resume_offset past 0 continues a partial upload: the .part must hold at
+// least that many bytes, anything after it (a torn last chunk) is cut off
+static int open_upload_file(client_info_t *client, off_t resume_offset, uint32_t total_chunks)
+{
+    transfer_t *transfer = client->transfer;
+    char name[FILENAME_MAX_LEN + sizeof(PART_SUFFIX)];
 
-    // Detect if this looks like binary file data instead of commands
-    if (bytes_read >= (int)sizeof(FileChunkHeader))
+    transfer->current_header.filename[FILENAME_MAX_LEN - 1] = '\0';
+    mkdirat(client->dir_fd, "saved", 0777);
+    transfer->saved_fd = openat(client->dir_fd, "saved", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (transfer->saved_fd == -1)
     {
-        // Check if this might be a file header by examining the first few bytes
-        FileChunkHeader *potential_header = (FileChunkHeader *)temp_buffer;
-        uint32_t chunk_size = ntohl(potential_header->chunk_size);
-        uint32_t total_chunks = ntohl(potential_header->total_chunks);
-
-        // Reasonable bounds check for file transfer header - prevent division by zero
-        if (chunk_size > 0 && chunk_size <= 8192 && total_chunks > 0 && total_chunks <= 2000000)
-        {
-            printf(CYAN "Detected file transfer data in command mode for client %s, switching to file mode\n" RESET, client->client_ip);
-            client->state = 1; // Switch to file transfer mode
-
-           // process the header data directly using temp_buffer
-            int processed = 0;
-            while (processed < bytes_read)
-            {
-                if (!client->header_complete)
-                {
-                    int header_needed = sizeof(FileChunkHeader) - client->bytes_in_buffer;
-                    int to_copy = (bytes_read - processed < header_needed) ? (bytes_read - processed) : header_needed;
-
-                    memcpy(client->recv_buffer + client->bytes_in_buffer, temp_buffer + processed, to_copy);
-                    client->bytes_in_buffer += to_copy;
-                    processed += to_copy;
-
-                    if (client->bytes_in_buffer >= (int)sizeof(FileChunkHeader))
-                    {
-                        memcpy(&client->current_header, client->recv_buffer, sizeof(FileChunkHeader));
-                        client->header_complete = 1;
-                        client->payload_remaining = ntohl(client->current_header.chunk_size);
-                        client->bytes_in_buffer = 0;
-
-                        // If first chunk, open file
-                        if (ntohl(client->current_header.chunk_id) == 0)
-                        {
-                            mkdir("saved", 0777);
-                            char full_path[512];
-                            snprintf(full_path, sizeof(full_path), "saved/%s", client->current_header.filename);
-                            client->upload_file = fopen(full_path, "wb");
-                            if (client->upload_file)
-                            {
-                                strncpy(client->upload_filename, client->current_header.filename, sizeof(client->upload_filename) - 1);
-                                client->expected_chunks = ntohl(client->current_header.total_chunks);
-                                client->received_chunks = 0;
-                                printf(BLUE "Starting upload of '%s' (%d chunks)\n" RESET,
-                                       client->current_header.filename, client->expected_chunks);
-                            }
-                        }
-                    }
-                }
-                else
-                {
-                    int to_copy = (bytes_read - processed < client->payload_remaining) ? (bytes_read - processed) : client->payload_remaining;
-                    if (client->upload_file)
-                    {
-                        fwrite(temp_buffer + processed, 1, to_copy, client->upload_file);
-                        fflush(client->upload_file);
-                    }
-                    processed += to_copy;
-                    client->payload_remaining -= to_copy;
-
-                    if (client->payload_remaining == 0)
-                    {
-                        client->received_chunks++;
-                        client->header_complete = 0;
-                        client->bytes_in_buffer = 0;
-                        printf("Received chunk %d/%d\n", client->received_chunks, client->expected_chunks);
-
-                        if (client->received_chunks >= client->expected_chunks)
-                        {
-                            // File transfer complete
-                            if (client->upload_file)
-                            {
-                                fclose(client->upload_file);
-                                client->upload_file = NULL;
-                            }
-                            printf(GREEN "File received successfully: %s\n" RESET, client->upload_filename);
-                            send(client_fd, "SUCCESS: File uploaded\n", 23, 0);
-
-                            // Reset client state
-                            client->state = 0;
-                            client->bytes_in_buffer = 0;
-                            client->header_complete = 0;
-                            client->payload_remaining = 0;
-                            client->expected_chunks = 0;
-                            client->received_chunks = 0;
-                            client->upload_filename[0] = '\0';
-                        }
-                    }
-                }
-            }
-            return 0;
-        }
+        return -1;
     }
-
-    // Append to client buffer
-    if (client->buffer_len + bytes_read < sizeof(client->buffer) - 1)
+    snprintf(name, sizeof(name), "%s" PART_SUFFIX, transfer->current_header.filename);
+
+    // Very large uploads go to the disk past the page cache, which downloads depend on;
+    // O_DIRECT needs block-aligned chunk offsets
+    off_t file_size = (off_t)total_chunks * client->chunk_size;
+    int direct = direct_upload_bytes > 0 && file_size >= direct_upload_bytes && client->chunk_size % DIRECT_IO_ALIGN == 0;
+    int flags = (resume_offset == 0 ? O_WRONLY | O_CREAT | O_TRUNC : O_RDWR) | O_CLOEXEC;
+    int fd = openat(transfer->saved_fd, name, flags | (direct ? O_DIRECT : 0), 0666);
+    if (fd == -1 && direct && errno == EINVAL)
     {
-        memcpy(client->buffer + client->buffer_len, temp_buffer, bytes_read);
-        client->buffer_len += bytes_read;
-        client->buffer[client->buffer_len] = '\0';
+        direct = 0; // No O_DIRECT on this filesystem (tmpfs)
+        fd = openat(transfer->saved_fd, name, flags, 0666);
     }
-    else
+    if (fd == -1)
     {
-        printf(YELLOW "Buffer overflow for client %s, disconnecting\n" RESET, client->client_ip);
-        log_message("WARNING", "Client buffer overflow - disconnecting client");
-
-        // Send error message to client before disconnecting
-        const char *error_msg = "ERROR: Buffer overflow - connection terminated\n";
-        send(client_fd, error_msg, strlen(error_msg), MSG_NOSIGNAL);
-
-        // Force the message to be sent immediately
-        fsync(client_fd);
-
-        // Give client a moment to receive the message before disconnecting
-        usleep(100000); // 100ms delay
+        return -1;
+    }
 
-        // Return -1 to signal that client should be disconnected
+    struct stat st;
+    if (resume_offset > 0 &&
+        (fstat(fd, &st) == -1 || st.st_size < resume_offset || ftruncate(fd, resume_offset) == -1))
+    {
+        close(fd);
         return -1;
     }
 
-    // Process complete commands (ending with newline)
-    char *newline_pos;
-    while ((newline_pos = strchr(client->buffer, '\n')) != NULL)
+    // total_chunks * chunk_size is known from the first header: reserve the blocks in one go
+    // instead of growing the file a chunk at a time. KEEP_SIZE leaves st_size at the bytes
+    // written, which is what a resume asks for. Best effort, the writes report a full disk.
+    if (file_size > resume_offset)
     {
-        *newline_pos = '\0';
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, resume_offset, file_size - resume_offset);
+    }
+    transfer->upload_direct = direct;
+    return fd;
+}
 
-        // Remove carriage return if present
-        int cmd_len = strlen(client->buffer);
-        if (cmd_len > 0 && client->buffer[cmd_len - 1] == '\r')
-        {
-            client->buffer[cmd_len - 1] = '\0';
-        }
+// Where an upload of name picks up again: the size of its .part, or of the finished
+// file if there is none, so a client can tell an upload that already completed (size -u)
+static void send_upload_size(reply_t *reply, int dir_fd, const char *name)
+{
+    char path[sizeof("saved/") + FILENAME_MAX_LEN + sizeof(PART_SUFFIX)];
+    struct stat st;
+    snprintf(path, sizeof(path), "saved/%s" PART_SUFFIX, name);
+    if (fstatat(dir_fd, path, &st, 0) == 0 && S_ISREG(st.st_mode))
+    {
+        char response[64];
+        snprintf(response, sizeof(response), "OK: size=%lld\n", (long long)st.st_size);
+        reply_write(reply, response, strlen(response));
+        return;
+    }
+    snprintf(path, sizeof(path), "saved/%s", name);
+    send_file_size(reply, dir_fd, path);
+}
 
-        printf(CYAN "Command from %s (fd: %d): '%s'\n" RESET, client->client_ip, client_fd, client->buffer);
+// Give a finished upload its real name: cut the .part to the bytes received (a direct
+// tail write is padded, and fallocate() may have reserved more) and rename it over
+// saved/<name>, so readers see either the old file or all of the new one
+static int publish_upload(transfer_t *transfer)
+{
+    char part[sizeof(transfer->upload_filename) + sizeof(PART_SUFFIX)];
+    snprintf(part, sizeof(part), "%s" PART_SUFFIX, transfer->upload_filename);
 
-        // Process the command (reuse existing command handling logic)
-        process_client_command(client_fd, client->buffer);
+    int result = ftruncate(transfer->upload_fd, transfer->upload_offset);
+    if (result == 0)
+    {
+        result = renameat(transfer->saved_fd, part, transfer->saved_fd, transfer->upload_filename);
+    }
+    int error = errno;
+    close(transfer->upload_fd);
+    transfer->upload_fd = -1;
+    errno = error;
+    return result;
+}
 
-        // Shift remaining data in buffer
-        int remaining = client->buffer_len - (newline_pos - client->buffer + 1);
-        if (remaining > 0)
-        {
-            memmove(client->buffer, newline_pos + 1, remaining);
-            client->buffer_len = remaining;
-            client->buffer[client->buffer_len] = '\0';
-        }
-        else
-        {
-            client->buffer_len = 0;
-            client->buffer[0] = '\0';
-        }
+// Fill in a frame header at the start of an outgoing buffer
+static void put_frame_header(char *out, uint8_t type, uint32_t length)
+{
+    FrameHeader header = {
+        .version = FRAME_VERSION,
+        .type = type,
+        .flags = 0,
+        .length = htonl(length)};
+    memcpy(out, &header, sizeof(header));
+}
+
+// Reset a drained output queue, giving back memory a large reply made it grow to
+static void output_drained(client_info_t *client)
+{
+    client->output.len = 0;
+    client->output_sent = 0;
+    if (client->output.capacity > OUTPUT_KEEP_CAPACITY)
+    {
+        free(client->output.data);
+        client->output.data = NULL;
+        client->output.capacity = 0;
     }
+}
 
-    return 0;
+// Append raw bytes to the session's output queue
+static int queue_output(client_info_t *client, const char *data, size_t len)
+{
+    return reply_write(&client->output, data, len);
 }
 
-// Process individual client command (extracted from handle_client)
-void process_client_command(int sock, const char *command)
+// Queue a complete reply to the client as one response frame
+static int send_response(client_info_t *client, const char *text)
+{
+    char header[sizeof(FrameHeader)];
+    size_t len = strlen(text);
+    put_frame_header(header, FRAME_RESPONSE, len);
+    if (queue_output(client, header, sizeof(header)) == -1)
+    {
+        return -1;
+    }
+    return queue_output(client, text, len);
+}
+
+// A send found the socket buffer full; only EPOLLOUT continues the session now
+static void send_would_block(client_info_t *client)
 {
-    log_message("INFO", "Processing command");
+    METRIC_INC(send_eagain);
+    client->write_blocked = 1;
+}
 
-    if (strncmp(command, "upload", 6) == 0)
+// Write as much of the output queue as the socket takes
+// Returns 1 when it is empty, 0 if the socket would block, -1 on error
+static int send_output(client_info_t *client)
+{
+    reply_t *output = &client->output;
+    while (client->output_sent < output->len)
     {
-        log_message("INFO", "Handling upload command");
-        // Switch client to file transfer mode
-        client_info_t *client = find_client(sock);
-        if (client)
+        ssize_t result = send(client->socket_fd, output->data + client->output_sent,
+                              output->len - client->output_sent, MSG_NOSIGNAL);
+        if (result < 0)
         {
-            client->state = 1; // Set to file transfer mode
-            printf(CYAN "Client %s switched to file transfer mode\n" RESET, client->client_ip);
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                send_would_block(client);
+                return 0;
+            }
+            if (errno == EINTR)
+                continue;
+            perror("send");
+            return -1;
         }
+        client->output_sent += result;
+        METRIC_ADD(bytes_out, result);
+        session_active(client);
     }
-    else if (strncmp(command, "get ", 4) == 0)
+    output_drained(client);
+    return 1;
+}
+
+// True while the session must not parse more frames: a download owns the socket, or
+// an upload has as many chunks queued for the disk as it may (or all of them, and
+// waits for the writes before it confirms)
+static int input_blocked(client_info_t *client)
+{
+    if (client->state == 2)
     {
-        log_message("INFO", "Handling get command");
-        send_file(sock, command + 4);
+        return 1;
     }
-    else if (strcmp(command, "ls") == 0)
+    if (client->state != 1)
     {
-        log_message("INFO", "Handling ls command");
-        send_list(sock);
+        return 0;
     }
-    else if (strcmp(command, "pwd") == 0)
+    transfer_t *transfer = client->transfer;
+    return transfer->writes_in_flight >= MAX_WRITES_IN_FLIGHT ||
+           (transfer->expected_chunks > 0 && transfer->received_chunks >= transfer->expected_chunks);
+}
+
+// Send the replies of a parsed batch; if the socket is full, stop reading until they are out
+static int flush_output(client_info_t *client)
+{
+    if (client->state == 2)
     {
-        log_message("INFO", "Handling pwd command");
-        send_pwd(sock);
+        // The download sender drains the queue ahead of its first chunk
+        return 0;
     }
-    else if (strncmp(command, "cd ", 3) == 0)
+
+    int result = send_output(client);
+    if (result == -1)
     {
-        log_message("INFO", "Handling cd command");
-        change_dir(sock, command + 3);
+        return -1;
     }
-    else if (strncmp(command, "delete ", 7) == 0)
+    if (result == 0)
     {
-        log_message("INFO", "Handling delete command");
-        delete_file(sock, command + 7);
+        return set_client_events(client, EPOLLOUT);
     }
-    else if (strncmp(command, "rename ", 7) == 0)
-    {
-        log_message("INFO", "Handling rename command");
-        char cmd_copy[128];
-        strncpy(cmd_copy, command, sizeof(cmd_copy) - 1);
-        cmd_copy[sizeof(cmd_copy) - 1] = '\0';
+    // Uploads waiting on the disk stop reading; the completion handler re-enables it
+    return set_client_events(client, input_blocked(client) ? 0 : EPOLLIN);
+}
 
-        char *old_name = strtok(cmd_copy + 7, " ");
-        char *new_name = strtok(NULL, " ");
-        if (old_name && new_name)
-        {
-            rename_file(sock, old_name, new_name);
-        }
-        else
-        {
-            log_message("ERROR", "Invalid rename command");
-            send(sock, "ERROR: Invalid rename command\n", 30, MSG_NOSIGNAL);
-        }
-    }
-    else if (strcmp(command, "health") == 0)
+
+// Account for a completed disk write and give back its buffer
+// Returns the session the write belongs to, or NULL if it went away meanwhile
+static client_info_t *finish_write(disk_write_t *job)
+{
+    transfer_t *transfer = job->context;
+    transfer->writes_in_flight--;
+    metrics_observe_disk_write(job->duration_us);
+    if (job->error && !transfer->write_error)
     {
-        log_message("INFO", "Handling health command");
-        send_health_info(sock);
+        transfer->write_error = job->error;
     }
-    else
+    free_upload_write(job);
+
+    client_info_t *owner = transfer->owner;
+    if (!owner && transfer->writes_in_flight == 0)
     {
-        log_message("WARNING", "Unknown command received");
-        printf(YELLOW "Unknown command: '%s'\n" RESET, command);
-        send(sock, "ERROR: Unknown command\n", 23, MSG_NOSIGNAL);
+        // The session ended the transfer with this write still queued
+        release_transfer(transfer);
     }
+    return owner;
 }
 
-// Handle file transfer data (binary chunks)
-int handle_file_transfer(int client_fd)
+// Report a failed upload write to the client; the caller disconnects it
+static void report_write_error(client_info_t *client)
 {
-    client_info_t *client = find_client(client_fd);
-    if (!client)
+    transfer_t *transfer = client->transfer;
+    LOG_ERROR(RED "Error writing 'saved/%s': %s\n" RESET, transfer->upload_filename, strerror(transfer->write_error));
+    send_response(client, "ERROR: Cannot write file\n");
+}
+
+// Confirm an upload once every chunk is received and on disk
+static int complete_upload(client_info_t *client)
+{
+    transfer_t *transfer = client->transfer;
+    uint32_t crc = transfer->crc;
+    off_t from = transfer->resume_offset;
+    if (publish_upload(transfer) == -1)
     {
+        transfer->write_error = errno;
+        report_write_error(client);
         return -1;
     }
+    LOG_INFO(GREEN "File received successfully: %s (crc32c %08x)\n" RESET, transfer->upload_filename, crc);
+    metrics_observe_command(METRIC_CMD_UPLOAD, metrics_now_us() - transfer->started_us);
+    set_state(client, 0);
+    end_transfer(client);
+    LOG_INFO(CYAN "Client %s switched back to command mode\n" RESET, client->client_ip);
+
+    // The digest of everything this upload carried lets the client check the file as a whole;
+    // a resumed upload carried only the bytes from its resume offset on, from= says so
+    char response[96];
+    if (from > 0)
+        snprintf(response, sizeof(response), "SUCCESS: File uploaded crc32c=%08x from=%lld\n", crc, (long long)from);
+    else
+        snprintf(response, sizeof(response), "SUCCESS: File uploaded crc32c=%08x\n", crc);
+    return send_response(client, response);
+}
+
+// Keep an O_DIRECT write within the alignment rules: the last chunk is padded with zeros
+// to the next block (publish_upload() cuts it back), any other unaligned chunk sends the
+// rest of the upload through the page cache
+static void align_direct_write(transfer_t *transfer, disk_write_t *job)
+{
+    size_t padded = (job->len + DIRECT_IO_ALIGN - 1) & ~(size_t)(DIRECT_IO_ALIGN - 1);
+    int last = transfer->received_chunks >= transfer->expected_chunks;
+    if (job->offset % DIRECT_IO_ALIGN == 0 && (padded == job->len || (last && padded <= job->capacity)))
+    {
+        METRIC_ADD(upload_uncached_bytes, (long)job->len);
+        memset(job->data + job->len, 0, padded - job->len);
+        transfer->upload_padded = padded != job->len;
+        job->len = padded;
+        return;
+    }
 
-    // Process only available data - removed blocking while(1) loop
-    char temp_buffer[2048];
-    ssize_t bytes_read = recv(client_fd, temp_buffer, sizeof(temp_buffer), 0);
+    // Writes already queued were aligned, they are fine either way
+    int flags = fcntl(job->fd, F_GETFL);
+    if (flags == -1 || fcntl(job->fd, F_SETFL, flags & ~O_DIRECT) == -1)
+    {
+        perror("fcntl O_DIRECT");
+    }
+    transfer->upload_direct = 0;
+}
 
-    if (bytes_read <= 0)
+// Finish an upload chunk once its data frame is complete: hand its payload to the
+// disk writer and confirm the upload once the last write is done
+static int finish_upload_chunk(client_info_t *client)
+{
+    transfer_t *transfer = client->transfer;
+    disk_write_t *job = transfer->upload_write;
+    transfer->upload_write = NULL;
+    transfer->received_chunks++;
+    transfer->header_complete = 0;
+    transfer->bytes_in_buffer = 0;
+    METRIC_INC(upload_chunks);
+
+    LOG_DEBUG("Received chunk %d/%d\n", transfer->received_chunks, transfer->expected_chunks);
+
+    if (ntohl(transfer->current_header.type) == CHUNK_TYPE_LZ4)
     {
-        if (bytes_read == 0)
+        // Decode into the scratch block and let the job own the plain data instead
+        char *plain = codec_buffer(transfer);
+        int plain_len = plain ? lz4_decompress_block(job->data, job->len, plain, transfer_chunk_size(transfer)) : -1;
+        int last = transfer->received_chunks >= transfer->expected_chunks;
+        if (plain_len <= 0 || (!last && (size_t)plain_len != job->capacity))
         {
-            printf(YELLOW "Client %s disconnected during file transfer\n" RESET, client->client_ip);
-            // Clean up file transfer
-            if (client->upload_file)
-            {
-                fclose(client->upload_file);
-                client->upload_file = NULL;
-            }
-            client->state = 0;
+            // Every chunk but the last must fill the chunk size, resume offsets rely on it
+            LOG_ERROR(RED "Invalid compressed chunk %d from client %s\n" RESET, transfer->received_chunks - 1,
+                      client->client_ip);
+            free_upload_write(job);
+            send_response(client, "ERROR: Invalid compressed chunk\n");
             return -1;
         }
-        else if (errno == EWOULDBLOCK || errno == EAGAIN)
-        {
+        transfer->codec_buffer = job->data;
+        job->data = plain;
+        METRIC_INC(compressed_chunks);
+        METRIC_ADD(compression_saved_bytes, plain_len - (long)job->len);
+        job->len = plain_len;
+    }
+
+    // Nothing reaches the file unverified, so a failed upload can be resumed from what is there
+    transfer->crc = crc32c(transfer->crc, job->data, job->len);
+    if (transfer->crc != ntohl(transfer->current_header.checksum))
+    {
+        LOG_ERROR(RED "Checksum mismatch in chunk %d from client %s\n" RESET, transfer->received_chunks - 1,
+                  client->client_ip);
+        METRIC_INC(checksum_failures);
+        free_upload_write(job);
+        send_response(client, "ERROR: Checksum mismatch\n");
+        return -1;
+    }
+
+    job->fd = transfer->upload_fd;
+    job->offset = transfer->upload_offset;
+    job->context = transfer;
+    transfer->upload_offset += job->len;
+    if (transfer->upload_direct)
+    {
+        align_direct_write(transfer, job);
+    }
+    transfer->writes_in_flight++;
+    if (disk_writer_submit(job))
+    {
+        finish_write(job);
+    }
+
+    if (transfer->write_error)
+    {
+        report_write_error(client);
+        return -1;
+    }
+    if (transfer->received_chunks >= transfer->expected_chunks && transfer->writes_in_flight == 0)
+    {
+        return complete_upload(client);
+    }
+    return 0;
+}
+
+// The buffer the current chunk's payload is collected in, written as a whole once complete
+static disk_write_t *upload_block(transfer_t *transfer)
+{
+    if (!transfer->upload_write)
+    {
+        disk_write_t *job = pool_alloc(sizeof(disk_write_t));
+        char *block = job ? pool_alloc(transfer_chunk_size(transfer)) : NULL;
+        if (!block)
+        {
+            pool_free(job, sizeof(disk_write_t));
+            perror("pool_alloc");
+            return NULL;
+        }
+        memset(job, 0, sizeof(disk_write_t));
+        job->data = block;
+        job->capacity = transfer_chunk_size(transfer);
+        transfer->upload_write = job;
+    }
+    return transfer->upload_write;
+}
+
+// Consume part of a data frame's payload: the FileChunkHeader, then file bytes
+static int handle_upload_payload(client_info_t *client, const char *data, int len)
+{
+    int client_fd = client->socket_fd;
+    transfer_t *transfer = client->transfer;
+    int processed = 0;
+
+    if (!transfer->header_complete)
+    {
+        // Still receiving header
+        int header_needed = sizeof(FileChunkHeader) - transfer->bytes_in_buffer;
+        int to_copy = (len < header_needed) ? len : header_needed;
+
+        memcpy(transfer->recv_buffer + transfer->bytes_in_buffer, data, to_copy);
+        transfer->bytes_in_buffer += to_copy;
+        processed += to_copy;
+
+        if (transfer->bytes_in_buffer < (int)sizeof(FileChunkHeader))
+        {
+            return 0;
+        }
+
+        // Header complete
+        memcpy(&transfer->current_header, transfer->recv_buffer, sizeof(FileChunkHeader));
+        transfer->header_complete = 1;
+        transfer->bytes_in_buffer = 0;
+
+        // Convert from network byte order
+        uint32_t chunk_id = ntohl(transfer->current_header.chunk_id);
+        uint32_t chunk_size = ntohl(transfer->current_header.chunk_size);
+        uint32_t total_chunks = ntohl(transfer->current_header.total_chunks);
+        uint32_t type = ntohl(transfer->current_header.type);
+
+        // The frame length already bounds the chunk, the header has to agree with it
+        if (chunk_size != client->frame.length - sizeof(FileChunkHeader) || total_chunks == 0 || total_chunks > 2000000 ||
+            (type != CHUNK_TYPE_DATA && type != CHUNK_TYPE_LZ4) ||
+            chunk_id >= total_chunks || (transfer->upload_fd != -1 && chunk_id != (uint32_t)transfer->received_chunks))
+        {
+            LOG_ERROR(RED "Invalid file transfer header: chunk_id=%u, chunk_size=%u, total_chunks=%u\n" RESET,
+                   chunk_id, chunk_size, total_chunks);
+            send_response(client, "ERROR: Invalid file transfer header\n");
+            return -1;
+        }
+
+        transfer->payload_remaining = chunk_size;
+
+        LOG_DEBUG("Header complete - chunk %d/%d, size %d\n", chunk_id + 1, total_chunks, chunk_size);
+
+        // The first chunk opens the file; one past chunk 0 resumes a partial upload
+        if (transfer->upload_fd == -1)
+        {
+            transfer->upload_fd = open_upload_file(client, (off_t)chunk_id * client->chunk_size, total_chunks);
+            if (transfer->upload_fd == -1)
+            {
+                LOG_ERROR(RED "Error: Cannot %s file 'saved/%s'\n" RESET, chunk_id ? "resume" : "create",
+                       transfer->current_header.filename);
+                send_response(client, chunk_id ? "ERROR: Cannot resume upload\n" : "ERROR: Cannot create file\n");
+                return -1;
+            }
+
+            strncpy(transfer->upload_filename, transfer->current_header.filename, sizeof(transfer->upload_filename) - 1);
+            transfer->expected_chunks = total_chunks;
+            transfer->received_chunks = chunk_id;
+            transfer->upload_offset = (off_t)chunk_id * client->chunk_size;
+            transfer->resume_offset = transfer->upload_offset;
+
+            LOG_INFO(BLUE "%s upload of '%s' (%d chunks) at chunk %u from fd %d\n" RESET, chunk_id ? "Resuming" : "Starting",
+                   transfer->current_header.filename, total_chunks, chunk_id, client_fd);
+        }
+    }
+
+    int to_write = len - processed;
+    if (to_write > 0)
+    {
+        disk_write_t *job = upload_block(transfer);
+        if (!job)
+        {
+            return -1;
+        }
+        memcpy(job->data + job->len, data + processed, to_write);
+        job->len += to_write;
+        transfer->payload_remaining -= to_write;
+    }
+    return 0;
+}
+
+// Validate a frame header as soon as it is complete
+static int begin_frame(client_info_t *client)
+{
+    client->frame.length = ntohl(client->frame.length);
+
+    if (client->frame.version != FRAME_VERSION)
+    {
+        LOG_ERROR(RED "Client %s speaks protocol version %u, expected %u\n" RESET,
+               client->client_ip, client->frame.version, FRAME_VERSION);
+        send_response(client, "ERROR: Unsupported protocol version\n");
+        return -1;
+    }
+
+    switch (client->frame.type)
+    {
+    case FRAME_COMMAND:
+        if (client->frame.length >= sizeof(client->buffer))
+        {
+            LOG_WARNING(YELLOW "Command too long from client %s, disconnecting\n" RESET, client->client_ip);
+            send_response(client, "ERROR: Buffer overflow - connection terminated\n");
+            return -1;
+        }
+        client->buffer_len = 0;
+        break;
+    case FRAME_DATA:
+        if (client->state != 1)
+        {
+            send_response(client, "ERROR: Unexpected file data\n");
+            return -1;
+        }
+        if (client->frame.length <= sizeof(FileChunkHeader) ||
+            client->frame.length > sizeof(FileChunkHeader) + (uint32_t)client->chunk_size)
+        {
+            LOG_ERROR(RED "Invalid data frame length %u from client %s\n" RESET, client->frame.length, client->client_ip);
+            send_response(client, "ERROR: Invalid file transfer header\n");
+            return -1;
+        }
+        client->transfer->header_complete = 0;
+        client->transfer->bytes_in_buffer = 0;
+        break;
+    default:
+        LOG_ERROR(RED "Unknown frame type %u from client %s\n" RESET, client->frame.type, client->client_ip);
+        send_response(client, "ERROR: Unknown frame type\n");
+        return -1;
+    }
+
+    client->frame_remaining = client->frame.length;
+    return 0;
+}
+
+// Act on a fully received frame
+static int end_frame(client_info_t *client)
+{
+    client->frame_header_len = 0;
+
+    if (client->frame.type == FRAME_COMMAND)
+    {
+        client->buffer[client->buffer_len] = '\0';
+        client->buffer_len = 0;
+        LOG_DEBUG(CYAN "Command from %s (fd: %d): '%s'\n" RESET, client->client_ip, client->socket_fd, client->buffer);
+        process_client_command(client, client->buffer);
+        return 0;
+    }
+    return finish_upload_chunk(client);
+}
+
+// Run received bytes through the frame parser
+// Returns the bytes consumed, which is less than len when a download took over the
+// socket mid-batch, or -1 if the client must be disconnected
+static int process_input(client_info_t *client, const char *data, int len)
+{
+    int processed = 0;
+    while (processed < len)
+    {
+        if (input_blocked(client))
+        {
+            // Frames after a get wait until its data frames are out, frames of an
+            // upload until the disk has caught up
+            break;
+        }
+
+        if (client->frame_header_len < (int)sizeof(FrameHeader))
+        {
+            if (client->frame_header_len == 0)
+                client->frame_tick = session_wheel.now;
+            int header_needed = sizeof(FrameHeader) - client->frame_header_len;
+            int to_copy = (len - processed < header_needed) ? (len - processed) : header_needed;
+            memcpy((char *)&client->frame + client->frame_header_len, data + processed, to_copy);
+            client->frame_header_len += to_copy;
+            processed += to_copy;
+
+            if (client->frame_header_len == (int)sizeof(FrameHeader))
+            {
+                if (begin_frame(client) == -1)
+                    return -1;
+                if (client->frame_remaining == 0 && end_frame(client) == -1)
+                    return -1;
+            }
+            continue;
+        }
+
+        int to_copy = (len - processed < (int)client->frame_remaining) ? (len - processed) : (int)client->frame_remaining;
+        if (client->frame.type == FRAME_COMMAND)
+        {
+            memcpy(client->buffer + client->buffer_len, data + processed, to_copy);
+            client->buffer_len += to_copy;
+        }
+        else if (handle_upload_payload(client, data + processed, to_copy) == -1)
+        {
+            return -1;
+        }
+        processed += to_copy;
+        client->frame_remaining -= to_copy;
+
+        if (client->frame_remaining == 0 && end_frame(client) == -1)
+        {
+            return -1;
+        }
+    }
+    return processed;
+}
+
+// Keep unparsed input until the session is back in command mode
+static int stash_input(client_info_t *client, const char *data, int len)
+{
+    char *pending = pool_alloc(len);
+    if (!pending)
+    {
+        perror("pool_alloc");
+        return -1;
+    }
+    memcpy(pending, data, len);
+    client->pending_input = pending;
+    client->pending_len = len;
+    return 0;
+}
+
+// Parse input that arrived while a download owned the socket or the disk was behind
+static int resume_input(client_info_t *client)
+{
+    char *pending = client->pending_input;
+    int len = client->pending_len;
+    client->pending_input = NULL;
+    client->pending_len = 0;
+
+    int result = process_input(client, pending, len);
+    if (result >= 0)
+    {
+        result = (result < len) ? stash_input(client, pending + result, len - result) : 0;
+    }
+    pool_free(pending, len);
+    return result;
+}
+
+// True while an upload of large chunks is receiving: the socket is then read so that
+// payload bytes land in their chunk buffer and only headers go through rx_buffer
+static int direct_upload(client_info_t *client)
+{
+    return client->state == 1 && client->chunk_size >= DIRECT_RECV_MIN_CHUNK && !client->pending_input &&
+           !input_blocked(client);
+}
+
+// Where the next read of a direct upload goes: the rest of the current payload into its
+// chunk buffer (iov[0], returned as the count), then rx_buffer up to the end of the
+// next chunk header, or further once no more chunks are expected
+static int direct_upload_iov(client_info_t *client, struct iovec *iov)
+{
+    transfer_t *transfer = client->transfer;
+    size_t header_bytes = sizeof(FrameHeader) + sizeof(FileChunkHeader);
+    size_t rx_len = sizeof(rx_buffer);
+    int count = 0;
+
+    if (client->frame_header_len < (int)sizeof(FrameHeader))
+    {
+        rx_len = header_bytes - client->frame_header_len;
+    }
+    else if (client->frame.type != FRAME_DATA || !transfer->header_complete)
+    {
+        rx_len = sizeof(FileChunkHeader) - transfer->bytes_in_buffer;
+    }
+    else
+    {
+        disk_write_t *job = upload_block(transfer);
+        if (!job)
+        {
+            return -1;
+        }
+        iov[count].iov_base = job->data + job->len;
+        iov[count++].iov_len = client->frame_remaining;
+        if (transfer->expected_chunks == 0 || transfer->received_chunks + 1 < transfer->expected_chunks)
+        {
+            rx_len = header_bytes;
+        }
+    }
+    iov[count].iov_base = rx_buffer;
+    iov[count++].iov_len = rx_len;
+    return count;
+}
+
+// Account for payload bytes readv() put straight into the chunk buffer
+static int direct_payload_landed(client_info_t *client, size_t len)
+{
+    disk_write_t *job = client->transfer->upload_write;
+    job->len += len;
+    client->transfer->payload_remaining -= len;
+    client->frame_remaining -= len;
+    METRIC_ADD(upload_direct_bytes, (long)len);
+    return client->frame_remaining == 0 ? end_frame(client) : 0;
+}
+
+// Read once from the client and dispatch what arrived frame by frame
+// Returns the bytes read, 0 if the socket had nothing, -1 if the client must go
+static ssize_t receive_input(client_info_t *client)
+{
+    int client_fd = client->socket_fd;
+
+    struct iovec iov[2] = {{.iov_base = rx_buffer, .iov_len = sizeof(rx_buffer)}};
+    int iov_count = direct_upload(client) ? direct_upload_iov(client, iov) : 1;
+    if (iov_count == -1)
+    {
+        return -1;
+    }
+    size_t direct_len = (iov_count == 2) ? iov[0].iov_len : 0;
+
+    ssize_t bytes_read = readv(client_fd, iov, iov_count);
+    METRIC_INC(recv_calls);
+    if (bytes_read <= 0)
+    {
+        if (bytes_read == 0)
+        {
+            if (client->state == 1)
+                LOG_WARNING(YELLOW "Client %s disconnected during file transfer\n" RESET, client->client_ip);
+            else
+                LOG_INFO(YELLOW "Client %s disconnected (fd: %d)\n" RESET, client->client_ip, client_fd);
+        }
+        else if (errno == EWOULDBLOCK || errno == EAGAIN)
+        {
             // No more data available right now, return to event loop
             return 0;
         }
-        else
+        else
+        {
+            perror("recv");
+            LOG_ERROR(RED "Error reading from client %s (fd: %d)\n" RESET, client->client_ip, client_fd);
+        }
+        return -1;
+    }
+
+    METRIC_ADD(bytes_in, bytes_read);
+    session_active(client);
+
+    // Payload read in place first, whatever followed it is in rx_buffer
+    size_t landed = ((size_t)bytes_read < direct_len) ? (size_t)bytes_read : direct_len;
+    int rx_len = (int)(bytes_read - landed);
+    int consumed = (landed > 0 && direct_payload_landed(client, landed) == -1) ? -1 : process_input(client, rx_buffer, rx_len);
+    if (consumed == -1)
+    {
+        // Let the error reply out if the socket takes it right away
+        send_output(client);
+        return -1;
+    }
+    if (consumed < rx_len && stash_input(client, rx_buffer + consumed, rx_len - consumed) == -1)
+    {
+        return -1;
+    }
+    return bytes_read;
+}
+
+// Read and dispatch input until the socket is drained, the session stops taking input
+// or it used up RECV_BYTES_PER_WAKEUP, so one fast uploader can't starve the others
+int handle_client_data(client_info_t *client)
+{
+    size_t received = 0;
+    while (!input_blocked(client) && !client->pending_input)
+    {
+        if (received >= RECV_BYTES_PER_WAKEUP)
+        {
+            if (edge_triggered)
+                mark_ready(client);
+            break;
+        }
+        ssize_t result = receive_input(client);
+        if (result == -1)
+        {
+            return -1;
+        }
+        if (result == 0)
+        {
+            break;
+        }
+        received += result;
+    }
+
+    // A command left half-received has its own, fixed deadline
+    if (client->state == 0 && client->frame_header_len > 0 && command_timeout &&
+        client->timer.expires != client->frame_tick + command_timeout)
+    {
+        arm_session_timer(client);
+    }
+
+    // One write for all replies of this batch
+    return flush_output(client);
+}
+
+// Socket writable: continue the pending download or drain queued replies
+int handle_client_output(client_info_t *client)
+{
+    if (client->state != 2)
+    {
+        return flush_output(client);
+    }
+
+    client->write_blocked = 0;
+    int result = handle_file_download(client);
+    // A download that stopped on its budget with the socket still writable gets no new
+    // edge; one that is throttled waits for the rate limit timer instead
+    if (result == 0 && edge_triggered && client->state == 2 && !client->write_blocked && !client->throttled)
+    {
+        mark_ready(client);
+    }
+    return result;
+}
+
+// Report session count and pooled buffer usage (stats)
+static void send_memory_stats(reply_t *reply)
+{
+    pool_stats_t stats;
+    pool_get_stats(&stats);
+
+    char response[512];
+    snprintf(response, sizeof(response),
+             "Sessions: %d/%d (%zu bytes each while idle)\n"
+             "Transfer pool in use: %ld blocks, %ld bytes\n"
+             "Transfer pool cached: %ld blocks, %ld bytes\n",
+             __atomic_load_n(&client_count, __ATOMIC_RELAXED), max_clients, sizeof(client_info_t),
+             stats.blocks_in_use, stats.bytes_in_use, stats.blocks_cached, stats.bytes_cached);
+    reply_write(reply, response, strlen(response));
+}
+
+// Which latency histogram a command counts towards
+static metric_command_t command_kind(const char *command)
+{
+    if (strncmp(command, "get ", 4) == 0)
+        return METRIC_CMD_GET;
+    if (strncmp(command, "upload", 6) == 0)
+        return METRIC_CMD_UPLOAD;
+    if (strcmp(command, "ls") == 0 || strncmp(command, "ls ", 3) == 0)
+        return METRIC_CMD_LS;
+    if (strncmp(command, "cd ", 3) == 0)
+        return METRIC_CMD_CD;
+    if (strncmp(command, "delete ", 7) == 0)
+        return METRIC_CMD_DELETE;
+    if (strncmp(command, "rename ", 7) == 0)
+        return METRIC_CMD_RENAME;
+    return METRIC_CMD_OTHER;
+}
+
+// Process individual client command (extracted from handle_client)
+void process_client_command(client_info_t *client, const char *command)
+{
+    unsigned long long started_us = metrics_now_us();
+    metric_command_t kind = command_kind(command);
+    METRIC_INC(commands[kind]);
+
+    // Everything the command writes is queued as a single response frame; the header
+    // is reserved up front and filled in once the reply length is known
+    reply_t *reply = &client->output;
+    size_t frame_start = reply->len;
+    char header[sizeof(FrameHeader)] = {0};
+    if (reply_write(reply, header, sizeof(header)) == -1)
+    {
+        return;
+    }
+
+    if (strncmp(command, "hello ", 6) == 0)
+    {
+        negotiate_chunk_size(client, command + 6);
+    }
+    else if (strncmp(command, "upload", 6) == 0)
+    {
+        // Switch client to file transfer mode
+        if (client->transfer)
+        {
+            reply_write(reply, "ERROR: Transfer already in progress\n", 36);
+        }
+        else if (!begin_transfer(client))
+        {
+            reply_write(reply, "ERROR: File transfer failed\n", 28);
+        }
+        else
+        {
+            set_state(client, 1); // Set to file transfer mode
+            LOG_INFO(CYAN "Client %s switched to file transfer mode\n" RESET, client->client_ip);
+        }
+    }
+    else if (strncmp(command, "get ", 4) == 0)
+    {
+        const char *filename = command + 4;
+        int stream = 0;
+        int compress = 0;
+        int first_chunk = 0;
+        int chunk_count = -1; // Whole file
+        int range_len = 0;
+        int archive = 0;
+        if (strncmp(filename, "-z ", 3) == 0)
+        {
+            // Client decodes LZ4 chunks; combines with -r and -t, a stream stays raw
+            compress = 1;
+            filename += 3;
+        }
+        if (strncmp(filename, "-t ", 3) == 0)
+        {
+            // Client unpacks a tar stream of the directory tree
+            archive = 1;
+            filename += 3;
+        }
+        else if (strncmp(filename, "-s ", 3) == 0)
+        {
+            // Client supports the raw sendfile() stream
+            stream = 1;
+            filename += 3;
+        }
+        else if (strncmp(filename, "-r ", 3) == 0)
+        {
+            // Ranged get: -r <first_chunk> <chunk_count> <filename>
+            if (sscanf(filename + 3, "%d %d %n", &first_chunk, &chunk_count, &range_len) != 2 ||
+                first_chunk < 0 || chunk_count <= 0)
+            {
+                first_chunk = -1;
+            }
+            filename += 3 + range_len;
+        }
+
+        if (first_chunk < 0)
+        {
+            reply_write(reply, "ERROR: Invalid range\n", 21);
+        }
+        else if (client->transfer)
+        {
+            reply_write(reply, "ERROR: Transfer already in progress\n", 36);
+        }
+        else if (archive)
+        {
+            start_archive_download(client, filename, compress);
+        }
+        else
+        {
+            start_file_download(client, filename, stream, compress, first_chunk, chunk_count);
+        }
+    }
+    else if (strncmp(command, "size -u ", 8) == 0)
+    {
+        send_upload_size(reply, client->dir_fd, command + 8);
+    }
+    else if (strncmp(command, "size ", 5) == 0)
+    {
+        send_file_size(reply, client->dir_fd, command + 5);
+    }
+    else if (strcmp(command, "ls") == 0 || strncmp(command, "ls ", 3) == 0)
+    {
+        dircache_send_list(reply, client->dir_fd, command + 2);
+    }
+    else if (strcmp(command, "pwd") == 0)
+    {
+        send_pwd(reply, client->cwd);
+    }
+    else if (strncmp(command, "cd ", 3) == 0)
+    {
+        change_dir(reply, &client->dir_fd, client->cwd, sizeof(client->cwd), command + 3);
+    }
+    else if (strncmp(command, "delete ", 7) == 0)
+    {
+        delete_file(reply, client->dir_fd, command + 7);
+    }
+    else if (strncmp(command, "rename ", 7) == 0)
+    {
+        char cmd_copy[128];
+        strncpy(cmd_copy, command, sizeof(cmd_copy) - 1);
+        cmd_copy[sizeof(cmd_copy) - 1] = '\0';
+
+        char *old_name = strtok(cmd_copy + 7, " ");
+        char *new_name = strtok(NULL, " ");
+        if (old_name && new_name)
+        {
+            rename_file(reply, client->dir_fd, old_name, new_name);
+        }
+        else
+        {
+            LOG_ERROR(RED "Invalid rename command from client %s\n" RESET, client->client_ip);
+            reply_write(reply, "ERROR: Invalid rename command\n", 30);
+        }
+    }
+    else if (strcmp(command, "health") == 0)
+    {
+        // Answered from the sampler's latest snapshot, never blocks the loop
+        health_snapshot_t snapshot;
+        health_get_snapshot(&snapshot);
+        send_health_snapshot(reply, &snapshot);
+    }
+    else if (strcmp(command, "stats") == 0)
+    {
+        send_memory_stats(reply);
+    }
+    else if (strcmp(command, "metrics") == 0)
+    {
+        metrics_format_prometheus(reply);
+    }
+    else if (strcmp(command, "metrics json") == 0)
+    {
+        metrics_format_json(reply);
+    }
+    else
+    {
+        LOG_WARNING(YELLOW "Unknown command: '%s'\n" RESET, command);
+        reply_write(reply, "ERROR: Unknown command\n", 23);
+    }
+
+    if (reply->len == frame_start + sizeof(FrameHeader))
+    {
+        // No reply, e.g. an upload or download has started
+        reply->len = frame_start;
+    }
+    else
+    {
+        put_frame_header(reply->data + frame_start, FRAME_RESPONSE, reply->len - frame_start - sizeof(FrameHeader));
+    }
+
+    // A get or upload that started a transfer is timed when the transfer completes
+    if (client->state == 0 || (kind != METRIC_CMD_GET && kind != METRIC_CMD_UPLOAD))
+    {
+        metrics_observe_command(kind, metrics_now_us() - started_us);
+    }
+}
+
+// Agree on a chunk size with the client (hello <bytes>)
+int negotiate_chunk_size(client_info_t *client, const char *requested)
+{
+    char *end;
+    long chunk_size = strtol(requested, &end, 10);
+    if (end == requested || *end != '\0' || chunk_size <= 0)
+    {
+        reply_write(&client->output, "ERROR: Invalid chunk size\n", 26);
+        return -1;
+    }
+
+    // Clamp to what we are willing to buffer per client
+    if (chunk_size < CHUNK_SIZE)
+        chunk_size = CHUNK_SIZE;
+    if (chunk_size > CHUNK_SIZE_MAX)
+        chunk_size = CHUNK_SIZE_MAX;
+
+    // Takes effect with the next transfer, whose buffer is sized from it
+    client->chunk_size = chunk_size;
+
+    char response[64];
+    // Advertise LZ4 chunks, which uploads may use from now on and get -z asks for
+    snprintf(response, sizeof(response), "OK: chunk_size=%ld compress=lz4\n", chunk_size);
+    reply_write(&client->output, response, strlen(response));
+    LOG_INFO(CYAN "Client %s negotiated chunk size %ld\n" RESET, client->client_ip, chunk_size);
+    return 0;
+}
+
+// Whether a file starts like a format that is compressed already, judged from its first bytes
+static int file_is_compressed(int fd)
+{
+    unsigned char head[16];
+    ssize_t len = pread(fd, head, sizeof(head), 0);
+    return len > 0 && compress_skip_data(head, len);
+}
+
+// File cache key of a whole-file download; -1 if the file can't be cached
+static int download_cache_key(client_info_t *client, const char *filename, const struct stat *st, int stream,
+                              int compress, filecache_key_t *key)
+{
+    if (!S_ISREG(st->st_mode))
+        return -1;
+    memset(key, 0, sizeof(*key));
+    key->dev = st->st_dev;
+    key->ino = st->st_ino;
+    key->size = st->st_size;
+    key->mtime = st->st_mtim;
+    key->chunk_size = client->chunk_size;
+    key->stream = stream;
+    key->compress = compress;
+    strncpy(key->name, filename, FILENAME_MAX_LEN - 1);
+    return 0;
+}
+
+// Send a download recorded earlier straight from the file cache
+static int start_cached_download(client_info_t *client, const char *filename, filecache_entry_t *entry, off_t fsize)
+{
+    if (!begin_transfer(client))
+    {
+        filecache_release(entry);
+        reply_write(&client->output, "ERROR: File transfer failed\n", 28);
+        return -1;
+    }
+    LOG_INFO(BLUE "Sending file: %s (cached)\n" RESET, filename);
+
+    client->transfer->cached = entry;
+    client->transfer->cached_offset = 0;
+    strncpy(client->transfer->download_filename, filename, sizeof(client->transfer->download_filename) - 1);
+    client->transfer->download_filename[sizeof(client->transfer->download_filename) - 1] = '\0';
+    client->transfer->download_size = fsize;
+
+    if (set_client_events(client, EPOLLOUT) == -1)
+    {
+        end_transfer(client);
+        return -1;
+    }
+    set_state(client, 2);
+    return 0;
+}
+
+// Append a copy of bytes about to be sent to the download's recording; a download
+// that turns out bigger than its recording was sized for is not cached
+static void record_bytes(transfer_t *transfer, const char *data, size_t len)
+{
+    if (!transfer->recording || len == 0)
+        return;
+    if (transfer->recording_len + len > transfer->recording_capacity)
+    {
+        free(transfer->recording);
+        transfer->recording = NULL;
+        return;
+    }
+    memcpy(transfer->recording + transfer->recording_len, data, len);
+    transfer->recording_len += len;
+}
+
+// Hand a complete recording to the file cache, unless the file changed while it was sent
+static void finish_recording(transfer_t *transfer)
+{
+    struct stat st;
+    const filecache_key_t *key = &transfer->cache_key;
+    if (fstat(fileno(transfer->download_file), &st) == 0 && st.st_size == key->size &&
+        st.st_mtim.tv_sec == key->mtime.tv_sec && st.st_mtim.tv_nsec == key->mtime.tv_nsec)
+    {
+        filecache_insert(key, transfer->recording, transfer->recording_len);
+    }
+    else
+    {
+        free(transfer->recording);
+    }
+    transfer->recording = NULL;
+}
+
+// Prepare a download and hand it over to the EPOLLOUT-driven sender
+// A chunk_count of -1 sends the whole file, otherwise chunks [first_chunk, first_chunk + chunk_count)
+int start_file_download(client_info_t *client, const char *filename, int stream, int compress, int first_chunk,
+                        int chunk_count)
+{
+    // A whole file that was sent the same way before goes out from the cache, unopened
+    int whole_file = chunk_count == -1;
+    filecache_key_t cache_key;
+    struct stat cache_st;
+    if (whole_file && filecache_enabled() && fstatat(client->dir_fd, filename, &cache_st, 0) == 0 &&
+        filecache_admits(cache_st.st_size) &&
+        download_cache_key(client, filename, &cache_st, stream, compress, &cache_key) == 0)
+    {
+        filecache_entry_t *entry = filecache_lookup(&cache_key);
+        if (entry)
+        {
+            return start_cached_download(client, filename, entry, cache_st.st_size);
+        }
+    }
+
+    int fd = openat(client->dir_fd, filename, O_RDONLY | O_CLOEXEC);
+    FILE *fp = fd == -1 ? NULL : fdopen(fd, "rb");
+    if (!fp)
+    {
+        if (fd != -1)
+            close(fd);
+        LOG_ERROR(RED "Error: Cannot open file '%s' for reading\n" RESET, filename);
+        reply_write(&client->output, "ERROR: File not found\n", 22);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) == -1)
+    {
+        perror("fstat");
+        fclose(fp);
+        reply_write(&client->output, "ERROR: File not found\n", 22);
+        return -1;
+    }
+
+    // sendfile() needs a regular file, fall back to chunks for anything else
+    if (stream && !S_ISREG(st.st_mode))
+    {
+        stream = 0;
+    }
+
+    off_t fsize = st.st_size;
+    int total_chunks = (fsize + client->chunk_size - 1) / client->chunk_size;
+
+    LOG_INFO(BLUE "Sending file: %s%s\n" RESET, filename, stream ? " (sendfile)" : compress ? " (lz4)" : "");
+    LOG_INFO(YELLOW "File size: %lld bytes, Total chunks: %d\n" RESET, (long long)fsize, total_chunks);
+
+    if (chunk_count != -1)
+    {
+        // Ranges are always sent as chunks, their ids tell the client where they go
+        if (first_chunk >= total_chunks || fseeko(fp, (off_t)first_chunk * client->chunk_size, SEEK_SET) == -1)
+        {
+            fclose(fp);
+            reply_write(&client->output, "ERROR: Invalid range\n", 21);
+            return -1;
+        }
+        if (chunk_count > total_chunks - first_chunk)
+        {
+            chunk_count = total_chunks - first_chunk;
+        }
+        stream = 0;
+        LOG_INFO(YELLOW "Sending chunks %d-%d\n" RESET, first_chunk, first_chunk + chunk_count - 1);
+    }
+    else
+    {
+        chunk_count = total_chunks;
+    }
+
+    if (!stream && total_chunks == 0)
+    {
+        // Nothing to stream, stay in command mode
+        fclose(fp);
+        return 0;
+    }
+
+    // For very large files, optimize TCP socket buffer sizes
+    if (total_chunks > 100000)
+    {
+        int send_buffer_size = 256 * 1024; // 256KB send buffer
+        if (setsockopt(client->socket_fd, SOL_SOCKET, SO_SNDBUF, &send_buffer_size, sizeof(send_buffer_size)) < 0)
+        {
+            LOG_WARNING(YELLOW "Warning: Could not set send buffer size\n" RESET);
+        }
+    }
+
+    if (!begin_transfer(client))
+    {
+        fclose(fp);
+        reply_write(&client->output, "ERROR: File transfer failed\n", 28);
+        return -1;
+    }
+
+    client->transfer->download_file = fp;
+    strncpy(client->transfer->download_filename, filename, sizeof(client->transfer->download_filename) - 1);
+    client->transfer->download_filename[sizeof(client->transfer->download_filename) - 1] = '\0';
+    client->transfer->download_total_chunks = total_chunks;
+    client->transfer->download_next_chunk = first_chunk;
+    client->transfer->download_end_chunk = first_chunk + chunk_count;
+    client->transfer->download_stream = stream;
+    client->transfer->download_compress = compress && !stream && !file_is_compressed(fileno(fp));
+    // Chunks of a regular file are cut straight from mmap() windows; a stream's checksum
+    // reads what sendfile() sent from them
+    client->transfer->download_mapped =
+        S_ISREG(st.st_mode) && file_map_open(&client->transfer->download_map, fileno(fp), fsize) == 0;
+    client->transfer->incompressible_chunks = 0;
+    client->transfer->crc = 0;
+    client->transfer->download_offset = 0;
+    client->transfer->download_size = fsize;
+    client->transfer->send_len = 0;
+    client->transfer->send_offset = 0;
+
+    // Record a cacheable miss as it is sent; the recording is sized for uncompressed chunks
+    size_t recording_size = stream ? sizeof(FrameHeader) + sizeof(FileChunkHeader) + sizeof(uint64_t) +
+                                         (fsize + STREAM_FRAME_MAX_LEN - 1) / STREAM_FRAME_MAX_LEN * sizeof(FrameHeader) + fsize +
+                                         sizeof(FrameHeader) + STREAM_TRAILER_LEN
+                                   : (size_t)total_chunks * (sizeof(FrameHeader) + sizeof(FileChunkHeader)) + fsize;
+    if (whole_file && filecache_admits(recording_size) &&
+        download_cache_key(client, filename, &st, stream, compress, &client->transfer->cache_key) == 0)
+    {
+        client->transfer->recording = malloc(recording_size);
+        client->transfer->recording_capacity = recording_size;
+        client->transfer->recording_len = 0;
+    }
+
+    if (stream)
+    {
+        // One data frame announcing the byte length, the contents follow in stream frames
+        FileChunkHeader header = {
+            .chunk_id = htonl(0),
+            .chunk_size = htonl(sizeof(uint64_t)),
+            .total_chunks = htonl(1),
+            .type = htonl(CHUNK_TYPE_STREAM)};
+        strncpy(header.filename, filename, FILENAME_MAX_LEN - 1);
+        header.filename[FILENAME_MAX_LEN - 1] = '\0';
+        uint64_t length = htobe64((uint64_t)fsize);
+
+        char *out = client->transfer->transfer_buffer;
+        put_frame_header(out, FRAME_DATA, sizeof(FileChunkHeader) + sizeof(length));
+        memcpy(out + sizeof(FrameHeader), &header, sizeof(FileChunkHeader));
+        memcpy(out + sizeof(FrameHeader) + sizeof(FileChunkHeader), &length, sizeof(length));
+        client->transfer->send_len = sizeof(FrameHeader) + sizeof(FileChunkHeader) + sizeof(length);
+        record_bytes(client->transfer, out, client->transfer->send_len);
+    }
+
+    // Stop reading commands until the download is done; data goes out on EPOLLOUT
+    if (set_client_events(client, EPOLLOUT) == -1)
+    {
+        end_transfer(client);
+        return -1;
+    }
+    set_state(client, 2);
+    return 0;
+}
+
+// Stream the tree below dirname as one tar archive cut into chunks (get -t); the tree
+// is walked here, so the archive's size and chunk count are known up front
+int start_archive_download(client_info_t *client, const char *dirname, int compress)
+{
+    long long archive_size;
+    tar_writer_t *archive = tar_writer_open(client->dir_fd, dirname, &archive_size);
+    if (!archive)
+    {
+        LOG_ERROR(RED "Error: Cannot read directory '%s': %s\n" RESET, dirname, strerror(errno));
+        reply_write(&client->output, "ERROR: Directory not found\n", 27);
+        return -1;
+    }
+
+    long long total_chunks = (archive_size + client->chunk_size - 1) / client->chunk_size;
+    if (total_chunks > INT_MAX)
+    {
+        tar_writer_close(archive);
+        reply_write(&client->output, "ERROR: Directory too large\n", 27);
+        return -1;
+    }
+
+    LOG_INFO(BLUE "Sending directory: %s (tar%s)\n" RESET, dirname, compress ? ", lz4" : "");
+    LOG_INFO(YELLOW "Files: %ld, Archive size: %lld bytes, Total chunks: %lld\n" RESET, tar_writer_files(archive),
+             archive_size, total_chunks);
+
+    if (!begin_transfer(client))
+    {
+        tar_writer_close(archive);
+        reply_write(&client->output, "ERROR: File transfer failed\n", 28);
+        return -1;
+    }
+
+    client->transfer->download_archive = archive;
+    strncpy(client->transfer->download_filename, dirname, sizeof(client->transfer->download_filename) - 1);
+    client->transfer->download_filename[sizeof(client->transfer->download_filename) - 1] = '\0';
+    client->transfer->download_total_chunks = (int)total_chunks;
+    client->transfer->download_next_chunk = 0;
+    client->transfer->download_end_chunk = (int)total_chunks;
+    client->transfer->download_stream = 0;
+    client->transfer->download_compress = compress;
+    client->transfer->incompressible_chunks = 0;
+    client->transfer->crc = 0;
+    client->transfer->download_offset = 0;
+    client->transfer->download_size = archive_size;
+    client->transfer->send_len = 0;
+    client->transfer->send_offset = 0;
+
+    if (set_client_events(client, EPOLLOUT) == -1)
+    {
+        end_transfer(client);
+        return -1;
+    }
+    set_state(client, 2);
+    return 0;
+}
+
+// Send queued replies followed by whatever is left of the current chunk (send buffer,
+// then its mapped payload), gathered into one sendmsg() (writev() with MSG_NOSIGNAL)
+// per attempt
+// Returns 1 when both are drained, 0 if the socket would block, -1 on error
+static int flush_send_buffer(client_info_t *client)
+{
+    transfer_t *transfer = client->transfer;
+    reply_t *output = &client->output;
+
+    while (client->output_sent < output->len || transfer->send_offset < transfer->send_len)
+    {
+        size_t output_left = output->len - client->output_sent;
+        struct iovec iov[3];
+        int iov_count = 0;
+        if (output_left > 0)
+        {
+            iov[iov_count].iov_base = output->data + client->output_sent;
+            iov[iov_count++].iov_len = output_left;
+        }
+        int buffered_len = transfer->send_len - transfer->send_mapped_len;
+        if (transfer->send_offset < buffered_len)
+        {
+            iov[iov_count].iov_base = transfer->transfer_buffer + transfer->send_offset;
+            iov[iov_count++].iov_len = buffered_len - transfer->send_offset;
+        }
+        if (transfer->send_mapped_len > 0)
+        {
+            int mapped_sent = transfer->send_offset > buffered_len ? transfer->send_offset - buffered_len : 0;
+            iov[iov_count].iov_base = (char *)transfer->send_mapped + mapped_sent;
+            iov[iov_count++].iov_len = transfer->send_mapped_len - mapped_sent;
+        }
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iov_count};
+
+        ssize_t result = sendmsg(client->socket_fd, &msg, MSG_NOSIGNAL);
+        if (result < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Socket buffer full, wait for the next EPOLLOUT
+                send_would_block(client);
+                return 0;
+            }
+            if (errno == EPIPE || errno == ECONNRESET)
+            {
+                LOG_ERROR(RED "Error: Connection lost while sending '%s' (client disconnected)\n" RESET,
+                       transfer->download_filename);
+            }
+            else
+            {
+                LOG_ERROR(RED "Error: Failed to send '%s': %s\n" RESET, transfer->download_filename, strerror(errno));
+            }
+            return -1;
+        }
+
+        METRIC_ADD(bytes_out, result);
+        client->bytes_sent += result;
+        session_active(client);
+
+        // Replies go first, the rest belongs to the chunk
+        size_t from_output = (size_t)result < output_left ? (size_t)result : output_left;
+        client->output_sent += from_output;
+        transfer->send_offset += result - from_output;
+        if (output_left > 0 && client->output_sent == output->len)
+        {
+            output_drained(client);
+        }
+    }
+    return 1;
+}
+
+// Checksum and (if asked) compress one chunk's file bytes, run under file_map_guard()
+// when they are a slice of the mapping
+typedef struct
+{
+    transfer_t *transfer;
+    const char *data; // The chunk's file bytes
+    int len;
+    char *payload;    // Where the chunk's payload goes in the send buffer
+    int payload_len;  // Set to the LZ4 block's length if it was kept
+    uint32_t type;
+} chunk_encoding_t;
+
+static void encode_chunk(void *arg)
+{
+    chunk_encoding_t *chunk = arg;
+    transfer_t *transfer = chunk->transfer;
+
+    // The checksum covers the file bytes, sent as they are or compressed
+    transfer->crc = crc32c(transfer->crc, chunk->data, chunk->len);
+    if (!transfer->download_compress)
+        return;
+
+    // Keep the LZ4 block only if it saves enough; data that keeps not shrinking goes raw.
+    // A mapped slice compresses straight into the send buffer.
+    char *packed = chunk->data == chunk->payload ? codec_buffer(transfer) : chunk->payload;
+    int packed_len = packed ? lz4_compress_block(chunk->data, chunk->len, packed,
+                                                 chunk->len - chunk->len / COMPRESS_MIN_SAVING) : 0;
+    if (packed_len > 0)
+    {
+        if (packed != chunk->payload)
+            memcpy(chunk->payload, packed, packed_len);
+        METRIC_INC(compressed_chunks);
+        METRIC_ADD(compression_saved_bytes, chunk->len - packed_len);
+        chunk->payload_len = packed_len;
+        chunk->type = CHUNK_TYPE_LZ4;
+        transfer->incompressible_chunks = 0;
+    }
+    else if (++transfer->incompressible_chunks >= COMPRESS_GIVE_UP)
+    {
+        LOG_DEBUG("'%s' does not compress, sending the rest raw\n", transfer->download_filename);
+        transfer->download_compress = 0;
+    }
+}
+
+// Copy a raw chunk's mapped bytes into the download's recording, run under file_map_guard()
+static void record_chunk(void *arg)
+{
+    chunk_encoding_t *chunk = arg;
+    record_bytes(chunk->transfer, chunk->data, chunk->len);
+}
+
+// Fill the send buffer with the next [Frame][Header][Payload] chunk; a raw chunk of a
+// mapped file leaves its payload in the mapping, flush_send_buffer() sends it from there
+static int prepare_next_chunk(client_info_t *client)
+{
+    transfer_t *transfer = client->transfer;
+    char *out = transfer->transfer_buffer;
+    chunk_encoding_t chunk = {.transfer = transfer, .payload = out + sizeof(FrameHeader) + sizeof(FileChunkHeader),
+                              .type = CHUNK_TYPE_DATA};
+    chunk.data = chunk.payload;
+    if (transfer->download_mapped)
+    {
+        off_t offset = (off_t)transfer->download_next_chunk * client->chunk_size;
+        off_t left = transfer->download_size - offset;
+        chunk.len = left < client->chunk_size ? (int)left : client->chunk_size;
+        chunk.data = chunk.len > 0 ? file_map_slice(&transfer->download_map, offset, chunk.len) : NULL;
+        if (!chunk.data)
+            chunk.len = -1;
+    }
+    else if (transfer->download_archive)
+    {
+        chunk.len = (int)tar_writer_read(transfer->download_archive, chunk.payload, client->chunk_size);
+    }
+    else
+    {
+        chunk.len = (int)fread(chunk.payload, 1, client->chunk_size, transfer->download_file);
+    }
+    if (chunk.len <= 0)
+    {
+        LOG_ERROR(RED "Error: Failed to read chunk %d of '%s'\n" RESET,
+               transfer->download_next_chunk, transfer->download_filename);
+        return -1;
+    }
+    chunk.payload_len = chunk.len;
+
+    if (!transfer->download_mapped)
+    {
+        encode_chunk(&chunk);
+    }
+    else if (file_map_guard(encode_chunk, &chunk) == -1)
+    {
+        LOG_ERROR(RED "Error: '%s' was truncated during download\n" RESET, transfer->download_filename);
+        return -1;
+    }
+
+    FileChunkHeader header = {
+        .chunk_id = htonl(transfer->download_next_chunk),
+        .chunk_size = htonl(chunk.payload_len),
+        .total_chunks = htonl(transfer->download_total_chunks),
+        .type = htonl(chunk.type),
+        .checksum = htonl(transfer->crc)};
+    strncpy(header.filename, transfer->download_filename, FILENAME_MAX_LEN - 1);
+    header.filename[FILENAME_MAX_LEN - 1] = '\0';
+    put_frame_header(out, FRAME_DATA, sizeof(FileChunkHeader) + chunk.payload_len);
+    memcpy(out + sizeof(FrameHeader), &header, sizeof(FileChunkHeader));
+
+    transfer->send_len = sizeof(FrameHeader) + sizeof(FileChunkHeader) + chunk.payload_len;
+    transfer->send_offset = 0;
+    transfer->send_mapped = NULL;
+    transfer->send_mapped_len = 0;
+    if (chunk.type == CHUNK_TYPE_DATA && chunk.data != chunk.payload)
+    {
+        transfer->send_mapped = chunk.data;
+        transfer->send_mapped_len = chunk.len;
+    }
+    record_bytes(transfer, out, transfer->send_len - transfer->send_mapped_len);
+    if (transfer->recording && transfer->send_mapped_len > 0)
+    {
+        // The payload is still a slice of the mapping: copy it under the guard as well, a
+        // truncated file drops the recording and fails the send instead of the process
+        chunk.data = transfer->send_mapped;
+        if (file_map_guard(record_chunk, &chunk) == -1)
+        {
+            free(transfer->recording);
+            transfer->recording = NULL;
+        }
+    }
+    transfer->download_next_chunk++;
+    return 0;
+}
+
+// Next stream frame of a download that is being recorded for the file cache: read it
+// into the recording with pread() and send it from there instead of with sendfile()
+// Returns 1 when the frame is sent, 0 to finish it on the next EPOLLOUT, -1 on error
+static int send_recorded_frame(client_info_t *client)
+{
+    transfer_t *transfer = client->transfer;
+    off_t remaining = transfer->download_size - transfer->download_offset;
+    off_t frame_len = remaining < STREAM_FRAME_MAX_LEN ? remaining : STREAM_FRAME_MAX_LEN;
+    size_t total = sizeof(FrameHeader) + frame_len;
+    if (transfer->recording_len + total > transfer->recording_capacity)
+    {
+        // Longer than it was sized for: stop recording, sendfile() takes over
+        free(transfer->recording);
+        transfer->recording = NULL;
+        return 1;
+    }
+
+    char *frame = transfer->recording + transfer->recording_len;
+    put_frame_header(frame, FRAME_STREAM, (uint32_t)frame_len);
+    for (off_t done = 0; done < frame_len;)
+    {
+        ssize_t got = pread(fileno(transfer->download_file), frame + sizeof(FrameHeader) + done, frame_len - done,
+                            transfer->download_offset + done);
+        if (got <= 0)
+        {
+            LOG_ERROR(RED "Error: '%s' shrank during download\n" RESET, transfer->download_filename);
+            return -1;
+        }
+        done += got;
+    }
+    transfer->crc = crc32c(transfer->crc, frame + sizeof(FrameHeader), frame_len);
+    transfer->recording_len += total;
+    transfer->download_offset += frame_len;
+
+    transfer->send_mapped = frame;
+    transfer->send_mapped_len = (int)total;
+    transfer->send_len = (int)total;
+    transfer->send_offset = 0;
+    return flush_send_buffer(client);
+}
+
+// Add len bytes at offset, just handed to sendfile(), to the stream's checksum; they are
+// read from the mapping, so the page cache is not copied. Returns -1 if they are gone
+static int checksum_sent_bytes(transfer_t *transfer, off_t offset, size_t len)
+{
+    chunk_encoding_t chunk = {.transfer = transfer, .len = (int)len};
+    chunk.data = transfer->download_mapped ? file_map_slice(&transfer->download_map, offset, len) : NULL;
+    if (!chunk.data || file_map_guard(encode_chunk, &chunk) == -1)
+    {
+        LOG_ERROR(RED "Error: '%s' was truncated during download\n" RESET, transfer->download_filename);
+        return -1;
+    }
+    return 0;
+}
+
+// Push raw file bytes from the page cache straight into the socket, one stream frame
+// at a time; the frame header goes through the send buffer, the contents via sendfile()
+// The last frame holds the CRC32C of the contents. At most budget file bytes go out per call
+// Returns 1 when the whole file is sent, 0 to continue on the next EPOLLOUT, -1 on error
+static int sendfile_download(client_info_t *client, size_t budget)
+{
+    size_t sent_this_wakeup = 0;
+
+    while (client->transfer->download_offset < client->transfer->download_size)
+    {
+        if (sent_this_wakeup >= budget)
+        {
+            return 0;
+        }
+
+        if (client->transfer->recording)
         {
-            perror("recv during file transfer");
-            // Clean up file transfer on actual error
-            if (client->upload_file)
+            off_t before = client->transfer->download_offset;
+            int result = send_recorded_frame(client);
+            if (result <= 0)
             {
-                fclose(client->upload_file);
-                client->upload_file = NULL;
+                return result;
             }
-            client->state = 0;
-            return -1;
+            sent_this_wakeup += client->transfer->download_offset - before;
+            continue;
         }
-    }
-
-    printf("DEBUG: Received %zd bytes in file transfer mode\n", bytes_read);
 
-    // Process the received data
-    int processed = 0;
-    while (processed < bytes_read)
-    {
-        if (!client->header_complete)
+        if (client->transfer->stream_frame_remaining == 0)
         {
-            // Still receiving header
-            int header_needed = sizeof(FileChunkHeader) - client->bytes_in_buffer;
-            int to_copy = (bytes_read - processed < header_needed) ? (bytes_read - processed) : header_needed;
-
-            memcpy(client->recv_buffer + client->bytes_in_buffer, temp_buffer + processed, to_copy);
-            client->bytes_in_buffer += to_copy;
-            processed += to_copy;
-
-            if (client->bytes_in_buffer >= (int)sizeof(FileChunkHeader))
+            off_t remaining = client->transfer->download_size - client->transfer->download_offset;
+            off_t frame_len = remaining < STREAM_FRAME_MAX_LEN ? remaining : STREAM_FRAME_MAX_LEN;
+            put_frame_header(client->transfer->transfer_buffer, FRAME_STREAM, (uint32_t)frame_len);
+            client->transfer->send_mapped = NULL;
+            client->transfer->send_mapped_len = 0;
+            client->transfer->send_len = sizeof(FrameHeader);
+            client->transfer->send_offset = 0;
+            client->transfer->stream_frame_remaining = frame_len;
+
+            int result = flush_send_buffer(client);
+            if (result <= 0)
             {
-                // Header complete
-                memcpy(&client->current_header, client->recv_buffer, sizeof(FileChunkHeader));
-                client->header_complete = 1;
+                return result;
+            }
+        }
 
-                // Convert from network byte order
-                uint32_t chunk_id = ntohl(client->current_header.chunk_id);
-                uint32_t chunk_size = ntohl(client->current_header.chunk_size);
-                uint32_t total_chunks = ntohl(client->current_header.total_chunks);
+        size_t to_send = client->transfer->stream_frame_remaining;
+        if (to_send > budget - sent_this_wakeup)
+        {
+            to_send = budget - sent_this_wakeup;
+        }
+        off_t offset = client->transfer->download_offset;
+        ssize_t result = sendfile(client->socket_fd, fileno(client->transfer->download_file), &client->transfer->download_offset, to_send);
+        if (result < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                send_would_block(client);
+                return 0;
+            }
+            LOG_ERROR(RED "Error: sendfile failed for '%s': %s\n" RESET, client->transfer->download_filename, strerror(errno));
+            return -1;
+        }
+        if (result == 0)
+        {
+            LOG_ERROR(RED "Error: '%s' shrank during download\n" RESET, client->transfer->download_filename);
+            return -1;
+        }
+        if (checksum_sent_bytes(client->transfer, offset, result) == -1)
+        {
+            return -1;
+        }
+        sent_this_wakeup += result;
+        METRIC_ADD(bytes_out, result);
+        client->bytes_sent += result;
+        session_active(client);
+        client->transfer->stream_frame_remaining -= result;
+    }
 
-                // Validate header values to prevent client crashes
-                if (chunk_size == 0 || total_chunks == 0 || chunk_size > 8192 || total_chunks > 2000000)
-                {
-                    printf(RED "Invalid file transfer header: chunk_size=%u, total_chunks=%u\n" RESET, chunk_size, total_chunks);
-                    send(client_fd, "ERROR: Invalid file transfer header\n", 36, 0);
-                    client->state = 0;
-                    return -1;
-                }
+    if (!client->transfer->stream_trailer_sent)
+    {
+        char *out = client->transfer->transfer_buffer;
+        uint32_t crc = htonl(client->transfer->crc);
+        put_frame_header(out, FRAME_STREAM, STREAM_TRAILER_LEN);
+        memcpy(out + sizeof(FrameHeader), &crc, STREAM_TRAILER_LEN);
+        client->transfer->send_mapped = NULL;
+        client->transfer->send_mapped_len = 0;
+        client->transfer->send_len = sizeof(FrameHeader) + STREAM_TRAILER_LEN;
+        client->transfer->send_offset = 0;
+        client->transfer->stream_trailer_sent = 1;
+        record_bytes(client->transfer, out, client->transfer->send_len);
+        return flush_send_buffer(client);
+    }
+    return 1;
+}
 
-                client->payload_remaining = chunk_size;
+// Send the next slice of a download from its file cache entry, at most budget bytes
+// Returns 1 when all of it is sent, 0 to continue on the next EPOLLOUT, -1 on error
+static int send_cached_download(client_info_t *client, size_t budget)
+{
+    transfer_t *transfer = client->transfer;
+    size_t len;
+    const char *data = filecache_data(transfer->cached, &len);
+    if (transfer->cached_offset >= len)
+    {
+        return 1;
+    }
 
-                printf("DEBUG: Header complete - chunk %d/%d, size %d\n", chunk_id + 1, total_chunks, chunk_size);
+    size_t slice = len - transfer->cached_offset;
+    if (slice > budget)
+    {
+        slice = budget;
+    }
+    transfer->send_mapped = data + transfer->cached_offset;
+    transfer->send_mapped_len = (int)slice;
+    transfer->send_len = (int)slice;
+    transfer->send_offset = 0;
+    transfer->cached_offset += slice;
+    METRIC_ADD(filecache_served_bytes, slice);
+
+    int result = flush_send_buffer(client);
+    if (result <= 0)
+    {
+        return result;
+    }
+    return transfer->cached_offset >= len ? 1 : 0;
+}
 
-                // If this is the first chunk, open the file
-                if (chunk_id == 0)
-                {
-                    mkdir("saved", 0777);
-                    char full_path[512];
-                    snprintf(full_path, sizeof(full_path), "saved/%s", client->current_header.filename);
-
-                    client->upload_file = fopen(full_path, "wb");
-                    if (!client->upload_file)
-                    {
-                        printf(RED "Error: Cannot create file '%s'\n" RESET, full_path);
-                        send(client_fd, "ERROR: Cannot create file\n", 26, 0);
-                        client->state = 0;
-                        return -1;
-                    }
-
-                    strncpy(client->upload_filename, client->current_header.filename, sizeof(client->upload_filename) - 1);
-                    client->expected_chunks = total_chunks;
-                    client->received_chunks = 0;
-
-                    printf(BLUE "Starting upload of '%s' (%d chunks)\n" RESET,
-                           client->current_header.filename, total_chunks);
-                }
+// Send as much of the pending download as the socket accepts, up to the per-wakeup
+// budget and about allowance bytes (a chunk that is started goes out whole)
+static int send_download(client_info_t *client, long long allowance)
+{
+    size_t budget = allowance < SENDFILE_BYTES_PER_WAKEUP ? (size_t)allowance : SENDFILE_BYTES_PER_WAKEUP;
+    long long sent_before = client->bytes_sent;
+    int result = flush_send_buffer(client);
+    if (result <= 0)
+    {
+        return result;
+    }
 
-                // Reset buffer for payload
-                client->bytes_in_buffer = 0;
-            }
+    if (client->transfer->cached)
+    {
+        result = send_cached_download(client, budget);
+        if (result <= 0)
+        {
+            return result;
         }
-        else
+    }
+    else if (client->transfer->download_stream)
+    {
+        result = sendfile_download(client, budget);
+        if (result <= 0)
         {
-            // Receiving payload
-            int to_copy = (bytes_read - processed < client->payload_remaining) ? (bytes_read - processed) : client->payload_remaining;
-
-            if (client->upload_file)
+            return result;
+        }
+    }
+    else
+    {
+        for (int chunks = 0; chunks < DOWNLOAD_CHUNKS_PER_WAKEUP; chunks++)
+        {
+            if (client->transfer->download_next_chunk >= client->transfer->download_end_chunk ||
+                client->bytes_sent - sent_before >= allowance)
+            {
+                break;
+            }
+            if (client->transfer->download_compress && chunks * client->chunk_size >= COMPRESS_BYTES_PER_WAKEUP)
+            {
+                break; // Compressing costs CPU, let other clients have the loop
+            }
+            if (prepare_next_chunk(client) == -1)
             {
-                fwrite(temp_buffer + processed, 1, to_copy, client->upload_file);
-                fflush(client->upload_file); // Ensure data is written immediately
+                return -1;
             }
+            result = flush_send_buffer(client);
+            if (result <= 0)
+            {
+                return result;
+            }
+        }
 
-            processed += to_copy;
-            client->payload_remaining -= to_copy;
+        if (client->transfer->download_next_chunk < client->transfer->download_end_chunk)
+        {
+            // Budget or allowance used up, continue on the next wakeup
+            return 0;
+        }
+    }
 
-            printf("DEBUG: Payload progress: %d/%d bytes for current chunk\n",
-                   (int)(ntohl(client->current_header.chunk_size) - client->payload_remaining),
-                   (int)ntohl(client->current_header.chunk_size));
+    if (client->transfer->cached)
+        LOG_INFO(GREEN "File sent successfully: %s (%lld bytes, from cache)\n" RESET,
+               client->transfer->download_filename, (long long)client->transfer->download_size);
+    else if (client->transfer->download_archive)
+        LOG_INFO(GREEN "Directory sent successfully: %s (%ld files, %lld bytes, crc32c %08x)\n" RESET,
+               client->transfer->download_filename, tar_writer_files(client->transfer->download_archive),
+               (long long)client->transfer->download_size, client->transfer->crc);
+    else
+        LOG_INFO(GREEN "File sent successfully: %s (%lld bytes, crc32c %08x)\n" RESET,
+               client->transfer->download_filename, (long long)client->transfer->download_size,
+               client->transfer->crc);
+    if (client->transfer->download_archive && tar_writer_damaged(client->transfer->download_archive))
+        LOG_WARNING(YELLOW "Warning: %d entries of '%s' changed while being sent, sent padded or left out\n" RESET,
+                    tar_writer_damaged(client->transfer->download_archive), client->transfer->download_filename);
+    if (client->transfer->recording)
+        finish_recording(client->transfer);
+
+    metrics_observe_command(METRIC_CMD_GET, metrics_now_us() - client->transfer->started_us);
+    end_transfer(client);
+    set_state(client, 0);
+
+    // Frames that arrived behind the get are parsed now
+    if (client->pending_input && resume_input(client) == -1)
+    {
+        return -1;
+    }
+    return flush_output(client);
+}
 
-            if (client->payload_remaining == 0)
-            {
-                // Chunk complete
-                client->received_chunks++;
-                client->header_complete = 0;
-                client->bytes_in_buffer = 0;
+// Out of tokens: stop asking for EPOLLOUT until the worker's timer finds the buckets refilled
+static int throttle_download(client_info_t *client)
+{
+    if (set_client_events(client, 0) == -1)
+    {
+        return -1;
+    }
+    if (!throttled_clients && ratelimit_timer_arm(ratelimit_fd) == -1)
+    {
+        return set_client_events(client, EPOLLOUT); // No timer to wake it, keep sending
+    }
+    client->throttled = 1;
+    client->next_throttled = throttled_clients;
+    throttled_clients = client;
+    METRIC_INC(download_throttles);
+    METRIC_INC(throttled_sessions);
+    return 0;
+}
 
-                printf("Received chunk %d/%d\n", client->received_chunks, client->expected_chunks);
+// Send the pending download as far as the socket, the fairness budget and the
+// session's rate limits allow
+int handle_file_download(client_info_t *client)
+{
+    if (client->state != 2 || !client->transfer ||
+        (!client->transfer->download_file && !client->transfer->download_archive && !client->transfer->cached))
+    {
+        return -1;
+    }
+    if (ratelimit_fd == -1)
+    {
+        return send_download(client, LLONG_MAX);
+    }
 
-                if (client->received_chunks >= client->expected_chunks)
-                {
-                    // File transfer complete
-                    if (client->upload_file)
-                    {
-                        fclose(client->upload_file);
-                        client->upload_file = NULL;
-                    }
-
-                    printf(GREEN "File received successfully: %s\n" RESET, client->upload_filename);
-                    send(client_fd, "SUCCESS: File uploaded\n", 23, 0);
-
-                    // Reset client state completely
-                    client->state = 0;
-                    client->bytes_in_buffer = 0;
-                    client->header_complete = 0;
-                    client->payload_remaining = 0;
-                    client->expected_chunks = 0;
-                    client->received_chunks = 0;
-                    client->upload_filename[0] = '\0';
-
-                    printf(CYAN "Client %s switched back to command mode\n" RESET, client->client_ip);
-                    return 0;
-                }
+    long long allowance = ratelimit_allowance(&client->bucket, client->ip_limit);
+    if (allowance < RATELIMIT_MIN_SEND)
+    {
+        return throttle_download(client);
+    }
+    long long sent_before = client->bytes_sent;
+    int result = send_download(client, allowance);
+    ratelimit_charge(&client->bucket, client->ip_limit, client->bytes_sent - sent_before);
+    return result;
+}
+
+// Rate limit timer fired: give throttled downloads whose buckets refilled their EPOLLOUT
+// back, and wait another tick for the rest. A session that fails is closed with the
+// deferred close: the list is detached first and its slots stay valid until the batch ends
+static void resume_throttled(int epoll_fd)
+{
+    ratelimit_timer_ack(ratelimit_fd);
+    client_info_t *client = throttled_clients;
+    throttled_clients = NULL;
+    while (client)
+    {
+        client_info_t *next = client->next_throttled;
+        if (client->closing)
+        {
+            client = next;
+            continue;
+        }
+        if (ratelimit_allowance(&client->bucket, client->ip_limit) >= RATELIMIT_MIN_SEND)
+        {
+            client->throttled = 0;
+            client->next_throttled = NULL;
+            METRIC_ADD(throttled_sessions, -1);
+            if (set_client_events(client, EPOLLOUT) == -1)
+            {
+                disconnect_client(epoll_fd, client);
             }
         }
+        else
+        {
+            client->next_throttled = throttled_clients;
+            throttled_clients = client;
+        }
+        client = next;
+    }
+    if (throttled_clients)
+    {
+        ratelimit_timer_arm(ratelimit_fd);
     }
+}
 
-    // Return to event loop to handle other clients
-    return 0;
+// A write of this session's upload completed: report a failure, confirm the upload
+// once the last write is done, or go on with input held back while the disk was behind
+static int handle_write_done(client_info_t *client)
+{
+    transfer_t *transfer = client->transfer;
+    if (transfer->write_error)
+    {
+        report_write_error(client);
+        return -1;
+    }
+    if (transfer->received_chunks >= transfer->expected_chunks && transfer->writes_in_flight == 0 &&
+        complete_upload(client) == -1)
+    {
+        return -1;
+    }
+    if (client->pending_input && !input_blocked(client) && resume_input(client) == -1)
+    {
+        return -1;
+    }
+    return flush_output(client);
 }
 
-// Main epoll-based server function
-void start_epoll_server(int port)
+// Disk completion eventfd readable: settle the writes the disk writer finished.
+// Sessions closed earlier in the batch only get their writes accounted for
+static void handle_disk_completions(int epoll_fd)
+{
+    disk_write_t *job = disk_writer_reap();
+    while (job)
+    {
+        disk_write_t *next = job->next;
+        client_info_t *client = finish_write(job);
+        if (client && !client->closing && handle_write_done(client) == -1)
+        {
+            // Let the error reply out if the socket takes it right away; the session's
+            // socket event may still be in this batch, so the slot is pooled after it
+            send_output(client);
+            disconnect_client(epoll_fd, client);
+        }
+        job = next;
+    }
+}
+
+// Create a non-blocking listening socket; SO_REUSEPORT lets every worker bind its own
+static int create_listener(int port)
 {
     // Create server socket
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -671,7 +2625,8 @@ void start_epoll_server(int port)
 
     // Set socket options
     int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1)
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1 ||
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1)
     {
         perror("setsockopt");
         close(server_fd);
@@ -699,6 +2654,96 @@ void start_epoll_server(int port)
         exit(1);
     }
 
+    return server_fd;
+}
+
+// Close a session whose deadline passed; a partial upload is closed with its session
+// (the chunks written so far stay on disk in its .part, so the upload can be resumed).
+// The session may still have an event later in this batch: disconnect_client() only marks
+// it closing, and the slot is pooled after the batch
+static void reap_session(int epoll_fd, client_info_t *client)
+{
+    METRIC_INC(session_timeouts[client->state]);
+    if (client->state == 1)
+    {
+        LOG_WARNING(YELLOW "Upload of '%s' from %s stalled, closing the session (fd: %d)\n" RESET,
+                    client->transfer->upload_filename[0] ? client->transfer->upload_filename : "?",
+                    client->client_ip, client->socket_fd);
+    }
+    else if (client->state == 2)
+    {
+        LOG_WARNING(YELLOW "Download of '%s' to %s stalled, closing the session (fd: %d)\n" RESET,
+                    client->transfer->download_filename, client->client_ip, client->socket_fd);
+    }
+    else
+    {
+        LOG_INFO(YELLOW "Client %s timed out %s, closing the session (fd: %d)\n" RESET, client->client_ip,
+                 client->frame_header_len > 0 ? "in the middle of a command" : "while idle", client->socket_fd);
+        // Between frames the client can still be told why
+        if (send_response(client, "ERROR: Session timed out\n") == 0)
+            send_output(client);
+    }
+    disconnect_client(epoll_fd, client);
+}
+
+// Session timer tick: advance the wheel and settle every deadline that came due
+static void handle_session_timers(int epoll_fd)
+{
+    timer_wheel_ack(wheel_fd);
+    unsigned long long now = timer_wheel_clock();
+    wheel_timer_t *timer = timer_wheel_advance(&session_wheel, now);
+    while (timer)
+    {
+        wheel_timer_t *next = timer->next;
+        client_info_t *client = timer->data;
+        if (client->closing)
+        {
+            timer = next;
+            continue;
+        }
+
+        // Waiting on the disk or on the rate limit is the server's doing, not a stall
+        if ((client->state == 1 && client->transfer->writes_in_flight > 0) || client->throttled)
+            session_active(client);
+
+        unsigned long long deadline = session_deadline(client);
+        if (deadline != 0 && deadline <= now)
+            reap_session(epoll_fd, client);
+        else
+            arm_session_timer(client);
+        timer = next;
+    }
+}
+
+// Edge-triggered sessions that stopped on a budget go on where they left off,
+// after everyone with a fresh event had a turn
+static void run_ready_clients(int epoll_fd)
+{
+    client_info_t *client = ready_clients;
+    ready_clients = NULL;
+    while (client)
+    {
+        client_info_t *next = client->next_ready;
+        client->ready = 0;
+        client->next_ready = NULL;
+
+        int result = 0;
+        if (client->events & EPOLLOUT)
+            result = handle_client_output(client);
+        else if (client->events & EPOLLIN)
+            result = handle_client_data(client);
+        if (result == -1)
+        {
+            disconnect_client(epoll_fd, client);
+        }
+        client = next;
+    }
+}
+
+// Event loop of one worker: its own listener, epoll instance and client table
+// One worker also drives the health sampler, whose snapshot all workers read
+static void run_event_loop(int server_fd, int sample_health)
+{
     // Create epoll instance
     int epoll_fd = epoll_create1(0);
     if (epoll_fd == -1)
@@ -707,11 +2752,18 @@ void start_epoll_server(int port)
         close(server_fd);
         exit(1);
     }
+    server_epoll_fd = epoll_fd;
+    if (metrics_attach() == -1)
+    {
+        close(epoll_fd);
+        close(server_fd);
+        exit(1);
+    }
 
-    // Add server socket to epoll
+    // Add server socket to epoll; every wakeup accepts until EAGAIN, so it can be edge-triggered too
     struct epoll_event event;
-    event.events = EPOLLIN;
-    event.data.fd = server_fd;
+    event.events = EPOLLIN | (edge_triggered ? EPOLLET : 0);
+    event.data.ptr = NULL; // NULL marks the listening socket, clients carry their session
 
     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &event) == -1)
     {
@@ -721,15 +2773,112 @@ void start_epoll_server(int port)
         exit(1);
     }
 
-    printf(GREEN "Epoll-based server listening on port %d...\n" RESET, port);
-    log_message("INFO", "Epoll server started");
+    // Upload writes finished by the disk writer threads are announced on an eventfd
+    int disk_fd = disk_writer_attach();
+    if (disk_fd != -1)
+    {
+        event.events = EPOLLIN;
+        event.data.ptr = &disk_events_marker;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, disk_fd, &event) == -1)
+        {
+            perror("epoll_ctl: disk writer");
+            close(epoll_fd);
+            close(server_fd);
+            exit(1);
+        }
+    }
+
+    filecache_attach(file_cache_bytes);
+
+    // Cached listings are invalidated from the directories' inotify events
+    int dircache_fd = dircache_attach(dir_cache_bytes);
+    if (dircache_fd != -1)
+    {
+        event.events = EPOLLIN;
+        event.data.ptr = &dircache_events_marker;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dircache_fd, &event) == -1)
+        {
+            perror("epoll_ctl: listing cache");
+        }
+    }
+
+    // Idle, command and transfer deadlines of the worker's sessions
+    timer_wheel_init(&session_wheel);
+    if (idle_timeout || command_timeout || transfer_timeout)
+    {
+        wheel_fd = timer_wheel_start();
+        event.events = EPOLLIN;
+        event.data.ptr = &wheel_timer_marker;
+        if (wheel_fd != -1 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wheel_fd, &event) == -1)
+        {
+            perror("epoll_ctl: session timer");
+            close(wheel_fd);
+            wheel_fd = -1;
+        }
+        if (wheel_fd == -1)
+            LOG_WARNING(YELLOW "No session timer, sessions of this worker never time out\n" RESET);
+    }
+
+    // Downloads that ran out of tokens are woken by the worker's own timer
+    if (ratelimit_enabled() && (ratelimit_fd = ratelimit_timer_start()) != -1)
+    {
+        event.events = EPOLLIN;
+        event.data.ptr = &ratelimit_timer_marker;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ratelimit_fd, &event) == -1)
+        {
+            perror("epoll_ctl: rate limit timer");
+            close(ratelimit_fd);
+            ratelimit_fd = -1;
+        }
+    }
+    if (ratelimit_enabled() && ratelimit_fd == -1)
+    {
+        LOG_WARNING(YELLOW "No rate limit timer, downloads of this worker are not shaped\n" RESET);
+    }
+
+    // The worker that samples health also serves metrics scrapes
+    int metrics_fd = sample_health && metrics_port > 0 ? metrics_http_listen(metrics_port) : -1;
+    if (metrics_fd != -1)
+    {
+        event.events = EPOLLIN;
+        event.data.ptr = &metrics_listener_marker;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, metrics_fd, &event) == -1)
+        {
+            perror("epoll_ctl: metrics listener");
+            close(metrics_fd);
+            metrics_fd = -1;
+        }
+        else
+        {
+            LOG_INFO(GREEN "Serving metrics on http://0.0.0.0:%d/metrics\n" RESET, metrics_port);
+        }
+    }
+
+    int health_fd = sample_health ? health_sampler_start() : -1;
+    if (health_fd != -1)
+    {
+        event.events = EPOLLIN;
+        event.data.ptr = &health_timer_marker;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, health_fd, &event) == -1)
+        {
+            perror("epoll_ctl: health timer");
+            close(health_fd);
+            health_fd = -1;
+        }
+    }
 
     // Event loop
-    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event *events = malloc(sizeof(struct epoll_event) * max_events);
+    if (!events)
+    {
+        perror("malloc");
+        exit(1);
+    }
 
     while (1)
     {
-        int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        // Sessions left on the ready list only need the events that are already there
+        int num_events = epoll_wait(epoll_fd, events, max_events, ready_clients ? 0 : -1);
 
         if (num_events == -1)
         {
@@ -738,45 +2887,176 @@ void start_epoll_server(int port)
             perror("epoll_wait");
             break;
         }
+        metrics_observe_wakeup(num_events);
 
         // Process all ready events
         for (int i = 0; i < num_events; i++)
         {
-            int fd = events[i].data.fd;
+            client_info_t *client = events[i].data.ptr;
 
-            if (fd == server_fd)
+            if (!client)
             {
                 // New connection
                 handle_new_connection(server_fd, epoll_fd);
             }
-            else
+            else if (events[i].data.ptr == &disk_events_marker)
+            {
+                handle_disk_completions(epoll_fd);
+            }
+            else if (events[i].data.ptr == &dircache_events_marker)
+            {
+                dircache_handle_events();
+            }
+            else if (events[i].data.ptr == &ratelimit_timer_marker)
             {
-                // Client data ready
-                if (events[i].events & (EPOLLERR | EPOLLHUP))
+                resume_throttled(epoll_fd);
+            }
+            else if (events[i].data.ptr == &wheel_timer_marker)
+            {
+                handle_session_timers(epoll_fd);
+            }
+            else if (events[i].data.ptr == &health_timer_marker)
+            {
+                health_sampler_tick(health_fd);
+            }
+            else if (events[i].data.ptr == &metrics_listener_marker)
+            {
+                metrics_http_accept(epoll_fd, metrics_fd);
+            }
+            else if (metrics_http_owns(events[i].data.ptr))
+            {
+                metrics_http_event(epoll_fd, events[i].data.ptr, events[i].events);
+            }
+            else if (client->closing)
+            {
+                // Closed by an earlier event of this batch, the slot waits for the batch to end
+                continue;
+            }
+            else if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                // Client disconnected or error
+                LOG_INFO(YELLOW "Client disconnected (fd: %d)\n" RESET, client->socket_fd);
+                disconnect_client(epoll_fd, client);
+            }
+            else if (events[i].events & EPOLLIN)
+            {
+                // Data available for reading
+                if (handle_client_data(client) == -1)
                 {
                     // Client disconnected or error
-                    printf(YELLOW "Client disconnected (fd: %d)\n" RESET, fd);
-                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
-                    remove_client(fd);
-                    close(fd);
+                    disconnect_client(epoll_fd, client);
                 }
-                else if (events[i].events & EPOLLIN)
+            }
+            else if (events[i].events & EPOLLOUT)
+            {
+                // Socket writable, continue the pending download or queued replies
+                if (handle_client_output(client) == -1)
                 {
-                    // Data available for reading
-                    if (handle_client_data(fd) == -1)
-                    {
-                        // Client disconnected or error
-                        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
-                        remove_client(fd);
-                        close(fd);
-                    }
+                    disconnect_client(epoll_fd, client);
                 }
             }
         }
+
+        run_ready_clients(epoll_fd);
+        release_closed_clients();
     }
 
     // Cleanup
+    free(events);
+    if (wheel_fd != -1)
+        close(wheel_fd);
+    if (ratelimit_fd != -1)
+        close(ratelimit_fd);
+    if (health_fd != -1)
+        close(health_fd);
+    if (metrics_fd != -1)
+        close(metrics_fd);
     close(epoll_fd);
     close(server_fd);
-    printf(GREEN "Server shutdown complete\n" RESET);
+}
+
+// Worker thread entry point, the listener is created by the spawning thread
+static void *epoll_worker_main(void *arg)
+{
+    run_event_loop((int)(intptr_t)arg, 0);
+    return NULL;
+}
+
+// Main epoll-based server function
+void start_epoll_server(const server_options_t *options)
+{
+    int port = options->port;
+    int workers = options->workers;
+    if (options->max_clients > 0)
+        max_clients = options->max_clients;
+    metrics_port = options->metrics_port;
+    dir_cache_bytes = (size_t)options->dir_cache_mb << 20;
+    file_cache_bytes = (size_t)options->file_cache_mb << 20;
+    direct_upload_bytes = (long long)options->direct_upload_mb << 20;
+    edge_triggered = options->edge_triggered;
+    idle_timeout = (unsigned long long)options->idle_timeout * 1000 / TIMER_WHEEL_TICK_MS;
+    command_timeout = (unsigned long long)options->command_timeout * 1000 / TIMER_WHEEL_TICK_MS;
+    transfer_timeout = (unsigned long long)options->transfer_timeout * 1000 / TIMER_WHEEL_TICK_MS;
+    if (options->max_events > 0)
+        max_events = options->max_events;
+    ratelimit_configure((long long)options->session_rate_kb << 10, (long long)options->ip_rate_kb << 10,
+                        (long long)options->global_rate_kb << 10);
+
+    if (!getcwd(initial_cwd, sizeof(initial_cwd)) || (initial_dir_fd = open_dir_fd(AT_FDCWD, ".")) == -1)
+    {
+        perror("getcwd");
+        exit(1);
+    }
+
+    // Console output goes through the logger's flusher thread from here on
+    logger_start(options->log_level);
+#ifndef LOG_DEBUG_ENABLED
+    if (options->log_level == LOG_LEVEL_DEBUG)
+    {
+        LOG_WARNING(YELLOW "Debug logging is not compiled in, rebuild with DEBUG_LOG=1\n" RESET);
+    }
+#endif
+
+    if (workers < 1)
+        workers = 1;
+    if (workers > MAX_WORKERS)
+        workers = MAX_WORKERS;
+
+    // Bind every listener up front so a port conflict fails before any thread runs;
+    // the kernel then spreads incoming connections across the SO_REUSEPORT group
+    int listeners[MAX_WORKERS];
+    for (int i = 0; i < workers; i++)
+    {
+        listeners[i] = create_listener(port);
+    }
+
+    // Writer threads must run before the workers attach their completion queues
+    if (options->io_threads > 0 && disk_writer_start(options->io_threads) == 0)
+    {
+        LOG_WARNING(YELLOW "No disk writer threads, upload chunks are written on the event loop\n" RESET);
+    }
+
+    LOG_INFO(GREEN "Epoll-based server listening on port %d with %d worker%s (max %d clients, %d I/O thread%s)...\n" RESET,
+           port, workers, workers == 1 ? "" : "s", max_clients, disk_writer_threads(),
+           disk_writer_threads() == 1 ? "" : "s");
+
+    pthread_t threads[MAX_WORKERS];
+    for (int i = 1; i < workers; i++)
+    {
+        if (pthread_create(&threads[i], NULL, epoll_worker_main, (void *)(intptr_t)listeners[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    // The calling thread runs the first worker
+    run_event_loop(listeners[0], 1);
+
+    for (int i = 1; i < workers; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    LOG_INFO(GREEN "Server shutdown complete\n" RESET);
+    logger_stop();
 }
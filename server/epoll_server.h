@@ -2,6 +2,7 @@
 #define EPOLL_SERVER_H
 
 #include <sys/socket.h>
+#include "logger.h"
 
 /**
  * @file epoll_server.h
@@ -16,45 +17,160 @@
  *
  * I. SERVER ARCHITECTURE
  * ----------------------
- * This server is a high-performance, I/O-multiplexed, single-threaded application
- * designed to handle multiple concurrent clients efficiently.
+ * This server is a high-performance, I/O-multiplexed application designed to handle
+ * multiple concurrent clients efficiently. By default it runs one event loop; with
+ * `--workers N` it runs N independent event loops, one per thread.
  *
  * Key components:
  * 1.  **Epoll Event Loop**: The core of the server is a main loop built around `epoll_wait()`.
  *     This allows the server to monitor a large number of file descriptors (sockets) for
  *     I/O events (e.g., new connections, incoming data) without blocking or needing a
  *     thread per client.
+ *     Client sockets are level-triggered unless `--edge-triggered` registers them (and
+ *     the listener) with `EPOLLET`. Every handler then works until EAGAIN: the listener
+ *     accepts every pending connection, input is read in a loop and downloads send until
+ *     the socket is full. A session that stops on a fairness budget instead
+ *     (RECV_BYTES_PER_WAKEUP of input, a download's per-wakeup budget) gets no new edge,
+ *     so it goes on the worker's ready list and is resumed after the next `epoll_wait()`,
+ *     which doesn't block while the list is non-empty. `--max-events N` (default 64)
+ *     sets the size of one `epoll_wait()` batch.
  *
  * 2.  **Non-Blocking Sockets**: All sockets (both the main listening socket and all client
- *     sockets) are set to non-blocking mode using `fcntl(fd, F_SETFL, O_NONBLOCK)`.
+ *     sockets) are non-blocking: the listener is set up with `fcntl(fd, F_SETFL, O_NONBLOCK)`,
+ *     clients are accepted non-blocking with `accept4(SOCK_NONBLOCK | SOCK_CLOEXEC)`.
  *     This ensures that I/O calls like `accept()`, `recv()`, and `send()` return
  *     immediately instead of waiting. If an operation cannot be completed, they return -1
- *     with `errno` set to `EAGAIN` or `EWOULDBLOCK`.
+ *     with `errno` set to `EAGAIN` or `EWOULDBLOCK`. Client sockets also get `TCP_NODELAY`:
+ *     replies and frames are queued whole before they are written, and Nagle would hold the
+ *     tail of every small download back until the client's delayed ACK.
  *
  * 3.  **State Management**: To handle non-blocking I/O correctly, the server maintains a
  *     state for each client in a `client_info_t` struct. This is crucial because a single
  *     `recv()` call is not guaranteed to read a complete command or an entire file chunk.
  *     The state tracks:
  *     - Partially received commands in a text buffer.
- *     - The client's current mode (`state`): 0 for command mode, 1 for file transfer mode.
+ *     - The client's current mode (`state`): 0 for command mode, 1 for file upload mode,
+ *       2 for file download mode.
  *     - Partially received binary file transfer chunks, including the header and payload.
+ *     - The open download file and the partially sent outbound chunk.
+ *     The transfer fields and the chunk buffer live in a separate `transfer_t` that is taken
+ *     from a size-classed, per-worker buffer pool (`pool.c`) when an upload or download
+ *     starts and returned when it ends, so an idle session costs only its command buffer
+ *     and `cwd`.
  *
- * 4.  **Single-Threaded Model**: By leveraging `epoll`, the server can manage all clients
- *     within a single thread. This avoids the complexity and overhead of multi-threading
- *     (like locks and context switching) while remaining highly concurrent.
+ * 4.  **Worker Model**: By leveraging `epoll`, one thread can manage all clients. To use
+ *     more cores, `ftp_server_epoll <port> --workers N` starts N event-loop threads. Each
+ *     worker binds its own listening socket with `SO_REUSEPORT` (the kernel spreads new
+ *     connections across them) and owns its own epoll instance and client table, kept in
+ *     thread-local storage. Workers share nothing on the hot path, so no locks are needed.
+ *     Clients are found in O(1) through the session pointer stored in
+ *     `epoll_event.data.ptr`; the connection cap is set with `--max-clients N`
+ *     (default 1024). A session's working directory is part of its `client_info_t`: an
+ *     `O_PATH` directory handle (`dir_fd`) plus its path (`cwd`, for `pwd`). `cd` never
+ *     calls the process-wide `chdir()`; it opens the new directory relative to the old
+ *     handle, and every command resolves names against the handle with `openat()`,
+ *     `fstatat()`, `unlinkat()`, `renameat()` and `mkdirat()`, so no lookup walks the
+ *     full path from `/` again.
+ *
+ * 5.  **Disk Writes**: Upload chunks are not written on the event loop. Each complete chunk
+ *     is handed as one `pwrite()` job to a small pool of disk writer threads
+ *     (`disk_writer.c`, `--io-threads N`, default 2), so a slow disk stalls no socket.
+ *     Every worker polls an eventfd on which its finished writes are announced (registered
+ *     with the address of a private marker as `data.ptr`). A session stops reading while
+ *     MAX_WRITES_IN_FLIGHT of its chunks are queued, and an upload is confirmed only after
+ *     its last write completed. `--io-threads 0` writes inline on the event loop.
+ *     An upload is written to `saved/<name>.part`, whose blocks are reserved for
+ *     `total_chunks * chunk_size` with `fallocate(FALLOC_FL_KEEP_SIZE)` when the first
+ *     chunk arrives, and renamed over `saved/<name>` once the last write is done, so
+ *     readers never see a partial file under the real name. With `--direct-upload-mb N`
+ *     uploads of at least N MiB whose chunk size is a multiple of DIRECT_IO_ALIGN (4 KiB)
+ *     are written with `O_DIRECT` and leave the page cache to the downloads: the pool's
+ *     chunk blocks are page aligned, the last chunk is padded with zeros to a whole block
+ *     and the file cut back before the rename. A filesystem without `O_DIRECT` gets
+ *     buffered writes.
+ *
+ * 6.  **Logging**: Console messages go through `logger.c`: the caller formats into a
+ *     lock-free ring and a flusher thread writes whole batches to stdout, so no worker
+ *     blocks on the terminal. `--log-level debug|info|warning|error` (default info)
+ *     filters before formatting; per-chunk and per-command tracing uses `LOG_DEBUG()`,
+ *     which only exists in builds made with `DEBUG_LOG=1`.
+ *
+ * 7.  **Listing Cache**: Every worker keeps rendered `ls` and `ls --compact` replies
+ *     (`dircache.c`), keyed by the directory's device and inode, and an inotify instance
+ *     in its epoll set that drops a directory's listings when an entry is created,
+ *     deleted or moved. The queue is also drained before each lookup, so a cached reply
+ *     never misses a change. At most `--dir-cache-mb N` MiB (default 8, 0 disables) are
+ *     kept per worker, least recently used listings are evicted first, and paged
+ *     listings are always read from the directory.
+ *
+ * 8.  **Download Cache**: With `--file-cache-mb N` (default 0, off) every worker keeps
+ *     whole-file downloads of regular files exactly as they were sent (`filecache.c`):
+ *     frames, chunk headers and payloads, keyed by device, inode, size and mtime plus
+ *     the request's shape (chunk size, `-s`, `-z`). A repeated `get` is answered by
+ *     writing the cached bytes, with no open, read, checksum or compression. An entry
+ *     is kept only if the file is unchanged when its recording ends; a single download
+ *     may use a quarter of the budget and least recently used entries are evicted.
+ *
+ * 9.  **Bandwidth Shaping**: Downloads pay for their bytes from token buckets
+ *     (`ratelimit.c`): one per session (`--session-rate-kb`), one per client IP shared
+ *     by that address's sessions (`--ip-rate-kb`) and one for the whole server
+ *     (`--global-rate-kb`), all in KiB/s and off by default. A download whose buckets
+ *     run low drops its EPOLLOUT interest and sits on its worker's throttled list; a
+ *     one-shot timerfd in the worker's epoll set re-checks it every 10 ms and restores
+ *     EPOLLOUT once tokens are back. Nothing sleeps, and command replies are never
+ *     shaped, so other sessions (and the next command) are not held up.
+ *
+ * 10. **Session Timeouts**: Each worker keeps the deadlines of its sessions on a
+ *     hierarchical timer wheel (`timer_wheel.c`, 250 ms ticks, O(1) add and remove)
+ *     driven by one periodic timerfd in its epoll set. A session in command mode is
+ *     closed after `--idle-timeout` seconds without activity, a command frame must
+ *     arrive completely within `--command-timeout` seconds of its first byte, and an
+ *     upload or download is closed after `--transfer-timeout` seconds without
+ *     progress. Each is off (0) unless given. Socket I/O only
+ *     stamps the session's last active tick; a deadline that comes due is checked
+ *     against it and pushed out if the session moved data meanwhile. Uploads waiting
+ *     on the disk and throttled downloads never count as stalled.
  *
  *
  * II. COMMUNICATION PROTOCOLS
  * ---------------------------
  * The server uses two distinct protocols: one for text-based commands and one for
- * binary file transfers.
+ * binary file transfers. Both travel inside frames.
+ *
+ *   0. FRAMING
+ *   ----------
+ *   Every message in either direction is `[FrameHeader][Payload]`:
+ *       typedef struct {
+ *           uint8_t version;          // FRAME_VERSION (2).
+ *           uint8_t type;             // What the payload is, see below.
+ *           uint16_t flags;           // Reserved (0).
+ *           uint32_t length;          // Payload bytes that follow (network byte order).
+ *       } FrameHeader;
+ *
+ *   -   `FRAME_COMMAND` (1), client to server: one command, no trailing newline.
+ *   -   `FRAME_RESPONSE` (2), server to client: the complete reply to one command.
+ *   -   `FRAME_DATA` (3), either direction: one `[FileChunkHeader][Payload]` chunk.
+ *   -   `FRAME_STREAM` (4), server to client: raw file bytes of a stream download.
+ *
+ *   `handle_client_data()` reads into a per-worker buffer and dispatches each frame on its
+ *   type; nothing is inferred from the payload. A wrong version, an unknown type, an
+ *   oversized command or a data frame outside an upload is answered with an `ERROR:`
+ *   response and the connection is closed. Frames that arrive behind a `get` are kept
+ *   until the download has been sent, then parsed in order.
+ *
+ *   Commands may be pipelined: a client can send many command frames without waiting.
+ *   Replies are not sent one by one; each is framed in place in the session's output
+ *   queue (`output`), and the queue is written once per received batch. If the socket
+ *   can't take it all, the session switches to `EPOLLOUT` and stops reading until the
+ *   queue is drained, so a client that doesn't read can't make the server buffer without
+ *   bound. Before a download's first chunk, queued replies and the chunk go out together
+ *   in one `sendmsg()` call.
  *
  *   A. COMMAND PROTOCOL (Text-based)
  *   --------------------------------
- *   -   **Format**: Commands are simple ASCII strings terminated by a newline character (`\n`).
- *       The server also handles optional carriage returns (`\r\n`).
+ *   -   **Format**: Each command is the payload of one command frame (e.g. `ls`).
  *   -   **Interaction**: The client sends a command. The server processes it and sends back a
- *       human-readable, newline-terminated response.
+ *       human-readable reply in one response frame.
  *   -   **Responses**: Server responses typically start with a status indicator:
  *       - `SUCCESS:`: The requested operation completed successfully.
  *       - `ERROR:`: An error occurred. The message provides details.
@@ -67,7 +183,8 @@
  *   File transfers are designed to be robust and handle large files efficiently. The file is
  *   broken down into smaller chunks, and each chunk is sent with a header.
  *
- *   -   **Structure**: Each message is a chunk composed of `[Header][Payload]`.
+ *   -   **Structure**: Each data frame holds one chunk composed of `[Header][Payload]`; the
+ *       header's `chunk_size` must match the frame length.
  *   -   **`FileChunkHeader`**: A fixed-size binary header precedes each data payload.
  *       All integer fields MUST be converted to network byte order (`htonl`) by the sender
  *       and converted back to host byte order (`ntohl`) by the receiver.
@@ -77,53 +194,184 @@
  *           uint32_t chunk_id;        // 0-indexed sequence number of the chunk.
  *           uint32_t chunk_size;      // Size of the payload that follows this header.
  *           uint32_t total_chunks;    // The total number of chunks for the entire file.
- *           uint32_t type;            // Reserved for future use (currently 0).
+ *           uint32_t type;            // 0 = data, 1 = stream header, 2 = LZ4 data.
+ *           uint32_t checksum;        // CRC32C of the transfer's bytes through this chunk.
  *           char filename[64];        // The name of the file being transferred.
  *       } FileChunkHeader;
  *
+ *   -   **Chunk Size (`hello` command)**:
+ *       Chunks default to 512 bytes. Right after connecting, a client may send
+ *       `hello <bytes>`; the server clamps the value to [512 B, 4 MiB] and answers
+ *       `OK: chunk_size=<bytes> compress=lz4\n`; transfer buffers are sized from it. From
+ *       then on downloads are cut at that size and upload chunks larger than it are
+ *       rejected.
+ *
  *   -   **Upload Flow (`upload` command)**:
- *       1.  Client sends the text command: `upload\n`
+ *       1.  Client sends the command: `upload`
  *       2.  The server receives this, acknowledges nothing back, but switches the client's
  *           internal state to file transfer mode (`state = 1`).
  *       3.  The client immediately begins sending the file as a stream of binary chunks
  *           (`Header` + `Payload`, `Header` + `Payload`, ...).
- *       4.  The server reads the incoming binary stream. Because of non-blocking I/O, it
- *           may receive partial headers or payloads, which it buffers in the client's
- *           state struct (`recv_buffer`) until a full chunk is processed.
- *       5.  On receiving the first chunk (`chunk_id == 0`), the server creates the file
- *           in the `saved/` directory.
- *       6.  After the server has received and written `total_chunks`, it sends a final
- *           text confirmation: `SUCCESS: File uploaded\n`.
+ *       4.  The server reads the incoming data frames. Because of non-blocking I/O, it
+ *           may receive partial frames; a partial `FileChunkHeader` is buffered in the
+ *           transfer state (`recv_buffer`), payload bytes are collected in a pooled,
+ *           page-aligned block and the whole chunk is queued for a disk writer thread
+ *           at `chunk_id * chunk_size` once its frame is complete. With chunks of
+ *           DIRECT_RECV_MIN_CHUNK (64 KiB) and up, `readv()` puts the rest of the
+ *           payload straight into that block and reads `rx_buffer` only up to the end
+ *           of the next chunk header, so payload bytes are copied once, by the kernel,
+ *           and a 1 MiB chunk takes a few reads instead of one per 256 KiB.
+ *       5.  On receiving the first chunk (`chunk_id == 0`), the server creates
+ *           `saved/<filename>.part` and preallocates it.
+ *       6.  After the server has received and written `total_chunks`, it renames the
+ *           `.part` to `saved/<filename>` and sends a final
+ *           response: `SUCCESS: File uploaded crc32c=<hex>\n`, the CRC32C of the bytes the
+ *           upload carried. A resumed upload carried the bytes from its resume offset on
+ *           and says so: `SUCCESS: File uploaded crc32c=<hex> from=<offset>\n`. A failed write is answered with
+ *           `ERROR: Cannot write file\n` and the connection is closed.
  *       7.  The server then resets the client's state back to command mode (`state = 0`).
  *
+ *   -   **Resuming Transfers**:
+ *       An upload whose first chunk has `chunk_id = n > 0` continues `saved/<filename>.part`:
+ *       the partial file must hold at least `n * chunk_size` bytes, is cut back to exactly
+ *       that (dropping a torn last chunk) and receives chunks `n, n + 1, ...` in sequence,
+ *       otherwise the reply is `ERROR: Cannot resume upload\n`. A client learns `n` from
+ *       `size -u <filename>` divided by the negotiated chunk size; it reports the `.part`,
+ *       or the finished `saved/<filename>` if there is none. Downloads resume the
+ *       same way with a ranged get starting at the first missing chunk (see below).
+ *
  *   -   **Download Flow (`get` command)**:
- *       1.  Client sends the text command: `get <filename>\n`
+ *       1.  Client sends the command: `get <filename>`
  *       2.  The server attempts to open the requested file.
  *           - If not found, it sends: `ERROR: File not found\n`.
- *           - If found, it calculates the number of chunks and begins sending the file
- *             as a stream of binary chunks (`Header` + `Payload`, ...).
- *       3.  The client is responsible for reading this stream, parsing the headers, and
+ *           - If found, it calculates the number of chunks, switches the client to
+ *             download mode (`state = 2`) and registers the socket for `EPOLLOUT` only.
+ *       3.  On every `EPOLLOUT` event, `handle_file_download()` sends chunks
+ *           (`Header` + `Payload`, ...) until the socket would block or the per-wakeup
+ *           budget (`DOWNLOAD_CHUNKS_PER_WAKEUP`) is used up. A partially sent chunk is
+ *           kept in the client's `transfer_buffer` and resumed on the next event, so many
+ *           concurrent downloads interleave without stalling the event loop.
+ *           Chunks of regular files are slices of 16 MiB `mmap()` windows (`file_map.c`):
+ *           the CRC and LZ4 read the mapping directly, and a raw chunk's payload goes
+ *           to `sendmsg()` from the mapping as a third iovec behind the headers, so it
+ *           is never copied into `transfer_buffer`. Windows are mapped
+ *           `MADV_SEQUENTIAL`, the next one is read ahead with `POSIX_FADV_WILLNEED`,
+ *           and files of 256 MiB and up drop the pages behind the cursor from the
+ *           page cache. A file truncated under its mapping fails the download instead
+ *           of raising SIGBUS.
+ *       4.  The client is responsible for reading this stream, parsing the headers, and
  *           reassembling the file. The client knows the transfer is complete when it
  *           has received `total_chunks`.
- *       4.  The server sends no final "success" message; the completion is implicit.
+ *       5.  The server sends no final "success" message; the completion is implicit.
+ *           After the last chunk the socket goes back to `EPOLLIN` and `state = 0`.
+ *
+ *   -   **Stream Download (`get -s` command)**:
+ *       A client that sends `get -s <filename>` accepts a raw stream instead of chunks.
+ *       For regular files the server sends a single data frame with `type = 1`
+ *       (`CHUNK_TYPE_STREAM`), `chunk_id = 0`, `total_chunks = 1` and `chunk_size = 8`,
+ *       whose payload is the file length as a big-endian 64-bit integer. The file contents
+ *       follow in stream frames of up to 1 MiB, pushed with `sendfile(2)` straight from
+ *       the page cache. A last stream frame of 4 bytes holds the big-endian CRC32C of the
+ *       contents; `sendfile()` never brings them into the server, so the sum is taken from
+ *       the file's `mmap()` windows behind each call, without a copy. Files that are
+ *       not regular fall back to normal chunks (`type = 0`), so the client must dispatch on
+ *       the header type.
+ *
+ *   -   **Ranged Download (`get -r` command)**:
+ *       `get -r <first_chunk> <chunk_count> <filename>` sends only chunks
+ *       `first_chunk .. first_chunk + chunk_count - 1`, cut with the session's negotiated
+ *       chunk size. Each header still carries its absolute `chunk_id` and the file's
+ *       `total_chunks`, so chunk `n` belongs at offset `n * chunk_size`. A client can ask
+ *       for the size with `size`, then fetch disjoint ranges over several connections in
+ *       parallel. Ranges are always sent as chunks, never as a stream.
+ *
+ *   -   **Directory Download (`get -t` command)**:
+ *       `get -t <directory>` sends the whole tree below a directory as one tar archive
+ *       (`tar.c`, GNU format) cut into ordinary chunks, with the directory name in the
+ *       headers. `start_archive_download()` walks the tree first, so the archive's exact
+ *       size, and with it `total_chunks`, is known before chunk 0; `prepare_next_chunk()`
+ *       then takes each chunk from `tar_writer_read()` instead of `fread()`, opening
+ *       every file as the archive reaches it and hinting the next one to the kernel with
+ *       `posix_fadvise()`. Regular files and directories are included, symlinks and
+ *       special files are not. A file that changes between the walk and its turn is
+ *       padded to, or cut at, its walked size, so the chunk count holds. Checksums and
+ *       `-z` work as for any chunked download (`get -z -t <directory>`).
+ *
+ *   -   **Compressed Chunks (`type = 2`)**:
+ *       A `CHUNK_TYPE_LZ4` chunk's payload is one LZ4 block (`compress.c`) and
+ *       `chunk_size` is the block's length; decoded, it is the chunk's original bytes, so
+ *       every chunk but the last still decodes to exactly the negotiated chunk size and
+ *       resume offsets are unchanged. `get -z <filename>` (also `get -z -r ...`) asks
+ *       for them: the server compresses each chunk on the event loop, keeps the block
+ *       only if it saves at least 1/16 of the chunk, sends the rest of a file raw once
+ *       COMPRESS_GIVE_UP chunks in a row didn't shrink, and doesn't try at all for files
+ *       that start like JPEG, PNG, GIF, ZIP, gzip and other compressed formats. A client
+ *       may send LZ4 chunks in any upload; a block that doesn't decode is answered with
+ *       `ERROR: Invalid compressed chunk\n` and the connection is closed. `-z` has no
+ *       effect with `-s`, streams stay zero-copy.
+ *
+ *   -   **Checksums (`checksum`)**:
+ *       Every chunk carries the CRC32C (`checksum.c`) of all file bytes the transfer has
+ *       carried so far, this chunk included, computed over the decoded bytes (before LZ4).
+ *       The sum starts from 0 with the transfer's first chunk, which for a resumed upload
+ *       or a ranged get is not chunk 0. A receiver that recomputes it checks each chunk on
+ *       arrival and, with the last one, everything that came before, so a dropped or
+ *       reordered chunk fails as well as a corrupted one. The server verifies upload
+ *       chunks before they are written; a mismatch is answered with
+ *       `ERROR: Checksum mismatch\n` and the connection is closed, so the file only holds
+ *       verified chunks and the upload can be resumed. The upload's `SUCCESS` reply
+ *       repeats the final sum for the client to compare (from the resume offset, named
+ *       with `from=`, after a resume). A stream download (`get -s`) ends with a 4-byte
+ *       stream frame holding the big-endian CRC32C of the whole file from byte 0, taken
+ *       from the file's mappings behind each `sendfile()` call.
  *
  *
  * III. COMMAND REFERENCE
  * ----------------------
  * All commands are case-sensitive.
  *
- * - `ls`
+ * - `hello <bytes>`
+ *   - **Description**: Negotiates the chunk size used for file transfers.
+ *   - **Arguments**: `bytes` - The requested payload size per chunk.
+ *   - **Response**: `OK: chunk_size=<bytes> compress=lz4\n` with the size actually granted;
+ *     `compress=lz4` says LZ4 chunks are understood.
+ *   - **Error**: `ERROR: Invalid chunk size\n` if the argument is not a positive number.
+ *
+ * - `ls [--offset N] [--limit N] [--compact]`
  *   - **Description**: Lists files and directories in the server's current working directory.
- *   - **Arguments**: None.
- *   - **Response**: A series of lines, each detailing a file or directory. The list is
- *     terminated by the line `END_OF_LIST\n`.
- *   - **Error**: `ERROR: Cannot list directory\n` if `opendir()` fails.
+ *     Entries are read with `getdents64()` in 64 KiB batches and typed from `d_type`
+ *     (`fstatat()` only for links and filesystems that leave it unknown); the whole
+ *     listing is one response frame, drained on `EPOLLOUT`. Full listings are answered
+ *     from the worker's listing cache until the directory changes.
+ *   - **Arguments**: `--offset`/`--limit` return one page of entries (in directory
+ *     order); `--compact` prints `d`, `f`, `o` or `?` (directory, file, other, unknown),
+ *     a tab and the name, one entry per line.
+ *   - **Response**: A series of lines, each detailing a file or directory. A page that
+ *     stops before the last entry adds `MORE: offset=<next>\n`. The list is terminated by
+ *     the line `END_OF_LIST\n`.
+ *   - **Error**: `ERROR: Cannot list directory\n` if the directory can't be opened,
+ *     `ERROR: Invalid ls option\n` for unknown options.
  *
  * - `get <filename>`
  *   - **Description**: Requests a file from the server.
  *   - **Arguments**: `filename` - The name of the file to download.
+ *   - **Options**: `-s` before the filename requests the raw stream download.
+ *     `-z` (first) asks for LZ4-compressed chunks.
+ *     `-r <first_chunk> <chunk_count>` requests only that chunk range; the count is cut
+ *     short at the end of the file. `-t <directory>` sends a directory tree as a tar
+ *     archive in chunks.
  *   - **Response**: The server begins a binary file transfer (see protocol above).
  *   - **Error**: `ERROR: File not found\n` if the file cannot be opened for reading.
+ *     `ERROR: Invalid range\n` if a range is malformed or starts past the last chunk.
+ *     `ERROR: Directory not found\n` if `-t` names no readable directory.
+ *
+ * - `size <filename>` / `size -u <name>`
+ *   - **Description**: Reports the size of a regular file, used to plan ranged downloads.
+ *     With `-u`, the size of the unfinished upload `saved/<name>.part`, or of
+ *     `saved/<name>` if there is none, used to resume an upload.
+ *   - **Arguments**: `filename` - The name of the file.
+ *   - **Response**: `OK: size=<bytes>\n`.
+ *   - **Error**: `ERROR: File not found\n`.
  *
  * - `upload`
  *   - **Description**: Informs the server that the client is about to send a file.
@@ -140,7 +388,7 @@
  *   - **Error**: `ERROR: Cannot get current directory\n`.
  *
  * - `cd <path>`
- *   - **Description**: Changes the server's current working directory.
+ *   - **Description**: Changes the session's working directory (other clients are unaffected).
  *   - **Arguments**: `path` - The relative or absolute path to change to.
  *   - **Response**: `OK: Directory changed\n`.
  *   - **Error**: `ERROR: Cannot change directory\n`.
@@ -155,7 +403,29 @@
  *   - **Description**: Retrieves a system health and status report from the server.
  *   - **Arguments**: None.
  *   - **Response**: A multi-line string containing CPU usage/temp, disk usage, RAM usage,
- *     and system uptime.
+ *     and system uptime. The values come from a snapshot that the first worker refreshes
+ *     every HEALTH_SAMPLE_INTERVAL_MS from a timerfd in its epoll set (`health.c`), so
+ *     the reply never waits on /proc; CPU usage covers the last interval, plus a one
+ *     minute average.
+ *
+ * - `stats`
+ *   - **Description**: Reports memory use of the connection handling.
+ *   - **Arguments**: None.
+ *   - **Response**: Open sessions against the cap, the size of an idle session and the
+ *     blocks/bytes of the transfer buffer pool that are in use and cached.
+ *
+ * - `metrics` / `metrics json`
+ *   - **Description**: Reports server internals, summed over all workers (`metrics.c`).
+ *   - **Arguments**: Optional `json`.
+ *   - **Response**: Prometheus text exposition (or one JSON object) with per-command
+ *     counts and latency histograms (get/ls/cd/delete/rename/upload/other; a get or
+ *     upload is timed until its transfer completes), bytes in and out, sessions by
+ *     `state`, epoll wakeups and events per wakeup, sends that hit EAGAIN, socket reads
+ *     and upload payload bytes read in place, upload chunks received, the time each chunk's disk write took and the listing cache's hits,
+ *     misses, invalidations and size, the chunks and bytes saved by compression, and
+ *     upload chunks rejected for a checksum mismatch.
+ *     With `--metrics-port N` the first worker also serves the same reports over HTTP
+ *     as `GET /metrics` and `GET /metrics.json`, for scrapers.
  *
  *
  * IV. ERROR HANDLING & DISCONNECTION   
@@ -163,7 +433,7 @@
  * - **Command Errors**: Invalid commands or operations that fail (e.g., `cd` to a non-existent
  *   directory) result in an `ERROR:` message sent to the client. The connection remains open.
  *
- * - **Buffer Overflow**: If a client sends a command line that is too long, the server
+ * - **Buffer Overflow**: If a client sends a command frame that is too long, the server
  *   sends an error message and forcefully disconnects the client to protect itself.
  *
  * - **Client Disconnection**: The server detects a client disconnection when `recv()` returns 0
@@ -171,28 +441,50 @@
  *   detects this via `EPOLLHUP` or `EPOLLERR` flags. When a client disconnects, the server:
  *   1. Closes the client's socket file descriptor.
  *   2. Removes the file descriptor from the `epoll` watch list.
- *   3. Frees the `client_info_t` struct associated with that client.
+ *   3. Returns the `client_info_t` session to its worker's pool for reuse.
  *   4. If the client was in the middle of a file upload, the partially written file is
- *      closed and left in a partial state.
+ *      closed and left in a partial state, from which the upload can be resumed.
+ *
+ * - **Timeouts**: A session that misses its deadline (see Session Timeouts) is closed
+ *   the same way. An idle one first gets `ERROR: Session timed out\n`; a stalled upload
+ *   releases its file and buffers, keeping the chunks written so far for a resume.
  */
 
-// Function declarations for epoll server
-void start_epoll_server(int port);
-int set_nonblocking(int socket_fd);
-int handle_new_connection(int server_fd, int epoll_fd);
-int handle_client_data(int client_fd);
-void process_client_command(int sock, const char *command);
+// Client info structure (opaque here; full definition in the .c file)
+// This struct is essential for state management in a non-blocking server. It holds the
+// socket, the partial command buffer, the mode (`state`), the session's `cwd` and all
+// file transfer state. Sessions are pooled per worker and handed to the event loop
+// through `epoll_event.data.ptr`, so a pointer stays valid until the client disconnects.
+typedef struct client_info client_info_t;
 
-// Client info structure (Simplified here for header; full definition in .c file)
-// This struct is essential for state management in a non-blocking server.
+// Runtime configuration, filled in from the command line by main_epoll.c
 typedef struct
 {
-    int socket_fd;
-    char buffer[1024];
-    int buffer_len;
-    int state; // 0 = command mode, 1 = file transfer mode
-    char client_ip[16];
-    // Additional state for file transfers is managed in the implementation file.
-} client_info_t;
+    int port;
+    int workers;     // Event-loop threads (--workers)
+    int max_clients; // Connection cap across all workers (--max-clients)
+    int io_threads;  // Disk writer threads for uploads, 0 writes inline (--io-threads)
+    log_level_t log_level; // Lowest level printed (--log-level)
+    int metrics_port; // HTTP port serving /metrics, 0 = none (--metrics-port)
+    int dir_cache_mb; // Listing cache per worker in MiB, 0 = off (--dir-cache-mb)
+    int file_cache_mb; // Download cache per worker in MiB, 0 = off (--file-cache-mb)
+    int session_rate_kb; // Download rate limit per session in KiB/s, 0 = none (--session-rate-kb)
+    int ip_rate_kb;      // Shared by the sessions of one client IP, 0 = none (--ip-rate-kb)
+    int global_rate_kb;  // Shared by all downloads of the server, 0 = none (--global-rate-kb)
+    int edge_triggered;  // Register client sockets with EPOLLET (--edge-triggered)
+    int max_events;      // Events per epoll_wait(), 0 = default (--max-events)
+    int idle_timeout;     // Seconds a session may sit idle in command mode, 0 = forever (--idle-timeout)
+    int command_timeout;  // Seconds to finish sending a command, 0 = forever (--command-timeout)
+    int transfer_timeout; // Seconds an upload or download may go without progress, 0 = forever (--transfer-timeout)
+    int direct_upload_mb; // Uploads of at least this many MiB are written with O_DIRECT, 0 = never (--direct-upload-mb)
+} server_options_t;
+
+// Function declarations for epoll server
+void start_epoll_server(const server_options_t *options);
+int set_nonblocking(int socket_fd);
+int handle_new_connection(int server_fd, int epoll_fd);
+int handle_client_data(client_info_t *client);
+void process_client_command(client_info_t *client, const char *command);
+int handle_file_download(client_info_t *client);
 
 #endif
\ No newline at end of file
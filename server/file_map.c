@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+#include "file_map.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static pthread_once_t sigbus_once = PTHREAD_ONCE_INIT;
+static __thread sigjmp_buf *fault_jump; // Set while this thread runs file_map_guard()
+
+// A mapped page past the file's current end: jump out of the guarded work, or die as
+// SIGBUS normally would if the fault was not ours
+static void handle_sigbus(int sig)
+{
+    if (fault_jump)
+    {
+        siglongjmp(*fault_jump, 1);
+    }
+    signal(sig, SIG_DFL);
+}
+
+static void install_sigbus_handler(void)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_sigbus;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, NULL);
+}
+
+// Prepare reading fd through mappings; returns -1 if the file is empty
+int file_map_open(file_map_t *map, int fd, off_t file_size)
+{
+    memset(map, 0, sizeof(*map));
+    map->fd = -1;
+    if (file_size <= 0)
+        return -1;
+    pthread_once(&sigbus_once, install_sigbus_handler);
+    map->fd = fd;
+    map->file_size = file_size;
+    map->drop_behind = file_size >= FILE_MAP_DROP_BEHIND_MIN;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return 0;
+}
+
+static void unmap_window(file_map_t *map)
+{
+    if (!map->window)
+        return;
+    munmap(map->window, map->window_len);
+    if (map->drop_behind)
+    {
+        posix_fadvise(map->fd, map->window_offset, map->window_len, POSIX_FADV_DONTNEED);
+    }
+    map->window = NULL;
+}
+
+// Bytes [offset, offset + len) of the file, mapping the window around them if needed
+// Returns NULL if the range is past the end or the mapping fails
+const char *file_map_slice(file_map_t *map, off_t offset, size_t len)
+{
+    if (map->fd == -1 || offset < 0 || len == 0 || offset + (off_t)len > map->file_size)
+        return NULL;
+
+    if (!map->window || offset < map->window_offset ||
+        offset + (off_t)len > map->window_offset + (off_t)map->window_len)
+    {
+        unmap_window(map);
+        off_t page = sysconf(_SC_PAGESIZE);
+        off_t start = offset / page * page;
+        off_t end = start + FILE_MAP_WINDOW_SIZE;
+        if (end < offset + (off_t)len)
+            end = offset + len;
+        if (end > map->file_size)
+            end = map->file_size;
+
+        void *window = mmap(NULL, end - start, PROT_READ, MAP_SHARED, map->fd, start);
+        if (window == MAP_FAILED)
+            return NULL;
+        madvise(window, end - start, MADV_SEQUENTIAL);
+        map->window = window;
+        map->window_offset = start;
+        map->window_len = end - start;
+
+        // Start reading the next window while this one goes out
+        if (end < map->file_size)
+        {
+            posix_fadvise(map->fd, end, FILE_MAP_WINDOW_SIZE, POSIX_FADV_WILLNEED);
+        }
+    }
+    return map->window + (offset - map->window_offset);
+}
+
+void file_map_close(file_map_t *map)
+{
+    unmap_window(map);
+    map->fd = -1;
+}
+
+// Run work(arg), which may read slices; returns -1 if a page it touched was gone
+int file_map_guard(void (*work)(void *), void *arg)
+{
+    sigjmp_buf jump;
+    if (sigsetjmp(jump, 1))
+    {
+        fault_jump = NULL;
+        return -1;
+    }
+    fault_jump = &jump;
+    work(arg);
+    fault_jump = NULL;
+    return 0;
+}
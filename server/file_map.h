@@ -0,0 +1,42 @@
+#ifndef FILE_MAP_H
+#define FILE_MAP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * @file file_map.h
+ * @brief Windowed mmap() reader for chunked downloads
+ *
+ * A download maps its file FILE_MAP_WINDOW_SIZE bytes at a time and reads each chunk
+ * as a slice of the mapping, so the checksum, the compressor and the socket all take
+ * the page cache's own pages without a copy into a read buffer first. Each window is
+ * mapped MADV_SEQUENTIAL and the next one is requested with POSIX_FADV_WILLNEED as
+ * the transfer enters it, so the disk keeps ahead of the socket. A window behind the
+ * cursor is unmapped; for files of FILE_MAP_DROP_BEHIND_MIN and up its pages are also
+ * dropped from the page cache, so one huge download doesn't evict everything else.
+ *
+ * A slice stays valid until the next file_map_slice() or file_map_close() call.
+ * Touching a page of a file that was truncated after mapping raises SIGBUS; code
+ * that reads slices runs under file_map_guard(), which turns the fault into an error.
+ */
+
+#define FILE_MAP_WINDOW_SIZE (16 * 1024 * 1024)
+#define FILE_MAP_DROP_BEHIND_MIN (256LL * 1024 * 1024)
+
+typedef struct
+{
+    int fd;            // Not owned, -1 while nothing is mapped
+    off_t file_size;   // Size at open, slices past it are refused
+    char *window;
+    off_t window_offset;
+    size_t window_len;
+    int drop_behind;
+} file_map_t;
+
+int file_map_open(file_map_t *map, int fd, off_t file_size);
+const char *file_map_slice(file_map_t *map, off_t offset, size_t len);
+void file_map_close(file_map_t *map);
+int file_map_guard(void (*work)(void *), void *arg);
+
+#endif
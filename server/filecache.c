@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+#include "filecache.h"
+#include "colors.h"
+#include "logger.h"
+#include "metrics.h"
+#include <stdlib.h>
+#include <string.h>
+
+// One recorded download, every byte the server sent for it
+struct filecache_entry
+{
+    filecache_key_t key;
+    char *data;
+    size_t len;
+    int refs; // The cache's own reference plus one per download sending from it
+    struct filecache_entry *prev; // LRU list, most recently used first
+    struct filecache_entry *next;
+};
+
+static __thread size_t cache_budget = 0;
+static __thread size_t cache_bytes = 0;
+static __thread int entry_count = 0;
+static __thread filecache_entry_t *lru_head = NULL;
+static __thread filecache_entry_t *lru_tail = NULL;
+
+// Create this worker's cache; a budget of 0 leaves caching off
+void filecache_attach(size_t max_bytes)
+{
+    cache_budget = max_bytes;
+}
+
+static void unlink_entry(filecache_entry_t *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        lru_head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        lru_tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void push_front(filecache_entry_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = lru_head;
+    if (lru_head)
+        lru_head->prev = entry;
+    lru_head = entry;
+    if (!lru_tail)
+        lru_tail = entry;
+}
+
+void filecache_release(filecache_entry_t *entry)
+{
+    if (entry && --entry->refs == 0)
+    {
+        free(entry->data);
+        free(entry);
+    }
+}
+
+// Take an entry out of the cache; downloads still sending from it keep it alive
+static void drop_entry(filecache_entry_t *entry)
+{
+    unlink_entry(entry);
+    cache_bytes -= entry->len;
+    entry_count--;
+    METRIC_ADD(filecache_bytes, -(long)entry->len);
+    filecache_release(entry);
+}
+
+static int same_file(const filecache_key_t *a, const filecache_key_t *b)
+{
+    return a->dev == b->dev && a->ino == b->ino;
+}
+
+static int same_version(const filecache_key_t *a, const filecache_key_t *b)
+{
+    return a->size == b->size && a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+static int same_shape(const filecache_key_t *a, const filecache_key_t *b)
+{
+    return a->chunk_size == b->chunk_size && a->stream == b->stream && a->compress == b->compress &&
+           strcmp(a->name, b->name) == 0;
+}
+
+int filecache_enabled(void)
+{
+    return cache_budget > 0;
+}
+
+// Whether a recording of len bytes would be kept
+int filecache_admits(size_t len)
+{
+    return cache_budget > 0 && len <= cache_budget / 4;
+}
+
+// The cached download for key, with a reference the caller passes to filecache_release();
+// NULL on a miss. Entries of an older version of the file are dropped on the way.
+filecache_entry_t *filecache_lookup(const filecache_key_t *key)
+{
+    if (cache_budget == 0)
+        return NULL;
+
+    filecache_entry_t *entry = lru_head;
+    while (entry)
+    {
+        filecache_entry_t *next = entry->next;
+        if (same_file(&entry->key, key))
+        {
+            if (!same_version(&entry->key, key))
+            {
+                drop_entry(entry);
+            }
+            else if (same_shape(&entry->key, key))
+            {
+                METRIC_INC(filecache_hits);
+                LOG_DEBUG(CYAN "Download of '%s' served from cache (%zu bytes)\n" RESET, key->name, entry->len);
+                unlink_entry(entry);
+                push_front(entry);
+                entry->refs++;
+                return entry;
+            }
+        }
+        entry = next;
+    }
+    METRIC_INC(filecache_misses);
+    return NULL;
+}
+
+const char *filecache_data(const filecache_entry_t *entry, size_t *len)
+{
+    *len = entry->len;
+    return entry->data;
+}
+
+// Keep a finished recording; takes ownership of data, which is freed if it isn't kept
+void filecache_insert(const filecache_key_t *key, char *data, size_t len)
+{
+    filecache_entry_t *entry = filecache_admits(len) ? malloc(sizeof(filecache_entry_t)) : NULL;
+    if (!entry)
+    {
+        free(data);
+        return;
+    }
+    // Another session may have recorded the same download meanwhile
+    for (filecache_entry_t *other = lru_head; other; other = other->next)
+    {
+        if (same_file(&other->key, key) && same_version(&other->key, key) && same_shape(&other->key, key))
+        {
+            free(entry);
+            free(data);
+            return;
+        }
+    }
+
+    // A recording was sized for the worst case; compressed chunks leave room to spare
+    char *trimmed = realloc(data, len);
+    entry->key = *key;
+    entry->data = trimmed ? trimmed : data;
+    entry->len = len;
+    entry->refs = 1;
+
+    while (lru_tail && (cache_bytes + len > cache_budget || entry_count >= FILECACHE_MAX_ENTRIES))
+    {
+        drop_entry(lru_tail);
+    }
+    push_front(entry);
+    cache_bytes += len;
+    entry_count++;
+    METRIC_ADD(filecache_bytes, (long)len);
+}
@@ -0,0 +1,52 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/**
+ * @file filecache.h
+ * @brief Per-worker cache of whole downloads, kept exactly as they went on the wire
+ *
+ * A whole-file `get` of a regular file is recorded while it is sent: every frame,
+ * chunk header and (possibly compressed) payload. The next identical request is
+ * answered from that recording with plain writes of the cached bytes: no open, no
+ * read, no checksum and no compression. An entry is keyed by the file's device,
+ * inode, size and modification time, plus everything that shapes the bytes (chunk
+ * size, stream or chunks, -z, the name in the headers), so a changed file simply
+ * misses; a lookup that finds an older version of the same file drops it.
+ *
+ * Like the listing cache, each worker owns its cache without locks. At most the
+ * configured number of bytes (`--file-cache-mb`) is kept, a single download may fill
+ * a quarter of it, and the least recently used entry is evicted first. Entries are
+ * reference counted, so one that is evicted while downloads still send from it is
+ * freed when the last of them finishes.
+ */
+
+#define FILECACHE_MAX_ENTRIES 256 // Downloads per worker, whatever their size
+
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    int chunk_size;
+    int stream;   // Requested as a sendfile() stream (get -s)
+    int compress; // Requested as LZ4 chunks (get -z)
+    char name[64]; // As it appears in the chunk headers
+} filecache_key_t;
+
+typedef struct filecache_entry filecache_entry_t;
+
+void filecache_attach(size_t max_bytes);
+int filecache_enabled(void);
+int filecache_admits(size_t len);
+filecache_entry_t *filecache_lookup(const filecache_key_t *key);
+const char *filecache_data(const filecache_entry_t *entry, size_t *len);
+void filecache_insert(const filecache_key_t *key, char *data, size_t len);
+void filecache_release(filecache_entry_t *entry);
+
+#endif
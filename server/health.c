@@ -0,0 +1,97 @@
+#define _GNU_SOURCE
+#include "health.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+
+// CPU counters of the recent samples, oldest overwritten first
+typedef struct
+{
+    unsigned long long idle;
+    unsigned long long total;
+} cpu_times_t;
+
+static cpu_times_t window[HEALTH_WINDOW_SAMPLES];
+static int window_count = 0; // Valid entries in window
+static int window_next = 0;  // Where the next sample goes
+
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static health_snapshot_t latest = {.cpu_usage = -1, .cpu_usage_avg = -1, .cpu_temp = -1, .disk_usage = -1};
+
+// Take one sample and publish it; only the thread owning the timer calls this
+static void take_sample(void)
+{
+    health_snapshot_t snapshot;
+    snapshot.cpu_usage = -1;
+    snapshot.cpu_usage_avg = -1;
+
+    cpu_times_t now;
+    if (read_cpu_times(&now.idle, &now.total) == 0)
+    {
+        if (window_count > 0)
+        {
+            // Newest is the previous sample, oldest the one this sample replaces
+            cpu_times_t *prev = &window[(window_next + HEALTH_WINDOW_SAMPLES - 1) % HEALTH_WINDOW_SAMPLES];
+            cpu_times_t *oldest = &window[window_count < HEALTH_WINDOW_SAMPLES ? 0 : window_next];
+            snapshot.cpu_usage = cpu_usage_between(prev->idle, prev->total, now.idle, now.total);
+            snapshot.cpu_usage_avg = cpu_usage_between(oldest->idle, oldest->total, now.idle, now.total);
+        }
+        window[window_next] = now;
+        window_next = (window_next + 1) % HEALTH_WINDOW_SAMPLES;
+        if (window_count < HEALTH_WINDOW_SAMPLES)
+            window_count++;
+    }
+    read_health(&snapshot);
+
+    pthread_mutex_lock(&snapshot_lock);
+    latest = snapshot;
+    pthread_mutex_unlock(&snapshot_lock);
+}
+
+// Take the first sample and arm a periodic timer; returns its fd for the epoll set,
+// or -1 if none could be created (health then keeps its last snapshot)
+int health_sampler_start(void)
+{
+    take_sample();
+
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1)
+    {
+        perror("timerfd_create");
+        return -1;
+    }
+
+    // First CPU reading after a short delay, then one sample per interval
+    struct itimerspec spec = {
+        .it_interval = {HEALTH_SAMPLE_INTERVAL_MS / 1000, (HEALTH_SAMPLE_INTERVAL_MS % 1000) * 1000000L},
+        .it_value = {0, 100 * 1000000L}};
+    if (timerfd_settime(timer_fd, 0, &spec, NULL) == -1)
+    {
+        perror("timerfd_settime");
+        close(timer_fd);
+        return -1;
+    }
+    return timer_fd;
+}
+
+// Timer expired: acknowledge it and sample
+void health_sampler_tick(int timer_fd)
+{
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+    {
+        perror("timerfd read");
+    }
+    take_sample();
+}
+
+// Copy the latest published snapshot
+void health_get_snapshot(health_snapshot_t *snapshot)
+{
+    pthread_mutex_lock(&snapshot_lock);
+    *snapshot = latest;
+    pthread_mutex_unlock(&snapshot_lock);
+}
@@ -0,0 +1,25 @@
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include "commands.h"
+
+/**
+ * @file health.h
+ * @brief Background health sampling for the epoll server
+ *
+ * One event loop owns a timerfd (health_sampler_start()) and calls
+ * health_sampler_tick() each time it fires. A tick reads /proc/stat, the thermal
+ * zone, statvfs("/") and sysinfo() - a few microseconds, no sleeping - and publishes
+ * a snapshot with CPU usage over the last interval and over the last minute.
+ * health_get_snapshot() copies the latest one from any thread, so `health` is
+ * answered without touching /proc at all.
+ */
+
+#define HEALTH_SAMPLE_INTERVAL_MS 1000 // Time between samples
+#define HEALTH_WINDOW_SAMPLES 60       // Samples the rolling CPU average covers
+
+int health_sampler_start(void);
+void health_sampler_tick(int timer_fd);
+void health_get_snapshot(health_snapshot_t *snapshot);
+
+#endif
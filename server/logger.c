@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+#include "logger.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+
+#define LOG_RING_SLOTS 4096        // Queued lines, power of two
+#define LOG_LINE_MAX 256           // Longer messages are cut
+#define LOG_BATCH_BYTES 65536      // Written to stdout with one call
+#define LOG_IDLE_SLEEP_NS 5000000L // Flusher pause when the ring is empty
+
+// One queued line; sequence says whose turn the slot is: equal to the ring position
+// it is free for a producer, one past it the line is published for the flusher
+typedef struct
+{
+    unsigned long sequence;
+    int len;
+    char text[LOG_LINE_MAX];
+} log_slot_t;
+
+log_level_t logger_level = LOG_LEVEL_INFO;
+
+static log_slot_t ring[LOG_RING_SLOTS];
+static unsigned long ring_tail = 0; // Next position producers claim
+static unsigned long ring_head = 0; // Next position the flusher reads, flusher only
+static long dropped = 0;            // Lines lost to a full ring
+static int running = 0;
+static pthread_t flusher;
+
+// Format a line, cutting it at the slot size but keeping its newline
+static int format_line(char *out, const char *format, va_list args)
+{
+    int len = vsnprintf(out, LOG_LINE_MAX, format, args);
+    if (len < 0)
+        return 0;
+    if (len >= LOG_LINE_MAX)
+    {
+        len = LOG_LINE_MAX - 1;
+        out[len - 1] = '\n';
+    }
+    return len;
+}
+
+// Move published lines to stdout; returns how many were written
+static int drain_ring(void)
+{
+    char batch[LOG_BATCH_BYTES];
+    size_t batch_len = 0;
+    int lines = 0;
+
+    while (1)
+    {
+        log_slot_t *slot = &ring[ring_head & (LOG_RING_SLOTS - 1)];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != ring_head + 1)
+            break;
+
+        if (batch_len + slot->len > sizeof(batch))
+        {
+            fwrite(batch, 1, batch_len, stdout);
+            batch_len = 0;
+        }
+        memcpy(batch + batch_len, slot->text, slot->len);
+        batch_len += slot->len;
+
+        // Hand the slot back to producers one lap later
+        __atomic_store_n(&slot->sequence, ring_head + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+        ring_head++;
+        lines++;
+    }
+
+    long lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+    if (batch_len > 0 || lost > 0)
+    {
+        fwrite(batch, 1, batch_len, stdout);
+        if (lost > 0)
+            printf("[log] %ld messages dropped, ring full\n", lost);
+        fflush(stdout);
+    }
+    return lines;
+}
+
+static void *flusher_main(void *arg)
+{
+    (void)arg;
+    struct timespec idle = {0, LOG_IDLE_SLEEP_NS};
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    {
+        if (drain_ring() == 0)
+            nanosleep(&idle, NULL);
+    }
+    drain_ring();
+    return NULL;
+}
+
+// Start the flusher thread; from now on logging never touches stdio on the caller's thread
+int logger_start(log_level_t level)
+{
+    logger_level = level;
+    if (running)
+        return 0;
+
+    for (unsigned long i = 0; i < LOG_RING_SLOTS; i++)
+    {
+        ring[i].sequence = i;
+    }
+    fflush(stdout);
+
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0)
+    {
+        perror("logger: pthread_create");
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
+    return 0;
+}
+
+// Write out everything queued and go back to synchronous logging
+void logger_stop(void)
+{
+    if (!__atomic_exchange_n(&running, 0, __ATOMIC_ACQ_REL))
+        return;
+    pthread_join(flusher, NULL);
+}
+
+void logger_set_level(log_level_t level)
+{
+    logger_level = level;
+}
+
+// Map "debug", "info", "warning" or "error" to a level; returns -1 if unknown
+int logger_parse_level(const char *name, log_level_t *level)
+{
+    static const char *names[] = {"debug", "info", "warning", "error"};
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++)
+    {
+        if (strcasecmp(name, names[i]) == 0)
+        {
+            *level = (log_level_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Queue one message; callers go through the LOG_* macros, which check the level first
+void logger_write(log_level_t level, const char *format, ...)
+{
+    (void)level;
+    va_list args;
+
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    {
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+        return;
+    }
+
+    // Claim a free slot (bounded multi-producer queue)
+    unsigned long pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+    log_slot_t *slot;
+    while (1)
+    {
+        slot = &ring[pos & (LOG_RING_SLOTS - 1)];
+        long diff = (long)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&ring_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // The flusher is a whole lap behind
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else
+        {
+            pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    va_start(args, format);
+    slot->len = format_line(slot->text, format, args);
+    va_end(args);
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,54 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+/**
+ * @file logger.h
+ * @brief Leveled console logging through a lock-free ring and a flusher thread
+ *
+ * Callers format a message into a slot of a fixed-size ring buffer and return; a
+ * background thread writes the queued lines to stdout and flushes once per batch, so
+ * an event loop never waits on the terminal. Any thread may log. When the ring is
+ * full the message is dropped and counted rather than blocking the caller.
+ *
+ * Messages below the runtime level (logger_set_level(), `--log-level`) are skipped
+ * before any formatting. LOG_DEBUG() only exists in builds with LOG_DEBUG_ENABLED
+ * defined (`make -f Makefile_epoll DEBUG_LOG=1`); otherwise it expands to nothing and
+ * its arguments are never evaluated, so per-chunk tracing costs the hot path nothing.
+ *
+ * Until logger_start() runs (and in programs that never call it) messages are written
+ * synchronously, so the shared command code works in the threaded server as well.
+ */
+
+typedef enum
+{
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_ERROR
+} log_level_t;
+
+extern log_level_t logger_level;
+
+int logger_start(log_level_t level);
+void logger_stop(void);
+void logger_set_level(log_level_t level);
+int logger_parse_level(const char *name, log_level_t *level);
+void logger_write(log_level_t level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#define LOG_AT(level, ...)                   \
+    do                                       \
+    {                                        \
+        if ((level) >= logger_level)         \
+            logger_write(level, __VA_ARGS__); \
+    } while (0)
+
+#ifdef LOG_DEBUG_ENABLED
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void)0)
+#endif
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARNING(...) LOG_AT(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif
@@ -2,23 +2,182 @@
 #include "server.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 int main(int argc, char *argv[])
 {
-    int port = 8080; // Default port
+    server_options_t options = {
+        .port = 8080,       // Default port
+        .workers = 1,        // Event-loop threads
+        .max_clients = 1024, // Connection cap
+        .io_threads = 2,     // Upload disk writer threads
+        .dir_cache_mb = 8,   // Listing cache per worker
+        .file_cache_mb = 0,  // Download cache per worker, off unless asked for
+        .session_rate_kb = 0, // Download rate limits in KiB/s, none unless asked for
+        .ip_rate_kb = 0,
+        .global_rate_kb = 0,
+        .edge_triggered = 0, // Level-triggered client sockets
+        .max_events = 64,    // Events per epoll_wait()
+        .idle_timeout = 0,      // Session timeouts in seconds, none unless asked for
+        .command_timeout = 0,
+        .transfer_timeout = 0,
+        .direct_upload_mb = 0,  // Uploads go through the page cache unless asked otherwise
+        .log_level = LOG_LEVEL_INFO
+    };
 
-    if (argc > 1)
+    for (int i = 1; i < argc; i++)
     {
-        port = atoi(argv[1]);
-        if (port <= 0 || port > 65535)
+        if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
         {
-            fprintf(stderr, "Invalid port number. Using default port 8080.\n");
-            port = 8080;
+            options.workers = atoi(argv[++i]);
+            if (options.workers <= 0)
+            {
+                fprintf(stderr, "Invalid worker count. Using 1 worker.\n");
+                options.workers = 1;
+            }
+        }
+        else if (strcmp(argv[i], "--max-clients") == 0 && i + 1 < argc)
+        {
+            options.max_clients = atoi(argv[++i]);
+            if (options.max_clients <= 0)
+            {
+                fprintf(stderr, "Invalid client limit. Using 1024 clients.\n");
+                options.max_clients = 1024;
+            }
+        }
+        else if (strcmp(argv[i], "--io-threads") == 0 && i + 1 < argc)
+        {
+            options.io_threads = atoi(argv[++i]);
+            if (options.io_threads < 0)
+            {
+                fprintf(stderr, "Invalid I/O thread count. Using 2 threads.\n");
+                options.io_threads = 2;
+            }
+        }
+        else if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc)
+        {
+            options.metrics_port = atoi(argv[++i]);
+            if (options.metrics_port <= 0 || options.metrics_port > 65535)
+            {
+                fprintf(stderr, "Invalid metrics port. Metrics are only available through the metrics command.\n");
+                options.metrics_port = 0;
+            }
+        }
+        else if (strcmp(argv[i], "--dir-cache-mb") == 0 && i + 1 < argc)
+        {
+            options.dir_cache_mb = atoi(argv[++i]);
+            if (options.dir_cache_mb < 0)
+            {
+                fprintf(stderr, "Invalid listing cache size. Using 8 MiB.\n");
+                options.dir_cache_mb = 8;
+            }
+        }
+        else if (strcmp(argv[i], "--file-cache-mb") == 0 && i + 1 < argc)
+        {
+            options.file_cache_mb = atoi(argv[++i]);
+            if (options.file_cache_mb < 0)
+            {
+                fprintf(stderr, "Invalid download cache size. Downloads are not cached.\n");
+                options.file_cache_mb = 0;
+            }
+        }
+        else if (strcmp(argv[i], "--session-rate-kb") == 0 && i + 1 < argc)
+        {
+            options.session_rate_kb = atoi(argv[++i]);
+            if (options.session_rate_kb < 0)
+            {
+                fprintf(stderr, "Invalid session rate limit. Sessions are not limited.\n");
+                options.session_rate_kb = 0;
+            }
+        }
+        else if (strcmp(argv[i], "--ip-rate-kb") == 0 && i + 1 < argc)
+        {
+            options.ip_rate_kb = atoi(argv[++i]);
+            if (options.ip_rate_kb < 0)
+            {
+                fprintf(stderr, "Invalid per-address rate limit. Addresses are not limited.\n");
+                options.ip_rate_kb = 0;
+            }
+        }
+        else if (strcmp(argv[i], "--global-rate-kb") == 0 && i + 1 < argc)
+        {
+            options.global_rate_kb = atoi(argv[++i]);
+            if (options.global_rate_kb < 0)
+            {
+                fprintf(stderr, "Invalid global rate limit. The server is not limited.\n");
+                options.global_rate_kb = 0;
+            }
+        }
+        else if (strcmp(argv[i], "--edge-triggered") == 0)
+        {
+            options.edge_triggered = 1;
+        }
+        else if (strcmp(argv[i], "--max-events") == 0 && i + 1 < argc)
+        {
+            options.max_events = atoi(argv[++i]);
+            if (options.max_events <= 0)
+            {
+                fprintf(stderr, "Invalid event batch size. Using 64 events.\n");
+                options.max_events = 64;
+            }
+        }
+        else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc)
+        {
+            options.idle_timeout = atoi(argv[++i]);
+            if (options.idle_timeout < 0)
+            {
+                fprintf(stderr, "Invalid idle timeout. Idle sessions are kept.\n");
+                options.idle_timeout = 0;
+            }
+        }
+        else if (strcmp(argv[i], "--command-timeout") == 0 && i + 1 < argc)
+        {
+            options.command_timeout = atoi(argv[++i]);
+            if (options.command_timeout < 0)
+            {
+                fprintf(stderr, "Invalid command timeout. Commands may take any time.\n");
+                options.command_timeout = 0;
+            }
+        }
+        else if (strcmp(argv[i], "--transfer-timeout") == 0 && i + 1 < argc)
+        {
+            options.transfer_timeout = atoi(argv[++i]);
+            if (options.transfer_timeout < 0)
+            {
+                fprintf(stderr, "Invalid transfer timeout. Stalled transfers are kept.\n");
+                options.transfer_timeout = 0;
+            }
+        }
+        else if (strcmp(argv[i], "--direct-upload-mb") == 0 && i + 1 < argc)
+        {
+            options.direct_upload_mb = atoi(argv[++i]);
+            if (options.direct_upload_mb < 0)
+            {
+                fprintf(stderr, "Invalid direct upload size. Uploads use the page cache.\n");
+                options.direct_upload_mb = 0;
+            }
+        }
+        else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc)
+        {
+            if (logger_parse_level(argv[++i], &options.log_level) == -1)
+            {
+                fprintf(stderr, "Invalid log level. Using info.\n");
+                options.log_level = LOG_LEVEL_INFO;
+            }
+        }
+        else
+        {
+            options.port = atoi(argv[i]);
+            if (options.port <= 0 || options.port > 65535)
+            {
+                fprintf(stderr, "Invalid port number. Using default port 8080.\n");
+                options.port = 8080;
+            }
         }
     }
 
-    printf("Starting epoll-based FTP server on port %d\n", port);
-    start_epoll_server(port);
+    printf("Starting epoll-based FTP server on port %d\n", options.port);
+    start_epoll_server(&options);
 
     return 0;
 }
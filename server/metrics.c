@@ -0,0 +1,421 @@
+#define _GNU_SOURCE
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+
+#define METRICS_HTTP_MAX_CONNS 8    // Concurrent scrapes, more are refused
+#define METRICS_HTTP_REQUEST_MAX 2048
+
+static const char *command_names[METRIC_CMD_KINDS] = {"get", "upload", "ls", "cd", "delete", "rename", "other"};
+
+// Upper bounds of the histogram buckets
+static const long latency_bounds_us[] = {50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+                                         250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000, 60000000};
+static const long wakeup_bounds[] = {1, 2, 4, 8, 16, 32, 64};
+static const long disk_bounds_us[] = {10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+                                      250000, 1000000};
+#define BOUNDS(array) array, (int)(sizeof(array) / sizeof(array[0]))
+
+// Every thread's metrics, summed when a report is built
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static metrics_t *registry = NULL;
+
+__thread metrics_t *thread_metrics = NULL;
+
+// A scrape connection on the HTTP port, owned by the event loop that listens
+typedef struct
+{
+    int fd; // -1 while the slot is free
+    size_t len;
+    char request[METRICS_HTTP_REQUEST_MAX];
+} http_conn_t;
+
+static http_conn_t http_conns[METRICS_HTTP_MAX_CONNS];
+
+// Give the calling event-loop thread its own counters
+int metrics_attach(void)
+{
+    if (thread_metrics)
+        return 0;
+
+    metrics_t *metrics = calloc(1, sizeof(metrics_t));
+    if (!metrics)
+    {
+        perror("calloc");
+        return -1;
+    }
+    pthread_mutex_lock(&registry_lock);
+    metrics->next = registry;
+    registry = metrics;
+    pthread_mutex_unlock(&registry_lock);
+    thread_metrics = metrics;
+    return 0;
+}
+
+unsigned long long metrics_now_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+static void observe(histogram_t *histogram, const long *bounds, int bound_count, long value)
+{
+    int bucket = 0;
+    while (bucket < bound_count && value > bounds[bucket])
+        bucket++;
+    __atomic_add_fetch(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->sum, value, __ATOMIC_RELAXED);
+}
+
+void metrics_observe_command(metric_command_t command, unsigned long long micros)
+{
+    observe(&thread_metrics->command_latency[command], BOUNDS(latency_bounds_us), (long)micros);
+}
+
+void metrics_observe_wakeup(int events)
+{
+    METRIC_INC(epoll_wakeups);
+    observe(&thread_metrics->wakeup_events, BOUNDS(wakeup_bounds), events);
+}
+
+void metrics_observe_disk_write(unsigned long long micros)
+{
+    observe(&thread_metrics->disk_write, BOUNDS(disk_bounds_us), (long)micros);
+}
+
+// Add up all threads; metrics_t is nothing but longs up to its registry link
+static void sum_metrics(metrics_t *total)
+{
+    memset(total, 0, sizeof(*total));
+    long *sum = (long *)total;
+    size_t fields = offsetof(metrics_t, next) / sizeof(long);
+
+    pthread_mutex_lock(&registry_lock);
+    for (metrics_t *metrics = registry; metrics; metrics = metrics->next)
+    {
+        long *values = (long *)metrics;
+        for (size_t i = 0; i < fields; i++)
+        {
+            sum[i] += __atomic_load_n(&values[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static double hit_ratio(long hits, long misses)
+{
+    return hits + misses > 0 ? (double)hits / (hits + misses) : 0;
+}
+
+static void emit(reply_t *reply, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void emit(reply_t *reply, const char *format, ...)
+{
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len > 0)
+        reply_write(reply, line, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1);
+}
+
+static void emit_counter(reply_t *reply, const char *name, const char *help, long value)
+{
+    emit(reply, "# HELP %s %s\n# TYPE %s counter\n%s %ld\n", name, help, name, name, value);
+}
+
+// One Prometheus histogram series; scale turns the stored unit into the exported one
+static void emit_histogram(reply_t *reply, const char *name, const char *labels, const histogram_t *histogram,
+                           const long *bounds, int bound_count, double scale)
+{
+    const char *sep = labels[0] ? "," : "";
+    long cumulative = 0;
+    for (int i = 0; i < bound_count; i++)
+    {
+        cumulative += histogram->buckets[i];
+        emit(reply, "%s_bucket{%s%sle=\"%g\"} %ld\n", name, labels, sep, bounds[i] * scale, cumulative);
+    }
+    emit(reply, "%s_bucket{%s%sle=\"+Inf\"} %ld\n", name, labels, sep, histogram->count);
+    const char *open_brace = labels[0] ? "{" : "";
+    const char *close_brace = labels[0] ? "}" : "";
+    emit(reply, "%s_sum%s%s%s %g\n", name, open_brace, labels, close_brace, histogram->sum * scale);
+    emit(reply, "%s_count%s%s%s %ld\n", name, open_brace, labels, close_brace, histogram->count);
+}
+
+void metrics_format_prometheus(reply_t *reply)
+{
+    metrics_t total;
+    sum_metrics(&total);
+    char labels[64];
+
+    emit(reply, "# HELP ftp_commands_total Commands received, by command\n# TYPE ftp_commands_total counter\n");
+    for (int i = 0; i < METRIC_CMD_KINDS; i++)
+    {
+        emit(reply, "ftp_commands_total{command=\"%s\"} %ld\n", command_names[i], total.commands[i]);
+    }
+
+    emit(reply, "# HELP ftp_command_duration_seconds Command latency; get and upload cover the whole transfer\n"
+                "# TYPE ftp_command_duration_seconds histogram\n");
+    for (int i = 0; i < METRIC_CMD_KINDS; i++)
+    {
+        snprintf(labels, sizeof(labels), "command=\"%s\"", command_names[i]);
+        emit_histogram(reply, "ftp_command_duration_seconds", labels, &total.command_latency[i],
+                       BOUNDS(latency_bounds_us), 1e-6);
+    }
+
+    emit_counter(reply, "ftp_received_bytes_total", "Bytes read from client sockets", total.bytes_in);
+    emit_counter(reply, "ftp_sent_bytes_total", "Bytes written to client sockets", total.bytes_out);
+
+    emit(reply, "# HELP ftp_sessions Open sessions, by state\n# TYPE ftp_sessions gauge\n");
+    static const char *states[] = {"command", "upload", "download"};
+    for (int i = 0; i < 3; i++)
+    {
+        emit(reply, "ftp_sessions{state=\"%s\"} %ld\n", states[i], total.sessions[i]);
+    }
+
+    emit_counter(reply, "ftp_epoll_wakeups_total", "epoll_wait() calls that returned events", total.epoll_wakeups);
+    emit(reply, "# HELP ftp_epoll_events_per_wakeup Events returned by one epoll_wait()\n"
+                "# TYPE ftp_epoll_events_per_wakeup histogram\n");
+    emit_histogram(reply, "ftp_epoll_events_per_wakeup", "", &total.wakeup_events, BOUNDS(wakeup_bounds), 1);
+
+    emit_counter(reply, "ftp_send_eagain_total", "Sends that found the socket buffer full", total.send_eagain);
+    emit_counter(reply, "ftp_upload_chunks_total", "Upload chunks received", total.upload_chunks);
+    emit_counter(reply, "ftp_recv_calls_total", "Reads from client sockets", total.recv_calls);
+    emit_counter(reply, "ftp_upload_direct_bytes_total", "Upload payload bytes read straight into their chunk buffer",
+                 total.upload_direct_bytes);
+    emit_counter(reply, "ftp_upload_uncached_bytes_total", "Upload bytes written with O_DIRECT, past the page cache",
+                 total.upload_uncached_bytes);
+
+    emit(reply, "# HELP ftp_disk_write_seconds Time spent writing one upload chunk\n"
+                "# TYPE ftp_disk_write_seconds histogram\n");
+    emit_histogram(reply, "ftp_disk_write_seconds", "", &total.disk_write, BOUNDS(disk_bounds_us), 1e-6);
+
+    emit_counter(reply, "ftp_dircache_hits_total", "ls replies served from the listing cache", total.dircache_hits);
+    emit_counter(reply, "ftp_dircache_misses_total", "Cacheable ls replies that read the directory",
+                 total.dircache_misses);
+    emit_counter(reply, "ftp_dircache_invalidations_total", "Cached listings dropped by a directory change",
+                 total.dircache_invalidations);
+    emit(reply, "# HELP ftp_dircache_bytes Bytes held by cached listings\n# TYPE ftp_dircache_bytes gauge\n"
+                "ftp_dircache_bytes %ld\n", total.dircache_bytes);
+
+    emit_counter(reply, "ftp_compressed_chunks_total", "Chunks sent or received LZ4 compressed",
+                 total.compressed_chunks);
+    emit_counter(reply, "ftp_compression_saved_bytes_total", "Payload bytes compression kept off the wire",
+                 total.compression_saved_bytes);
+    emit_counter(reply, "ftp_checksum_failures_total", "Upload chunks rejected for a CRC32C mismatch",
+                 total.checksum_failures);
+
+    emit_counter(reply, "ftp_filecache_hits_total", "Downloads sent from the file cache", total.filecache_hits);
+    emit_counter(reply, "ftp_filecache_misses_total", "Cacheable downloads that read the file",
+                 total.filecache_misses);
+    emit_counter(reply, "ftp_filecache_served_bytes_total", "Bytes sent from cached downloads",
+                 total.filecache_served_bytes);
+    emit(reply, "# HELP ftp_filecache_bytes Bytes held by cached downloads\n# TYPE ftp_filecache_bytes gauge\n"
+                "ftp_filecache_bytes %ld\n", total.filecache_bytes);
+    emit(reply, "# HELP ftp_filecache_hit_ratio Share of cacheable downloads sent from the cache\n"
+                "# TYPE ftp_filecache_hit_ratio gauge\nftp_filecache_hit_ratio %.4f\n",
+         hit_ratio(total.filecache_hits, total.filecache_misses));
+
+    emit_counter(reply, "ftp_download_throttles_total", "Times a download paused for its rate limit",
+                 total.download_throttles);
+    emit(reply, "# HELP ftp_throttled_sessions Downloads waiting for their rate limit to refill\n"
+                "# TYPE ftp_throttled_sessions gauge\nftp_throttled_sessions %ld\n", total.throttled_sessions);
+
+    emit(reply, "# HELP ftp_session_timeouts_total Sessions closed for a missed deadline, by state\n"
+                "# TYPE ftp_session_timeouts_total counter\n");
+    for (int i = 0; i < 3; i++)
+    {
+        emit(reply, "ftp_session_timeouts_total{state=\"%s\"} %ld\n", states[i], total.session_timeouts[i]);
+    }
+}
+
+// Histogram as {"count":..,"sum":..,"buckets":{"<bound>":n,...,"inf":n}}, non-cumulative
+static void emit_json_histogram(reply_t *reply, const histogram_t *histogram, const long *bounds, int bound_count)
+{
+    emit(reply, "{\"count\":%ld,\"sum\":%ld,\"buckets\":{", histogram->count, histogram->sum);
+    for (int i = 0; i < bound_count; i++)
+    {
+        emit(reply, "\"%ld\":%ld,", bounds[i], histogram->buckets[i]);
+    }
+    emit(reply, "\"inf\":%ld}}", histogram->buckets[bound_count]);
+}
+
+void metrics_format_json(reply_t *reply)
+{
+    metrics_t total;
+    sum_metrics(&total);
+
+    emit(reply, "{\"commands\":{");
+    for (int i = 0; i < METRIC_CMD_KINDS; i++)
+    {
+        emit(reply, "%s\"%s\":{\"count\":%ld,\"latency_us\":", i ? "," : "", command_names[i], total.commands[i]);
+        emit_json_histogram(reply, &total.command_latency[i], BOUNDS(latency_bounds_us));
+        emit(reply, "}");
+    }
+    emit(reply, "},\"bytes_in\":%ld,\"bytes_out\":%ld", total.bytes_in, total.bytes_out);
+    emit(reply, ",\"sessions\":{\"command\":%ld,\"upload\":%ld,\"download\":%ld}",
+         total.sessions[0], total.sessions[1], total.sessions[2]);
+    emit(reply, ",\"epoll_wakeups\":%ld,\"events_per_wakeup\":", total.epoll_wakeups);
+    emit_json_histogram(reply, &total.wakeup_events, BOUNDS(wakeup_bounds));
+    emit(reply, ",\"send_eagain\":%ld,\"upload_chunks\":%ld,\"recv_calls\":%ld,\"upload_direct_bytes\":%ld",
+         total.send_eagain, total.upload_chunks, total.recv_calls, total.upload_direct_bytes);
+    emit(reply, ",\"upload_uncached_bytes\":%ld", total.upload_uncached_bytes);
+    emit(reply, ",\"disk_write_us\":");
+    emit_json_histogram(reply, &total.disk_write, BOUNDS(disk_bounds_us));
+    emit(reply, ",\"dircache\":{\"hits\":%ld,\"misses\":%ld,\"invalidations\":%ld,\"bytes\":%ld}",
+         total.dircache_hits, total.dircache_misses, total.dircache_invalidations, total.dircache_bytes);
+    emit(reply, ",\"compressed_chunks\":%ld,\"compression_saved_bytes\":%ld,\"checksum_failures\":%ld",
+         total.compressed_chunks, total.compression_saved_bytes, total.checksum_failures);
+    emit(reply, ",\"filecache\":{\"hits\":%ld,\"misses\":%ld,\"hit_ratio\":%.4f,\"served_bytes\":%ld,\"bytes\":%ld}",
+         total.filecache_hits, total.filecache_misses, hit_ratio(total.filecache_hits, total.filecache_misses),
+         total.filecache_served_bytes, total.filecache_bytes);
+    emit(reply, ",\"download_throttles\":%ld,\"throttled_sessions\":%ld", total.download_throttles,
+         total.throttled_sessions);
+    emit(reply, ",\"session_timeouts\":{\"command\":%ld,\"upload\":%ld,\"download\":%ld}}\n",
+         total.session_timeouts[0], total.session_timeouts[1], total.session_timeouts[2]);
+}
+
+// Listening socket for scrapes; returns -1 (and the server runs without it) on failure
+int metrics_http_listen(int port)
+{
+    for (int i = 0; i < METRICS_HTTP_MAX_CONNS; i++)
+    {
+        http_conns[i].fd = -1;
+    }
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1)
+    {
+        perror("metrics: socket");
+        return -1;
+    }
+
+    int opt = 1;
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1 ||
+        bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listen_fd, 16) == -1)
+    {
+        perror("metrics: bind");
+        close(listen_fd);
+        return -1;
+    }
+    return listen_fd;
+}
+
+// Whether an epoll data.ptr is one of the scrape connections
+int metrics_http_owns(const void *ptr)
+{
+    return (const char *)ptr >= (const char *)http_conns &&
+           (const char *)ptr < (const char *)(http_conns + METRICS_HTTP_MAX_CONNS);
+}
+
+static void close_http_conn(int epoll_fd, http_conn_t *conn)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+}
+
+void metrics_http_accept(int epoll_fd, int listen_fd)
+{
+    int fd;
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+    {
+        http_conn_t *conn = NULL;
+        for (int i = 0; i < METRICS_HTTP_MAX_CONNS && !conn; i++)
+        {
+            if (http_conns[i].fd == -1)
+                conn = &http_conns[i];
+        }
+
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+        if (!conn || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+        {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->len = 0;
+    }
+}
+
+// Answer a complete request with the report its path asks for
+static void respond(http_conn_t *conn)
+{
+    reply_t body = {.sock = -1, .buffered = 1};
+    const char *status = "200 OK";
+    const char *type = "text/plain; version=0.0.4";
+
+    if (strncmp(conn->request, "GET /metrics.json ", 18) == 0)
+    {
+        type = "application/json";
+        metrics_format_json(&body);
+    }
+    else if (strncmp(conn->request, "GET /metrics ", 13) == 0 || strncmp(conn->request, "GET / ", 6) == 0)
+    {
+        metrics_format_prometheus(&body);
+    }
+    else
+    {
+        status = "404 Not Found";
+        reply_write(&body, "Not found\n", 10);
+    }
+
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                              status, type, body.len);
+
+    // A report fits the socket buffer; a scraper too slow to take it just gets less
+    struct iovec iov[2] = {{header, header_len}, {body.data, body.len}};
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = body.len ? 2 : 1};
+    if (sendmsg(conn->fd, &msg, MSG_NOSIGNAL) < header_len + (ssize_t)body.len)
+    {
+        perror("metrics: send");
+    }
+    free(body.data);
+}
+
+void metrics_http_event(int epoll_fd, void *ptr, unsigned int events)
+{
+    http_conn_t *conn = ptr;
+    if (events & (EPOLLERR | EPOLLHUP))
+    {
+        close_http_conn(epoll_fd, conn);
+        return;
+    }
+
+    ssize_t result = recv(conn->fd, conn->request + conn->len, sizeof(conn->request) - 1 - conn->len, 0);
+    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (result <= 0)
+    {
+        close_http_conn(epoll_fd, conn);
+        return;
+    }
+    conn->len += result;
+    conn->request[conn->len] = '\0';
+
+    // Only the request line matters, but wait for the whole header before answering
+    if (strstr(conn->request, "\r\n\r\n") || conn->len == sizeof(conn->request) - 1)
+    {
+        respond(conn);
+        close_http_conn(epoll_fd, conn);
+    }
+}
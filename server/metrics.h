@@ -0,0 +1,93 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "commands.h"
+
+/**
+ * @file metrics.h
+ * @brief Server-internal counters and latency histograms for the epoll server
+ *
+ * Every event-loop thread calls metrics_attach() once and then updates its own
+ * metrics_t through the METRIC_* macros; the counters are only ever written by
+ * their thread (relaxed atomics, no shared cache lines between workers) and are
+ * summed across threads when a report is formatted.
+ *
+ * Reports come in two formats: Prometheus text exposition (`metrics` command,
+ * `GET /metrics` on the HTTP port) and JSON (`metrics json`, `GET /metrics.json`).
+ * Durations are kept in microseconds and exported in seconds for Prometheus.
+ */
+
+// Commands with their own count and latency histogram
+typedef enum
+{
+    METRIC_CMD_GET,
+    METRIC_CMD_UPLOAD,
+    METRIC_CMD_LS,
+    METRIC_CMD_CD,
+    METRIC_CMD_DELETE,
+    METRIC_CMD_RENAME,
+    METRIC_CMD_OTHER,
+    METRIC_CMD_KINDS
+} metric_command_t;
+
+#define METRICS_MAX_BUCKETS 20
+
+// Non-cumulative bucket counts; buckets[n] past the last bound counts the overflow
+typedef struct
+{
+    long buckets[METRICS_MAX_BUCKETS + 1];
+    long count;
+    long sum;
+} histogram_t;
+
+typedef struct metrics
+{
+    long commands[METRIC_CMD_KINDS];
+    histogram_t command_latency[METRIC_CMD_KINDS]; // Microseconds; get/upload: whole transfer
+    long bytes_in;
+    long bytes_out;
+    long sessions[3];           // Open sessions by state (gauge)
+    long epoll_wakeups;         // epoll_wait() calls that returned events
+    histogram_t wakeup_events;  // Events per wakeup
+    long send_eagain;           // Sends that hit a full socket buffer
+    long upload_chunks;         // Upload chunks received
+    long recv_calls;            // Reads from client sockets
+    long upload_direct_bytes;   // Upload payload bytes read straight into their chunk buffer
+    long upload_uncached_bytes; // Upload bytes written with O_DIRECT, past the page cache
+    histogram_t disk_write;     // Microseconds spent in pwrite() per chunk
+    long dircache_hits;         // ls answered from a cached listing
+    long dircache_misses;       // Cacheable ls that had to read the directory
+    long dircache_invalidations; // Cached listings dropped by a directory change
+    long dircache_bytes;        // Bytes of cached listings (gauge)
+    long compressed_chunks;     // Chunks sent or received as LZ4 blocks
+    long compression_saved_bytes; // Payload bytes LZ4 kept off the wire
+    long checksum_failures;     // Upload chunks rejected for a CRC32C mismatch
+    long filecache_hits;        // Downloads sent from the file cache
+    long filecache_misses;      // Cacheable downloads that had to read the file
+    long filecache_served_bytes; // Bytes sent from cached downloads
+    long filecache_bytes;       // Bytes of cached downloads (gauge)
+    long download_throttles;    // Times a download paused on an empty token bucket
+    long throttled_sessions;    // Downloads waiting for their rate limit to refill (gauge)
+    long session_timeouts[3];   // Sessions closed for a missed deadline, by state
+    struct metrics *next;       // Registry link
+} metrics_t;
+
+extern __thread metrics_t *thread_metrics;
+
+#define METRIC_ADD(field, n) __atomic_add_fetch(&thread_metrics->field, (n), __ATOMIC_RELAXED)
+#define METRIC_INC(field) METRIC_ADD(field, 1)
+
+int metrics_attach(void);
+unsigned long long metrics_now_us(void);
+void metrics_observe_command(metric_command_t command, unsigned long long micros);
+void metrics_observe_wakeup(int events);
+void metrics_observe_disk_write(unsigned long long micros);
+void metrics_format_prometheus(reply_t *reply);
+void metrics_format_json(reply_t *reply);
+
+int metrics_http_listen(int port);
+int metrics_http_owns(const void *ptr);
+void metrics_http_accept(int epoll_fd, int listen_fd);
+void metrics_http_event(int epoll_fd, void *ptr, unsigned int events);
+
+#endif
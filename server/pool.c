@@ -0,0 +1,124 @@
+#define _POSIX_C_SOURCE 200112L
+#include "pool.h"
+#include <stdlib.h>
+
+#define POOL_MIN_SHIFT 6                          // Smallest class: 64 bytes
+#define POOL_MAX_SHIFT 23                         // Largest class: 8 MiB
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_CACHE_BYTES_PER_CLASS (8 * 1024 * 1024)
+#define POOL_MAX_CACHED_PER_CLASS 256
+#define POOL_PAGE_SIZE 4096 // Classes this large start on a page boundary
+
+typedef struct pool_block
+{
+    struct pool_block *next;
+} pool_block_t;
+
+// Free lists are per thread, every worker recycles the blocks it allocated
+static __thread pool_block_t *free_lists[POOL_CLASSES];
+static __thread int cached_blocks[POOL_CLASSES];
+
+// Occupancy counters across all threads
+static pool_stats_t stats;
+
+// A class's capacity: its power of two, plus the headroom from a page up, so a chunk
+// buffer with its frame and chunk headers in front still fits the chunk's own class
+static size_t class_size(int cls)
+{
+    size_t size = (size_t)1 << (cls + POOL_MIN_SHIFT);
+    return size >= POOL_PAGE_SIZE ? size + POOL_HEADROOM : size;
+}
+
+// Map a request to its size class, or -1 if it is too large to pool
+static int size_class(size_t size)
+{
+    int cls = 0;
+    while (cls < POOL_CLASSES && class_size(cls) < size)
+        cls++;
+    return cls == POOL_CLASSES ? -1 : cls;
+}
+
+static int class_cache_limit(int cls)
+{
+    size_t limit = POOL_CACHE_BYTES_PER_CLASS / ((size_t)1 << (cls + POOL_MIN_SHIFT)); // Headroom aside
+    if (limit < 1)
+        limit = 1;
+    if (limit > POOL_MAX_CACHED_PER_CLASS)
+        limit = POOL_MAX_CACHED_PER_CLASS;
+    return (int)limit;
+}
+
+void *pool_alloc(size_t size)
+{
+    int cls = size_class(size);
+    if (cls < 0)
+    {
+        void *block = malloc(size);
+        if (block)
+        {
+            __atomic_add_fetch(&stats.blocks_in_use, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&stats.bytes_in_use, (long)size, __ATOMIC_RELAXED);
+        }
+        return block;
+    }
+
+    long capacity = (long)class_size(cls);
+    pool_block_t *block = free_lists[cls];
+    if (block)
+    {
+        free_lists[cls] = block->next;
+        cached_blocks[cls]--;
+        __atomic_sub_fetch(&stats.blocks_cached, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&stats.bytes_cached, capacity, __ATOMIC_RELAXED);
+    }
+    else if (capacity >= POOL_PAGE_SIZE)
+    {
+        // Chunk buffers are read into and written out whole, keep them page aligned
+        void *aligned;
+        if (posix_memalign(&aligned, POOL_PAGE_SIZE, capacity) != 0)
+            return NULL;
+        block = aligned;
+    }
+    else
+    {
+        block = malloc(capacity);
+        if (!block)
+            return NULL;
+    }
+
+    __atomic_add_fetch(&stats.blocks_in_use, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.bytes_in_use, capacity, __ATOMIC_RELAXED);
+    return block;
+}
+
+void pool_free(void *block, size_t size)
+{
+    if (!block)
+        return;
+
+    int cls = size_class(size);
+    long capacity = cls < 0 ? (long)size : (long)class_size(cls);
+    __atomic_sub_fetch(&stats.blocks_in_use, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&stats.bytes_in_use, capacity, __ATOMIC_RELAXED);
+
+    if (cls < 0 || cached_blocks[cls] >= class_cache_limit(cls))
+    {
+        free(block);
+        return;
+    }
+
+    pool_block_t *cached = block;
+    cached->next = free_lists[cls];
+    free_lists[cls] = cached;
+    cached_blocks[cls]++;
+    __atomic_add_fetch(&stats.blocks_cached, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.bytes_cached, capacity, __ATOMIC_RELAXED);
+}
+
+void pool_get_stats(pool_stats_t *out)
+{
+    out->blocks_in_use = __atomic_load_n(&stats.blocks_in_use, __ATOMIC_RELAXED);
+    out->bytes_in_use = __atomic_load_n(&stats.bytes_in_use, __ATOMIC_RELAXED);
+    out->blocks_cached = __atomic_load_n(&stats.blocks_cached, __ATOMIC_RELAXED);
+    out->bytes_cached = __atomic_load_n(&stats.bytes_cached, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,36 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/**
+ * @file pool.h
+ * @brief Size-classed buffer pool for per-session transfer state
+ *
+ * Requests are rounded up to a power-of-two size class; classes of 4 KiB and up are
+ * POOL_HEADROOM bytes larger than their power of two, so a chunk buffer with its
+ * frame and chunk headers in front takes the chunk's class, not the next one up
+ * (1 MiB + 92 bytes is one 1 MiB class block, not a 2 MiB one). Freed blocks go onto a
+ * free list owned by the calling thread, so each epoll worker recycles its own
+ * buffers without locks. Each class keeps at most POOL_CACHE_BYTES_PER_CLASS
+ * cached; anything beyond that (and anything larger than the biggest class) goes
+ * back to the heap. Blocks of 4 KiB classes and up are page aligned.
+ *
+ * Callers must pass the same size to pool_free() that they passed to pool_alloc().
+ */
+
+#define POOL_HEADROOM 128 // Page-sized classes and up hold this much past their power of two
+
+typedef struct
+{
+    long blocks_in_use; // Blocks handed out and not yet returned
+    long bytes_in_use;  // Class capacity of those blocks
+    long blocks_cached; // Returned blocks kept on free lists
+    long bytes_cached;  // Class capacity of the cached blocks
+} pool_stats_t;
+
+void *pool_alloc(size_t size);
+void pool_free(void *block, size_t size);
+void pool_get_stats(pool_stats_t *stats);
+
+#endif
@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+#include "ratelimit.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define IP_TABLE_SIZE 256
+
+// Bucket shared by the sessions of one client address
+struct ratelimit_ip
+{
+    char ip[64];
+    token_bucket_t bucket;
+    int refs; // Sessions holding it
+    struct ratelimit_ip *next; // Hash chain
+};
+
+static long long session_rate = 0;
+static long long ip_rate = 0;
+static long long global_rate = 0;
+
+// The per-IP table and the global bucket are shared by every worker
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static ratelimit_ip_t *ip_table[IP_TABLE_SIZE];
+static token_bucket_t global_bucket;
+
+static unsigned long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static long long bucket_capacity(const token_bucket_t *bucket)
+{
+    long long capacity = bucket->rate * RATELIMIT_BURST_MS / 1000;
+    return capacity < RATELIMIT_BURST_MIN ? RATELIMIT_BURST_MIN : capacity;
+}
+
+static void bucket_init(token_bucket_t *bucket, long long rate)
+{
+    bucket->rate = rate;
+    bucket->tokens = rate > 0 ? bucket_capacity(bucket) : 0; // Start with a full burst
+    bucket->refilled_us = now_us();
+}
+
+// Add the tokens earned since the last refill; LLONG_MAX if the bucket is unlimited
+static long long bucket_refill(token_bucket_t *bucket, unsigned long long now)
+{
+    if (bucket->rate == 0)
+        return LLONG_MAX;
+
+    unsigned long long elapsed = now - bucket->refilled_us;
+    if (elapsed > 1000000ULL * RATELIMIT_BURST_MS)
+        elapsed = 1000000ULL * RATELIMIT_BURST_MS; // Far more than fills any bucket, and no overflow
+    long long earned = (long long)(elapsed * (unsigned long long)bucket->rate / 1000000ULL);
+    if (earned > 0)
+    {
+        // Only the time that earned whole bytes is used up, the remainder carries over
+        bucket->refilled_us += ((unsigned long long)earned * 1000000ULL + bucket->rate - 1) / bucket->rate;
+        bucket->tokens += earned;
+        long long capacity = bucket_capacity(bucket);
+        if (bucket->tokens > capacity)
+        {
+            bucket->tokens = capacity;
+            bucket->refilled_us = now;
+        }
+    }
+    return bucket->tokens;
+}
+
+static void bucket_charge(token_bucket_t *bucket, long long bytes)
+{
+    if (bucket->rate > 0)
+        bucket->tokens -= bytes;
+}
+
+// Set the limits in bytes per second before the workers start; 0 leaves one off
+void ratelimit_configure(long long session, long long ip, long long global)
+{
+    session_rate = session > 0 ? session : 0;
+    ip_rate = ip > 0 ? ip : 0;
+    global_rate = global > 0 ? global : 0;
+    bucket_init(&global_bucket, global_rate);
+}
+
+int ratelimit_enabled(void)
+{
+    return session_rate > 0 || ip_rate > 0 || global_rate > 0;
+}
+
+void ratelimit_session_init(token_bucket_t *bucket)
+{
+    bucket_init(bucket, session_rate);
+}
+
+static unsigned int hash_ip(const char *ip)
+{
+    unsigned int hash = 2166136261u;
+    for (; *ip; ip++)
+        hash = (hash ^ (unsigned char)*ip) * 16777619u;
+    return hash % IP_TABLE_SIZE;
+}
+
+// The bucket of a client address, created on its first session; NULL if addresses
+// are not limited (or on allocation failure, which leaves the session unlimited by IP)
+ratelimit_ip_t *ratelimit_ip_acquire(const char *ip)
+{
+    if (ip_rate == 0)
+        return NULL;
+
+    pthread_mutex_lock(&shared_lock);
+    ratelimit_ip_t **slot = &ip_table[hash_ip(ip)];
+    ratelimit_ip_t *limit = *slot;
+    while (limit && strcmp(limit->ip, ip) != 0)
+        limit = limit->next;
+    if (!limit && (limit = malloc(sizeof(ratelimit_ip_t))))
+    {
+        snprintf(limit->ip, sizeof(limit->ip), "%s", ip);
+        bucket_init(&limit->bucket, ip_rate);
+        limit->refs = 0;
+        limit->next = *slot;
+        *slot = limit;
+    }
+    if (limit)
+        limit->refs++;
+    pthread_mutex_unlock(&shared_lock);
+    return limit;
+}
+
+// A session of the address closed; the last one takes the bucket with it
+void ratelimit_ip_release(ratelimit_ip_t *limit)
+{
+    if (!limit)
+        return;
+
+    pthread_mutex_lock(&shared_lock);
+    if (--limit->refs == 0)
+    {
+        ratelimit_ip_t **slot = &ip_table[hash_ip(limit->ip)];
+        while (*slot != limit)
+            slot = &(*slot)->next;
+        *slot = limit->next;
+        free(limit);
+    }
+    pthread_mutex_unlock(&shared_lock);
+}
+
+// Bytes a download may send now: the emptiest bucket it is limited by decides,
+// LLONG_MAX if nothing limits it, 0 or less while any of them is empty
+long long ratelimit_allowance(token_bucket_t *session, ratelimit_ip_t *ip)
+{
+    unsigned long long now = now_us();
+    long long allowance = bucket_refill(session, now);
+    if (ip || global_rate > 0)
+    {
+        pthread_mutex_lock(&shared_lock);
+        if (ip)
+        {
+            long long tokens = bucket_refill(&ip->bucket, now);
+            if (tokens < allowance)
+                allowance = tokens;
+        }
+        long long tokens = bucket_refill(&global_bucket, now);
+        if (tokens < allowance)
+            allowance = tokens;
+        pthread_mutex_unlock(&shared_lock);
+    }
+    return allowance;
+}
+
+// Pay for bytes a download sent
+void ratelimit_charge(token_bucket_t *session, ratelimit_ip_t *ip, long long bytes)
+{
+    if (bytes <= 0)
+        return;
+    bucket_charge(session, bytes);
+    if (ip || global_rate > 0)
+    {
+        pthread_mutex_lock(&shared_lock);
+        if (ip)
+            bucket_charge(&ip->bucket, bytes);
+        bucket_charge(&global_bucket, bytes);
+        pthread_mutex_unlock(&shared_lock);
+    }
+}
+
+// A worker's wake-up timer for throttled downloads, disarmed until one needs it
+int ratelimit_timer_start(void)
+{
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1)
+    {
+        perror("timerfd_create");
+    }
+    return timer_fd;
+}
+
+// Fire once, RATELIMIT_TICK_MS from now
+int ratelimit_timer_arm(int timer_fd)
+{
+    struct itimerspec spec = {.it_value = {0, RATELIMIT_TICK_MS * 1000000L}};
+    if (timerfd_settime(timer_fd, 0, &spec, NULL) == -1)
+    {
+        perror("timerfd_settime");
+        return -1;
+    }
+    return 0;
+}
+
+void ratelimit_timer_ack(int timer_fd)
+{
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+    {
+        perror("timerfd read");
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+/**
+ * @file ratelimit.h
+ * @brief Token bucket bandwidth shaping for downloads
+ *
+ * Download bytes are paid for from up to three token buckets: the session's own,
+ * one shared by every session from the same client IP and one global bucket shared
+ * by all workers. Each limit is optional (a rate of 0 turns it off). Buckets fill at
+ * their rate, measured on CLOCK_MONOTONIC, and hold at most RATELIMIT_BURST_MS worth
+ * of tokens, so an idle session can't save up for a long full-speed burst later.
+ *
+ * Before a download sends, ratelimit_allowance() tops the buckets up for the time
+ * that passed and says how many bytes may go out now; what was actually sent is then
+ * paid with ratelimit_charge(). A chunk may overshoot the allowance, leaving a bucket
+ * in debt that the next refills pay back first, so the average stays at the rate.
+ * A session with less than RATELIMIT_MIN_SEND bytes of allowance stops asking for
+ * EPOLLOUT and is woken by its worker's timerfd (ratelimit_timer_start()), which fires
+ * RATELIMIT_TICK_MS after it is armed.
+ *
+ * Session buckets belong to their worker. The per-IP table and the global bucket are
+ * shared between workers behind a single mutex, taken twice per download wakeup.
+ */
+
+#define RATELIMIT_TICK_MS 10   // Delay before a throttled download is retried
+#define RATELIMIT_BURST_MS 250 // Tokens a bucket may hold, as time at its rate
+#define RATELIMIT_BURST_MIN (64 * 1024) // Smallest bucket, so low rates still send whole chunks
+#define RATELIMIT_MIN_SEND (16 * 1024) // Tokens a download waits for, instead of waking for every few bytes
+
+typedef struct
+{
+    long long rate;   // Bytes per second, 0 = unlimited
+    long long tokens; // Bytes that may be sent; negative after an overshoot
+    unsigned long long refilled_us;
+} token_bucket_t;
+
+typedef struct ratelimit_ip ratelimit_ip_t;
+
+void ratelimit_configure(long long session_rate, long long ip_rate, long long global_rate);
+int ratelimit_enabled(void);
+void ratelimit_session_init(token_bucket_t *bucket);
+ratelimit_ip_t *ratelimit_ip_acquire(const char *ip);
+void ratelimit_ip_release(ratelimit_ip_t *limit);
+long long ratelimit_allowance(token_bucket_t *session, ratelimit_ip_t *ip);
+void ratelimit_charge(token_bucket_t *session, ratelimit_ip_t *ip, long long bytes);
+
+int ratelimit_timer_start(void);
+int ratelimit_timer_arm(int timer_fd);
+void ratelimit_timer_ack(int timer_fd);
+
+#endif
@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include "timer_wheel.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SLOT_BITS 6 // log2(TIMER_WHEEL_SLOTS)
+#define WHEEL_SPAN (1ULL << (SLOT_BITS * TIMER_WHEEL_LEVELS)) // Ticks the whole wheel covers
+
+// Current time in ticks of the monotonic clock
+unsigned long long timer_wheel_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long long ms = (unsigned long long)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+    return ms / TIMER_WHEEL_TICK_MS;
+}
+
+void timer_wheel_init(timer_wheel_t *wheel)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = timer_wheel_clock();
+}
+
+// Link a timer into the slot its distance from now falls in
+static void place(timer_wheel_t *wheel, wheel_timer_t *timer)
+{
+    if (timer->expires < wheel->now)
+        timer->expires = wheel->now; // Overdue: due on the next tick processed
+    unsigned long long delta = timer->expires - wheel->now;
+    if (delta >= WHEEL_SPAN)
+    {
+        timer->expires = wheel->now + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= 1ULL << (SLOT_BITS * (level + 1)))
+        level++;
+    wheel_timer_t **slot = &wheel->slots[level][(timer->expires >> (SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+
+    timer->next = *slot;
+    if (*slot)
+        (*slot)->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+// Schedule a timer for tick expires, moving it if it is already pending
+void timer_wheel_add(timer_wheel_t *wheel, wheel_timer_t *timer, unsigned long long expires)
+{
+    timer_wheel_remove(timer);
+    timer->expires = expires;
+    place(wheel, timer);
+}
+
+void timer_wheel_remove(wheel_timer_t *timer)
+{
+    if (!timer->pprev)
+        return;
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+int timer_wheel_pending(const wheel_timer_t *timer)
+{
+    return timer->pprev != NULL;
+}
+
+// Spread one slot of an upper level over the levels below it; returns the slot index
+static int cascade(timer_wheel_t *wheel, int level)
+{
+    int index = (wheel->now >> (SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+    wheel_timer_t *timer = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    while (timer)
+    {
+        wheel_timer_t *next = timer->next;
+        place(wheel, timer);
+        timer = next;
+    }
+    return index;
+}
+
+// Process every tick up to and including now; returns the timers that came due, linked
+// through next and no longer pending. The caller may add them (or others) again.
+wheel_timer_t *timer_wheel_advance(timer_wheel_t *wheel, unsigned long long now)
+{
+    wheel_timer_t *expired = NULL;
+    while (wheel->now <= now)
+    {
+        int index = wheel->now & (TIMER_WHEEL_SLOTS - 1);
+        for (int level = 1; index == 0 && level < TIMER_WHEEL_LEVELS; level++)
+        {
+            // Going on upwards only while the upper level wraps around as well
+            if (cascade(wheel, level) != 0)
+                break;
+        }
+
+        wheel_timer_t *timer = wheel->slots[0][index];
+        wheel->slots[0][index] = NULL;
+        while (timer)
+        {
+            wheel_timer_t *next = timer->next;
+            timer->pprev = NULL;
+            timer->next = expired;
+            expired = timer;
+            timer = next;
+        }
+        wheel->now++;
+    }
+    return expired;
+}
+
+// A periodic timerfd that fires once per tick
+int timer_wheel_start(void)
+{
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1)
+    {
+        perror("timerfd_create");
+        return -1;
+    }
+
+    struct itimerspec spec = {
+        .it_interval = {TIMER_WHEEL_TICK_MS / 1000, (TIMER_WHEEL_TICK_MS % 1000) * 1000000L},
+        .it_value = {TIMER_WHEEL_TICK_MS / 1000, (TIMER_WHEEL_TICK_MS % 1000) * 1000000L}};
+    if (timerfd_settime(timer_fd, 0, &spec, NULL) == -1)
+    {
+        perror("timerfd_settime");
+        close(timer_fd);
+        return -1;
+    }
+    return timer_fd;
+}
+
+void timer_wheel_ack(int timer_fd)
+{
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+    {
+        perror("timerfd read");
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+/**
+ * @file timer_wheel.h
+ * @brief Hierarchical timer wheel for per-session deadlines
+ *
+ * Time is counted in ticks of TIMER_WHEEL_TICK_MS. The wheel has TIMER_WHEEL_LEVELS
+ * levels of 64 slots: level 0 holds timers due within 64 ticks, one slot per tick,
+ * and every level above covers 64 times the span of the one below. Adding, moving
+ * and removing a timer are O(1) list operations; when level 0 wraps around, the next
+ * slot of level 1 is spread over level 0 (and so on upwards), so each timer is
+ * touched at most once per level on its way down. Deadlines further out than the
+ * whole wheel (about 48 days at 250 ms) are clamped to its end.
+ *
+ * Each event loop owns a wheel, driven by a periodic timerfd in its epoll set
+ * (timer_wheel_start()). A tick reads the monotonic clock, so ticks lost to a busy
+ * loop are caught up on the next one.
+ */
+
+#define TIMER_WHEEL_TICK_MS 250
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOTS 64
+
+typedef struct wheel_timer
+{
+    struct wheel_timer *next;   // Slot list, or the expired list handed back by timer_wheel_advance()
+    struct wheel_timer **pprev; // The link pointing at this timer, NULL while it is not pending
+    unsigned long long expires; // Tick it is due at
+    void *data;                 // Owner, for the caller
+} wheel_timer_t;
+
+typedef struct
+{
+    unsigned long long now; // Next tick to be processed
+    wheel_timer_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel_t;
+
+unsigned long long timer_wheel_clock(void);
+void timer_wheel_init(timer_wheel_t *wheel);
+void timer_wheel_add(timer_wheel_t *wheel, wheel_timer_t *timer, unsigned long long expires);
+void timer_wheel_remove(wheel_timer_t *timer);
+int timer_wheel_pending(const wheel_timer_t *timer);
+wheel_timer_t *timer_wheel_advance(timer_wheel_t *wheel, unsigned long long now);
+
+int timer_wheel_start(void);
+void timer_wheel_ack(int timer_fd);
+
+#endif